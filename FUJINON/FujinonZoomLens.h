@@ -6,6 +6,61 @@
 #define FUJINON_ZOOM_LENS_H
 
 #include <iostream>
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <initializer_list>
+#include <memory>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+/*
+ * The codec, LUTs, controller and transport interface in this header need the standard library only.
+ * Byte and position types (the same typedefs as OpenCV's, so both headers can be included together):
+ */
+typedef unsigned char uchar;
+typedef unsigned int uint;
+
+/*
+ * Data part of a C10 frame, held inline (the length field allows at most 15 bytes; commands use 0-2).
+ * Copying one never allocates, so commands can travel from the GUI to the serial port without touching the heap.
+ */
+class FujinonZoomLensPayload {
+public:
+	static constexpr size_t CAPACITY = 15;
+
+	FujinonZoomLensPayload() : length(0), bytes{} {};
+	FujinonZoomLensPayload(std::initializer_list<uchar> list) : FujinonZoomLensPayload() { assign(list.begin(), list.end()); }
+	template<class InputIt> FujinonZoomLensPayload(InputIt first, InputIt last) : FujinonZoomLensPayload() { assign(first, last); }
+	FujinonZoomLensPayload(const std::vector<uchar> &vec) : FujinonZoomLensPayload(vec.begin(), vec.end()) {};
+
+	/* Bytes beyond CAPACITY are dropped */
+	template<class InputIt> void assign(InputIt first, InputIt last) {
+		length = 0;
+		for (; first != last && length < CAPACITY; ++first) bytes[length++] = static_cast<uchar>(*first);
+	}
+	void push_back(uchar b) { if (length < CAPACITY) bytes[length++] = b; }
+	void clear() { length = 0; }
+
+	size_t size() const { return length; }
+	bool empty() const { return length == 0; }
+	const uchar *data() const { return bytes.data(); }
+	const uchar *begin() const { return bytes.data(); }
+	const uchar *end() const { return bytes.data() + length; }
+	uchar operator[](size_t i) const { return bytes[i]; }
+	uchar &operator[](size_t i) { return bytes[i]; }
+
+	bool operator==(const FujinonZoomLensPayload &other) const { return length == other.length && std::equal(begin(), end(), other.begin()); }
+	bool operator!=(const FujinonZoomLensPayload &other) const { return !(*this == other); }
+
+private:
+	uint8_t length;
+	std::array<uchar, CAPACITY> bytes;
+};
 
 /*
  * Helper class to use FujinonZoomLensController
@@ -130,92 +185,185 @@ namespace FujinonZoomLensControllerUtil {
 	enum class ZOOM_LENS_FILTER { VISIBLE_LIGHT_CUT_FILTER = 0, FILTER_CLEAR = 1 };
 	enum class ZOOM_LENS_IRIS { AUTO = 0, REMOTE = 1 };
 	enum class ZOOM_LENS_F { CLOSE = 0, F16 = 1, F11 = 2, F8 = 3, F5_6 = 4, F4 = 5, OPEN = 6 };
+}
+
+/*
+ * Lens-model specific parameters.
+ * LUTs are kept as separate ascending columns so that interp() can run on them directly.
+ */
+struct FujinonZoomLensProfile {
+	std::string model; // lens name as returned by 0x11 + 0x12 (empty: matches any lens)
+	std::vector<float> zoomRatio, zoomPosition; // ZOOM_LUT
+	std::vector<float> focusMeter, focusPosition; // FOCUS_LUT
+	std::array<std::array<uchar, 2>, 7> fTable; // iris position for each ZOOM_LENS_F
+	float zoomMin, zoomMax; // travel limits in ratio
+	float focusMin, focusMax; // travel limits in meter
+
+	/* Fill LUT columns and travel limits from (value, position) pairs */
+	void setZoomLUT(const std::vector<std::pair<float, float>> &lut) {
+		zoomRatio.clear(); zoomPosition.clear();
+		for (auto i : lut) { zoomRatio.push_back(i.first); zoomPosition.push_back(i.second); }
+		zoomMin = zoomRatio.front(); zoomMax = zoomRatio.back();
+	}
+	void setFocusLUT(const std::vector<std::pair<float, float>> &lut) {
+		focusMeter.clear(); focusPosition.clear();
+		for (auto i : lut) { focusMeter.push_back(i.first); focusPosition.push_back(i.second); }
+		focusMin = focusMeter.front(); focusMax = focusMeter.back();
+	}
+};
+
+namespace FujinonZoomLensControllerUtil {
+	/*
+	 * Built-in profile of the lens this controller was written for
+	 */
+	inline const FujinonZoomLensProfile &defaultProfile() {
+		static const FujinonZoomLensProfile profile = [] {
+			FujinonZoomLensProfile p;
+			p.setZoomLUT(ZOOM_LUT);
+			p.setFocusLUT(FOCUS_LUT);
+			p.fTable = { { { 0x00, 0x00 } /* CLOSE */, { 0x34, 0x00 } /* F16 */, { 0x46, 0x00 } /* F11 */, { 0x5E, 0x00 } /* F8 */,
+				{ 0x8E, 0x00 } /* F5.6 */, { 0xEE, 0x00 } /* F4 */, { 0xFF, 0xFF } /* OPEN */ } };
+			return p;
+		}();
+		return profile;
+	}
 
 	/*
 	 * Compute checksum
 	 */
-	inline uchar checksum(std::vector<uchar> vec) {
+	inline uchar checksum(const uchar *first, const uchar *last) {
 		uchar sum = 0x00;
-		for (int i : vec) sum += i;
+		for (; first != last; ++first) sum += *first;
 		return 0x100 - sum;
 	}
 
+	inline uchar checksum(const std::vector<uchar> &vec) {
+		return checksum(vec.data(), vec.data() + vec.size());
+	}
+
+	/*
+	 * Append a command in C10 protocol to out (no allocation once out has grown to its working size)
+	 */
+	inline void appendCommand(std::vector<uchar> &out, uchar code, const FujinonZoomLensPayload &data) {
+		const size_t begin = out.size();
+		out.push_back(static_cast<uchar>(data.size())); // append data length
+		out.push_back(code); // append function code
+		out.insert(out.end(), data.begin(), data.end()); // append function data
+		out.push_back(checksum(out.data() + begin, out.data() + out.size())); // append checksum
+	}
+
 	/*
 	 * Generate command in C10 protocol
 	 */
-	inline std::vector<uchar> encodeCommand(uchar code, std::vector<uchar> data) {
+	inline std::vector<uchar> encodeCommand(uchar code, const FujinonZoomLensPayload &data) {
 		std::vector<uchar> api_frame;
-		api_frame.push_back(data.size()); // append data length
-		api_frame.push_back(code); // append function code
-		for (auto i : data) { api_frame.push_back(i); } // append function data
-		api_frame.push_back(checksum(api_frame)); // append checksum
-
+		appendCommand(api_frame, code, data);
 		return api_frame;
 	}
 
 	/*
-	 * Decode command in C10 protocol
+	 * Reply from the lens
 	 */
-	inline bool decodeCommand(const boost::array<uchar, 32> api_frame) {
-		// print frame
-//		for (size_t i = 0; i < api_frame.size() - 1; ++i) {
-//			std::cout << std::hex << static_cast<uint>(api_frame[i]) << " ";
-//		}
-//		std::cout << std::dec << std::endl;
-
-		// retrieve data part
-		size_t length = static_cast<uint>(api_frame[0]);
-		uchar code = api_frame[1];
-		std::vector<uchar> data;
-		for (size_t i = 1; i <= length; i++) {
-			data.push_back(api_frame[1 + i]);
-		}
-		uchar checksum_received = api_frame[2 + length];
-
-		// checksum
-		std::vector<uchar> data_for_checksum = data;
-		data_for_checksum.push_back(api_frame[0]);
-		data_for_checksum.push_back(api_frame[1]);
-		if (!(checksum_received == checksum(data_for_checksum))) {
-			std::cout << "Checksum failed" << std::endl;
-			return false;
+	struct FujinonZoomLensResponse {
+		uchar code = 0;
+		FujinonZoomLensPayload data;
+
+		/* data as text (name, serial number) without trailing padding */
+		std::string text() const {
+			std::string str(data.begin(), data.end());
+			str.erase(std::find(str.begin(), str.end(), '\0'), str.end());
+			while (!str.empty() && str.back() == ' ') str.pop_back();
+			return str;
 		}
 
-		// decode data
-		if (code == 0x11) { // Get second half of name
-			std::cout << "Name (first half): ";
-			for (int i = 0; i < length; i++) {
-				std::cout << static_cast<char>(data[i]);
-			}
-			std::cout << std::endl;
+		/* data as 16 bit position (big endian) */
+		uint position() const {
+			return data.size() == 2 ? static_cast<uint>(data[0]) * 256 + data[1] : 0;
 		}
-		else if (code == 0x12) { // Get first half of name
-			std::cout << "Name (second half): ";
-			for (int i = 0; i < length; i++) {
-				std::cout << static_cast<char>(data[i]);
-			}
-			std::cout << std::endl;
-		}
-		else if (code == 0x17) { // Get serial number
-			std::cout << "Serial number: ";
-			for (int i = 0; i < length; i++) {
-				std::cout << static_cast<char>(data[i]);
+	};
+
+	/*
+	 * Parse a frame in C10 protocol. Returns false if the frame is truncated or the checksum does not match.
+	 */
+	inline bool parseResponse(const uchar *api_frame, size_t received, FujinonZoomLensResponse &response) {
+		if (received < 3) return false;
+		size_t length = static_cast<uint>(api_frame[0]);
+		if (length + 3 > received || length > FujinonZoomLensPayload::CAPACITY) return false;
+
+		if (api_frame[2 + length] != checksum(api_frame, api_frame + 2 + length)) return false;
+
+		response.code = api_frame[1];
+		response.data.assign(api_frame + 2, api_frame + 2 + length);
+		return true;
+	}
+
+	/*
+	 * Split the byte stream received from the lens into C10 frames.
+	 * Bytes that cannot start a valid frame are skipped, so the parser resynchronizes after line noise.
+	 */
+	class FujinonZoomLensFrameParser {
+	public:
+		static constexpr size_t MAX_DATA_LENGTH = 15; // C10 data length field
+
+		FujinonZoomLensFrameParser() : head(0), dropped(0) {};
+
+		void push(const uchar *bytes, size_t n) { buffer.insert(buffer.end(), bytes, bytes + n); }
+
+		/* Extract the next complete frame. Returns false if more bytes are needed. */
+		bool next(FujinonZoomLensResponse &response) {
+			bool found = false;
+			while (!found && buffer.size() - head >= 3) {
+				size_t length = buffer[head];
+				if (length > MAX_DATA_LENGTH) { head++; dropped++; continue; }
+				if (buffer.size() - head < length + 3) break;
+
+				uchar sum = 0x00;
+				for (size_t i = head; i < head + length + 3; i++) sum += buffer[i];
+				if (sum != 0x00) { head++; dropped++; continue; } // checksum makes the sum of the whole frame zero
+
+				response.code = buffer[head + 1];
+				response.data.assign(buffer.begin() + head + 2, buffer.begin() + head + 2 + length);
+				head += length + 3;
+				found = true;
 			}
-			std::cout << std::endl;
+			if (head == buffer.size()) { buffer.clear(); head = 0; }
+			else if (head > 64) { buffer.erase(buffer.begin(), buffer.begin() + head); head = 0; }
+			return found;
 		}
-		else if (code == 0x31) { // Get zoom position
-			std::cout << "Zoom position: " << std::hex << (uint)data[0] << " " << (uint)data[1] << std::endl;
-		}
-		else if (code == 0x32) { // Get focus position
-			std::cout << "Focus position: " << std::hex << (uint)data[0] << " " << (uint)data[1] << std::endl;
+
+		/* Bytes pending in the buffer */
+		size_t pending() const { return buffer.size() - head; }
+
+		/* Bytes skipped while resynchronizing */
+		size_t droppedBytes() const { return dropped; }
+
+		void clear() { buffer.clear(); head = 0; }
+
+	private:
+		std::vector<uchar> buffer;
+		size_t head;
+		size_t dropped;
+	};
+
+	/*
+	 * Print a reply from the lens
+	 */
+	inline void printResponse(const FujinonZoomLensResponse &response) {
+		switch (response.code) {
+		case 0x11: std::cout << "Name (first half): " << response.text() << std::endl; break;
+		case 0x12: std::cout << "Name (second half): " << response.text() << std::endl; break;
+		case 0x17: std::cout << "Serial number: " << response.text() << std::endl; break;
+		case 0x30: std::cout << "Iris position: " << std::hex << response.position() << std::dec << std::endl; break;
+		case 0x31: std::cout << "Zoom position: " << std::hex << response.position() << std::dec << std::endl; break;
+		case 0x32: std::cout << "Focus position: " << std::hex << response.position() << std::dec << std::endl; break;
+		default: break;
 		}
-		return true;
 	}
 
 	/*
 	 * Sanity check
 	 */
-	inline void sanityCheck(uchar code, std::vector<uchar> data) {
+	inline void sanityCheck(uchar code, const FujinonZoomLensPayload &data) {
 		switch (code) {
 		case 0x20: /* Iris control (Position) */
 			assert(data.size() == 2 && "Wrong data size");
@@ -241,6 +389,9 @@ namespace FujinonZoomLensControllerUtil {
 		case 0x12: /* Name(second half) */
 			assert(data.size() == 0 && "Wrong data size");
 			break;
+		case 0x30: /* Get iris position */
+			assert(data.size() == 0 && "Wrong data size");
+			break;
 		case 0x31: /* Get zoom position */
 			assert(data.size() == 0 && "Wrong data size");
 			break;
@@ -259,7 +410,52 @@ namespace FujinonZoomLensControllerUtil {
  */
 struct FujinonZoomLensCommand {
 	uchar code;
-	std::vector<uchar> data;
+	FujinonZoomLensPayload data;
+};
+
+/*
+ * Shadow of one lens axis: the last payload sent and the last payload the lens confirmed
+ */
+struct FujinonZoomLensShadowAxis {
+	bool commanded = false;
+	bool confirmed = false;
+	FujinonZoomLensPayload commandedData;
+	FujinonZoomLensPayload confirmedData;
+};
+
+/*
+ * Statistics of redundant-command suppression
+ */
+struct FujinonZoomLensShadowStats {
+	size_t sent = 0; // commands passed to the client
+	size_t suppressed = 0; // commands dropped because the lens was already in that state
+
+	double suppressionRatio() const { return sent + suppressed > 0 ? static_cast<double>(suppressed) / (sent + suppressed) : 0.0; }
+};
+
+/*
+ * An ordered group of commands handed to the lens worker as one unit.
+ * The commands are checked and encoded as they are added, into frames that the worker writes to the
+ * port in one write before collecting the replies, so moving every axis costs about one round trip.
+ */
+struct FujinonZoomLensBatch {
+	static constexpr size_t CAPACITY = 8; // the worker collects the replies into a fixed array
+
+	std::vector<FujinonZoomLensCommand> commands; // in the order they are sent
+	std::vector<uchar> frames; // commands encoded back to back
+
+	/* False if the batch is full (the command is not added) */
+	bool add(uchar code, const FujinonZoomLensPayload &data) {
+		if (commands.size() >= CAPACITY) return false;
+		FujinonZoomLensControllerUtil::sanityCheck(code, data);
+		commands.push_back({ code, data });
+		FujinonZoomLensControllerUtil::appendCommand(frames, code, data);
+		return true;
+	}
+
+	size_t size() const { return commands.size(); }
+	bool empty() const { return commands.empty(); }
+	bool full() const { return commands.size() >= CAPACITY; }
 };
 
 /*
@@ -268,6 +464,14 @@ struct FujinonZoomLensCommand {
 class FujinonZoomLensClientTemplate {
 public:
 	virtual void send(FujinonZoomLensCommand cmd) = 0;
+
+	/* Send a batch as one unit. Clients that cannot keep it together send its commands one by one. */
+	virtual void sendBatch(std::shared_ptr<const FujinonZoomLensBatch> batch) {
+		for (const FujinonZoomLensCommand &cmd : batch->commands) send(cmd);
+	}
+
+	/* Stop the lens ahead of everything queued. Clients that send at once have no queue to overtake and do nothing. */
+	virtual void halt() {}
 };
 
 /*
@@ -281,7 +485,19 @@ public:
 	 *
 	 * 1. Register client to the controller
 	 */
-	FujinonZoomLensController(std::shared_ptr<FujinonZoomLensClientTemplate> _client):client(_client) {};
+	FujinonZoomLensController(std::shared_ptr<FujinonZoomLensClientTemplate> _client):client(_client), ownProfile(nullptr) {};
+
+	/*
+	 * Set the profile of the lens this controller drives (nullptr: the built-in default profile).
+	 * The profile comes from whoever identified the lens (FujinonZoomLensServer); the profile store keeps it alive.
+	 * May be called from any thread; the command path only does an atomic load.
+	 */
+	void setProfile(const FujinonZoomLensProfile *p) { ownProfile.store(p, std::memory_order_release); }
+
+	const FujinonZoomLensProfile &profile() const {
+		const FujinonZoomLensProfile *p = ownProfile.load(std::memory_order_acquire);
+		return p ? *p : FujinonZoomLensControllerUtil::defaultProfile();
+	}
 
 	/**
 	 * Setter
@@ -289,43 +505,18 @@ public:
 
 	/* iris control - select F number from ZOOM_LENS_F */
 	void setF(FujinonZoomLensControllerUtil::ZOOM_LENS_F F) {
-		uchar data1, data2;
-		switch (F) {
-		case FujinonZoomLensControllerUtil::ZOOM_LENS_F::CLOSE:
-			data1 = 0x00; data2 = 0x00;
-		break; case FujinonZoomLensControllerUtil::ZOOM_LENS_F::F16:
-			data1 = 0x34; data2 = 0x00;
-			break;
-		case FujinonZoomLensControllerUtil::ZOOM_LENS_F::F11:
-			data1 = 0x46; data2 = 0x00;
-			break;
-		case FujinonZoomLensControllerUtil::ZOOM_LENS_F::F8:
-			data1 = 0x5E; data2 = 0x00;
-			break;
-		case FujinonZoomLensControllerUtil::ZOOM_LENS_F::F5_6:
-			data1 = 0x8E; data2 = 0x00;
-			break;
-		case FujinonZoomLensControllerUtil::ZOOM_LENS_F::F4:
-			data1 = 0xEE; data2 = 0x00;
-			break;
-		case FujinonZoomLensControllerUtil::ZOOM_LENS_F::OPEN:
-			data1 = 0xFF; data2 = 0xFF;
-			break;
-		default:
-			data1 = 0xFF; data2 = 0xFF; // open
-			break;
-		}
-		command(0x20, { data1, data2 });
+		size_t index = static_cast<size_t>(F);
+		if (index >= profile().fTable.size()) index = static_cast<size_t>(FujinonZoomLensControllerUtil::ZOOM_LENS_F::OPEN); // open
+		const auto &position = profile().fTable[index];
+		command(0x20, { position[0], position[1] });
 	}
 
 	/* Zoom by ratio (1x: wide end <--> 32x: tele end) */
 	void setZoomRatio(float ratio) {
-		ratio = std::clamp(ratio, 1.0f, 32.0f);
+		const FujinonZoomLensProfile &p = profile();
+		ratio = std::clamp(ratio, p.zoomMin, p.zoomMax);
 
-		std::vector<float> x, y;
-		for (auto i : FujinonZoomLensControllerUtil::ZOOM_LUT) { x.push_back(i.first); y.push_back(i.second); }
-
-		uint data = interp(ratio, x, y);
+		uint data = static_cast<uint>(std::lround(interp(ratio, p.zoomRatio, p.zoomPosition))); // nearest: a LUT node may come out just below its position
 		uchar data1 = static_cast<uchar>(data / 256); // C10 protocol uses big endian
 		uchar data2 = static_cast<uchar>(data % 256);
 
@@ -335,12 +526,10 @@ public:
 
 	/* focus by meter (3m (Minimum object distance) <--> 500m (Infinity)) */
 	void setFocus(float meter) {
-		meter = std::clamp(meter, 3.0f, 500.0f);
-
-		std::vector<float> x, y;
-		for (auto i : FujinonZoomLensControllerUtil::FOCUS_LUT) { x.push_back(i.first); y.push_back(i.second); }
+		const FujinonZoomLensProfile &p = profile();
+		meter = std::clamp(meter, p.focusMin, p.focusMax);
 
-		uint data = interp(meter, x, y);
+		uint data = static_cast<uint>(std::lround(interp(meter, p.focusMeter, p.focusPosition)));
 		uchar data1 = static_cast<uchar>(data / 256); // C10 protocol uses big endian
 		uchar data2 = static_cast<uchar>(data % 256);
 
@@ -383,30 +572,131 @@ public:
 	void getNameFirst() { command(0x11, {}); }
 	void getNameSecond() { command(0x12, {}); }
 	void getSerialNumber() { command(0x17, {}); }
+	void getIrisPosition() { command(0x30, {}); }
 	void getZoomPosition() { command(0x31, {}); }
 	void getFocusPosition() { command(0x32, {}); }
 
-	/* Send command via registered sender */
-	void command(uchar code, std::vector<uchar> data) {
+	/*
+	 * Batch: commands issued between beginBatch() and commitBatch() (e.g. every axis of a scene change)
+	 * are collected, after suppression, and handed to the client as one batch when committed.
+	 * A batch that fills up is handed over at once and a new one is started.
+	 */
+	void beginBatch() {
+		if (!batch) batch = std::make_shared<FujinonZoomLensBatch>();
+	}
+
+	void commitBatch() {
+		std::shared_ptr<FujinonZoomLensBatch> committed = std::move(batch); // leaves batch empty
+		if (committed && !committed->empty()) client->sendBatch(std::move(committed));
+	}
+
+	bool isBatching() const { return batch != nullptr; }
+
+	/*
+	 * Stop iris, zoom and focus where they are, ahead of the commands already queued (which are dropped).
+	 * The batch being collected is dropped too, and the positions are no longer taken as confirmed,
+	 * so the next setter is sent even if it repeats the last one.
+	 */
+	void stop() {
+		batch.reset();
+		for (size_t i = 0; i < 3; i++) {
+			shadow[i].confirmed = false;
+			shadow[i].commanded = false;
+		}
+		client->halt();
+	}
+
+	/*
+	 * Send command via registered sender.
+	 * A setter whose payload equals the state confirmed by the lens is suppressed unless force is true
+	 * (or setForceResend(true) was called).
+	 */
+	void command(uchar code, const FujinonZoomLensPayload &data, bool force = false) {
 		FujinonZoomLensControllerUtil::sanityCheck(code, data);
 
+		int index = shadowIndex(code);
+		if (index >= 0) {
+			FujinonZoomLensShadowAxis &axis = shadow[index];
+			if (!force && !forceResend && axis.confirmed && axis.confirmedData == data &&
+				(!axis.commanded || axis.commandedData == data)) {
+				shadowStats.suppressed++;
+				return;
+			}
+			axis.commanded = true;
+			axis.commandedData = data;
+		}
+		shadowStats.sent++;
+
+		if (batch) {
+			if (batch->full()) {
+				client->sendBatch(std::move(batch));
+				batch = std::make_shared<FujinonZoomLensBatch>();
+			}
+			batch->add(code, data);
+			return;
+		}
+
 		FujinonZoomLensCommand cmd;
 		cmd.code = code;
 		cmd.data = data;
 		client->send(cmd);
 	}
 
-	friend class FujinonZoomLensControllerTest;
+	/*
+	 * Feed a reply from the lens into the shadow state.
+	 * For setters, data is the payload that the lens acknowledged; for position queries (0x30-0x32), the reported position.
+	 * Call this from the thread that issues commands.
+	 */
+	void onResponse(uchar code, const FujinonZoomLensPayload &data) {
+		if (code >= 0x30 && code <= 0x32) code -= 0x10; // reported position confirms the corresponding position control
+		int index = shadowIndex(code);
+		if (index < 0) return;
+		shadow[index].confirmed = true;
+		shadow[index].confirmedData = data;
+	}
+
+	/* Disable suppression (e.g. while the lens may have been moved by hand) */
+	void setForceResend(bool enable) { forceResend = enable; }
+	bool isForceResend() const { return forceResend; }
+
+	/* Forget the confirmed state (e.g. after reconnecting), so that the next setter is always sent */
+	void invalidateShadow() {
+		for (auto &axis : shadow) axis.confirmed = false;
+	}
+
+	const FujinonZoomLensShadowAxis *shadowState(uchar code) const {
+		int index = shadowIndex(code);
+		return index >= 0 ? &shadow[index] : nullptr;
+	}
+	const FujinonZoomLensShadowStats &suppressionStats() const { return shadowStats; }
+
 
 private:
 
 	std::shared_ptr<FujinonZoomLensClientTemplate> client;
+	std::atomic<const FujinonZoomLensProfile *> ownProfile;
+
+	std::array<FujinonZoomLensShadowAxis, 5> shadow; // iris, zoom, focus, filter, iris mode
+	FujinonZoomLensShadowStats shadowStats;
+	bool forceResend = false;
+	std::shared_ptr<FujinonZoomLensBatch> batch; // being collected (nullptr: commands are sent one by one)
+
+	static int shadowIndex(uchar code) {
+		switch (code) {
+		case 0x20: return 0; /* Iris control (Position) */
+		case 0x21: return 1; /* Zoom control (Position) */
+		case 0x22: return 2; /* Focus control (Position) */
+		case 0x40: return 3; /* Filter control (VisCut/Clear) */
+		case 0x42: return 4; /* Iris control (Auto/Remote) */
+		default: return -1;
+		}
+	}
 
 	/*
 	 * Linearly interpolation to get f(q) using a LUT of y=f(x)
 	 * (x,y are assumed to be ascendant.)
 	 */
-	float interp(float q, std::vector<float> x, std::vector<float> y) {
+	float interp(float q, const std::vector<float> &x, const std::vector<float> &y) const {
 		float r; // r = f(q)
 		q = std::clamp(q, x.front(), x.back()); // clamp to valid range
 		auto next = std::find_if(x.begin(), x.end(), [&q](float v) { return q <= v; });
@@ -426,113 +716,75 @@ private:
 };
 
 
-
-
+/*
+ * Latency and throughput of a transport
+ */
+struct FujinonZoomLensTransportStats {
+	size_t bytesSent = 0;
+	size_t bytesReceived = 0;
+	size_t roundTrips = 0; // request/reply exchanges reported by the user of the transport
+	size_t timeouts = 0; // receives that ended without data (a reply was lost)
+	double totalRoundTripUs = 0.0;
+	double maxRoundTripUs = 0.0;
+	std::chrono::steady_clock::time_point since = std::chrono::steady_clock::now();
+
+	double meanRoundTripUs() const { return roundTrips > 0 ? totalRoundTripUs / roundTrips : 0.0; }
+
+	/* bytes per second in both directions since the transport was opened */
+	double throughput() const {
+		double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - since).count();
+		return elapsed > 0.0 ? (bytesSent + bytesReceived) / elapsed : 0.0;
+	}
+};
 
 /*
- * Test for FujinonZoomLensController
+ * Byte pipe to a lens.
+ * Codec and frame parsing stay in FujinonZoomLensControllerUtil; transports only move bytes.
  */
-class FujinonZoomLensControllerTest {
+class FujinonZoomLensTransport {
 public:
+	virtual ~FujinonZoomLensTransport() = default;
 
-    FujinonZoomLensControllerTest(AppMsgPtr _appMsg): appMsg(_appMsg){ }
+	/* Send the whole buffer in one write */
+	void send(const uchar *bytes, size_t n) {
+		doSend(bytes, n);
+		transportStats.bytesSent += n;
+	}
 
 	/*
-	 * Check if command is generated correctly.
+	 * Wait up to the reply timeout for incoming bytes. data points to them (valid until the next call) and
+	 * the count is returned; 0 means that no reply is coming (in-process transports never block).
 	 */
-    bool run() {
-		class FujinonZoomLensClientTest : public FujinonZoomLensClientTemplate {
-			void send(FujinonZoomLensCommand cmd){}
-		};
-
-		auto client = std::make_shared<FujinonZoomLensClientTest>();
-
-		FujinonZoomLensController zlc(std::static_pointer_cast<FujinonZoomLensClientTemplate>(client));
-        /*
-         * interp
-         */
-        std::vector<float> x{1.0, 3.0, 6.0, 10.0};
-        std::vector<float> y{2.0, 4.0, 9.0, 15.0};
-        std::cout
-                << zlc.interp(0.0, x, y) << " -- 2.0 (Expected output)" << std::endl
-                << zlc.interp(1.0, x, y) << " -- 2.0 (Expected output)" << std::endl
-                << zlc.interp(2.0, x, y) << " -- 3.0 (Expected output)" << std::endl
-                << zlc.interp(3.0, x, y) << " -- 4.0 (Expected output)" << std::endl
-                << zlc.interp(4.0, x, y) << " -- 5.6666 (Expected output)" << std::endl
-                << zlc.interp(6.0, x, y) << " -- 9.0(Expected output)" << std::endl
-                << zlc.interp(9.0, x, y) << " -- 13.5 (Expected output)" << std::endl
-                << zlc.interp(11.0, x, y) << " -- 15.0 (Expected output)" << std::endl;
-
-
-        /*
-         * iris
-         */
-		zlc.setF(FujinonZoomLensControllerUtil::ZOOM_LENS_F::CLOSE); // close
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
-        std::cout << "2 20 0 0 de (Expected output)" << std::endl;
-
-		zlc.setF(FujinonZoomLensControllerUtil::ZOOM_LENS_F::OPEN); // open
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
-        std::cout << "2 20 ff ff e0 (Expected output)" << std::endl;
-
-        /*
-         * setZoomRatio
-         */
-		zlc.command(0x21, {0x00, 0x00}); // wide end
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
-        std::cout << "2 21 0 0 dd (Expected output)" << std::endl;
-
-		zlc.command(0x21, {0xFF, 0xFF}); // tele end
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
-        std::cout << "2 21 ff ff df (Expected output)" << std::endl;
-
-		zlc.setZoomRatio(1.0); // wide end
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
-        std::cout << "2 21 0 0 dd (Expected output)" << std::endl;
-
-		zlc.setZoomRatio(2.0); // wide end
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
-        std::cout << "2 21 54 00 89 (Expected output)" << std::endl;
-
-		zlc.setZoomRatio(3.0); // wide end
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
-        std::cout << "2 21 78 00 65 (Expected output)" << std::endl;
-
-		zlc.setZoomRatio(10.0); // wide end
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
-        std::cout << "2 21 C2 00 1B (Expected output)" << std::endl;
-
-		zlc.setZoomRatio(32.0); // tele end
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
-        std::cout << "2 21 ff ff df (Expected output)" << std::endl;
-
-
-        /*
-         * focus
-         */
-		zlc.setFocus(3.0); // focus at 3m
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
-        std::cout << "2 22 0C 00 D0 (Expected output)" << std::endl;
-
-		zlc.setFocus(5.0); // focus at 50m
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
-        std::cout << "2 22 6E 00 6E (Expected output)" << std::endl;
-
-		zlc.setFocus(100.0); // focus at 100m
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
-        std::cout << "2 22 F7 63 82 (Expected output)" << std::endl;
-
-		zlc.setFocus(500.0); // focus at infinity
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
-        std::cout << "2 22 FF FF DE (Expected output)" << std::endl;
-
-        return true;
-    }
+	size_t receive(const uchar *&data) {
+		size_t n = doReceive(data);
+		transportStats.bytesReceived += n;
+		if (n == 0) transportStats.timeouts++;
+		return n;
+	}
 
-private:
+	void setReplyTimeout(std::chrono::milliseconds timeout) { replyTimeout = timeout; }
+	std::chrono::milliseconds getReplyTimeout() const { return replyTimeout; }
+
+	void recordRoundTrip(std::chrono::steady_clock::duration elapsed) {
+		double us = std::chrono::duration<double, std::micro>(elapsed).count();
+		transportStats.roundTrips++;
+		transportStats.totalRoundTripUs += us;
+		transportStats.maxRoundTripUs = std::max(transportStats.maxRoundTripUs, us);
+	}
 
-    AppMsgPtr appMsg;
+	const FujinonZoomLensTransportStats &stats() const { return transportStats; }
+	void resetStats() { transportStats = FujinonZoomLensTransportStats(); }
 
+	virtual std::string description() const = 0;
+
+protected:
+	virtual void doSend(const uchar *bytes, size_t n) = 0;
+	virtual size_t doReceive(const uchar *&data) = 0;
+
+	std::chrono::milliseconds replyTimeout{ 200 }; // the lens answers within a few ms at 38400 bps
+
+private:
+	FujinonZoomLensTransportStats transportStats;
 };
 
 #endif //FUJINON_ZOOM_LENS_H
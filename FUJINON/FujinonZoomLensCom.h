@@ -6,10 +6,14 @@
 #define FUJINON_ZOOM_LENS_COM_H
 
 #include <iostream>
+#include <chrono>
+#include <cstdlib>
 #include <boost/asio.hpp>
 #include <boost/array.hpp>
 
 #include "FujinonZoomLens.h"
+#include "FujinonZoomLensProfile.h"
+#include "FujinonZoomLensTransport.h"
 #include "AppMsg.h"
 
 class FujinonZoomLensClient: public FujinonZoomLensClientTemplate {
@@ -19,82 +23,375 @@ public:
 
 	void send(FujinonZoomLensCommand cmd) override {
 		/* Implement here */
-		auto md = appMsg->zlcRequestMessenger->prepareMsg();
-		md->code = cmd.code;
-		md->data = cmd.data;
-		appMsg->zlcRequestMessenger->send();
+		appMsg->zlcScheduler->push(std::move(cmd));
 //		std::cout << "sendinf from FujinonZoomLensClient" << std::endl;
 	}
+
+	void sendBatch(std::shared_ptr<const FujinonZoomLensBatch> batch) override {
+		appMsg->zlcScheduler->pushBatch(std::move(batch));
+	}
+
+	void halt() override {
+		appMsg->zlcScheduler->halt();
+	}
 };
 
 
 
+/*
+ * Last known lens state (-1: unknown)
+ */
+struct FujinonZoomLensState {
+	int iris = -1; // 0x20 position
+	int zoom = -1; // 0x21 position
+	int focus = -1; // 0x22 position
+	int filter = -1; // 0x40 data
+	int irisMode = -1; // 0x42 data
+
+	/* Record a command that the lens acknowledged */
+	void track(const FujinonZoomLensCommand &cmd) {
+		auto position = [&cmd]() { return static_cast<int>(cmd.data[0]) * 256 + cmd.data[1]; };
+		switch (cmd.code) {
+		case 0x20: iris = position(); break;
+		case 0x21: zoom = position(); break;
+		case 0x22: focus = position(); break;
+		case 0x40: filter = cmd.data[0]; break;
+		case 0x42: irisMode = cmd.data[0]; break;
+		default: break;
+		}
+	}
+
+	/* Record a position reported by the lens */
+	void track(const FujinonZoomLensControllerUtil::FujinonZoomLensResponse &response) {
+		if (response.data.size() != 2) return;
+		switch (response.code) {
+		case 0x30: iris = response.position(); break;
+		case 0x31: zoom = response.position(); break;
+		case 0x32: focus = response.position(); break;
+		default: break;
+		}
+	}
+
+	bool save(const std::string &fileName) const {
+		rapidjson::Document doc;
+		doc.SetObject();
+		doc.AddMember("IRIS", iris, doc.GetAllocator());
+		doc.AddMember("ZOOM", zoom, doc.GetAllocator());
+		doc.AddMember("FOCUS", focus, doc.GetAllocator());
+		doc.AddMember("FILTER", filter, doc.GetAllocator());
+		doc.AddMember("IRIS_MODE", irisMode, doc.GetAllocator());
+
+		FILE *fp = fopen(fileName.c_str(), "wb");
+		if (fp == NULL) return false;
+		char writeBuffer[1024];
+		rapidjson::FileWriteStream os(fp, writeBuffer, sizeof(writeBuffer));
+		rapidjson::PrettyWriter<rapidjson::FileWriteStream> writer(os);
+		doc.Accept(writer);
+		fclose(fp);
+		return true;
+	}
+
+	bool load(const std::string &fileName) {
+		FILE *fp = fopen(fileName.c_str(), "rb");
+		if (fp == NULL) return false;
+		char buf[512];
+		rapidjson::FileReadStream rs(fp, buf, sizeof(buf));
+		rapidjson::Document doc;
+		doc.ParseStream(rs);
+		fclose(fp);
+		if (doc.HasParseError() || !doc.IsObject()) return false;
+
+		auto read = [&doc](const char *name) { return doc.HasMember(name) && doc[name].IsInt() ? doc[name].GetInt() : -1; };
+		iris = read("IRIS");
+		zoom = read("ZOOM");
+		focus = read("FOCUS");
+		filter = read("FILTER");
+		irisMode = read("IRIS_MODE");
+		return true;
+	}
+};
+
+struct FujinonZoomLensServerOptions {
+	bool warmStart = false; // keep/restore the lens position instead of driving to the wide end
+	std::string lastStateFile; // state restored on warm start (empty: none)
+	std::string stateFile; // state saved when the server is destroyed (empty: not saved)
+	bool printPositions = true; // print position replies (0x30 - 0x32) to the console
+	std::chrono::milliseconds replyTimeout{ 200 }; // a reply not received within this is taken as lost
+};
+
 class FujinonZoomLensServer {
-	boost::asio::io_service io;
-	boost::asio::serial_port port;
-	boost::array<uchar, 32> receive_api_frame;
-	size_t length;
+	std::unique_ptr<FujinonZoomLensTransport> transport;
+	std::string port; // reopened by reconnect() (empty: transport given by the caller, cannot be reopened)
+	bool connected;
+	std::string serialNumber;
+	std::string name;
+	const FujinonZoomLensProfile *profile; // chosen by identify(), kept alive by the profile store
+
+	FujinonZoomLensServerOptions options;
+	FujinonZoomLensState state;
+	FujinonZoomLensControllerUtil::FujinonZoomLensFrameParser parser;
+	std::vector<uchar> send_api_frames;
+	double readyTime; // [ms] from open to ready
+	std::chrono::steady_clock::time_point written; // last write to the port
 
+	/* positions closer than this are considered to be already there */
+	static constexpr int POSITION_TOLERANCE = 0x100;
 
 public:
-	FujinonZoomLensServer(const char *PORT = "COM1") : port(boost::asio::serial_port(io, PORT))
+	/*
+	 * PORT: serial port name, "tcp://host:port" or "loopback" (see openFujinonZoomLensTransport)
+	 */
+	FujinonZoomLensServer(const std::string &PORT, FujinonZoomLensServerOptions _options = FujinonZoomLensServerOptions())
+		: FujinonZoomLensServer(openFujinonZoomLensTransport(PORT), std::move(_options)) {
+		port = PORT;
+	}
+
+	FujinonZoomLensServer(std::unique_ptr<FujinonZoomLensTransport> _transport, FujinonZoomLensServerOptions _options = FujinonZoomLensServerOptions())
+		: transport(std::move(_transport)), connected(true), profile(&FujinonZoomLensControllerUtil::defaultProfile()),
+		options(std::move(_options)), readyTime(0.0)
 	{
+		const auto begin = std::chrono::steady_clock::now();
+		transport->setReplyTimeout(options.replyTimeout);
 		initialize();
+		readyTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+	}
+
+	~FujinonZoomLensServer() {
+		if (!options.stateFile.empty()) state.save(options.stateFile);
 	}
 
 	void initialize() {
-		port.set_option(boost::asio::serial_port_base::baud_rate(38400));
-		port.set_option(boost::asio::serial_port_base::character_size(8));
-		port.set_option(boost::asio::serial_port_base::flow_control(boost::asio::serial_port_base::flow_control::none));
-		port.set_option(boost::asio::serial_port_base::parity(boost::asio::serial_port_base::parity::none));
-		port.set_option(boost::asio::serial_port_base::stop_bits(boost::asio::serial_port_base::stop_bits::one));
+		identify();
 
 		/*
 		 * Make sure to use "video iris mode"
 		 * Initialize zoom lens
 		 * - Set filter to "Filter Clear" (not cut visible light)
 		 * - Set to remote iris (to enable iris control)
+		 * Cold start: set zoom to wide end and iris to open
+		 * Warm start: restore the last saved state, skipping axes that are already there
+		 * All commands are sent in one burst and the replies are collected afterwards.
 		 */
-		port.write_some(boost::asio::buffer(FujinonZoomLensControllerUtil::encodeCommand(0x40, { 0xE0 }))); // set filter to "Filter Clear"
-		receive_api_frame.assign(0xFF); // Assign 0xFF to all entries
-		length = port.read_some(boost::asio::buffer(receive_api_frame));
-		FujinonZoomLensControllerUtil::decodeCommand(receive_api_frame);
+		std::vector<FujinonZoomLensCommand> init;
+		if (!options.warmStart) {
+			init = {
+				{ 0x40, { 0xE0 } }, // set filter to "Filter Clear"
+				{ 0x42, { 0xDC } }, // set to remote iris
+				{ 0x21, { 0x00, 0x00 } }, // set zoom to wide end
+				{ 0x20, { 0xFF, 0xFF } } // set iris to open
+			};
+		}
+		else {
+			FujinonZoomLensState saved;
+			if (!options.lastStateFile.empty() && saved.load(options.lastStateFile)) {
+				std::cout << "Restoring lens state from " << options.lastStateFile << std::endl;
+			}
+
+			// current positions
+			std::vector<FujinonZoomLensControllerUtil::FujinonZoomLensResponse> responses;
+			runPipelined({ { 0x30, {} }, { 0x31, {} }, { 0x32, {} } }, &responses);
+			FujinonZoomLensState current;
+			for (auto &r : responses) {
+				if (r.data.size() != 2) continue;
+				if (r.code == 0x30) current.iris = r.position();
+				if (r.code == 0x31) current.zoom = r.position();
+				if (r.code == 0x32) current.focus = r.position();
+			}
+
+			auto position = [](int v) { return FujinonZoomLensPayload{ static_cast<uchar>(v / 256), static_cast<uchar>(v % 256) }; };
+			auto satisfied = [](int target, int now) { return target < 0 || (now >= 0 && std::abs(target - now) <= POSITION_TOLERANCE); };
 
-		port.write_some(boost::asio::buffer(FujinonZoomLensControllerUtil::encodeCommand(0x42, { 0xDC }))); // set to remote iris
-		receive_api_frame.assign(0xFF); // Assign 0xFF to all entries
-		length = port.read_some(boost::asio::buffer(receive_api_frame));
-		FujinonZoomLensControllerUtil::decodeCommand(receive_api_frame);
+			// filter and iris mode cannot be queried, always (re)send them
+			init.push_back({ 0x40, { static_cast<uchar>(saved.filter >= 0 ? saved.filter : 0xE0) } });
+			init.push_back({ 0x42, { static_cast<uchar>(saved.irisMode >= 0 ? saved.irisMode : 0xDC) } });
+			if (!satisfied(saved.zoom, current.zoom)) init.push_back({ 0x21, position(saved.zoom) });
+			if (!satisfied(saved.focus, current.focus)) init.push_back({ 0x22, position(saved.focus) });
+			if (!satisfied(saved.iris, current.iris)) init.push_back({ 0x20, position(saved.iris) });
 
-		port.write_some(boost::asio::buffer(FujinonZoomLensControllerUtil::encodeCommand(0x21, { 0x00, 0x00 }))); // set zoom to wide end
-		receive_api_frame.assign(0xFF); // Assign 0xFF to all entries
-		length = port.read_some(boost::asio::buffer(receive_api_frame));
-		FujinonZoomLensControllerUtil::decodeCommand(receive_api_frame);
+			std::cout << "Warm start: " << (5 - init.size()) << " of 3 position commands skipped" << std::endl;
+		}
+		runPipelined(init);
+	}
+
+	/*
+	 * Select the lens profile (lensProfile()).
+	 * A lens seen before is recognized by its serial number alone; otherwise its name is queried too.
+	 */
+	void identify() {
+		FujinonZoomLensControllerUtil::FujinonZoomLensResponse response;
+		if (runCommand({ 0x17, {} }, &response)) serialNumber = response.text();
 
-		port.write_some(boost::asio::buffer(FujinonZoomLensControllerUtil::encodeCommand(0x20, { 0xFF, 0xFF }))); // set iris to open
-		receive_api_frame.assign(0xFF); // Assign 0xFF to all entries
-		length = port.read_some(boost::asio::buffer(receive_api_frame));
-		FujinonZoomLensControllerUtil::decodeCommand(receive_api_frame);
+		auto &store = FujinonZoomLensProfileStore::get_instance();
+		const FujinonZoomLensProfile *known = serialNumber.empty() ? nullptr : store.findBySerial(serialNumber);
+		if (known != nullptr && !known->model.empty()) {
+			profile = known;
+			name = profile->model;
+		}
+		else {
+			std::vector<FujinonZoomLensControllerUtil::FujinonZoomLensResponse> responses;
+			runPipelined({ { 0x11, {} }, { 0x12, {} } }, &responses);
+			name.clear();
+			for (auto &r : responses) name += r.text();
+			profile = store.select(name, serialNumber);
+		}
+		std::cout << "Lens " << name << " (S/N " << serialNumber << "): profile "
+			<< (profile->model.empty() ? "default" : profile->model) << std::endl;
 	}
 
-	void runCommand(FujinonZoomLensCommand cmd) {
-		uchar code = cmd.code;
-		std::vector<uchar> data = cmd.data;
+	/*
+	 * Reopen the port after the connection was lost, identify the lens and replay the last known
+	 * state (filter, iris mode, positions) in one burst. Returns false if the lens is not back yet.
+	 */
+	bool reconnect() {
+		if (port.empty()) return false;
+		try {
+			transport = openFujinonZoomLensTransport(port);
+			transport->setReplyTimeout(options.replyTimeout);
+		} catch (const boost::system::system_error &) {
+			return false; // not there yet
+		}
+		parser.clear();
+		connected = true;
+		identify();
+		if (connected) replay();
+		return connected;
+	}
+
+	/* False once a read or write failed, until reconnect() succeeds */
+	bool isConnected() const { return connected; }
+
+	const std::string &lensName() const { return name; }
+	const std::string &lensSerialNumber() const { return serialNumber; }
+	/* Profile of the lens on this port, as identified on open and on every reconnect (lens worker only) */
+	const FujinonZoomLensProfile &lensProfile() const { return *profile; }
+	const FujinonZoomLensState &lensState() const { return state; }
+
+	/* [ms] from opening the port until the lens was ready */
+	double timeToReady() const { return readyTime; }
+
+	const FujinonZoomLensTransport &lensTransport() const { return *transport; }
+
+	/* When the last write to the port returned */
+	std::chrono::steady_clock::time_point lastWriteTime() const { return written; }
+
+	/*
+	 * Send a command and wait for the reply. Returns false if the reply is invalid.
+	 */
+	bool runCommand(const FujinonZoomLensCommand &cmd, FujinonZoomLensControllerUtil::FujinonZoomLensResponse *response = nullptr) {
+		FujinonZoomLensControllerUtil::FujinonZoomLensResponse reply;
+		bool valid = runPipelined(&cmd, 1, &reply) == 1;
+		if (response != nullptr && valid) *response = reply;
+		return valid;
+	}
+
+	/*
+	 * Send commands back to back in a single write, then collect one reply per command.
+	 * Returns the number of valid replies, which are appended to responses.
+	 */
+	size_t runPipelined(const std::vector<FujinonZoomLensCommand> &cmds,
+		std::vector<FujinonZoomLensControllerUtil::FujinonZoomLensResponse> *responses = nullptr) {
+		if (responses == nullptr) return runPipelined(cmds.data(), cmds.size(), nullptr);
+		const size_t first = responses->size();
+		responses->resize(first + cmds.size());
+		size_t valid = runPipelined(cmds.data(), cmds.size(), responses->data() + first);
+		responses->resize(first + valid);
+		return valid;
+	}
+
+	/*
+	 * Same for n commands in an array; the valid replies are stored from responses[0] (room for n, or nullptr).
+	 * Frames are encoded into a buffer kept across calls, so a call does not allocate.
+	 */
+	size_t runPipelined(const FujinonZoomLensCommand *cmds, size_t n,
+		FujinonZoomLensControllerUtil::FujinonZoomLensResponse *responses) {
+		if (n == 0) return 0;
 
 		/* SANITY CHECK */
-		FujinonZoomLensControllerUtil::sanityCheck(code, data);
+		send_api_frames.clear();
+		for (size_t i = 0; i < n; i++) {
+			FujinonZoomLensControllerUtil::sanityCheck(cmds[i].code, cmds[i].data);
+			FujinonZoomLensControllerUtil::appendCommand(send_api_frames, cmds[i].code, cmds[i].data);
+		}
+		return runEncoded(send_api_frames.data(), send_api_frames.size(), cmds, n, responses);
+	}
+
+	/*
+	 * Write frames already encoded from cmds (e.g. a preset) in a single write, then collect one reply per command.
+	 */
+	size_t runEncoded(const uchar *frames, size_t bytes, const FujinonZoomLensCommand *cmds, size_t n,
+		FujinonZoomLensControllerUtil::FujinonZoomLensResponse *responses) {
+		if (n == 0 || !connected) return 0;
 
 		/* SEND COMMAND */
-		auto send_api_frame = FujinonZoomLensControllerUtil::encodeCommand(code, data);
-//		for (auto i : send_api_frame) { std::cout << std::hex << (uint)i << " "; }
-//		std::cout << std::dec << std::endl;
-		port.write_some(boost::asio::buffer(send_api_frame));
+		const auto begin = std::chrono::steady_clock::now();
+		size_t valid = 0;
+		try {
+			transport->send(frames, bytes);
+			written = std::chrono::steady_clock::now();
 
-		/* RECEIVE COMMAND */
-		receive_api_frame.assign(0xFF); // Assign 0xFF to all entries
-		length = port.read_some(boost::asio::buffer(receive_api_frame));
-		FujinonZoomLensControllerUtil::decodeCommand(receive_api_frame);
+			/* RECEIVE COMMAND */
+			// Replies come in command order. A reply to a later command means that the replies in between
+			// were lost; a reply matching no remaining command (e.g. one that came after its timeout) is skipped.
+			for (size_t i = 0; i < n;) {
+				FujinonZoomLensControllerUtil::FujinonZoomLensResponse response;
+				if (!readResponse(response)) {
+					for (; i < n; i++) std::cout << "No reply to " << std::hex << (uint)cmds[i].code << std::dec << std::endl;
+					break;
+				}
+				if (options.printPositions || response.code < 0x30 || response.code > 0x32) FujinonZoomLensControllerUtil::printResponse(response);
+				size_t match = i;
+				while (match < n && cmds[match].code != response.code) match++;
+				if (match == n) {
+					std::cout << "Unexpected reply " << std::hex << (uint)response.code << " to " << (uint)cmds[i].code << std::dec << std::endl;
+					continue;
+				}
+				for (; i < match; i++) std::cout << "No reply to " << std::hex << (uint)cmds[i].code << std::dec << std::endl;
+				state.track(cmds[i]);
+				state.track(response);
+				if (responses != nullptr) responses[valid] = response;
+				valid++;
+				i++;
+			}
+		} catch (const boost::system::system_error &e) {
+			// e.g. the USB-serial adapter was unplugged; the caller decides when to reconnect()
+			std::cerr << "Lens connection lost (" << transport->description() << "): " << e.what() << std::endl;
+			connected = false;
+			return valid;
+		}
+		transport->recordRoundTrip(std::chrono::steady_clock::now() - begin);
+		return valid;
 	}
 
+private:
+	/* Last known state back to the lens, in one write */
+	void replay() {
+		auto position = [](int v) { return FujinonZoomLensPayload{ static_cast<uchar>(v / 256), static_cast<uchar>(v % 256) }; };
+		std::array<FujinonZoomLensCommand, 5> cmds;
+		size_t n = 0;
+		if (state.filter >= 0) cmds[n++] = { 0x40, { static_cast<uchar>(state.filter) } };
+		if (state.irisMode >= 0) cmds[n++] = { 0x42, { static_cast<uchar>(state.irisMode) } };
+		if (state.zoom >= 0) cmds[n++] = { 0x21, position(state.zoom) };
+		if (state.focus >= 0) cmds[n++] = { 0x22, position(state.focus) };
+		if (state.iris >= 0) cmds[n++] = { 0x20, position(state.iris) };
+		const size_t valid = runPipelined(cmds.data(), n, nullptr);
+		std::cout << "Lens state replayed: " << valid << " of " << n << " commands acknowledged" << std::endl;
+	}
+
+	/*
+	 * Wait for one complete frame, up to the transport's reply timeout.
+	 * Returns false if none arrived in time (the reply was lost) or the transport has nothing more to deliver.
+	 */
+	bool readResponse(FujinonZoomLensControllerUtil::FujinonZoomLensResponse &response) {
+		const auto deadline = std::chrono::steady_clock::now() + transport->getReplyTimeout();
+		while (!parser.next(response)) {
+			if (std::chrono::steady_clock::now() >= deadline) return false; // bytes kept coming, but no valid frame
+			const uchar *received;
+			size_t length = transport->receive(received);
+			if (length == 0) return false;
+			parser.push(received, length);
+		}
+		return true;
+	}
 };
 
 #endif //FUJINON_ZOOM_LENS_COM_H
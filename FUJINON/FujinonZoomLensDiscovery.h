@@ -0,0 +1,164 @@
+﻿//
+// Created by Masahiro Hirano <masahiro.dll@gmail.com>
+//
+
+#ifndef FUJINON_ZOOM_LENS_DISCOVERY_H
+#define FUJINON_ZOOM_LENS_DISCOVERY_H
+
+#include <chrono>
+#include <filesystem>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/array.hpp>
+
+#include "FujinonZoomLens.h"
+
+/*
+ * Find serial ports with a Fujinon lens attached.
+ *
+ * All candidates are probed at once with a name query (0x11) on a single io_service,
+ * so discovery takes one probe round trip (bounded by the deadline) regardless of the number of ports.
+ * Any path that can be opened as a serial port can be probed, including simulated ptys.
+ */
+class FujinonZoomLensDiscovery {
+public:
+	/*
+	 * Candidate serial ports of this machine.
+	 * On Linux, adapters listed in /dev/serial/by-id are reported by that stable path instead of /dev/ttyUSBn.
+	 */
+	static std::vector<std::string> candidates() {
+		std::vector<std::string> ports;
+#if defined(_WIN32)
+		for (int i = 1; i <= 32; i++) ports.push_back("COM" + std::to_string(i));
+#else
+		std::error_code error;
+		std::set<std::filesystem::path> byIdTargets;
+		for (auto &entry : std::filesystem::directory_iterator("/dev/serial/by-id", error)) {
+			auto target = std::filesystem::canonical(entry.path(), error);
+			if (error) continue;
+			byIdTargets.insert(target);
+			ports.push_back(entry.path().string());
+		}
+		for (auto &entry : std::filesystem::directory_iterator("/dev", error)) {
+			std::string name = entry.path().filename().string();
+			bool isCandidate = name.rfind("ttyUSB", 0) == 0 || name.rfind("ttyACM", 0) == 0
+				|| name.rfind("cu.usbserial", 0) == 0; // macOS
+			if (isCandidate && byIdTargets.count(entry.path()) == 0) ports.push_back(entry.path().string());
+		}
+		std::sort(ports.begin(), ports.end());
+#endif
+		return ports;
+	}
+
+	/*
+	 * Path that keeps naming the same adapter when it is unplugged and plugged back in:
+	 * on Linux, the /dev/serial/by-id link to port (/dev/ttyUSBn may come back under another number).
+	 * Returns port itself if there is no such link.
+	 */
+	static std::string stablePath(const std::string &port) {
+#if !defined(_WIN32)
+		std::error_code error;
+		const auto target = std::filesystem::canonical(port, error);
+		if (error) return port;
+		for (auto &entry : std::filesystem::directory_iterator("/dev/serial/by-id", error)) {
+			std::error_code linkError;
+			if (std::filesystem::canonical(entry.path(), linkError) == target && !linkError) return entry.path().string();
+		}
+#endif
+		return port;
+	}
+
+	/*
+	 * Probe ports concurrently. Returns port -> lens name (first half) for every port that answered before the deadline.
+	 */
+	static std::map<std::string, std::string> probe(const std::vector<std::string> &ports,
+		std::chrono::milliseconds deadline = std::chrono::milliseconds(200)) {
+		boost::asio::io_service io;
+		std::vector<std::shared_ptr<Probe>> probes;
+		const std::vector<uchar> query = FujinonZoomLensControllerUtil::encodeCommand(0x11, {});
+
+		for (auto &name : ports) {
+			auto p = std::make_shared<Probe>(io, name);
+			boost::system::error_code error;
+			p->port.open(name, error);
+			if (error) continue;
+			p->port.set_option(boost::asio::serial_port_base::baud_rate(38400), error);
+			p->port.set_option(boost::asio::serial_port_base::character_size(8), error);
+			p->port.set_option(boost::asio::serial_port_base::flow_control(boost::asio::serial_port_base::flow_control::none), error);
+			p->port.set_option(boost::asio::serial_port_base::parity(boost::asio::serial_port_base::parity::none), error);
+			p->port.set_option(boost::asio::serial_port_base::stop_bits(boost::asio::serial_port_base::stop_bits::one), error);
+			if (error) continue;
+			probes.push_back(p);
+		}
+
+		boost::asio::steady_timer timer(io, deadline);
+		size_t remaining = probes.size();
+		auto finish = [&remaining, &timer]() { if (--remaining == 0) timer.cancel(); };
+
+		for (auto &p : probes) {
+			boost::asio::async_write(p->port, boost::asio::buffer(query),
+				[p, finish](const boost::system::error_code &error, size_t) {
+					if (error) { finish(); return; }
+					p->read(finish);
+				});
+		}
+		timer.async_wait([&probes](const boost::system::error_code &error) {
+			if (error) return; // all probes answered
+			for (auto &p : probes) {
+				boost::system::error_code ignored;
+				p->port.cancel(ignored);
+			}
+		});
+		if (!probes.empty()) io.run();
+
+		std::map<std::string, std::string> found;
+		for (auto &p : probes) {
+			if (p->answered) found[p->name] = p->lensName;
+		}
+		return found;
+	}
+
+	/* Probe every candidate port of this machine */
+	static std::map<std::string, std::string> discover(std::chrono::milliseconds deadline = std::chrono::milliseconds(200)) {
+		return probe(candidates(), deadline);
+	}
+
+private:
+	struct Probe : public std::enable_shared_from_this<Probe> {
+		Probe(boost::asio::io_service &io, std::string _name) : port(io), name(std::move(_name)), answered(false) {};
+
+		boost::asio::serial_port port;
+		std::string name;
+		std::string lensName;
+		bool answered;
+		boost::array<uchar, 32> receive_api_frame;
+		FujinonZoomLensControllerUtil::FujinonZoomLensFrameParser parser;
+
+		template<typename F>
+		void read(F finish) {
+			auto self = shared_from_this();
+			port.async_read_some(boost::asio::buffer(receive_api_frame),
+				[self, finish](const boost::system::error_code &error, size_t length) {
+					if (error) { finish(); return; }
+					self->parser.push(self->receive_api_frame.data(), length);
+					FujinonZoomLensControllerUtil::FujinonZoomLensResponse response;
+					while (self->parser.next(response)) {
+						if (response.code == 0x11) {
+							self->lensName = response.text();
+							self->answered = true;
+							finish();
+							return;
+						}
+					}
+					self->read(finish);
+				});
+		}
+	};
+};
+
+#endif //FUJINON_ZOOM_LENS_DISCOVERY_H
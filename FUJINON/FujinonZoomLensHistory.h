@@ -0,0 +1,241 @@
+﻿//
+// Created by Masahiro Hirano <masahiro.dll@gmail.com>
+//
+
+#ifndef FUJINON_ZOOM_LENS_HISTORY_H
+#define FUJINON_ZOOM_LENS_HISTORY_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "FujinonZoomLens.h"
+#include "ThreadSafeQueue.h"
+
+/*
+ * Lens state that applied at one instant (-1: unknown)
+ */
+struct FujinonZoomLensFrameTag {
+	double iris = -1.0; // positions reported by the lens, interpolated between polls
+	double zoom = -1.0;
+	double focus = -1.0;
+	int irisCommanded = -1; // last position commanded before the instant
+	int zoomCommanded = -1;
+	int focusCommanded = -1;
+	float zoomRatio = -1.0f; // zoom / focus converted with the profile of the lens at the instant
+	float focusMeter = -1.0f;
+};
+
+/*
+ * Timestamped history of commanded and polled positions of iris, zoom and focus.
+ *
+ * Samples are kept sorted by time (bounded to capacity per series), so the state at any
+ * steady_clock instant is found by binary search. Polled positions are interpolated linearly
+ * between the neighbouring polls (held after the last one); commanded positions are steps.
+ * The profile the lens was identified with is a step too, so positions are converted to ratio and
+ * meter with the profile that applied when they were recorded (the built-in one before any).
+ */
+class FujinonZoomLensHistory {
+public:
+	explicit FujinonZoomLensHistory(size_t _capacity = 1 << 16) : capacity(_capacity) {};
+
+	/*
+	 * Record a command the lens acknowledged (0x20 - 0x22) or a position it reported (0x30 - 0x32)
+	 */
+	void record(uchar code, const FujinonZoomLensPayload &data, std::chrono::steady_clock::time_point time) {
+		if (data.size() != 2) return;
+		const uint position = static_cast<uint>(data[0]) * 256 + data[1];
+		if (code >= 0x20 && code <= 0x22) insert(commanded[code - 0x20], { time, position });
+		else if (code >= 0x30 && code <= 0x32) insert(polled[code - 0x30], { time, position });
+	}
+
+	/*
+	 * Record that the lens was identified with profile (kept alive by the profile store) from time on
+	 */
+	void recordProfile(const FujinonZoomLensProfile *profile, std::chrono::steady_clock::time_point time) {
+		std::unique_lock<std::shared_mutex> lock(mtx);
+		auto next = std::upper_bound(profiles.begin(), profiles.end(), time,
+			[](std::chrono::steady_clock::time_point t, const ProfileChange &c) { return t < c.time; });
+		profiles.insert(next, { time, profile });
+		if (profiles.size() > capacity) profiles.pop_front();
+	}
+
+	/* Position of an axis (0 iris, 1 zoom, 2 focus) reported around time, -1 if unknown */
+	double position(size_t axis, std::chrono::steady_clock::time_point time) const {
+		std::shared_lock<std::shared_mutex> lock(mtx);
+		return interpolate(polled[axis], time);
+	}
+
+	/* Last position commanded to an axis at or before time, -1 if none */
+	int commandedPosition(size_t axis, std::chrono::steady_clock::time_point time) const {
+		std::shared_lock<std::shared_mutex> lock(mtx);
+		return step(commanded[axis], time);
+	}
+
+	/* Profile of the lens at time */
+	const FujinonZoomLensProfile &profile(std::chrono::steady_clock::time_point time) const {
+		std::shared_lock<std::shared_mutex> lock(mtx);
+		return profileAt(time);
+	}
+
+	FujinonZoomLensFrameTag tag(std::chrono::steady_clock::time_point time) const {
+		FujinonZoomLensFrameTag t;
+		std::shared_lock<std::shared_mutex> lock(mtx);
+		t.iris = interpolate(polled[0], time);
+		t.zoom = interpolate(polled[1], time);
+		t.focus = interpolate(polled[2], time);
+		t.irisCommanded = step(commanded[0], time);
+		t.zoomCommanded = step(commanded[1], time);
+		t.focusCommanded = step(commanded[2], time);
+		const FujinonZoomLensProfile &profile = profileAt(time);
+		lock.unlock();
+		double zoom = t.zoom >= 0.0 ? t.zoom : t.zoomCommanded;
+		double focus = t.focus >= 0.0 ? t.focus : t.focusCommanded;
+		if (zoom >= 0.0) t.zoomRatio = inverse(static_cast<float>(zoom), profile.zoomPosition, profile.zoomRatio);
+		if (focus >= 0.0) t.focusMeter = inverse(static_cast<float>(focus), profile.focusPosition, profile.focusMeter);
+		return t;
+	}
+
+	size_t size() const {
+		std::shared_lock<std::shared_mutex> lock(mtx);
+		size_t n = 0;
+		for (auto &series : polled) n += series.size();
+		for (auto &series : commanded) n += series.size();
+		return n;
+	}
+
+private:
+	struct Sample {
+		std::chrono::steady_clock::time_point time;
+		uint position;
+	};
+	using Series = std::deque<Sample>;
+
+	struct ProfileChange {
+		std::chrono::steady_clock::time_point time;
+		const FujinonZoomLensProfile *profile;
+	};
+
+	void insert(Series &series, Sample sample) {
+		std::unique_lock<std::shared_mutex> lock(mtx);
+		if (series.empty() || series.back().time <= sample.time) series.push_back(sample);
+		else series.insert(std::upper_bound(series.begin(), series.end(), sample.time,
+			[](std::chrono::steady_clock::time_point t, const Sample &s) { return t < s.time; }), sample); // late arrival
+		if (series.size() > capacity) series.pop_front();
+	}
+
+	/* First sample after time */
+	static Series::const_iterator after(const Series &series, std::chrono::steady_clock::time_point time) {
+		return std::upper_bound(series.begin(), series.end(), time,
+			[](std::chrono::steady_clock::time_point t, const Sample &s) { return t < s.time; });
+	}
+
+	static double interpolate(const Series &series, std::chrono::steady_clock::time_point time) {
+		auto next = after(series, time);
+		if (next == series.begin()) return -1.0;
+		auto prev = std::prev(next);
+		if (next == series.end()) return prev->position;
+		double span = std::chrono::duration<double>(next->time - prev->time).count();
+		double w = span > 0.0 ? std::chrono::duration<double>(time - prev->time).count() / span : 0.0;
+		return prev->position + w * (static_cast<double>(next->position) - prev->position);
+	}
+
+	static int step(const Series &series, std::chrono::steady_clock::time_point time) {
+		auto next = after(series, time);
+		return next == series.begin() ? -1 : static_cast<int>(std::prev(next)->position);
+	}
+
+	const FujinonZoomLensProfile &profileAt(std::chrono::steady_clock::time_point time) const {
+		auto next = std::upper_bound(profiles.begin(), profiles.end(), time,
+			[](std::chrono::steady_clock::time_point t, const ProfileChange &c) { return t < c.time; });
+		return next == profiles.begin() ? FujinonZoomLensControllerUtil::defaultProfile() : *std::prev(next)->profile;
+	}
+
+	/* LUT value (ratio, meter) of a raw position; positions must be ascending */
+	static float inverse(float position, const std::vector<float> &positions, const std::vector<float> &values) {
+		if (positions.empty()) return -1.0f;
+		auto next = std::upper_bound(positions.begin(), positions.end(), position);
+		if (next == positions.begin()) return values.front();
+		if (next == positions.end()) return values.back();
+		size_t i = next - positions.begin();
+		float w = (position - positions[i - 1]) / (positions[i] - positions[i - 1]);
+		return values[i - 1] + w * (values[i] - values[i - 1]);
+	}
+
+	const size_t capacity;
+	std::array<Series, 3> polled;
+	std::array<Series, 3> commanded;
+	std::deque<ProfileChange> profiles;
+	mutable std::shared_mutex mtx;
+};
+
+/*
+ * Streams per-frame lens metadata to a CSV sidecar on its own thread.
+ * add() never blocks the frame path; rows that do not fit in the queue are counted and dropped.
+ */
+class FujinonZoomLensMetadataWriter {
+public:
+	struct Row {
+		long frameIndex;
+		double timestampMs; // position of the frame in its source
+		long long timeNs; // steady_clock time the frame was tagged at
+		FujinonZoomLensFrameTag tag;
+	};
+
+	FujinonZoomLensMetadataWriter(const std::string &fileName, size_t queueSize = 1024)
+		: queue(queueSize), droppedRows(0), writtenRows(0) {
+		fp = fopen(fileName.c_str(), "w");
+		if (fp == NULL) {
+			std::cerr << "Failed to open " << fileName << std::endl;
+			return;
+		}
+		fprintf(fp, "frame,timestamp_ms,time_ns,zoom,focus,iris,zoom_commanded,focus_commanded,iris_commanded,zoom_ratio,focus_meter\n");
+		worker = std::thread([this] { write(); });
+	}
+
+	~FujinonZoomLensMetadataWriter() {
+		queue.close();
+		if (worker.joinable()) worker.join();
+		if (fp != NULL) fclose(fp);
+	}
+
+	void add(long frameIndex, double timestampMs, std::chrono::steady_clock::time_point time, const FujinonZoomLensFrameTag &tag) {
+		Row row{ frameIndex, timestampMs, std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count(), tag };
+		if (fp == NULL || !queue.tryPush(row)) droppedRows++;
+	}
+
+	size_t dropped() const { return droppedRows.load(); }
+	size_t written() const { return writtenRows.load(); }
+
+private:
+	void write() {
+		Row row;
+		while (true) {
+			if (!queue.pop(row, std::chrono::milliseconds(200))) {
+				fflush(fp);
+				if (queue.isClosed()) break;
+				continue;
+			}
+			const FujinonZoomLensFrameTag &t = row.tag;
+			fprintf(fp, "%ld,%.3f,%lld,%.1f,%.1f,%.1f,%d,%d,%d,%.3f,%.3f\n", row.frameIndex, row.timestampMs, row.timeNs,
+				t.zoom, t.focus, t.iris, t.zoomCommanded, t.focusCommanded, t.irisCommanded, t.zoomRatio, t.focusMeter);
+			writtenRows++;
+		}
+	}
+
+	ThreadSafeQueue<Row> queue;
+	std::atomic<size_t> droppedRows;
+	std::atomic<size_t> writtenRows;
+	FILE *fp;
+	std::thread worker;
+};
+
+#endif //FUJINON_ZOOM_LENS_HISTORY_H
@@ -0,0 +1,416 @@
+﻿//
+// Created by Masahiro Hirano <masahiro.dll@gmail.com>
+//
+
+#ifndef FUJINON_ZOOM_LENS_MOTION_H
+#define FUJINON_ZOOM_LENS_MOTION_H
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include "rapidjson/document.h"
+#include "rapidjson/filereadstream.h"
+#include "rapidjson/filewritestream.h"
+#include "rapidjson/prettywriter.h"
+
+#include "FujinonZoomLens.h"
+
+/*
+ * Motion of one lens axis after a position command: a dead time, then a trapezoidal velocity
+ * profile (constant acceleration up to the top velocity, the same deceleration into the target).
+ * Positions are raw (0x0000 - 0xFFFF), times in seconds.
+ */
+struct FujinonZoomLensMotionParams {
+	double velocity = 30000.0; // positions / s
+	double acceleration = 150000.0; // positions / s^2
+	double deadTime = 0.03; // from the acknowledgement to the start of the motion
+	size_t moves = 0; // moves fitted into these parameters (0: defaults)
+	size_t cruises = 0; // of them, moves long enough to reach the top velocity (the only ones that tell it)
+
+	/* Time from the command to arrival over distance */
+	double duration(double distance) const {
+		return deadTime + motionTime(distance);
+	}
+
+	/* Distance covered elapsed seconds after the command, on a move over distance */
+	double travel(double elapsed, double distance) const {
+		const double t = elapsed - deadTime;
+		if (t <= 0.0 || distance <= 0.0) return 0.0;
+		const double end = motionTime(distance);
+		if (t >= end) return distance;
+		const double accelTime = std::min(velocity / acceleration, end / 2.0);
+		if (t < accelTime) return 0.5 * acceleration * t * t;
+		if (t > end - accelTime) return distance - 0.5 * acceleration * (end - t) * (end - t);
+		return 0.5 * acceleration * accelTime * accelTime + velocity * (t - accelTime); // cruising
+	}
+
+private:
+	double motionTime(double distance) const {
+		if (distance <= 0.0) return 0.0;
+		if (distance >= velocity * velocity / acceleration) return distance / velocity + velocity / acceleration;
+		return 2.0 * std::sqrt(distance / acceleration); // never reaches the top velocity
+	}
+};
+
+/*
+ * Motor model of each lens (by profile model) and axis, fitted online from the commands the lens
+ * acknowledged and the positions it reported, i.e. the stream that feeds the lens telemetry.
+ *
+ * A command opens a move from the position estimated at that instant, and the polls that follow are
+ * kept as (time since the command, distance covered). Once a poll finds the axis at the target, the
+ * move is fitted (Levenberg-Marquardt starting from the current parameters, so a move with a few
+ * polls refines them rather than replacing them) and blended into the parameters of the lens.
+ * Moves that started while the axis was still moving, never arrived or were too short are not fitted.
+ *
+ * From the parameters the model predicts when the current move arrives and where the axis is between polls.
+ */
+class FujinonZoomLensMotionModel {
+public:
+	static constexpr int ARRIVAL_TOLERANCE = 0x40; // a poll this close to the target ends the move (as waitSettled)
+	static constexpr double MIN_FIT_DISTANCE = 0x400; // shorter moves hardly constrain velocity and acceleration
+	static constexpr double MAX_DEAD_TIME = 1.0;
+	static constexpr double BLEND_MIN = 0.1; // weight of a new move once many were fitted
+	static constexpr size_t MAX_SAMPLES = 256; // per move
+	static constexpr double SINGULAR = 1e-10; // |det| of the normal matrix relative to the product of its diagonal
+
+	/*
+	 * Record a command the lens acknowledged (0x20 - 0x22) or a position it reported (0x30 - 0x32)
+	 */
+	void record(uchar code, const FujinonZoomLensPayload &data, std::chrono::steady_clock::time_point time) {
+		if (data.size() != 2) return;
+		const int position = static_cast<int>(data[0]) * 256 + data[1];
+		std::unique_lock<std::shared_mutex> lock(mtx);
+		if (code >= 0x20 && code <= 0x22) start(code - 0x20, position, time);
+		else if (code >= 0x30 && code <= 0x32) observe(code - 0x30, position, time);
+	}
+
+	/*
+	 * Record that the lens was identified with profile: what follows is recorded for its model
+	 */
+	void recordProfile(const FujinonZoomLensProfile &profile) {
+		std::unique_lock<std::shared_mutex> lock(mtx);
+		if (profile.model != lens) { // another lens: its moves say nothing about this one
+			lens = profile.model;
+			axes = {};
+		}
+	}
+
+	/* Estimated position of an axis (0 iris, 1 zoom, 2 focus) at time, -1 if unknown */
+	double position(size_t axis, std::chrono::steady_clock::time_point time) const {
+		std::shared_lock<std::shared_mutex> lock(mtx);
+		return estimate(axis, time);
+	}
+
+	/* Predicted arrival of the last move commanded to an axis (time_point() if none) */
+	std::chrono::steady_clock::time_point arrival(size_t axis) const {
+		std::shared_lock<std::shared_mutex> lock(mtx);
+		return arrivalOf(axis);
+	}
+
+	/* Parameters of an axis of the current lens */
+	FujinonZoomLensMotionParams params(size_t axis) const {
+		std::shared_lock<std::shared_mutex> lock(mtx);
+		return paramsOf(axis);
+	}
+
+	/*
+	 * Fit one move: samples are (time since the command, distance covered) on a move over distance.
+	 * The parameters are searched as log velocity, log acceleration and dead time.
+	 */
+	static FujinonZoomLensMotionParams fit(const FujinonZoomLensMotionParams &initial,
+		const std::vector<std::pair<double, double>> &samples, double distance) {
+		using Vec = std::array<double, 3>;
+		auto make = [&initial](const Vec &x) {
+			FujinonZoomLensMotionParams p = initial;
+			p.velocity = std::exp(x[0]);
+			p.acceleration = std::exp(x[1]);
+			p.deadTime = x[2];
+			return p;
+		};
+		auto cost = [&](const Vec &x) {
+			const FujinonZoomLensMotionParams p = make(x);
+			double c = 0.0;
+			for (auto &s : samples) {
+				const double r = p.travel(s.first, distance) - s.second;
+				c += r * r;
+			}
+			return c;
+		};
+
+		// where the current parameters put the whole move past the arrival (or short of it), the travel is
+		// flat in them; so first scale time to put the arrival between the last poll short of the target and the first at it
+		double before = 0.0, after = 0.0;
+		for (auto &s : samples) {
+			if (s.second < distance - ARRIVAL_TOLERANCE) before = std::max(before, s.first);
+			else if (after == 0.0 || s.first < after) after = s.first;
+		}
+		FujinonZoomLensMotionParams seed = initial;
+		const double predicted = initial.duration(distance);
+		const double expected = before > 0.0 && before < after ? (before + after) / 2.0 : after;
+		if (after > 0.0 && (predicted < before || predicted > after) && expected > initial.deadTime) {
+			const double k = (predicted - initial.deadTime) / (expected - initial.deadTime);
+			seed.velocity *= k;
+			seed.acceleration *= k * k;
+		}
+
+		Vec x = { std::log(seed.velocity), std::log(seed.acceleration), seed.deadTime };
+		const Vec h = { 1e-4, 1e-4, 1e-5 }; // forward difference steps
+		double c = cost(x), lambda = 1e-3;
+		bool stepped = false;
+		for (int iteration = 0; iteration < 30 && c > 0.0; iteration++) {
+			double A[3][3] = {}, g[3] = {};
+			const FujinonZoomLensMotionParams p = make(x);
+			std::array<FujinonZoomLensMotionParams, 3> perturbed;
+			for (size_t k = 0; k < 3; k++) {
+				Vec xk = x;
+				xk[k] += h[k];
+				perturbed[k] = make(xk);
+			}
+			for (auto &s : samples) {
+				const double y = p.travel(s.first, distance);
+				double J[3];
+				for (size_t k = 0; k < 3; k++) J[k] = (perturbed[k].travel(s.first, distance) - y) / h[k];
+				for (size_t i = 0; i < 3; i++) {
+					g[i] += J[i] * (y - s.second);
+					for (size_t j = 0; j < 3; j++) A[i][j] += J[i] * J[j];
+				}
+			}
+			// a parameter the polls do not depend on at all (the velocity, on a move too short to reach it) is held
+			const double largest = std::max({ A[0][0], A[1][1], A[2][2] });
+			bool held[3], any = false;
+			for (size_t k = 0; k < 3; k++) {
+				held[k] = !(A[k][k] > 1e-12 * largest);
+				any = any || !held[k];
+			}
+			if (!any) {
+				if (!stepped) return initial;
+				break;
+			}
+			for (size_t k = 0; k < 3; k++) {
+				if (!held[k]) continue;
+				for (size_t i = 0; i < 3; i++) A[i][k] = A[k][i] = 0.0;
+				A[k][k] = 1.0;
+				g[k] = 0.0;
+			}
+
+			// solve A d = -g (Cramer's rule)
+			auto det = [](const double m[3][3]) {
+				return m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+					+ m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+			};
+			// near singular before damping: the polls cannot tell the parameters apart (e.g. all of them on the cruise,
+			// none while accelerating), so any solution would be noise. Keep the last step taken, or the previous parameters
+			const double undamped = det(A);
+			if (!std::isfinite(undamped) || !(std::abs(undamped) > SINGULAR * A[0][0] * A[1][1] * A[2][2])) {
+				if (!stepped) return initial;
+				break;
+			}
+			for (size_t i = 0; i < 3; i++) if (!held[i]) A[i][i] += lambda * A[i][i];
+			const double d = det(A);
+			Vec candidate = x;
+			for (size_t k = 0; k < 3; k++) {
+				double Ak[3][3];
+				for (size_t i = 0; i < 3; i++) for (size_t j = 0; j < 3; j++) Ak[i][j] = j == k ? -g[i] : A[i][j];
+				candidate[k] += det(Ak) / d;
+			}
+			candidate[0] = std::clamp(candidate[0], std::log(100.0), std::log(1e6));
+			candidate[1] = std::clamp(candidate[1], std::log(100.0), std::log(1e8));
+			candidate[2] = std::clamp(candidate[2], 0.0, MAX_DEAD_TIME);
+
+			const double cc = cost(candidate);
+			if (cc < c) {
+				const bool converged = c - cc < c * 1e-6;
+				x = candidate;
+				c = cc;
+				stepped = true;
+				lambda = std::max(lambda * 0.3, 1e-9);
+				if (converged) break;
+			} else {
+				lambda *= 10.0;
+				if (lambda > 1e9) break;
+			}
+		}
+		return stepped ? make(x) : seed;
+	}
+
+	/*
+	 * Load and save the fitted parameters of every lens
+	 * {"LENSES":[{"MODEL":"...","AXES":[{"VELOCITY":...,"ACCELERATION":...,"DEAD_TIME":...,"MOVES":...,"CRUISES":...}, (iris, zoom, focus)]}]}
+	 */
+	bool load(const std::string &fileName) {
+		FILE *fp = fopen(fileName.c_str(), "rb");
+		if (fp == NULL) return false;
+		char buf[512];
+		rapidjson::FileReadStream rs(fp, buf, sizeof(buf));
+		rapidjson::Document doc;
+		doc.ParseStream(rs);
+		fclose(fp);
+		if (doc.HasParseError() || !doc.IsObject() || !doc.HasMember("LENSES") || !doc["LENSES"].IsArray()) {
+			std::cerr << "Failed to parse " << fileName << std::endl;
+			return false;
+		}
+
+		std::map<std::string, std::array<FujinonZoomLensMotionParams, 3>> loaded;
+		for (auto &l : doc["LENSES"].GetArray()) {
+			if (!l.IsObject() || !l.HasMember("MODEL") || !l["MODEL"].IsString() || !l.HasMember("AXES") || !l["AXES"].IsArray()) continue;
+			auto &axisParams = loaded[l["MODEL"].GetString()];
+			size_t axis = 0;
+			for (auto &a : l["AXES"].GetArray()) {
+				if (axis >= axisParams.size()) break;
+				FujinonZoomLensMotionParams &p = axisParams[axis++];
+				if (!a.IsObject()) continue;
+				if (a.HasMember("VELOCITY") && a["VELOCITY"].IsNumber() && a["VELOCITY"].GetDouble() > 0.0) p.velocity = a["VELOCITY"].GetDouble();
+				if (a.HasMember("ACCELERATION") && a["ACCELERATION"].IsNumber() && a["ACCELERATION"].GetDouble() > 0.0) p.acceleration = a["ACCELERATION"].GetDouble();
+				if (a.HasMember("DEAD_TIME") && a["DEAD_TIME"].IsNumber()) p.deadTime = std::clamp(a["DEAD_TIME"].GetDouble(), 0.0, MAX_DEAD_TIME);
+				if (a.HasMember("MOVES") && a["MOVES"].IsUint()) p.moves = a["MOVES"].GetUint();
+				if (a.HasMember("CRUISES") && a["CRUISES"].IsUint()) p.cruises = a["CRUISES"].GetUint();
+			}
+		}
+		std::unique_lock<std::shared_mutex> lock(mtx);
+		lenses = std::move(loaded);
+		return true;
+	}
+
+	bool save(const std::string &fileName) const {
+		rapidjson::Document doc;
+		doc.SetObject();
+		rapidjson::Value array(rapidjson::kArrayType);
+		{
+			std::shared_lock<std::shared_mutex> lock(mtx);
+			for (auto &l : lenses) {
+				rapidjson::Value entry(rapidjson::kObjectType);
+				entry.AddMember("MODEL", rapidjson::Value(l.first.c_str(), doc.GetAllocator()), doc.GetAllocator());
+				rapidjson::Value axisArray(rapidjson::kArrayType);
+				for (auto &p : l.second) {
+					rapidjson::Value a(rapidjson::kObjectType);
+					a.AddMember("VELOCITY", p.velocity, doc.GetAllocator());
+					a.AddMember("ACCELERATION", p.acceleration, doc.GetAllocator());
+					a.AddMember("DEAD_TIME", p.deadTime, doc.GetAllocator());
+					a.AddMember("MOVES", static_cast<uint64_t>(p.moves), doc.GetAllocator());
+					a.AddMember("CRUISES", static_cast<uint64_t>(p.cruises), doc.GetAllocator());
+					axisArray.PushBack(a, doc.GetAllocator());
+				}
+				entry.AddMember("AXES", axisArray, doc.GetAllocator());
+				array.PushBack(entry, doc.GetAllocator());
+			}
+		}
+		doc.AddMember("LENSES", array, doc.GetAllocator());
+
+		FILE *fp = fopen(fileName.c_str(), "wb");
+		if (fp == NULL) {
+			std::cerr << "Failed to write " << fileName << std::endl;
+			return false;
+		}
+		char writeBuffer[1024];
+		rapidjson::FileWriteStream os(fp, writeBuffer, sizeof(writeBuffer));
+		rapidjson::PrettyWriter<rapidjson::FileWriteStream> writer(os);
+		doc.Accept(writer);
+		fclose(fp);
+		return true;
+	}
+
+private:
+	struct Move {
+		std::chrono::steady_clock::time_point start;
+		int from = -1; // -1: unknown (nothing polled before the command)
+		int to = -1;
+		bool fromRest = false;
+		bool open = false; // still collecting polls
+		std::vector<std::pair<double, double>> samples; // (s since the command, distance covered)
+	};
+
+	struct Axis {
+		bool moved = false; // a move was commanded
+		Move move;
+		int polled = -1;
+		std::chrono::steady_clock::time_point polledTime;
+	};
+
+	static double seconds(std::chrono::steady_clock::duration d) {
+		return std::chrono::duration<double>(d).count();
+	}
+
+	const FujinonZoomLensMotionParams &paramsOf(size_t axis) const {
+		static const FujinonZoomLensMotionParams defaults;
+		auto it = lenses.find(lens);
+		return it != lenses.end() ? it->second[axis] : defaults;
+	}
+
+	std::chrono::steady_clock::time_point arrivalOf(size_t axis) const {
+		const Axis &a = axes[axis];
+		if (!a.moved) return std::chrono::steady_clock::time_point();
+		const double distance = a.move.from >= 0 ? std::abs(a.move.to - a.move.from) : 0xFFFF; // unknown: the full range
+		return a.move.start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+			std::chrono::duration<double>(paramsOf(axis).duration(distance)));
+	}
+
+	double estimate(size_t axis, std::chrono::steady_clock::time_point time) const {
+		const Axis &a = axes[axis];
+		const Move &m = a.move;
+		if (!a.moved || time < m.start) return a.polled;
+		const auto arrived = arrivalOf(axis);
+		const bool polledSince = a.polled >= 0 && a.polledTime > m.start;
+		// polled after the predicted arrival away from the target: the axis stopped elsewhere
+		if (polledSince && a.polledTime >= arrived && std::abs(a.polled - m.to) > ARRIVAL_TOLERANCE) return a.polled;
+		if (m.from < 0) return time >= arrived ? m.to : polledSince ? a.polled : -1.0;
+		const double covered = paramsOf(axis).travel(seconds(time - m.start), std::abs(m.to - m.from));
+		return m.to >= m.from ? m.from + covered : m.from - covered;
+	}
+
+	void start(size_t axis, int to, std::chrono::steady_clock::time_point time) {
+		Axis &a = axes[axis];
+		const double from = estimate(axis, time);
+		const bool fromRest = !a.moved || time >= arrivalOf(axis);
+		a.move.start = time;
+		a.move.from = from >= 0.0 ? static_cast<int>(std::lround(from)) : -1;
+		a.move.to = to;
+		a.move.fromRest = fromRest;
+		a.move.open = a.move.from >= 0;
+		a.move.samples.clear();
+		a.moved = true;
+	}
+
+	void observe(size_t axis, int position, std::chrono::steady_clock::time_point time) {
+		Axis &a = axes[axis];
+		a.polled = position;
+		a.polledTime = time;
+		Move &m = a.move;
+		if (!a.moved || !m.open || time <= m.start) return;
+
+		const double distance = std::abs(m.to - m.from);
+		m.samples.emplace_back(seconds(time - m.start), m.to >= m.from ? position - m.from : m.from - position);
+		if (std::abs(position - m.to) <= ARRIVAL_TOLERANCE) {
+			m.open = false;
+			if (!m.fromRest || distance < MIN_FIT_DISTANCE) return;
+			FujinonZoomLensMotionParams &p = lenses[lens][axis];
+			const FujinonZoomLensMotionParams f = fit(p, m.samples, distance);
+			const double w = std::max(1.0 / (p.moves + 1), BLEND_MIN);
+			if (distance >= f.velocity * f.velocity / f.acceleration) {
+				const double wv = std::max(1.0 / (p.cruises + 1), BLEND_MIN);
+				p.velocity = std::exp(std::log(p.velocity) + wv * (std::log(f.velocity) - std::log(p.velocity)));
+				p.cruises++;
+			}
+			p.acceleration = std::exp(std::log(p.acceleration) + w * (std::log(f.acceleration) - std::log(p.acceleration)));
+			p.deadTime += w * (f.deadTime - p.deadTime);
+			p.moves++;
+		} else if (m.samples.size() >= MAX_SAMPLES) {
+			m.open = false; // never arrives
+		}
+	}
+
+	std::map<std::string, std::array<FujinonZoomLensMotionParams, 3>> lenses; // iris, zoom, focus
+	std::string lens; // profile model of the lens being recorded (the built-in profile's until recordProfile())
+	std::array<Axis, 3> axes;
+	mutable std::shared_mutex mtx;
+};
+
+#endif //FUJINON_ZOOM_LENS_MOTION_H
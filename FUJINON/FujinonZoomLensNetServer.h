@@ -0,0 +1,468 @@
+﻿//
+// Created by Masahiro Hirano <masahiro.dll@gmail.com>
+//
+
+#ifndef FUJINON_ZOOM_LENS_NET_SERVER_H
+#define FUJINON_ZOOM_LENS_NET_SERVER_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/asio.hpp>
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+#include <unistd.h>
+#endif
+
+#include "FujinonZoomLens.h"
+
+/*
+ * Binary protocol of the lens control server.
+ * Requests and responses share a 7 byte header followed by up to 15 data bytes:
+ *
+ *   MAGIC | type/status | id (2, big endian) | lens | code | length | data[length]
+ *
+ * COMMAND        code/data is a C10 command; the response carries the lens reply (code/data).
+ * ACQUIRE_LEASE  code is the axis control code (0x20, 0x21, 0x22, 0x40, 0x42), data the lease time in ms (2 bytes).
+ *                While leased, commands from other clients to that axis are rejected with AXIS_LEASED.
+ * RELEASE_LEASE  code is the axis control code.
+ * STOP           stop iris, zoom and focus where they are, ahead of everything queued, whatever the leases; code and data
+ *                are ignored. Position commands of any client still waiting in the server are answered with CANCELLED.
+ */
+namespace FujinonZoomLensNetProtocol {
+	constexpr uchar MAGIC = 0xF5;
+	constexpr size_t HEADER_SIZE = 7;
+
+	enum class TYPE : uchar { COMMAND = 0x01, ACQUIRE_LEASE = 0x02, RELEASE_LEASE = 0x03, STOP = 0x04 };
+	enum class STATUS : uchar { OK = 0x00, RATE_LIMITED = 0x01, AXIS_LEASED = 0x02, INVALID = 0x03, LENS_ERROR = 0x04, QUEUE_FULL = 0x05,
+		CANCELLED = 0x06 };
+
+	inline std::vector<uchar> encode(uchar typeOrStatus, uint16_t id, uchar lens, uchar code, const FujinonZoomLensPayload &data) {
+		std::vector<uchar> message{ MAGIC, typeOrStatus, static_cast<uchar>(id >> 8), static_cast<uchar>(id & 0xFF), lens, code,
+			static_cast<uchar>(data.size()) };
+		message.insert(message.end(), data.begin(), data.end());
+		return message;
+	}
+
+	/* Axis index of a control code (same axes as the controller shadow), -1 if none */
+	inline int axisOf(uchar code) {
+		switch (code) {
+		case 0x20: return 0;
+		case 0x21: return 1;
+		case 0x22: return 2;
+		case 0x40: return 3;
+		case 0x42: return 4;
+		default: return -1;
+		}
+	}
+
+	/* C10 codes accepted from network clients */
+	inline bool isSupported(uchar code, size_t length) {
+		switch (code) {
+		case 0x20: case 0x21: case 0x22: return length == 2;
+		case 0x40: case 0x42: return length == 1;
+		case 0x11: case 0x12: case 0x17: case 0x30: case 0x31: case 0x32: return length == 0;
+		default: return false;
+		}
+	}
+}
+
+class FujinonZoomLensNetSession;
+
+/*
+ * A command waiting for (or handed to) the lens
+ */
+struct FujinonZoomLensNetRequest {
+	std::weak_ptr<FujinonZoomLensNetSession> session;
+	uint16_t id = 0;
+	uchar lens = 0;
+	FujinonZoomLensCommand cmd;
+	std::chrono::steady_clock::time_point enqueued;
+};
+
+/*
+ * Client connection (TCP or Unix domain socket)
+ */
+class FujinonZoomLensNetSession : public std::enable_shared_from_this<FujinonZoomLensNetSession> {
+public:
+	explicit FujinonZoomLensNetSession(uint64_t _clientId, double rate, double burst)
+		: clientId(_clientId), tokens(burst), tokenRate(rate), tokenBurst(burst), lastRefill(std::chrono::steady_clock::now()) {};
+	virtual ~FujinonZoomLensNetSession() = default;
+
+	/* Queue a message to the client (io thread only) */
+	void reply(std::vector<uchar> message) {
+		outbox.push_back(std::move(message));
+		if (outbox.size() == 1) writeNext();
+	}
+
+	/* Token bucket; false if the client exceeded its rate */
+	bool consumeToken() {
+		auto now = std::chrono::steady_clock::now();
+		tokens = std::min(tokenBurst, tokens + tokenRate * std::chrono::duration<double>(now - lastRefill).count());
+		lastRefill = now;
+		if (tokens < 1.0) return false;
+		tokens -= 1.0;
+		return true;
+	}
+
+	const uint64_t clientId;
+
+protected:
+	virtual void asyncWrite(const std::vector<uchar> &message, std::function<void(const boost::system::error_code &)> handler) = 0;
+
+	void writeNext() {
+		auto self = shared_from_this();
+		asyncWrite(outbox.front(), [self](const boost::system::error_code &error) {
+			if (error) { self->outbox.clear(); return; }
+			self->outbox.pop_front();
+			if (!self->outbox.empty()) self->writeNext();
+		});
+	}
+
+private:
+	std::deque<std::vector<uchar>> outbox;
+	double tokens;
+	double tokenRate;
+	double tokenBurst;
+	std::chrono::steady_clock::time_point lastRefill;
+};
+
+/*
+ * Local control server multiplexing any number of clients onto each lens.
+ *
+ * Network I/O runs on its own thread. Every lens has one FIFO per client and the lens worker
+ * takes commands round robin across clients (next()), so a chatty client cannot starve the others;
+ * per-client token buckets and a bound on pending commands keep the queues short, and axis
+ * leases let one tool own an axis for a while. The lens worker only does a non-blocking
+ * next() between serial transactions, so the serial path does not wait on the network.
+ */
+class FujinonZoomLensNetServer {
+public:
+	struct Options {
+		unsigned short tcpPort = 5760; // localhost only; 0 disables TCP
+		std::string unixSocketPath; // empty disables the Unix domain socket
+		size_t lensCount = 1;
+		double rateLimit = 500.0; // requests per second and client
+		double burst = 50.0;
+		size_t maxPending = 64; // commands per client and lens waiting for the lens
+		std::function<void()> onRequest; // called on the network thread when a command was queued (e.g. to wake the lens worker)
+	};
+
+	struct Stats {
+		size_t clients = 0;
+		size_t accepted = 0;
+		size_t rateLimited = 0;
+		size_t leaseRejected = 0;
+		size_t queueFull = 0;
+		size_t invalid = 0;
+		size_t stops = 0;
+		size_t cancelled = 0; // dropped by a stop before reaching the lens
+		size_t completed = 0;
+		double maxQueueUs = 0.0;
+	};
+
+	explicit FujinonZoomLensNetServer(Options _options) : options(std::move(_options)), lenses(std::max<size_t>(options.lensCount, 1)), nextClientId(1) {
+		if (options.tcpPort != 0) {
+			tcpAcceptor = std::make_unique<boost::asio::ip::tcp::acceptor>(io,
+				boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), options.tcpPort));
+			acceptTcp();
+		}
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+		if (!options.unixSocketPath.empty()) {
+			::unlink(options.unixSocketPath.c_str());
+			unixAcceptor = std::make_unique<boost::asio::local::stream_protocol::acceptor>(io,
+				boost::asio::local::stream_protocol::endpoint(options.unixSocketPath));
+			acceptUnix();
+		}
+#endif
+		worker = std::thread([this] { io.run(); });
+	};
+
+	~FujinonZoomLensNetServer() {
+		io.stop();
+		if (worker.joinable()) worker.join();
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+		if (!options.unixSocketPath.empty()) ::unlink(options.unixSocketPath.c_str());
+#endif
+	}
+
+	/* TCP port listened on, 0 if TCP is disabled */
+	unsigned short tcpPort() const { return tcpAcceptor ? tcpAcceptor->local_endpoint().port() : 0; }
+
+	/*
+	 * Take the next command for a lens (lens worker thread). Non-blocking; false if nothing is pending.
+	 */
+	bool next(uchar lens, FujinonZoomLensNetRequest &request) {
+		if (lens >= lenses.size()) return false;
+		LensQueue &q = lenses[lens];
+		std::lock_guard<std::mutex> lock(q.mtx);
+		while (!q.ready.empty()) {
+			uint64_t client = q.ready.front();
+			q.ready.pop_front();
+			auto itr = q.pending.find(client);
+			if (itr == q.pending.end() || itr->second.empty()) continue;
+			request = std::move(itr->second.front());
+			itr->second.pop_front();
+			if (!itr->second.empty()) q.ready.push_back(client); // round robin
+			else q.pending.erase(itr);
+			return true;
+		}
+		return false;
+	}
+
+	/*
+	 * Take the next stop request for a lens (lens worker thread). Non-blocking; false if none is pending.
+	 * Stops bypass the round robin: the worker takes them before any command.
+	 */
+	bool nextStop(uchar lens, FujinonZoomLensNetRequest &request) {
+		if (lens >= lenses.size()) return false;
+		LensQueue &q = lenses[lens];
+		std::lock_guard<std::mutex> lock(q.mtx);
+		if (q.stops.empty()) return false;
+		request = std::move(q.stops.front());
+		q.stops.pop_front();
+		return true;
+	}
+
+	/*
+	 * Report the lens reply of a request taken by next() or nextStop() (lens worker thread)
+	 */
+	void complete(const FujinonZoomLensNetRequest &request, bool ok, const FujinonZoomLensControllerUtil::FujinonZoomLensResponse &response) {
+		double queued = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - request.enqueued).count();
+		auto message = FujinonZoomLensNetProtocol::encode(static_cast<uchar>(ok ? FujinonZoomLensNetProtocol::STATUS::OK : FujinonZoomLensNetProtocol::STATUS::LENS_ERROR),
+			request.id, request.lens, ok ? response.code : request.cmd.code, ok ? response.data : FujinonZoomLensPayload());
+		{
+			std::lock_guard<std::mutex> lock(statsMtx);
+			stats.completed++;
+			stats.maxQueueUs = std::max(stats.maxQueueUs, queued);
+		}
+		boost::asio::post(io, [session = request.session, message = std::move(message)]() mutable {
+			if (auto s = session.lock()) s->reply(std::move(message));
+		});
+	}
+
+	/* Snapshot of the counters (any thread, also while the server is being stopped) */
+	Stats statistics() const {
+		std::lock_guard<std::mutex> lock(statsMtx);
+		return stats;
+	}
+
+private:
+	struct LensQueue {
+		std::mutex mtx;
+		std::map<uint64_t, std::deque<FujinonZoomLensNetRequest>> pending; // per client FIFO
+		std::deque<uint64_t> ready; // clients with pending commands, in service order
+		std::deque<FujinonZoomLensNetRequest> stops;
+	};
+
+	struct Lease {
+		uint64_t owner = 0;
+		std::chrono::steady_clock::time_point expiry;
+	};
+
+	template<class Socket>
+	class Session : public FujinonZoomLensNetSession {
+	public:
+		Session(FujinonZoomLensNetServer &_server, Socket _socket, uint64_t id)
+			: FujinonZoomLensNetSession(id, _server.options.rateLimit, _server.options.burst), server(_server), socket(std::move(_socket)) {};
+
+		~Session() override { server.releaseAll(clientId); }
+
+		void start() { readHeader(); }
+
+	protected:
+		void asyncWrite(const std::vector<uchar> &message, std::function<void(const boost::system::error_code &)> handler) override {
+			boost::asio::async_write(socket, boost::asio::buffer(message),
+				[handler](const boost::system::error_code &error, size_t) { handler(error); });
+		}
+
+	private:
+		void readHeader() {
+			auto self = std::static_pointer_cast<Session>(shared_from_this());
+			boost::asio::async_read(socket, boost::asio::buffer(header), [self](const boost::system::error_code &error, size_t) {
+				if (error) { self->server.disconnected(); return; }
+				if (self->header[0] != FujinonZoomLensNetProtocol::MAGIC) { self->server.disconnected(); return; } // out of sync, drop the client
+				self->body.resize(self->header[6]);
+				self->readBody();
+			});
+		}
+
+		void readBody() {
+			auto self = std::static_pointer_cast<Session>(shared_from_this());
+			boost::asio::async_read(socket, boost::asio::buffer(body), [self](const boost::system::error_code &error, size_t) {
+				if (error) { self->server.disconnected(); return; }
+				self->server.handle(self, self->header, self->body);
+				self->readHeader();
+			});
+		}
+
+		FujinonZoomLensNetServer &server;
+		Socket socket;
+		std::array<uchar, FujinonZoomLensNetProtocol::HEADER_SIZE> header;
+		std::vector<uchar> body;
+	};
+
+	void acceptTcp() {
+		tcpAcceptor->async_accept([this](const boost::system::error_code &error, boost::asio::ip::tcp::socket socket) {
+			if (error) return;
+			socket.set_option(boost::asio::ip::tcp::no_delay(true));
+			count(&Stats::clients);
+			std::make_shared<Session<boost::asio::ip::tcp::socket>>(*this, std::move(socket), nextClientId++)->start();
+			acceptTcp();
+		});
+	}
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+	void acceptUnix() {
+		unixAcceptor->async_accept([this](const boost::system::error_code &error, boost::asio::local::stream_protocol::socket socket) {
+			if (error) return;
+			count(&Stats::clients);
+			std::make_shared<Session<boost::asio::local::stream_protocol::socket>>(*this, std::move(socket), nextClientId++)->start();
+			acceptUnix();
+		});
+	}
+#endif
+
+	void disconnected() {
+		std::lock_guard<std::mutex> lock(statsMtx);
+		stats.clients--;
+	}
+
+	void count(size_t Stats::*counter) {
+		std::lock_guard<std::mutex> lock(statsMtx);
+		(stats.*counter)++;
+	}
+
+	/* Validate a request and queue it for its lens (network thread) */
+	void handle(const std::shared_ptr<FujinonZoomLensNetSession> &session, const std::array<uchar, FujinonZoomLensNetProtocol::HEADER_SIZE> &header,
+		const std::vector<uchar> &data) {
+		using namespace FujinonZoomLensNetProtocol;
+		const uint16_t id = static_cast<uint16_t>(header[2] << 8 | header[3]);
+		const uchar lens = header[4];
+		const uchar code = header[5];
+		auto respond = [&](STATUS status) { session->reply(encode(static_cast<uchar>(status), id, lens, code, {})); };
+
+		if (lens >= lenses.size()) { count(&Stats::invalid); respond(STATUS::INVALID); return; }
+		if (!session->consumeToken()) { count(&Stats::rateLimited); respond(STATUS::RATE_LIMITED); return; }
+
+		const auto now = std::chrono::steady_clock::now();
+		const int axis = axisOf(code);
+		switch (static_cast<TYPE>(header[1])) {
+		case TYPE::ACQUIRE_LEASE: {
+			if (axis < 0 || data.size() != 2) { count(&Stats::invalid); respond(STATUS::INVALID); return; }
+			Lease &lease = leases[lens][axis];
+			if (lease.owner != 0 && lease.owner != session->clientId && lease.expiry > now) { count(&Stats::leaseRejected); respond(STATUS::AXIS_LEASED); return; }
+			lease.owner = session->clientId;
+			lease.expiry = now + std::chrono::milliseconds(data[0] << 8 | data[1]);
+			respond(STATUS::OK);
+			return;
+		}
+		case TYPE::RELEASE_LEASE: {
+			if (axis < 0) { count(&Stats::invalid); respond(STATUS::INVALID); return; }
+			Lease &lease = leases[lens][axis];
+			if (lease.owner == session->clientId) lease.owner = 0;
+			respond(STATUS::OK);
+			return;
+		}
+		case TYPE::STOP:
+			stop(session, id, lens, now);
+			return;
+		case TYPE::COMMAND:
+			break;
+		default:
+			count(&Stats::invalid); respond(STATUS::INVALID);
+			return;
+		}
+
+		if (!isSupported(code, data.size())) { count(&Stats::invalid); respond(STATUS::INVALID); return; }
+		if (axis >= 0) {
+			const Lease &lease = leases[lens][axis];
+			if (lease.owner != 0 && lease.owner != session->clientId && lease.expiry > now) { count(&Stats::leaseRejected); respond(STATUS::AXIS_LEASED); return; }
+		}
+
+		FujinonZoomLensNetRequest request;
+		request.session = session;
+		request.id = id;
+		request.lens = lens;
+		request.cmd.code = code;
+		request.cmd.data = data;
+		request.enqueued = now;
+
+		LensQueue &q = lenses[lens];
+		std::lock_guard<std::mutex> lock(q.mtx);
+		auto &fifo = q.pending[session->clientId];
+		if (fifo.size() >= options.maxPending) { count(&Stats::queueFull); respond(STATUS::QUEUE_FULL); return; }
+		if (fifo.empty()) q.ready.push_back(session->clientId);
+		fifo.push_back(std::move(request));
+		count(&Stats::accepted);
+		if (options.onRequest) options.onRequest();
+	}
+
+	/* Queue a stop and cancel the position commands waiting for the lens (network thread) */
+	void stop(const std::shared_ptr<FujinonZoomLensNetSession> &session, uint16_t id, uchar lens, std::chrono::steady_clock::time_point now) {
+		using namespace FujinonZoomLensNetProtocol;
+		FujinonZoomLensNetRequest request;
+		request.session = session;
+		request.id = id;
+		request.lens = lens;
+		request.enqueued = now;
+
+		std::vector<FujinonZoomLensNetRequest> cancelled;
+		{
+			LensQueue &q = lenses[lens];
+			std::lock_guard<std::mutex> lock(q.mtx);
+			for (auto itr = q.pending.begin(); itr != q.pending.end();) {
+				auto &fifo = itr->second;
+				auto moving = std::stable_partition(fifo.begin(), fifo.end(),
+					[](const FujinonZoomLensNetRequest &r) { return r.cmd.code < 0x20 || r.cmd.code > 0x22; });
+				std::move(moving, fifo.end(), std::back_inserter(cancelled));
+				fifo.erase(moving, fifo.end());
+				itr = fifo.empty() ? q.pending.erase(itr) : std::next(itr); // next() skips clients left in ready
+			}
+			q.stops.push_back(std::move(request));
+		}
+		{
+			std::lock_guard<std::mutex> lock(statsMtx);
+			stats.stops++;
+			stats.cancelled += cancelled.size();
+		}
+		for (const FujinonZoomLensNetRequest &r : cancelled) {
+			if (auto s = r.session.lock()) s->reply(encode(static_cast<uchar>(STATUS::CANCELLED), r.id, r.lens, r.cmd.code, {}));
+		}
+		if (options.onRequest) options.onRequest();
+	}
+
+	/* Drop the leases of a client that went away (network thread) */
+	void releaseAll(uint64_t clientId) {
+		for (auto &lensLeases : leases) {
+			for (auto &lease : lensLeases.second) {
+				if (lease.owner == clientId) lease.owner = 0;
+			}
+		}
+	}
+
+	Options options;
+	std::vector<LensQueue> lenses;
+	std::map<uchar, std::array<Lease, 5>> leases; // network thread only
+	Stats stats; // guarded by statsMtx
+	mutable std::mutex statsMtx;
+	uint64_t nextClientId;
+
+	boost::asio::io_service io;
+	std::unique_ptr<boost::asio::ip::tcp::acceptor> tcpAcceptor;
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+	std::unique_ptr<boost::asio::local::stream_protocol::acceptor> unixAcceptor;
+#endif
+	std::thread worker;
+};
+
+#endif //FUJINON_ZOOM_LENS_NET_SERVER_H
@@ -0,0 +1,173 @@
+﻿//
+// Created by Masahiro Hirano <masahiro.dll@gmail.com>
+//
+
+#ifndef FUJINON_ZOOM_LENS_PRESET_H
+#define FUJINON_ZOOM_LENS_PRESET_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "rapidjson/document.h"
+#include "rapidjson/filereadstream.h"
+#include "rapidjson/filewritestream.h"
+#include "rapidjson/prettywriter.h"
+
+#include "FujinonZoomLens.h"
+
+/*
+ * A named framing: raw positions and filter (-1: not part of the preset).
+ * It is a batch made once, when the preset is made: recalling it writes the same frames every time.
+ */
+struct FujinonZoomLensPreset : FujinonZoomLensBatch {
+	std::string name;
+	int zoom = -1;
+	int focus = -1;
+	int iris = -1;
+	int filter = -1; // 0x40 data
+
+	FujinonZoomLensPreset(std::string _name, int _zoom, int _focus, int _iris, int _filter)
+		: name(std::move(_name)), zoom(_zoom), focus(_focus), iris(_iris), filter(_filter) {
+		auto position = [](int v) { return FujinonZoomLensPayload{ static_cast<uchar>(v / 256), static_cast<uchar>(v % 256) }; };
+		if (filter >= 0) add(0x40, { static_cast<uchar>(filter) });
+		if (zoom >= 0) add(0x21, position(zoom));
+		if (focus >= 0) add(0x22, position(focus));
+		if (iris >= 0) add(0x20, position(iris));
+	}
+};
+
+/*
+ * Time from a recall being requested until its frames were written to the port
+ */
+struct FujinonZoomLensPresetStats {
+	size_t recalled = 0;
+	double lastUs = 0.0;
+	double totalUs = 0.0;
+	double maxUs = 0.0;
+
+	double meanUs() const { return recalled > 0 ? totalUs / recalled : 0.0; }
+};
+
+/*
+ * Named presets, shared by the GUI (save, recall) and the lens worker (writes, latency).
+ * Presets are immutable once made, so a recall in flight keeps its frames even if the preset is replaced.
+ */
+class FujinonZoomLensPresetStore {
+public:
+	using PresetPtr = std::shared_ptr<const FujinonZoomLensPreset>;
+
+	/* Make (or replace) a preset */
+	PresetPtr set(const std::string &name, int zoom, int focus, int iris, int filter) {
+		auto preset = std::make_shared<const FujinonZoomLensPreset>(name, zoom, focus, iris, filter);
+		std::lock_guard<std::mutex> lock(mtx);
+		presets[name] = preset;
+		return preset;
+	}
+
+	bool remove(const std::string &name) {
+		std::lock_guard<std::mutex> lock(mtx);
+		return presets.erase(name) > 0;
+	}
+
+	PresetPtr find(const std::string &name) const {
+		std::lock_guard<std::mutex> lock(mtx);
+		auto itr = presets.find(name);
+		return itr != presets.end() ? itr->second : nullptr;
+	}
+
+	/* All presets by name */
+	std::vector<PresetPtr> list() const {
+		std::lock_guard<std::mutex> lock(mtx);
+		std::vector<PresetPtr> all;
+		for (auto &p : presets) all.push_back(p.second);
+		return all;
+	}
+
+	/* Called by the lens worker once a recall has been written */
+	void recordRecall(std::chrono::steady_clock::duration requestToWire) {
+		const double us = std::chrono::duration<double, std::micro>(requestToWire).count();
+		std::lock_guard<std::mutex> lock(mtx);
+		stats.recalled++;
+		stats.lastUs = us;
+		stats.totalUs += us;
+		stats.maxUs = std::max(stats.maxUs, us);
+	}
+
+	FujinonZoomLensPresetStats statistics() const {
+		std::lock_guard<std::mutex> lock(mtx);
+		return stats;
+	}
+
+	/*
+	 * Read presets from json, replacing the current ones:
+	 *   { "PRESETS": [ { "NAME": "wide", "ZOOM": 0, "FOCUS": 65535, "IRIS": 65535, "FILTER": 224 }, ... ] }
+	 */
+	bool load(const std::string &fileName) {
+		FILE *fp = fopen(fileName.c_str(), "rb");
+		if (fp == NULL) return false;
+		char buf[512];
+		rapidjson::FileReadStream rs(fp, buf, sizeof(buf));
+		rapidjson::Document doc;
+		doc.ParseStream(rs);
+		fclose(fp);
+		if (doc.HasParseError() || !doc.IsObject() || !doc.HasMember("PRESETS") || !doc["PRESETS"].IsArray()) {
+			std::cerr << "Failed to parse " << fileName << std::endl;
+			return false;
+		}
+
+		std::map<std::string, PresetPtr> loaded;
+		for (auto &p : doc["PRESETS"].GetArray()) {
+			if (!p.IsObject() || !p.HasMember("NAME") || !p["NAME"].IsString()) continue;
+			auto read = [&p](const char *name, int max) {
+				return p.HasMember(name) && p[name].IsInt() && p[name].GetInt() <= max ? p[name].GetInt() : -1;
+			};
+			std::string name = p["NAME"].GetString();
+			loaded[name] = std::make_shared<const FujinonZoomLensPreset>(name, read("ZOOM", 0xFFFF), read("FOCUS", 0xFFFF),
+				read("IRIS", 0xFFFF), read("FILTER", 0xFF));
+		}
+		std::lock_guard<std::mutex> lock(mtx);
+		presets = std::move(loaded);
+		return true;
+	}
+
+	bool save(const std::string &fileName) const {
+		rapidjson::Document doc;
+		doc.SetObject();
+		rapidjson::Value array(rapidjson::kArrayType);
+		for (auto &preset : list()) {
+			rapidjson::Value p(rapidjson::kObjectType);
+			p.AddMember("NAME", rapidjson::Value(preset->name.c_str(), doc.GetAllocator()), doc.GetAllocator());
+			p.AddMember("ZOOM", preset->zoom, doc.GetAllocator());
+			p.AddMember("FOCUS", preset->focus, doc.GetAllocator());
+			p.AddMember("IRIS", preset->iris, doc.GetAllocator());
+			p.AddMember("FILTER", preset->filter, doc.GetAllocator());
+			array.PushBack(p, doc.GetAllocator());
+		}
+		doc.AddMember("PRESETS", array, doc.GetAllocator());
+
+		FILE *fp = fopen(fileName.c_str(), "wb");
+		if (fp == NULL) {
+			std::cerr << "Failed to write " << fileName << std::endl;
+			return false;
+		}
+		char writeBuffer[1024];
+		rapidjson::FileWriteStream os(fp, writeBuffer, sizeof(writeBuffer));
+		rapidjson::PrettyWriter<rapidjson::FileWriteStream> writer(os);
+		doc.Accept(writer);
+		fclose(fp);
+		return true;
+	}
+
+private:
+	std::map<std::string, PresetPtr> presets;
+	FujinonZoomLensPresetStats stats;
+	mutable std::mutex mtx;
+};
+
+#endif //FUJINON_ZOOM_LENS_PRESET_H
@@ -0,0 +1,288 @@
+﻿//
+// Created by Masahiro Hirano <masahiro.dll@gmail.com>
+//
+
+#ifndef FUJINON_ZOOM_LENS_PROFILE_H
+#define FUJINON_ZOOM_LENS_PROFILE_H
+
+#include <cmath>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "rapidjson/document.h"
+#include "rapidjson/filereadstream.h"
+#include "rapidjson/filewritestream.h"
+#include "rapidjson/prettywriter.h"
+
+#include "FujinonZoomLens.h"
+#include "AtomicSnapshot.h"
+
+/*
+ * Database of lens profiles.
+ *
+ * Profiles are read from json files (one per lens model):
+ *   {
+ *     "MODEL": "<name returned by 0x11 + 0x12>",
+ *     "ZOOM_LUT": [[1.0, 0], ..., [32.0, 65535]],   // [ratio, position]
+ *     "FOCUS_LUT": [[3.0, 3072], ..., [500, 65535]], // [meter, position]
+ *     "F_TABLE": [[0, 0], [52, 0], ...],             // iris position for CLOSE, F16, F11, F8, F5.6, F4, OPEN
+ *     "ZOOM_RANGE": [1.0, 32.0],                     // optional travel limits (default: LUT range)
+ *     "FOCUS_RANGE": [3.0, 500.0]
+ *   }
+ * The whole set is published as one immutable snapshot, so profiles can be reloaded while
+ * controllers keep reading the previous one. Index 0 is always the built-in default profile.
+ * Profiles are handed out by pointer (select(), findByModel()), so every set published
+ * stays alive with the store; sets are only published when a directory is (re)loaded.
+ *
+ * The profile chosen for each serial number is cached (and persisted) so that a reconnect
+ * only needs the serial number query.
+ */
+class FujinonZoomLensProfileStore {
+private:
+	FujinonZoomLensProfileStore() {
+		published.push_back(profiles.publish({ FujinonZoomLensControllerUtil::defaultProfile() }));
+	};
+	~FujinonZoomLensProfileStore() = default;
+
+	AtomicSnapshot<std::vector<FujinonZoomLensProfile>> profiles;
+	std::vector<std::shared_ptr<const std::vector<FujinonZoomLensProfile>>> published; // keeps handed out pointers valid
+	std::map<std::string, std::string> serialCache; // serial number -> model
+	std::string cacheFileName;
+	std::mutex cacheMtx;
+
+	/*
+	 * Every element is checked before it is read: a malformed file is rejected, it never trips a rapidjson assertion.
+	 * LUTs need at least two nodes, ascending strictly in both columns (interp() and the history's inverse
+	 * divide by the gap between neighbours), with positions within 0x0000 - 0xFFFF.
+	 */
+	static bool parseProfile(const rapidjson::Document &doc, FujinonZoomLensProfile &profile) {
+		auto isPosition = [](const rapidjson::Value &v) { return v.IsNumber() && v.GetDouble() >= 0.0 && v.GetDouble() <= 0xFFFF; };
+		auto readLUT = [&doc, &isPosition](const char *name, std::vector<std::pair<float, float>> &lut) {
+			if (!doc.HasMember(name) || !doc[name].IsArray()) return false;
+			for (auto &v : doc[name].GetArray()) {
+				if (!v.IsArray() || v.Size() != 2 || !v[0].IsNumber() || !isPosition(v[1])) return false;
+				const float value = v[0].GetFloat();
+				const float position = v[1].GetFloat();
+				if (!std::isfinite(value)) return false;
+				if (!lut.empty() && (value <= lut.back().first || position <= lut.back().second)) return false;
+				lut.emplace_back(value, position);
+			}
+			return lut.size() >= 2;
+		};
+		auto readRange = [&doc](const char *name, float &min, float &max) {
+			if (!doc.HasMember(name)) return true;
+			const rapidjson::Value &range = doc[name];
+			if (!range.IsArray() || range.Size() != 2 || !range[0].IsNumber() || !range[1].IsNumber()) return false;
+			const float lo = std::max(min, range[0].GetFloat());
+			const float hi = std::min(max, range[1].GetFloat());
+			if (!(lo <= hi)) return false;
+			min = lo;
+			max = hi;
+			return true;
+		};
+
+		if (!doc.IsObject() || !doc.HasMember("MODEL") || !doc["MODEL"].IsString()) return false;
+		profile.model = doc["MODEL"].GetString();
+
+		std::vector<std::pair<float, float>> zoomLUT, focusLUT;
+		if (!readLUT("ZOOM_LUT", zoomLUT) || !readLUT("FOCUS_LUT", focusLUT)) return false;
+		profile.setZoomLUT(zoomLUT);
+		profile.setFocusLUT(focusLUT);
+		if (!readRange("ZOOM_RANGE", profile.zoomMin, profile.zoomMax)) return false;
+		if (!readRange("FOCUS_RANGE", profile.focusMin, profile.focusMax)) return false;
+
+		profile.fTable = FujinonZoomLensControllerUtil::defaultProfile().fTable;
+		if (doc.HasMember("F_TABLE")) {
+			if (!doc["F_TABLE"].IsArray()) return false;
+			auto table = doc["F_TABLE"].GetArray();
+			if (table.Size() != profile.fTable.size()) return false;
+			for (rapidjson::SizeType i = 0; i < table.Size(); i++) {
+				const rapidjson::Value &entry = table[i];
+				if (!entry.IsArray() || entry.Size() != 2) return false;
+				for (rapidjson::SizeType j = 0; j < 2; j++) {
+					if (!entry[j].IsUint() || entry[j].GetUint() > 0xFF) return false;
+					profile.fTable[i][j] = static_cast<uchar>(entry[j].GetUint());
+				}
+			}
+		}
+		return true;
+	}
+
+	void saveCache() {
+		if (cacheFileName.empty()) return;
+		rapidjson::Document doc;
+		doc.SetObject();
+		for (auto &entry : serialCache) {
+			doc.AddMember(rapidjson::Value(entry.first.c_str(), doc.GetAllocator()),
+				rapidjson::Value(entry.second.c_str(), doc.GetAllocator()), doc.GetAllocator());
+		}
+		FILE *fp = fopen(cacheFileName.c_str(), "wb");
+		if (fp == NULL) return;
+		char writeBuffer[4096];
+		rapidjson::FileWriteStream os(fp, writeBuffer, sizeof(writeBuffer));
+		rapidjson::PrettyWriter<rapidjson::FileWriteStream> writer(os);
+		doc.Accept(writer);
+		fclose(fp);
+	}
+
+public:
+	FujinonZoomLensProfileStore(const FujinonZoomLensProfileStore &) = delete;
+	FujinonZoomLensProfileStore &operator=(const FujinonZoomLensProfileStore &) = delete;
+
+	static FujinonZoomLensProfileStore &get_instance() {
+		static FujinonZoomLensProfileStore instance;
+		return instance;
+	}
+
+	/*
+	 * Load every *.json profile in directory and publish them as the new profile set.
+	 * Lenses identified before keep the profile they were given until they are identified again.
+	 * Returns the number of profiles loaded from files.
+	 */
+	size_t loadDirectory(const std::string &directory) {
+		std::vector<FujinonZoomLensProfile> loaded{ FujinonZoomLensControllerUtil::defaultProfile() };
+
+		std::error_code error;
+		for (auto &entry : std::filesystem::directory_iterator(directory, error)) {
+			if (entry.path().extension() != ".json") continue;
+
+			FILE *fp = fopen(entry.path().string().c_str(), "rb");
+			if (fp == NULL) continue;
+			char buf[512];
+			rapidjson::FileReadStream rs(fp, buf, sizeof(buf));
+			rapidjson::Document doc;
+			doc.ParseStream<rapidjson::ParseFlag::kParseCommentsFlag>(rs);
+			fclose(fp);
+
+			FujinonZoomLensProfile profile;
+			if (doc.HasParseError() || !parseProfile(doc, profile)) {
+				std::cerr << "Invalid lens profile: " << entry.path() << std::endl;
+				continue;
+			}
+			loaded.push_back(std::move(profile));
+		}
+
+		size_t n = loaded.size() - 1;
+		std::shared_ptr<const std::vector<FujinonZoomLensProfile>> current = profiles.publish(std::move(loaded));
+		std::lock_guard<std::mutex> lock(cacheMtx);
+		published.push_back(current);
+		return n;
+	}
+
+	/*
+	 * Read (and later persist) the serial number -> model cache
+	 */
+	void setCacheFile(const std::string &fileName) {
+		std::lock_guard<std::mutex> lock(cacheMtx);
+		cacheFileName = fileName;
+
+		FILE *fp = fopen(fileName.c_str(), "rb");
+		if (fp == NULL) return;
+		char buf[512];
+		rapidjson::FileReadStream rs(fp, buf, sizeof(buf));
+		rapidjson::Document doc;
+		doc.ParseStream(rs);
+		fclose(fp);
+		if (doc.HasParseError() || !doc.IsObject()) return;
+		for (auto itr = doc.MemberBegin(); itr != doc.MemberEnd(); itr++) {
+			if (itr->value.IsString()) serialCache[itr->name.GetString()] = itr->value.GetString();
+		}
+	}
+
+	/*
+	 * Profile whose model is a prefix of name (the longest one wins), nullptr if none.
+	 */
+	const FujinonZoomLensProfile *findByModel(const std::string &name) const {
+		const std::shared_ptr<const std::vector<FujinonZoomLensProfile>> set = profiles.load();
+		const FujinonZoomLensProfile *found = nullptr;
+		for (size_t i = 1; i < set->size(); i++) {
+			const std::string &model = (*set)[i].model;
+			if (name.compare(0, model.size(), model) == 0 && (found == nullptr || model.size() > found->model.size())) {
+				found = &(*set)[i];
+			}
+		}
+		return found;
+	}
+
+	/*
+	 * Profile remembered for this serial number, nullptr if the lens has not been seen before.
+	 */
+	const FujinonZoomLensProfile *findBySerial(const std::string &serial) {
+		std::string model;
+		{
+			std::lock_guard<std::mutex> lock(cacheMtx);
+			auto itr = serialCache.find(serial);
+			if (itr == serialCache.end()) return nullptr;
+			model = itr->second;
+		}
+		return model.empty() ? &profiles.load()->front() : findByModel(model);
+	}
+
+	/*
+	 * Choose the profile for a lens by model name (falls back to the default profile)
+	 * and remember it for the serial number.
+	 */
+	const FujinonZoomLensProfile *select(const std::string &name, const std::string &serial) {
+		const FujinonZoomLensProfile *p = findByModel(name);
+		if (p == nullptr) p = &profiles.load()->front();
+		if (!serial.empty()) {
+			std::lock_guard<std::mutex> lock(cacheMtx);
+			serialCache[serial] = p->model;
+			saveCache();
+		}
+		return p;
+	}
+
+	/*
+	 * Write a profile in the format loadDirectory() reads. Returns false if the file cannot be written.
+	 */
+	static bool save(const FujinonZoomLensProfile &profile, const std::string &fileName) {
+		rapidjson::Document doc;
+		doc.SetObject();
+		auto &allocator = doc.GetAllocator();
+		auto lut = [&allocator](const std::vector<float> &values, const std::vector<float> &positions) {
+			rapidjson::Value array(rapidjson::kArrayType);
+			for (size_t i = 0; i < values.size(); i++) {
+				rapidjson::Value pair(rapidjson::kArrayType);
+				pair.PushBack(values[i], allocator).PushBack(static_cast<int>(std::lround(positions[i])), allocator);
+				array.PushBack(pair, allocator);
+			}
+			return array;
+		};
+		auto range = [&allocator](float min, float max) {
+			rapidjson::Value array(rapidjson::kArrayType);
+			array.PushBack(min, allocator).PushBack(max, allocator);
+			return array;
+		};
+
+		doc.AddMember("MODEL", rapidjson::Value(profile.model.c_str(), allocator), allocator);
+		doc.AddMember("ZOOM_LUT", lut(profile.zoomRatio, profile.zoomPosition), allocator);
+		doc.AddMember("FOCUS_LUT", lut(profile.focusMeter, profile.focusPosition), allocator);
+		rapidjson::Value table(rapidjson::kArrayType);
+		for (auto &f : profile.fTable) {
+			rapidjson::Value pair(rapidjson::kArrayType);
+			pair.PushBack(static_cast<unsigned>(f[0]), allocator).PushBack(static_cast<unsigned>(f[1]), allocator);
+			table.PushBack(pair, allocator);
+		}
+		doc.AddMember("F_TABLE", table, allocator);
+		doc.AddMember("ZOOM_RANGE", range(profile.zoomMin, profile.zoomMax), allocator);
+		doc.AddMember("FOCUS_RANGE", range(profile.focusMin, profile.focusMax), allocator);
+
+		FILE *fp = fopen(fileName.c_str(), "wb");
+		if (fp == NULL) return false;
+		char writeBuffer[4096];
+		rapidjson::FileWriteStream os(fp, writeBuffer, sizeof(writeBuffer));
+		rapidjson::PrettyWriter<rapidjson::FileWriteStream> writer(os);
+		writer.SetFormatOptions(rapidjson::kFormatSingleLineArray);
+		doc.Accept(writer);
+		fclose(fp);
+		return true;
+	}
+
+	/* Snapshot of the current profile set */
+	std::shared_ptr<const std::vector<FujinonZoomLensProfile>> all() const { return profiles.load(); }
+};
+
+#endif //FUJINON_ZOOM_LENS_PROFILE_H
@@ -0,0 +1,410 @@
+﻿//
+// Created by Masahiro Hirano <masahiro.dll@gmail.com>
+//
+
+#ifndef FUJINON_ZOOM_LENS_SCHEDULER_H
+#define FUJINON_ZOOM_LENS_SCHEDULER_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "FujinonZoomLens.h"
+
+/*
+ * Priority classes of lens commands (lower is more urgent)
+ */
+enum class FujinonZoomLensPriority { EMERGENCY = 0, MOTION = 1, CONFIGURATION = 2, QUERY = 3 };
+
+namespace FujinonZoomLensSchedulerUtil {
+	constexpr size_t PRIORITY_COUNT = 4;
+
+	/* Default class of a command */
+	inline FujinonZoomLensPriority classify(uchar code) {
+		switch (code) {
+		case 0x20: case 0x21: case 0x22: return FujinonZoomLensPriority::MOTION;
+		case 0x40: case 0x42: return FujinonZoomLensPriority::CONFIGURATION;
+		default: return FujinonZoomLensPriority::QUERY;
+		}
+	}
+
+	inline const char *name(FujinonZoomLensPriority priority) {
+		switch (priority) {
+		case FujinonZoomLensPriority::EMERGENCY: return "emergency";
+		case FujinonZoomLensPriority::MOTION: return "motion";
+		case FujinonZoomLensPriority::CONFIGURATION: return "configuration";
+		default: return "query";
+		}
+	}
+}
+
+/*
+ * A command waiting for the lens worker.
+ * done (optional) receives whether the lens acknowledged the command and its reply.
+ */
+struct FujinonZoomLensScheduledCommand {
+	FujinonZoomLensCommand cmd;
+	FujinonZoomLensPriority priority = FujinonZoomLensPriority::QUERY;
+	std::chrono::steady_clock::time_point enqueued;
+	std::function<void(bool, const FujinonZoomLensControllerUtil::FujinonZoomLensResponse &)> done;
+	std::shared_ptr<const FujinonZoomLensBatch> batch; // a batch: its frames are written as they are, in one write; cmd is unused
+	bool recall = false; // the batch is a preset
+};
+
+/*
+ * Queue time of one priority class
+ */
+struct FujinonZoomLensSchedulerStats {
+	size_t scheduled = 0;
+	size_t coalesced = 0; // superseded by a newer command to the same control before being sent
+	size_t cancelled = 0; // dropped by halt() before being sent
+	size_t queued = 0; // waiting now
+	double totalQueueUs = 0.0;
+	double maxQueueUs = 0.0;
+
+	double meanQueueUs() const { return scheduled > 0 ? totalQueueUs / scheduled : 0.0; }
+};
+
+/*
+ * Command queue of the lens worker with priority classes and aging.
+ *
+ * Each class is a FIFO. EMERGENCY commands are always served first, so they wait for at most the
+ * one transaction already on the line. Among the other classes, a command of class c is ranked as if
+ * it had been queued c * agingStep later than it was: a query is served before motion commands that
+ * arrived more than 2 * agingStep after it, so no class is starved however busy the line is.
+ *
+ * Setters without a completion replace a queued setter of the same control, which keeps the
+ * latest-wins behaviour of GUI sliders without letting the queue grow while the line is busy.
+ *
+ * Queued commands live in a slab of nodes recycled through a free list; the FIFOs are linked through
+ * node indices. The slab only grows when the queue gets deeper than ever before, so in steady state
+ * push() and pop() do not allocate (a done callback with a large capture aside).
+ */
+class FujinonZoomLensScheduler {
+public:
+	explicit FujinonZoomLensScheduler(std::chrono::milliseconds _agingStep = std::chrono::milliseconds(50))
+		: agingStep(_agingStep), freeList(NONE), closed(false) {
+		grow();
+	};
+
+	void push(FujinonZoomLensCommand cmd) {
+		FujinonZoomLensPriority priority = FujinonZoomLensSchedulerUtil::classify(cmd.code);
+		push(std::move(cmd), priority);
+	}
+
+	void push(FujinonZoomLensCommand cmd, FujinonZoomLensPriority priority,
+		std::function<void(bool, const FujinonZoomLensControllerUtil::FujinonZoomLensResponse &)> done = nullptr) {
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			Fifo &queue = queues[static_cast<size_t>(priority)];
+			if (!done && priority != FujinonZoomLensPriority::QUERY) {
+				for (size_t i = queue.head; i != NONE; i = slab[i].next) {
+					FujinonZoomLensScheduledCommand &queued = slab[i].entry;
+					if (!queued.done && !queued.batch && queued.cmd.code == cmd.code) {
+						queued.cmd.data = cmd.data; // keeps its place in the queue
+						stats[static_cast<size_t>(priority)].coalesced++;
+						return;
+					}
+				}
+			}
+			enqueue(cmd, priority, std::move(done), nullptr, false);
+		}
+		cv.notify_one();
+	}
+
+	/*
+	 * Queue a batch as one transaction, in the class of its most urgent command.
+	 * Batches are not coalesced: two batches may set different controls.
+	 */
+	void pushBatch(std::shared_ptr<const FujinonZoomLensBatch> batch,
+		std::function<void(bool, const FujinonZoomLensControllerUtil::FujinonZoomLensResponse &)> done = nullptr) {
+		if (batch->empty()) return;
+		FujinonZoomLensPriority priority = FujinonZoomLensPriority::QUERY;
+		for (const FujinonZoomLensCommand &cmd : batch->commands) priority = std::min(priority, FujinonZoomLensSchedulerUtil::classify(cmd.code));
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			enqueue(FujinonZoomLensCommand(), priority, std::move(done), std::move(batch), false);
+		}
+		cv.notify_one();
+	}
+
+	/*
+	 * Queue a preset recall (as a motion command). Like setters, a recall without a completion
+	 * replaces a queued one.
+	 */
+	void recall(std::shared_ptr<const FujinonZoomLensBatch> preset,
+		std::function<void(bool, const FujinonZoomLensControllerUtil::FujinonZoomLensResponse &)> done = nullptr) {
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			Fifo &queue = queues[static_cast<size_t>(FujinonZoomLensPriority::MOTION)];
+			if (!done) {
+				for (size_t i = queue.head; i != NONE; i = slab[i].next) {
+					FujinonZoomLensScheduledCommand &queued = slab[i].entry;
+					if (!queued.done && queued.recall) {
+						queued.batch = std::move(preset);
+						stats[static_cast<size_t>(FujinonZoomLensPriority::MOTION)].coalesced++;
+						return;
+					}
+				}
+			}
+			enqueue(FujinonZoomLensCommand(), FujinonZoomLensPriority::MOTION, std::move(done), std::move(preset), true);
+		}
+		cv.notify_one();
+	}
+
+	/*
+	 * Stop the lens where it is, ahead of everything queued. The queued motion commands (setters, batches,
+	 * recalls) are dropped and their completions called with false, so nothing queued moves the lens again;
+	 * then the position of iris, zoom and focus is queried and each axis commanded to it, all as EMERGENCY.
+	 * done (optional) is called once every axis was commanded, with false if any step failed.
+	 */
+	void halt(std::function<void(bool, const FujinonZoomLensControllerUtil::FujinonZoomLensResponse &)> done = nullptr) {
+		auto state = std::make_shared<Halt>();
+		state->done = std::move(done);
+		std::vector<FujinonZoomLensScheduledCommand> dropped;
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			const size_t motion = static_cast<size_t>(FujinonZoomLensPriority::MOTION);
+			while (queues[motion].head != NONE) {
+				const size_t i = queues[motion].head;
+				queues[motion].head = slab[i].next;
+				dropped.push_back(std::move(slab[i].entry));
+				release(i);
+			}
+			queues[motion].tail = NONE;
+			stats[motion].queued -= dropped.size();
+			stats[motion].cancelled += dropped.size();
+
+			const uchar positions[] = { 0x30, 0x31, 0x32 };
+			for (uchar code : positions) {
+				enqueue({ code, {} }, FujinonZoomLensPriority::EMERGENCY,
+					[this, state, code](bool ok, const FujinonZoomLensControllerUtil::FujinonZoomLensResponse &response) {
+						if (!ok || response.data.size() != 2) {
+							state->finish(false, response);
+							return;
+						}
+						push({ static_cast<uchar>(code - 0x10), response.data }, FujinonZoomLensPriority::EMERGENCY,
+							[state](bool held, const FujinonZoomLensControllerUtil::FujinonZoomLensResponse &reply) { state->finish(held, reply); });
+					}, nullptr, false);
+			}
+		}
+		cv.notify_one();
+		for (FujinonZoomLensScheduledCommand &entry : dropped) {
+			if (entry.done) entry.done(false, FujinonZoomLensControllerUtil::FujinonZoomLensResponse());
+		}
+	}
+
+	/*
+	 * Put back a command the worker took but could not send (the lens went away), at the head of its
+	 * class so that it keeps its turn. A setter or recall without a completion is dropped instead if a
+	 * newer one to the same control was queued meanwhile, as push() would have replaced it. Batches are kept.
+	 */
+	void requeue(FujinonZoomLensScheduledCommand entry) {
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			Fifo &queue = queues[static_cast<size_t>(entry.priority)];
+			if (!entry.done && entry.priority != FujinonZoomLensPriority::QUERY && (entry.recall || !entry.batch)) {
+				for (size_t i = queue.head; i != NONE; i = slab[i].next) {
+					const FujinonZoomLensScheduledCommand &queued = slab[i].entry;
+					if (!queued.done && (entry.recall ? queued.recall : !queued.batch && queued.cmd.code == entry.cmd.code)) {
+						stats[static_cast<size_t>(entry.priority)].coalesced++;
+						return;
+					}
+				}
+			}
+			const size_t i = acquire();
+			const FujinonZoomLensPriority priority = entry.priority;
+			slab[i].entry = std::move(entry);
+			slab[i].next = queue.head;
+			queue.head = i;
+			if (queue.tail == NONE) queue.tail = i;
+			stats[static_cast<size_t>(priority)].queued++;
+		}
+		cv.notify_one();
+	}
+
+	/*
+	 * Take the next command, waiting up to timeout. False on timeout, wake() or close().
+	 */
+	bool pop(FujinonZoomLensScheduledCommand &entry, std::chrono::milliseconds timeout) {
+		std::unique_lock<std::mutex> lock(mtx);
+		if (empty() && !closed && !woken) {
+			cv.wait_for(lock, timeout, [this] { return !empty() || closed || woken; });
+		}
+		woken = false;
+		if (empty() || closed) return false;
+
+		// EMERGENCY first; otherwise the head with the earliest enqueued + class * agingStep
+		const auto now = std::chrono::steady_clock::now();
+		size_t best = queues.size();
+		std::chrono::steady_clock::time_point bestDeadline;
+		for (size_t c = 0; c < queues.size(); c++) {
+			if (queues[c].head == NONE) continue;
+			if (c == static_cast<size_t>(FujinonZoomLensPriority::EMERGENCY)) { best = c; break; }
+			auto deadline = slab[queues[c].head].entry.enqueued + agingStep * static_cast<int>(c);
+			if (best == queues.size() || deadline < bestDeadline) {
+				best = c;
+				bestDeadline = deadline;
+			}
+		}
+
+		const size_t i = queues[best].head;
+		queues[best].head = slab[i].next;
+		if (queues[best].head == NONE) queues[best].tail = NONE;
+		entry = std::move(slab[i].entry);
+		release(i);
+		FujinonZoomLensSchedulerStats &s = stats[best];
+		double us = std::chrono::duration<double, std::micro>(now - entry.enqueued).count();
+		s.queued--;
+		s.scheduled++;
+		s.totalQueueUs += us;
+		s.maxQueueUs = std::max(s.maxQueueUs, us);
+		return true;
+	}
+
+	/*
+	 * The worker marks when it wrote the command it took to the port, before running its completion,
+	 * so a completion can tell how long its command took to reach the wire.
+	 */
+	void markWritten(std::chrono::steady_clock::time_point time) {
+		written.store(time.time_since_epoch().count(), std::memory_order_release);
+	}
+
+	std::chrono::steady_clock::time_point lastWritten() const {
+		return std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(written.load(std::memory_order_acquire)));
+	}
+
+	/* Make a waiting pop() return so that the worker can poll other sources */
+	void wake() {
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			woken = true;
+		}
+		cv.notify_one();
+	}
+
+	void close() {
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			closed = true;
+		}
+		cv.notify_all();
+	}
+
+	bool isClosed() {
+		std::lock_guard<std::mutex> lock(mtx);
+		return closed;
+	}
+
+	FujinonZoomLensSchedulerStats statistics(FujinonZoomLensPriority priority) {
+		std::lock_guard<std::mutex> lock(mtx);
+		return stats[static_cast<size_t>(priority)];
+	}
+
+	/* Nodes in the slab, queued or free: the deepest the queue has been, rounded up to SLAB_CHUNK */
+	size_t capacity() {
+		std::lock_guard<std::mutex> lock(mtx);
+		return slab.size();
+	}
+
+	void resetStatistics() {
+		std::lock_guard<std::mutex> lock(mtx);
+		for (size_t c = 0; c < stats.size(); c++) {
+			size_t queued = stats[c].queued;
+			stats[c] = FujinonZoomLensSchedulerStats();
+			stats[c].queued = queued;
+		}
+	}
+
+private:
+	static constexpr size_t NONE = static_cast<size_t>(-1);
+	static constexpr size_t SLAB_CHUNK = 64; // nodes added each time the slab runs out
+
+	/* Slab node: linked into the FIFO of its class while queued, into the free list otherwise */
+	struct Node {
+		FujinonZoomLensScheduledCommand entry;
+		size_t next = NONE;
+	};
+
+	struct Fifo {
+		size_t head = NONE;
+		size_t tail = NONE;
+	};
+
+	/* Progress of a halt() over its three axes (completions run on the lens worker, one at a time) */
+	struct Halt {
+		std::function<void(bool, const FujinonZoomLensControllerUtil::FujinonZoomLensResponse &)> done;
+		size_t remaining = 3;
+		bool ok = true;
+
+		void finish(bool axisOk, const FujinonZoomLensControllerUtil::FujinonZoomLensResponse &response) {
+			ok = ok && axisOk;
+			if (--remaining == 0 && done) done(ok, response);
+		}
+	};
+
+	/* Append to the FIFO of priority (mtx held) */
+	void enqueue(const FujinonZoomLensCommand &cmd, FujinonZoomLensPriority priority,
+		std::function<void(bool, const FujinonZoomLensControllerUtil::FujinonZoomLensResponse &)> done,
+		std::shared_ptr<const FujinonZoomLensBatch> batch, bool recall) {
+		const size_t i = acquire();
+		FujinonZoomLensScheduledCommand &entry = slab[i].entry;
+		entry.cmd = cmd;
+		entry.priority = priority;
+		entry.enqueued = std::chrono::steady_clock::now();
+		entry.done = std::move(done);
+		entry.batch = std::move(batch);
+		entry.recall = recall;
+		Fifo &queue = queues[static_cast<size_t>(priority)];
+		if (queue.tail == NONE) queue.head = i;
+		else slab[queue.tail].next = i;
+		queue.tail = i;
+		stats[static_cast<size_t>(priority)].queued++;
+	}
+
+	bool empty() const {
+		return std::all_of(queues.begin(), queues.end(), [](const Fifo &q) { return q.head == NONE; });
+	}
+
+	/* Nodes are addressed by index, so growing the slab does not break the links */
+	void grow() {
+		const size_t first = slab.size();
+		slab.resize(first + SLAB_CHUNK);
+		for (size_t i = first; i < slab.size(); i++) slab[i].next = i + 1 < slab.size() ? i + 1 : freeList;
+		freeList = first;
+	}
+
+	size_t acquire() {
+		if (freeList == NONE) grow();
+		const size_t i = freeList;
+		freeList = slab[i].next;
+		slab[i].next = NONE;
+		return i;
+	}
+
+	void release(size_t i) {
+		slab[i].entry.done = nullptr; // drop what the completion captured now rather than on reuse
+		slab[i].entry.batch = nullptr;
+		slab[i].next = freeList;
+		freeList = i;
+	}
+
+	const std::chrono::steady_clock::duration agingStep;
+	std::vector<Node> slab;
+	size_t freeList;
+	std::array<Fifo, FujinonZoomLensSchedulerUtil::PRIORITY_COUNT> queues;
+	std::array<FujinonZoomLensSchedulerStats, FujinonZoomLensSchedulerUtil::PRIORITY_COUNT> stats;
+	std::mutex mtx;
+	std::condition_variable cv;
+	bool closed;
+	bool woken = false;
+	std::atomic<std::chrono::steady_clock::rep> written{ 0 };
+};
+
+#endif //FUJINON_ZOOM_LENS_SCHEDULER_H
@@ -0,0 +1,451 @@
+﻿//
+// Created by Masahiro Hirano <masahiro.dll@gmail.com>
+//
+
+#ifndef FUJINON_ZOOM_LENS_SEQUENCE_H
+#define FUJINON_ZOOM_LENS_SEQUENCE_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "FujinonZoomLens.h"
+#include "FujinonZoomLensMotion.h"
+#include "FujinonZoomLensScheduler.h"
+
+class FujinonZoomLensSequenceExecutor;
+
+/*
+ * Cost of waitSettled: position polls per wait
+ */
+struct FujinonZoomLensSettleStats {
+	size_t waits = 0;
+	size_t polls = 0;
+	double pollsPerWait() const { return waits > 0 ? static_cast<double>(polls) / waits : 0.0; }
+};
+
+/*
+ * Coroutine type of a lens sequence.
+ * Sequences are started with FujinonZoomLensSequenceExecutor::spawn() and free their frame when they finish;
+ * the frames of sequences still suspended when the executor is destroyed are freed by the executor.
+ *
+ *   FujinonZoomLensSequence choreography(FujinonZoomLensSequenceExecutor &lens) {
+ *       co_await lens.zoomTo(10.0f);
+ *       co_await lens.waitSettled(0x21);
+ *       uint focus = co_await lens.readFocus();
+ *       co_await lens.focusTo(20.0f);
+ *   }
+ *   executor.spawn(choreography(executor));
+ */
+class FujinonZoomLensSequence {
+public:
+	struct promise_type {
+		FujinonZoomLensSequence get_return_object() { return FujinonZoomLensSequence(std::coroutine_handle<promise_type>::from_promise(*this)); }
+		std::suspend_always initial_suspend() noexcept { return {}; } // started by spawn()
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() {
+			try { std::rethrow_exception(std::current_exception()); }
+			catch (const std::exception &e) { std::cerr << "Lens sequence failed: " << e.what() << std::endl; }
+			catch (...) { std::cerr << "Lens sequence failed" << std::endl; }
+		}
+		~promise_type();
+
+		FujinonZoomLensSequenceExecutor *executor = nullptr;
+	};
+
+	FujinonZoomLensSequence(FujinonZoomLensSequence &&other) noexcept : handle(other.handle) { other.handle = nullptr; }
+	FujinonZoomLensSequence(const FujinonZoomLensSequence &) = delete;
+	~FujinonZoomLensSequence() { if (handle) handle.destroy(); } // never spawned
+
+private:
+	friend class FujinonZoomLensSequenceExecutor;
+	explicit FujinonZoomLensSequence(std::coroutine_handle<promise_type> _handle) : handle(_handle) {};
+
+	std::coroutine_handle<promise_type> release() {
+		auto h = handle;
+		handle = nullptr;
+		return h;
+	}
+
+	std::coroutine_handle<promise_type> handle;
+};
+
+/*
+ * Runs any number of lens sequences on one thread.
+ *
+ * Each awaitable step hands its command to the lens scheduler with a completion and suspends;
+ * the completion posts the resumption back to the executor thread. A suspended sequence costs
+ * only its coroutine frame, and no thread ever sleeps waiting for the lens.
+ * Commands are encoded by a FujinonZoomLensController owned by the executor (profile, shadow and
+ * redundant-command suppression included); a suppressed command completes without suspending.
+ * Other clients move the lens too, so whoever sees every lens confirmation (the GUI) passes them to
+ * onResponse(): otherwise the shadow would only know the executor's own commands.
+ * With a motor model, waiting for an axis to settle sleeps until the predicted arrival instead of polling.
+ */
+class FujinonZoomLensSequenceExecutor {
+public:
+	explicit FujinonZoomLensSequenceExecutor(FujinonZoomLensScheduler &_scheduler, const FujinonZoomLensMotionModel *_motion = nullptr)
+		: scheduler(_scheduler), motion(_motion),
+		controller(std::make_shared<Client>(*this)),
+		anchor(std::make_shared<Anchor>(this)), inFlight(0), settleWaits(0), settlePolls(0), stopping(false) {
+		worker = std::thread([this] { loop(); });
+	};
+
+	/*
+	 * Sequences still suspended (on a command, a sleep or a settle wait) are destroyed without being resumed:
+	 * their resumptions are dropped with the queues, and their frames freed here.
+	 */
+	~FujinonZoomLensSequenceExecutor() {
+		{
+			std::lock_guard<std::mutex> lock(anchor->mtx);
+			anchor->executor = nullptr;
+		}
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			stopping = true;
+		}
+		cv.notify_all();
+		if (worker.joinable()) worker.join();
+
+		std::unordered_set<FujinonZoomLensSequence::promise_type *> suspended;
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			ready.clear();
+			timers = {};
+			suspended.swap(live);
+		}
+		for (auto *promise : suspended) {
+			std::coroutine_handle<FujinonZoomLensSequence::promise_type>::from_promise(*promise).destroy();
+		}
+	}
+
+	/* Start a sequence (any thread) */
+	void spawn(FujinonZoomLensSequence sequence) {
+		auto handle = sequence.release();
+		handle.promise().executor = this;
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			live.insert(&handle.promise());
+		}
+		inFlight++;
+		post([handle] { handle.resume(); });
+	}
+
+	/* Sequences started and not finished yet */
+	size_t running() const { return inFlight.load(); }
+
+	FujinonZoomLensSettleStats settleStatistics() const {
+		FujinonZoomLensSettleStats s;
+		s.waits = settleWaits.load();
+		s.polls = settlePolls.load();
+		return s;
+	}
+
+	/* Controller used to encode commands (executor thread only, but for setProfile()) */
+	FujinonZoomLensController &lens() { return controller; }
+
+	/*
+	 * A transaction the lens confirmed, whoever sent it (any thread): setters with the acknowledged
+	 * payload, queries with the reported data. Applied on the executor thread, in call order.
+	 */
+	void onResponse(uchar code, const FujinonZoomLensPayload &data) {
+		post([this, code, data] { confirm(code, data); });
+	}
+
+	/* Forget what was confirmed, e.g. after the lens reconnected or confirmations were lost (any thread) */
+	void invalidateShadow() {
+		post([this] {
+			controller.invalidateShadow();
+			targets = { -1, -1, -1 };
+		});
+	}
+
+	/*
+	 * Awaitable lens command; resumes with the lens reply once the lens acknowledged it
+	 */
+	class CommandAwaiter {
+	public:
+		CommandAwaiter(FujinonZoomLensSequenceExecutor &_executor, std::function<void(FujinonZoomLensController &)> _issue)
+			: executor(_executor), issue(std::move(_issue)) {};
+
+		bool await_ready() const noexcept { return false; }
+		bool await_suspend(std::coroutine_handle<> handle) {
+			this->handle = handle;
+			executor.issuing = this;
+			issue(executor.controller);
+			bool sent = executor.issuing == nullptr; // the client took it
+			executor.issuing = nullptr;
+			return sent; // suppressed: already in that state, continue immediately
+		}
+		FujinonZoomLensControllerUtil::FujinonZoomLensResponse await_resume() const { return response; }
+
+	private:
+		friend class FujinonZoomLensSequenceExecutor;
+		FujinonZoomLensSequenceExecutor &executor;
+		std::function<void(FujinonZoomLensController &)> issue;
+		std::coroutine_handle<> handle;
+		FujinonZoomLensControllerUtil::FujinonZoomLensResponse response;
+	};
+
+	CommandAwaiter zoomTo(float ratio) { return CommandAwaiter(*this, [ratio](FujinonZoomLensController &zlc) { zlc.setZoomRatio(ratio); }); }
+	CommandAwaiter focusTo(float meter) { return CommandAwaiter(*this, [meter](FujinonZoomLensController &zlc) { zlc.setFocus(meter); }); }
+	CommandAwaiter irisTo(FujinonZoomLensControllerUtil::ZOOM_LENS_F F) { return CommandAwaiter(*this, [F](FujinonZoomLensController &zlc) { zlc.setF(F); }); }
+	CommandAwaiter command(uchar code, FujinonZoomLensPayload data) {
+		return CommandAwaiter(*this, [code, data](FujinonZoomLensController &zlc) { zlc.command(code, data); });
+	}
+
+	/*
+	 * Awaitable position query; resumes with the position (0x0000 - 0xFFFF)
+	 */
+	class PositionAwaiter : public CommandAwaiter {
+	public:
+		using CommandAwaiter::CommandAwaiter;
+		uint await_resume() const { return CommandAwaiter::await_resume().position(); }
+	};
+
+	PositionAwaiter readIris() { return PositionAwaiter(*this, [](FujinonZoomLensController &zlc) { zlc.getIrisPosition(); }); }
+	PositionAwaiter readZoom() { return PositionAwaiter(*this, [](FujinonZoomLensController &zlc) { zlc.getZoomPosition(); }); }
+	PositionAwaiter readFocus() { return PositionAwaiter(*this, [](FujinonZoomLensController &zlc) { zlc.getFocusPosition(); }); }
+
+	/*
+	 * Awaitable pause that does not block the executor thread
+	 */
+	class SleepAwaiter {
+	public:
+		SleepAwaiter(FujinonZoomLensSequenceExecutor &_executor, std::chrono::steady_clock::duration _duration)
+			: executor(_executor), duration(_duration) {};
+
+		bool await_ready() const noexcept { return duration <= std::chrono::steady_clock::duration::zero(); }
+		void await_suspend(std::coroutine_handle<> handle) {
+			executor.postAt(std::chrono::steady_clock::now() + duration, [handle] { handle.resume(); });
+		}
+		void await_resume() const noexcept {}
+
+	private:
+		FujinonZoomLensSequenceExecutor &executor;
+		std::chrono::steady_clock::duration duration;
+	};
+
+	SleepAwaiter sleepFor(std::chrono::steady_clock::duration duration) { return SleepAwaiter(*this, duration); }
+
+	/*
+	 * Awaitable wait until an axis (0x20 iris, 0x21 zoom, 0x22 focus) stops moving.
+	 * The position is polled every interval; the axis is settled when it is within tolerance of the
+	 * last position the lens acknowledged for it, from any client (or, if none is known, when two readings agree).
+	 * With a motor model, the first poll waits for the predicted arrival, so a wait usually costs one poll.
+	 * Resumes with false if it did not settle before timeout.
+	 */
+	class SettleAwaiter {
+	public:
+		static constexpr std::chrono::milliseconds ARRIVAL_MARGIN{ 10 }; // after the predicted arrival
+
+		SettleAwaiter(FujinonZoomLensSequenceExecutor &_executor, uchar _code, uint _tolerance,
+			std::chrono::milliseconds _interval, std::chrono::milliseconds _timeout)
+			: executor(_executor), code(_code), tolerance(_tolerance), interval(_interval), timeout(_timeout) {};
+
+		bool await_ready() const noexcept { return false; }
+		void await_suspend(std::coroutine_handle<> _handle) {
+			handle = _handle;
+			deadline = std::chrono::steady_clock::now() + timeout;
+			if (code >= 0x20 && code <= 0x22) target = executor.targets[code - 0x20];
+			executor.settleWaits++;
+			if (target >= 0 && executor.motion != nullptr) {
+				const auto arrival = executor.motion->arrival(code - 0x20) + ARRIVAL_MARGIN;
+				if (arrival > std::chrono::steady_clock::now()) {
+					executor.postAt(std::min(arrival, deadline), [this] { poll(); });
+					return;
+				}
+			}
+			poll();
+		}
+		bool await_resume() const noexcept { return settled; }
+
+	private:
+		void poll() {
+			executor.settlePolls++;
+			executor.query(static_cast<uchar>(code + 0x10), [this](bool ok, const FujinonZoomLensControllerUtil::FujinonZoomLensResponse &response) {
+				if (ok && response.data.size() == 2) {
+					int position = static_cast<int>(response.position());
+					settled = target >= 0 ? std::abs(position - target) <= static_cast<int>(tolerance)
+						: last >= 0 && std::abs(position - last) <= static_cast<int>(tolerance);
+					last = position;
+				}
+				if (settled || std::chrono::steady_clock::now() >= deadline) {
+					handle.resume();
+					return;
+				}
+				executor.postAt(std::chrono::steady_clock::now() + interval, [this] { poll(); });
+			});
+		}
+
+		FujinonZoomLensSequenceExecutor &executor;
+		uchar code;
+		uint tolerance;
+		std::chrono::milliseconds interval;
+		std::chrono::milliseconds timeout;
+		std::chrono::steady_clock::time_point deadline;
+		std::coroutine_handle<> handle;
+		int target = -1;
+		int last = -1;
+		bool settled = false;
+	};
+
+	SettleAwaiter waitSettled(uchar code, uint tolerance = 0x40,
+		std::chrono::milliseconds interval = std::chrono::milliseconds(20), std::chrono::milliseconds timeout = std::chrono::milliseconds(5000)) {
+		return SettleAwaiter(*this, code, tolerance, interval, timeout);
+	}
+
+private:
+	friend struct FujinonZoomLensSequence::promise_type;
+
+	/*
+	 * Client of the executor's controller: commands go to the lens scheduler with a completion
+	 * that resumes the awaiting sequence on the executor thread.
+	 */
+	class Client : public FujinonZoomLensClientTemplate {
+	public:
+		explicit Client(FujinonZoomLensSequenceExecutor &_executor) : executor(_executor) {};
+		void send(FujinonZoomLensCommand cmd) override {
+			CommandAwaiter *awaiter = executor.issuing;
+			executor.issuing = nullptr;
+			FujinonZoomLensPriority priority = FujinonZoomLensSchedulerUtil::classify(cmd.code);
+			auto done = executor.completion(awaiter, cmd);
+			executor.scheduler.push(std::move(cmd), priority, std::move(done));
+		}
+	private:
+		FujinonZoomLensSequenceExecutor &executor;
+	};
+
+	/*
+	 * Completion of a command (called on the lens worker thread): updates the shadow and resumes the awaiter.
+	 * Completions arriving after the executor was destroyed are dropped.
+	 */
+	std::function<void(bool, const FujinonZoomLensControllerUtil::FujinonZoomLensResponse &)> completion(CommandAwaiter *awaiter, FujinonZoomLensCommand cmd) {
+		return [anchor = anchor, awaiter, cmd = std::move(cmd)](bool ok, const FujinonZoomLensControllerUtil::FujinonZoomLensResponse &response) {
+			std::lock_guard<std::mutex> lock(anchor->mtx);
+			FujinonZoomLensSequenceExecutor *executor = anchor->executor;
+			if (executor == nullptr) return;
+			executor->post([executor, awaiter, cmd, ok, response] {
+				// setters are confirmed with the acknowledged payload, queries with the reported data
+				if (ok) executor->confirm(cmd.code, response.data.empty() ? cmd.data : response.data);
+				if (awaiter != nullptr) {
+					awaiter->response = response;
+					awaiter->handle.resume();
+				}
+			});
+		};
+	}
+
+	/* Executor thread */
+	void confirm(uchar code, const FujinonZoomLensPayload &data) {
+		controller.onResponse(code, data);
+		if (code >= 0x20 && code <= 0x22 && data.size() == 2) targets[code - 0x20] = static_cast<int>(data[0]) * 256 + data[1];
+	}
+
+	/* Raw query that bypasses the controller (used for polling) */
+	void query(uchar code, std::function<void(bool, const FujinonZoomLensControllerUtil::FujinonZoomLensResponse &)> done) {
+		scheduler.push({ code, {} }, FujinonZoomLensPriority::QUERY,
+			[anchor = anchor, done = std::move(done)](bool ok, const FujinonZoomLensControllerUtil::FujinonZoomLensResponse &response) {
+				std::lock_guard<std::mutex> lock(anchor->mtx);
+				if (anchor->executor != nullptr) anchor->executor->post([done, ok, response] { done(ok, response); });
+			});
+	}
+
+	void post(std::function<void()> task) {
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			ready.push_back(std::move(task));
+		}
+		cv.notify_one();
+	}
+
+	void postAt(std::chrono::steady_clock::time_point time, std::function<void()> task) {
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			timers.push({ time, timerSequence++, std::move(task) });
+		}
+		cv.notify_one();
+	}
+
+	void sequenceFinished(FujinonZoomLensSequence::promise_type *promise) {
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			live.erase(promise);
+		}
+		inFlight--;
+	}
+
+	void loop() {
+		std::unique_lock<std::mutex> lock(mtx);
+		while (!stopping) {
+			const auto now = std::chrono::steady_clock::now();
+			while (!timers.empty() && timers.top().time <= now) {
+				ready.push_back(std::move(const_cast<Timer &>(timers.top()).task));
+				timers.pop();
+			}
+			if (ready.empty()) {
+				if (timers.empty()) cv.wait(lock);
+				else cv.wait_until(lock, timers.top().time);
+				continue;
+			}
+			std::deque<std::function<void()>> batch;
+			batch.swap(ready);
+			lock.unlock();
+			for (auto &task : batch) task();
+			lock.lock();
+		}
+	}
+
+	struct Timer {
+		std::chrono::steady_clock::time_point time;
+		uint64_t sequence; // keeps equal times in posting order
+		std::function<void()> task;
+		bool operator>(const Timer &other) const { return time != other.time ? time > other.time : sequence > other.sequence; }
+	};
+
+	/* Lets completions outlive the executor */
+	struct Anchor {
+		explicit Anchor(FujinonZoomLensSequenceExecutor *_executor) : executor(_executor) {};
+		std::mutex mtx;
+		FujinonZoomLensSequenceExecutor *executor;
+	};
+
+	FujinonZoomLensScheduler &scheduler;
+	const FujinonZoomLensMotionModel *motion; // nullptr: waitSettled polls from the start
+	FujinonZoomLensController controller;
+	std::array<int, 3> targets = { -1, -1, -1 }; // last position acknowledged per axis, from any client (executor thread only)
+	std::shared_ptr<Anchor> anchor;
+	CommandAwaiter *issuing = nullptr; // awaiter whose command is being encoded (executor thread only)
+	std::atomic<size_t> inFlight;
+	std::atomic<size_t> settleWaits;
+	std::atomic<size_t> settlePolls;
+
+	std::mutex mtx;
+	std::condition_variable cv;
+	std::deque<std::function<void()>> ready;
+	std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers;
+	uint64_t timerSequence = 0;
+	std::unordered_set<FujinonZoomLensSequence::promise_type *> live; // spawned and not finished
+	bool stopping;
+	std::thread worker;
+};
+
+inline FujinonZoomLensSequence::promise_type::~promise_type() {
+	if (executor) executor->sequenceFinished(this);
+}
+
+#endif //FUJINON_ZOOM_LENS_SEQUENCE_H
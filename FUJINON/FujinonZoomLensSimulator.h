@@ -0,0 +1,138 @@
+﻿//
+// Created by Masahiro Hirano <masahiro.dll@gmail.com>
+//
+
+#ifndef FUJINON_ZOOM_LENS_SIMULATOR_H
+#define FUJINON_ZOOM_LENS_SIMULATOR_H
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/array.hpp>
+
+#include "FujinonZoomLens.h"
+
+/*
+ * Software model of a lens speaking C10.
+ * Position controls take effect immediately; every frame is acknowledged like the real lens does.
+ */
+class FujinonZoomLensSimulator {
+public:
+	FujinonZoomLensSimulator(std::string _name = "SIMULATED LENS", std::string _serialNumber = "00000000")
+		: name(std::move(_name)), serialNumber(std::move(_serialNumber)) {};
+
+	/*
+	 * Consume bytes sent to the lens and append the replies to out.
+	 * Returns the number of complete frames handled.
+	 */
+	size_t handle(const uchar *bytes, size_t n, std::vector<uchar> &out) {
+		parser.push(bytes, n);
+		size_t handled = 0;
+		FujinonZoomLensControllerUtil::FujinonZoomLensResponse frame;
+		while (parser.next(frame)) {
+			reply(frame.code, frame.data, out);
+			handled++;
+		}
+		return handled;
+	}
+
+	uint iris = 0xFFFF;
+	uint zoom = 0x0000;
+	uint focus = 0x0000;
+	uchar filter = 0xE0;
+	uchar irisMode = 0xDC;
+
+private:
+	std::string name;
+	std::string serialNumber;
+	FujinonZoomLensControllerUtil::FujinonZoomLensFrameParser parser;
+
+	static void append(std::vector<uchar> &out, uchar code, const FujinonZoomLensPayload &data) {
+		FujinonZoomLensControllerUtil::appendCommand(out, code, data);
+	}
+
+	static FujinonZoomLensPayload position(uint v) { return { static_cast<uchar>(v / 256), static_cast<uchar>(v % 256) }; }
+
+	void reply(uchar code, const FujinonZoomLensPayload &data, std::vector<uchar> &out) {
+		auto text = [](const std::string &str) { return FujinonZoomLensPayload(str.begin(), str.end()); };
+		const size_t half = FujinonZoomLensControllerUtil::FujinonZoomLensFrameParser::MAX_DATA_LENGTH;
+		switch (code) {
+		case 0x11: append(out, code, text(name.substr(0, half))); break;
+		case 0x12: append(out, code, text(name.size() > half ? name.substr(half, half) : std::string())); break;
+		case 0x17: append(out, code, text(serialNumber.substr(0, half))); break;
+		case 0x30: append(out, code, position(iris)); break;
+		case 0x31: append(out, code, position(zoom)); break;
+		case 0x32: append(out, code, position(focus)); break;
+		case 0x20: if (data.size() == 2) iris = data[0] * 256 + data[1]; append(out, code, {}); break;
+		case 0x21: if (data.size() == 2) zoom = data[0] * 256 + data[1]; append(out, code, {}); break;
+		case 0x22: if (data.size() == 2) focus = data[0] * 256 + data[1]; append(out, code, {}); break;
+		case 0x40: if (data.size() == 1) filter = data[0]; append(out, code, {}); break;
+		case 0x42: if (data.size() == 1) irisMode = data[0]; append(out, code, {}); break;
+		default: append(out, code, {}); break;
+		}
+	}
+};
+
+/*
+ * Serves a FujinonZoomLensSimulator over TCP, the way a serial-to-Ethernet bridge exposes a lens.
+ * One client at a time; meant for tests and benchmarks on localhost.
+ */
+class FujinonZoomLensTcpBridgeSimulator {
+public:
+	explicit FujinonZoomLensTcpBridgeSimulator(std::shared_ptr<FujinonZoomLensSimulator> _lens, unsigned short port = 0)
+		: lens(std::move(_lens)),
+		acceptor(io, boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), port)) {
+		accept();
+		worker = std::thread([this] { io.run(); });
+	};
+
+	~FujinonZoomLensTcpBridgeSimulator() {
+		io.stop();
+		if (worker.joinable()) worker.join();
+	}
+
+	/* Port actually listened on (useful when constructed with port 0) */
+	unsigned short port() const { return acceptor.local_endpoint().port(); }
+
+private:
+	struct Session : public std::enable_shared_from_this<Session> {
+		Session(boost::asio::ip::tcp::socket _socket, std::shared_ptr<FujinonZoomLensSimulator> _lens)
+			: socket(std::move(_socket)), lens(std::move(_lens)) {};
+
+		void read() {
+			auto self = shared_from_this();
+			socket.async_read_some(boost::asio::buffer(rx), [self](const boost::system::error_code &error, size_t length) {
+				if (error) return;
+				self->tx.clear();
+				self->lens->handle(self->rx.data(), length, self->tx);
+				boost::system::error_code ignored;
+				boost::asio::write(self->socket, boost::asio::buffer(self->tx), ignored);
+				self->read();
+			});
+		}
+
+		boost::asio::ip::tcp::socket socket;
+		std::shared_ptr<FujinonZoomLensSimulator> lens;
+		boost::array<uchar, 256> rx;
+		std::vector<uchar> tx;
+	};
+
+	void accept() {
+		acceptor.async_accept([this](const boost::system::error_code &error, boost::asio::ip::tcp::socket socket) {
+			if (error) return;
+			socket.set_option(boost::asio::ip::tcp::no_delay(true));
+			std::make_shared<Session>(std::move(socket), lens)->read();
+			accept();
+		});
+	}
+
+	std::shared_ptr<FujinonZoomLensSimulator> lens;
+	boost::asio::io_service io;
+	boost::asio::ip::tcp::acceptor acceptor;
+	std::thread worker;
+};
+
+#endif //FUJINON_ZOOM_LENS_SIMULATOR_H
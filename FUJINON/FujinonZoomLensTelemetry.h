@@ -0,0 +1,434 @@
+﻿//
+// Created by Masahiro Hirano <masahiro.dll@gmail.com>
+//
+
+#ifndef FUJINON_ZOOM_LENS_TELEMETRY_H
+#define FUJINON_ZOOM_LENS_TELEMETRY_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include "FujinonZoomLens.h"
+
+/*
+ * One telemetry row: the last commanded and the last reported position of an axis (-1: unknown)
+ */
+struct FujinonZoomLensTelemetrySample {
+	int64_t timeNs = 0; // system_clock, so that files can be compared across runs
+	uint8_t axis = 0; // 0 iris, 1 zoom, 2 focus
+	int32_t commanded = -1;
+	int32_t actual = -1;
+};
+
+/*
+ * Append-only telemetry file, memory-mapped and stored column by column.
+ *
+ * Layout: a 64 KiB header, then blocks of BLOCK_SAMPLES rows. Each block holds its columns back
+ * to back (time, commanded, actual, axis), so a scan over one column stays within contiguous pages.
+ * The file grows by one block at a time; rows are only ever appended, with their times kept
+ * non-decreasing, so the time column is itself the index: a seek is a binary search over it.
+ *
+ * The row count in the header is published after the row is written, so a reader never sees a
+ * partial row. Appends run next to readers; only growing the file (every BLOCK_SAMPLES rows)
+ * excludes them while the file is remapped.
+ */
+class FujinonZoomLensTelemetryStore {
+public:
+	static constexpr size_t BLOCK_SAMPLES = 1 << 16;
+	static constexpr size_t BLOCK_BYTES = BLOCK_SAMPLES * (sizeof(int64_t) + 2 * sizeof(int32_t) + sizeof(uint8_t)); // multiple of 64 KiB
+	static constexpr size_t HEADER_BYTES = 1 << 16; // mapping granularity on Windows
+
+	FujinonZoomLensTelemetryStore() : base(nullptr), blocks(0), lastTimeNs(INT64_MIN) {
+		for (auto &axis : axisState) axis = { -1, -1 };
+	};
+
+	FujinonZoomLensTelemetryStore(const FujinonZoomLensTelemetryStore &) = delete;
+	FujinonZoomLensTelemetryStore &operator=(const FujinonZoomLensTelemetryStore &) = delete;
+
+	/*
+	 * Open fileName for appending, creating it if needed. Existing rows are kept.
+	 */
+	bool open(const std::string &fileName) {
+		std::unique_lock<std::shared_mutex> lock(mapMtx);
+		std::error_code error;
+		if (!std::filesystem::exists(fileName, error) || std::filesystem::file_size(fileName, error) < HEADER_BYTES) {
+			FILE *fp = fopen(fileName.c_str(), "wb");
+			if (fp == NULL) {
+				std::cerr << "Failed to create " << fileName << std::endl;
+				return false;
+			}
+			fclose(fp);
+			std::filesystem::resize_file(fileName, HEADER_BYTES + BLOCK_BYTES, error);
+			if (error) {
+				std::cerr << "Failed to allocate " << fileName << ": " << error.message() << std::endl;
+				return false;
+			}
+			if (!map(fileName)) return false;
+			Header *h = header();
+			std::memcpy(h->magic, MAGIC, sizeof(h->magic));
+			h->version = VERSION;
+			h->blockSamples = BLOCK_SAMPLES;
+			count().store(0, std::memory_order_release);
+		}
+		else {
+			if (!map(fileName)) return false;
+			const Header *h = header();
+			if (std::memcmp(h->magic, MAGIC, sizeof(h->magic)) != 0 || h->version != VERSION || h->blockSamples != BLOCK_SAMPLES) {
+				std::cerr << fileName << " is not a lens telemetry file" << std::endl;
+				unmap();
+				return false;
+			}
+			if (count().load(std::memory_order_acquire) > blocks * BLOCK_SAMPLES) {
+				std::cerr << fileName << " is truncated" << std::endl;
+				unmap();
+				return false;
+			}
+		}
+		path = fileName;
+		const size_t n = count().load(std::memory_order_acquire);
+		lastTimeNs = n > 0 ? timeAt(n - 1) : INT64_MIN;
+		return true;
+	}
+
+	bool isOpen() const {
+		std::shared_lock<std::shared_mutex> lock(mapMtx);
+		return base != nullptr;
+	}
+
+	const std::string &fileName() const { return path; }
+
+	/*
+	 * Record a command the lens acknowledged (0x20 - 0x22) or a position it reported (0x30 - 0x32)
+	 * as a row carrying both the commanded and the reported position of the axis. (Lens worker thread)
+	 */
+	void record(uchar code, const FujinonZoomLensPayload &data, std::chrono::steady_clock::time_point time) {
+		if (data.size() != 2) return;
+		const int32_t position = static_cast<int32_t>(data[0]) * 256 + data[1];
+		size_t axis;
+		if (code >= 0x20 && code <= 0x22) {
+			axis = code - 0x20;
+			axisState[axis].first = position;
+		}
+		else if (code >= 0x30 && code <= 0x32) {
+			axis = code - 0x30;
+			axisState[axis].second = position;
+		}
+		else return;
+
+		// steady_clock -> system_clock at the time of the call (transactions are recorded right after they complete)
+		const auto offset = std::chrono::system_clock::now().time_since_epoch() - std::chrono::steady_clock::now().time_since_epoch();
+		FujinonZoomLensTelemetrySample sample;
+		sample.timeNs = std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch() + offset).count();
+		sample.axis = static_cast<uint8_t>(axis);
+		sample.commanded = axisState[axis].first;
+		sample.actual = axisState[axis].second;
+		append(sample);
+	}
+
+	/*
+	 * Append a row. A time before the last row's (the system clock was set back) is clamped to it.
+	 */
+	bool append(FujinonZoomLensTelemetrySample sample) {
+		std::lock_guard<std::mutex> appendLock(appendMtx);
+		std::shared_lock<std::shared_mutex> lock(mapMtx);
+		if (base == nullptr) return false;
+		const size_t n = count().load(std::memory_order_relaxed);
+		if (n == blocks * BLOCK_SAMPLES) {
+			lock.unlock();
+			if (!grow()) return false;
+			lock.lock();
+		}
+		sample.timeNs = std::max(sample.timeNs, lastTimeNs);
+		lastTimeNs = sample.timeNs;
+
+		uchar *block = blockAt(n / BLOCK_SAMPLES);
+		const size_t i = n % BLOCK_SAMPLES;
+		reinterpret_cast<int64_t *>(block)[i] = sample.timeNs;
+		reinterpret_cast<int32_t *>(block + COMMANDED_OFFSET)[i] = sample.commanded;
+		reinterpret_cast<int32_t *>(block + ACTUAL_OFFSET)[i] = sample.actual;
+		(block + AXIS_OFFSET)[i] = sample.axis;
+		count().store(n + 1, std::memory_order_release); // publishes the row
+		return true;
+	}
+
+	/* Number of rows */
+	size_t size() const {
+		std::shared_lock<std::shared_mutex> lock(mapMtx);
+		return base != nullptr ? count().load(std::memory_order_acquire) : 0;
+	}
+
+	/*
+	 * Index of the first row at or after timeNs (size() if none)
+	 */
+	size_t lowerBound(int64_t timeNs) const {
+		std::shared_lock<std::shared_mutex> lock(mapMtx);
+		if (base == nullptr) return 0;
+		const size_t n = count().load(std::memory_order_acquire);
+		size_t lo = 0, hi = n;
+		while (lo < hi) {
+			const size_t mid = lo + (hi - lo) / 2;
+			if (timeAt(mid) < timeNs) lo = mid + 1;
+			else hi = mid;
+		}
+		return lo;
+	}
+
+	/*
+	 * Call f(const FujinonZoomLensTelemetrySample &) for rows [first, last). Only the pages of those rows are touched.
+	 */
+	template<class F> void visit(size_t first, size_t last, F &&f) const {
+		std::shared_lock<std::shared_mutex> lock(mapMtx);
+		if (base == nullptr) return;
+		last = std::min(last, static_cast<size_t>(count().load(std::memory_order_acquire)));
+		FujinonZoomLensTelemetrySample sample;
+		for (size_t r = first; r < last; r++) {
+			const uchar *block = blockAt(r / BLOCK_SAMPLES);
+			const size_t i = r % BLOCK_SAMPLES;
+			sample.timeNs = reinterpret_cast<const int64_t *>(block)[i];
+			sample.commanded = reinterpret_cast<const int32_t *>(block + COMMANDED_OFFSET)[i];
+			sample.actual = reinterpret_cast<const int32_t *>(block + ACTUAL_OFFSET)[i];
+			sample.axis = (block + AXIS_OFFSET)[i];
+			f(sample);
+		}
+	}
+
+	/* Time of the first and the last row, (0, 0) if empty */
+	std::pair<int64_t, int64_t> timeRange() const {
+		std::shared_lock<std::shared_mutex> lock(mapMtx);
+		if (base == nullptr) return { 0, 0 };
+		const size_t n = count().load(std::memory_order_acquire);
+		return n > 0 ? std::make_pair(timeAt(0), timeAt(n - 1)) : std::pair<int64_t, int64_t>(0, 0);
+	}
+
+private:
+	static constexpr char MAGIC[8] = { 'F', 'Z', 'L', 'T', 'E', 'L', 'E', 'M' };
+	static constexpr uint32_t VERSION = 1;
+	static constexpr size_t COMMANDED_OFFSET = BLOCK_SAMPLES * sizeof(int64_t);
+	static constexpr size_t ACTUAL_OFFSET = COMMANDED_OFFSET + BLOCK_SAMPLES * sizeof(int32_t);
+	static constexpr size_t AXIS_OFFSET = ACTUAL_OFFSET + BLOCK_SAMPLES * sizeof(int32_t);
+
+	struct Header {
+		char magic[8];
+		uint32_t version;
+		uint32_t blockSamples;
+		alignas(8) uint64_t count; // rows written
+	};
+
+	Header *header() const { return reinterpret_cast<Header *>(base); }
+	std::atomic_ref<uint64_t> count() const { return std::atomic_ref<uint64_t>(header()->count); }
+	uchar *blockAt(size_t b) const { return base + HEADER_BYTES + b * BLOCK_BYTES; }
+	int64_t timeAt(size_t r) const { return reinterpret_cast<const int64_t *>(blockAt(r / BLOCK_SAMPLES))[r % BLOCK_SAMPLES]; }
+
+	/* Map the whole file (mapMtx held exclusively) */
+	bool map(const std::string &fileName) {
+		try {
+			file = boost::interprocess::file_mapping(fileName.c_str(), boost::interprocess::read_write);
+			region = boost::interprocess::mapped_region(file, boost::interprocess::read_write);
+		} catch (const boost::interprocess::interprocess_exception &e) {
+			std::cerr << "Failed to map " << fileName << ": " << e.what() << std::endl;
+			unmap();
+			return false;
+		}
+		base = static_cast<uchar *>(region.get_address());
+		blocks = (region.get_size() - HEADER_BYTES) / BLOCK_BYTES;
+		return true;
+	}
+
+	void unmap() {
+		region = boost::interprocess::mapped_region();
+		file = boost::interprocess::file_mapping();
+		base = nullptr;
+		blocks = 0;
+	}
+
+	/*
+	 * Add a block. The file is unmapped while it is extended, since Windows does not allow
+	 * resizing a file with views open. (appendMtx held)
+	 */
+	bool grow() {
+		std::unique_lock<std::shared_mutex> lock(mapMtx);
+		const size_t size = HEADER_BYTES + (blocks + 1) * BLOCK_BYTES;
+		unmap();
+		std::error_code error;
+		std::filesystem::resize_file(path, size, error);
+		if (error) std::cerr << "Failed to extend " << path << ": " << error.message() << std::endl;
+		return map(path) && !error;
+	}
+
+	uchar *base;
+	size_t blocks;
+	std::string path;
+	boost::interprocess::file_mapping file;
+	boost::interprocess::mapped_region region;
+	int64_t lastTimeNs; // appendMtx
+	std::array<std::pair<int32_t, int32_t>, 3> axisState; // commanded, reported per axis (lens worker thread)
+	std::mutex appendMtx;
+	mutable std::shared_mutex mapMtx;
+};
+
+/*
+ * Min/max decimation pyramid over a telemetry store, for plotting any time span with a bounded number of points.
+ *
+ * Level 0 summarizes LEAF_SAMPLES rows of an axis per bucket and each level above FANOUT buckets of
+ * the one below, so a span is drawn from the finest level that fits the point budget. Spans that
+ * fit at full resolution are read from the store directly. update() indexes new rows incrementally,
+ * a bounded number per call, so a large file is indexed over a few GUI frames.
+ */
+class FujinonZoomLensTelemetryPyramid {
+public:
+	static constexpr size_t LEAF_SAMPLES = 16;
+	static constexpr size_t FANOUT = 4;
+
+	/* Points of one axis, in seconds relative to origin; min == max for rows read at full resolution */
+	struct Series {
+		std::vector<double> time;
+		std::vector<double> commandedMin, commandedMax;
+		std::vector<double> actualMin, actualMax;
+		size_t level = 0; // 0: full resolution, n: pyramid level n - 1
+
+		void clear() {
+			time.clear();
+			commandedMin.clear(); commandedMax.clear();
+			actualMin.clear(); actualMax.clear();
+		}
+	};
+
+	FujinonZoomLensTelemetryPyramid() : indexed(0) {};
+
+	/*
+	 * Index up to budget new rows of store. Returns the number of rows left to index.
+	 */
+	size_t update(const FujinonZoomLensTelemetryStore &store, size_t budget = 1 << 20) {
+		const size_t n = store.size();
+		if (n < indexed) { // another file
+			indexed = 0;
+			for (auto &axis : axes) axis.clear();
+		}
+		const size_t last = std::min(n, indexed + budget);
+		store.visit(indexed, last, [this](const FujinonZoomLensTelemetrySample &s) {
+			if (s.axis < axes.size()) add(axes[s.axis], s);
+		});
+		indexed = last;
+		return n - last;
+	}
+
+	size_t indexedRows() const { return indexed; }
+
+	/*
+	 * Points of an axis within [fromNs, toNs], at most about maxPoints
+	 */
+	void query(const FujinonZoomLensTelemetryStore &store, size_t axis, int64_t fromNs, int64_t toNs, int64_t originNs,
+		size_t maxPoints, Series &out) const {
+		out.clear();
+		if (axis >= axes.size()) return;
+		const auto &levels = axes[axis];
+		auto seconds = [originNs](int64_t t) { return (t - originNs) * 1e-9; };
+		auto value = [](int32_t v) { return v >= 0 ? static_cast<double>(v) : std::numeric_limits<double>::quiet_NaN(); };
+
+		// full resolution if few enough rows of the axis are in range
+		if (levels.empty() || count(levels[0], fromNs, toNs) * LEAF_SAMPLES <= maxPoints) {
+			out.level = 0;
+			const size_t first = store.lowerBound(fromNs), last = store.lowerBound(toNs + 1);
+			store.visit(first > 0 ? first - 1 : first, std::min(last + 1, store.size()), [&](const FujinonZoomLensTelemetrySample &s) {
+				if (s.axis != axis) return;
+				out.time.push_back(seconds(s.timeNs));
+				out.commandedMin.push_back(value(s.commanded));
+				out.commandedMax.push_back(value(s.commanded));
+				out.actualMin.push_back(value(s.actual));
+				out.actualMax.push_back(value(s.actual));
+			});
+			return;
+		}
+
+		size_t level = 0;
+		while (level + 1 < levels.size() && count(levels[level], fromNs, toNs) > maxPoints) level++;
+		out.level = level + 1;
+		const auto &buckets = levels[level];
+		auto first = std::lower_bound(buckets.begin(), buckets.end(), fromNs, [](const Bucket &b, int64_t t) { return b.lastNs < t; });
+		for (auto b = first; b != buckets.end() && b->firstNs <= toNs; ++b) {
+			out.time.push_back(seconds(b->firstNs / 2 + b->lastNs / 2));
+			out.commandedMin.push_back(b->commandedMax >= 0 ? b->commandedMin : std::numeric_limits<double>::quiet_NaN());
+			out.commandedMax.push_back(b->commandedMax >= 0 ? b->commandedMax : std::numeric_limits<double>::quiet_NaN());
+			out.actualMin.push_back(b->actualMax >= 0 ? b->actualMin : std::numeric_limits<double>::quiet_NaN());
+			out.actualMax.push_back(b->actualMax >= 0 ? b->actualMax : std::numeric_limits<double>::quiet_NaN());
+		}
+	}
+
+private:
+	struct Bucket {
+		int64_t firstNs, lastNs;
+		int32_t commandedMin = INT32_MAX, commandedMax = -1; // max -1: unknown throughout
+		int32_t actualMin = INT32_MAX, actualMax = -1;
+		size_t rows = 0;
+
+		void merge(const FujinonZoomLensTelemetrySample &s) {
+			if (rows == 0) firstNs = s.timeNs;
+			lastNs = s.timeNs;
+			if (s.commanded >= 0) { commandedMin = std::min(commandedMin, s.commanded); commandedMax = std::max(commandedMax, s.commanded); }
+			if (s.actual >= 0) { actualMin = std::min(actualMin, s.actual); actualMax = std::max(actualMax, s.actual); }
+			rows++;
+		}
+	};
+	using Levels = std::vector<std::vector<Bucket>>;
+
+	/* A row goes into the open (last) bucket of every level; a full bucket is closed by starting a new one */
+	static void add(Levels &levels, const FujinonZoomLensTelemetrySample &s) {
+		size_t capacity = LEAF_SAMPLES;
+		for (size_t level = 0; ; level++, capacity *= FANOUT) {
+			if (level == levels.size()) {
+				// a new level once the one below needs more than FANOUT buckets
+				if (level > 0 && levels[level - 1].size() <= FANOUT) break;
+				if (level == 0) { levels.emplace_back(); }
+				else {
+					std::vector<Bucket> above;
+					for (const Bucket &b : levels[level - 1]) {
+						if (above.empty() || above.back().rows + b.rows > capacity) above.push_back(Bucket());
+						merge(above.back(), b);
+					}
+					levels.push_back(std::move(above));
+					continue; // the row is in the buckets just merged
+				}
+			}
+			auto &buckets = levels[level];
+			if (buckets.empty() || buckets.back().rows == capacity) buckets.push_back(Bucket());
+			buckets.back().merge(s);
+		}
+	}
+
+	static void merge(Bucket &a, const Bucket &b) {
+		if (a.rows == 0) a.firstNs = b.firstNs;
+		a.lastNs = b.lastNs;
+		a.commandedMin = std::min(a.commandedMin, b.commandedMin);
+		a.commandedMax = std::max(a.commandedMax, b.commandedMax);
+		a.actualMin = std::min(a.actualMin, b.actualMin);
+		a.actualMax = std::max(a.actualMax, b.actualMax);
+		a.rows += b.rows;
+	}
+
+	/* Buckets overlapping [fromNs, toNs] */
+	static size_t count(const std::vector<Bucket> &buckets, int64_t fromNs, int64_t toNs) {
+		auto first = std::lower_bound(buckets.begin(), buckets.end(), fromNs, [](const Bucket &b, int64_t t) { return b.lastNs < t; });
+		auto last = std::upper_bound(first, buckets.end(), toNs, [](int64_t t, const Bucket &b) { return t < b.firstNs; });
+		return static_cast<size_t>(last - first);
+	}
+
+	std::array<Levels, 3> axes;
+	size_t indexed;
+};
+
+#endif //FUJINON_ZOOM_LENS_TELEMETRY_H
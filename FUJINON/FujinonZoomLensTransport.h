@@ -0,0 +1,217 @@
+﻿//
+// Created by Masahiro Hirano <masahiro.dll@gmail.com>
+//
+
+#ifndef FUJINON_ZOOM_LENS_TRANSPORT_H
+#define FUJINON_ZOOM_LENS_TRANSPORT_H
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/array.hpp>
+
+#include "FujinonZoomLens.h"
+#include "FujinonZoomLensSimulator.h"
+
+namespace FujinonZoomLensTransportUtil {
+	/*
+	 * read_some with a deadline: returns 0 if nothing arrived within timeout, throws on a stream error.
+	 * The read is cancelled on timeout, so a lens that stops answering cannot block the caller.
+	 */
+	template<class Stream, class Buffer>
+	size_t readSome(boost::asio::io_service &io, Stream &stream, Buffer &buffer, std::chrono::milliseconds timeout) {
+		size_t received = 0;
+		boost::system::error_code readError;
+		bool timedOut = false;
+		boost::asio::steady_timer timer(io, timeout);
+		stream.async_read_some(boost::asio::buffer(buffer), [&](const boost::system::error_code &error, size_t length) {
+			readError = error;
+			received = length;
+			timer.cancel();
+		});
+		timer.async_wait([&](const boost::system::error_code &error) {
+			if (error) return; // the read completed first
+			timedOut = true;
+			boost::system::error_code ignored;
+			stream.cancel(ignored);
+		});
+		io.restart();
+		io.run();
+		if (timedOut && readError == boost::asio::error::operation_aborted) return 0;
+		if (readError) throw boost::system::system_error(readError);
+		return received;
+	}
+}
+
+/*
+ * RS-232C (38400 bps, 8N1) through boost::asio::serial_port
+ */
+class FujinonZoomLensSerialTransport : public FujinonZoomLensTransport {
+public:
+	explicit FujinonZoomLensSerialTransport(const std::string &_name) : name(_name), port(io, _name) {
+		port.set_option(boost::asio::serial_port_base::baud_rate(38400));
+		port.set_option(boost::asio::serial_port_base::character_size(8));
+		port.set_option(boost::asio::serial_port_base::flow_control(boost::asio::serial_port_base::flow_control::none));
+		port.set_option(boost::asio::serial_port_base::parity(boost::asio::serial_port_base::parity::none));
+		port.set_option(boost::asio::serial_port_base::stop_bits(boost::asio::serial_port_base::stop_bits::one));
+	};
+
+	std::string description() const override { return "serial " + name; }
+
+protected:
+	void doSend(const uchar *bytes, size_t n) override { boost::asio::write(port, boost::asio::buffer(bytes, n)); }
+	size_t doReceive(const uchar *&data) override {
+		size_t n = FujinonZoomLensTransportUtil::readSome(io, port, receive_api_frame, replyTimeout);
+		data = receive_api_frame.data();
+		return n;
+	}
+
+private:
+	std::string name;
+	boost::asio::io_service io;
+	boost::asio::serial_port port;
+	boost::array<uchar, 32> receive_api_frame;
+};
+
+/*
+ * Raw TCP to a serial-to-Ethernet bridge
+ */
+class FujinonZoomLensTcpTransport : public FujinonZoomLensTransport {
+public:
+	FujinonZoomLensTcpTransport(const std::string &_host, const std::string &_port) : host(_host), portName(_port), socket(io) {
+		boost::asio::ip::tcp::resolver resolver(io);
+		boost::asio::connect(socket, resolver.resolve(host, portName));
+		socket.set_option(boost::asio::ip::tcp::no_delay(true));
+	};
+
+	std::string description() const override { return "tcp " + host + ":" + portName; }
+
+protected:
+	void doSend(const uchar *bytes, size_t n) override { boost::asio::write(socket, boost::asio::buffer(bytes, n)); }
+	size_t doReceive(const uchar *&data) override {
+		size_t n = FujinonZoomLensTransportUtil::readSome(io, socket, receive_api_frame, replyTimeout);
+		data = receive_api_frame.data();
+		return n;
+	}
+
+private:
+	std::string host;
+	std::string portName;
+	boost::asio::io_service io;
+	boost::asio::ip::tcp::socket socket;
+	boost::array<uchar, 256> receive_api_frame;
+};
+
+/*
+ * In-process lens: frames are handed to a FujinonZoomLensSimulator without copying,
+ * and replies are read straight out of the simulator's output buffer.
+ */
+class FujinonZoomLensLoopbackTransport : public FujinonZoomLensTransport {
+public:
+	explicit FujinonZoomLensLoopbackTransport(std::shared_ptr<FujinonZoomLensSimulator> _lens = std::make_shared<FujinonZoomLensSimulator>())
+		: lens(std::move(_lens)) {};
+
+	std::string description() const override { return "loopback"; }
+
+	FujinonZoomLensSimulator &simulator() { return *lens; }
+
+protected:
+	void doSend(const uchar *bytes, size_t n) override { lens->handle(bytes, n, pending); }
+	size_t doReceive(const uchar *&data) override {
+		delivered.swap(pending); // the previous delivery is no longer referenced by the caller
+		pending.clear();
+		data = delivered.data();
+		return delivered.size();
+	}
+
+private:
+	std::shared_ptr<FujinonZoomLensSimulator> lens;
+	std::vector<uchar> pending;
+	std::vector<uchar> delivered;
+};
+
+/*
+ * Open a transport from a port specification:
+ *   "loopback"            in-process simulated lens
+ *   "tcp://host:port"     serial-to-Ethernet bridge
+ *   anything else         serial port name (e.g. "/dev/ttyUSB0", "COM1")
+ */
+inline std::unique_ptr<FujinonZoomLensTransport> openFujinonZoomLensTransport(const std::string &spec) {
+	const std::string tcp = "tcp://";
+	if (spec == "loopback") {
+		return std::make_unique<FujinonZoomLensLoopbackTransport>();
+	}
+	if (spec.compare(0, tcp.size(), tcp) == 0) {
+		std::string address = spec.substr(tcp.size());
+		size_t colon = address.rfind(':');
+		return std::make_unique<FujinonZoomLensTcpTransport>(address.substr(0, colon), colon == std::string::npos ? "4001" : address.substr(colon + 1));
+	}
+	return std::make_unique<FujinonZoomLensSerialTransport>(spec);
+}
+
+/*
+ * Benchmark run identically against every transport
+ */
+namespace FujinonZoomLensTransportBench {
+	struct Result {
+		std::string transport;
+		size_t iterations = 0;
+		double meanRoundTripUs = 0.0; // one query, wait for its reply
+		double maxRoundTripUs = 0.0;
+		double pipelinedFramesPerSec = 0.0; // batches of commands written at once
+		double bytesPerSec = 0.0;
+	};
+
+	/* Read until count frames have been parsed; false if the transport ran dry */
+	inline bool receiveFrames(FujinonZoomLensTransport &transport, FujinonZoomLensControllerUtil::FujinonZoomLensFrameParser &parser, size_t count) {
+		FujinonZoomLensControllerUtil::FujinonZoomLensResponse response;
+		while (count > 0) {
+			if (parser.next(response)) { count--; continue; }
+			const uchar *data;
+			size_t n = transport.receive(data);
+			if (n == 0) return false;
+			parser.push(data, n);
+		}
+		return true;
+	}
+
+	inline Result run(FujinonZoomLensTransport &transport, size_t iterations = 1000, size_t batch = 8) {
+		Result result;
+		result.transport = transport.description();
+		result.iterations = iterations;
+		transport.resetStats();
+		FujinonZoomLensControllerUtil::FujinonZoomLensFrameParser parser;
+
+		// round trip latency
+		const auto query = FujinonZoomLensControllerUtil::encodeCommand(0x31, {});
+		for (size_t i = 0; i < iterations; i++) {
+			const auto begin = std::chrono::steady_clock::now();
+			transport.send(query.data(), query.size());
+			if (!receiveFrames(transport, parser, 1)) return result;
+			transport.recordRoundTrip(std::chrono::steady_clock::now() - begin);
+		}
+		result.meanRoundTripUs = transport.stats().meanRoundTripUs();
+		result.maxRoundTripUs = transport.stats().maxRoundTripUs;
+
+		// pipelined throughput
+		std::vector<uchar> frames;
+		for (size_t i = 0; i < batch; i++) {
+			auto frame = FujinonZoomLensControllerUtil::encodeCommand(0x21, { static_cast<uchar>(i), 0x00 });
+			frames.insert(frames.end(), frame.begin(), frame.end());
+		}
+		const auto begin = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < iterations; i++) {
+			transport.send(frames.data(), frames.size());
+			if (!receiveFrames(transport, parser, batch)) return result;
+		}
+		double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+		result.pipelinedFramesPerSec = elapsed > 0.0 ? iterations * batch / elapsed : 0.0;
+		result.bytesPerSec = transport.stats().throughput();
+		return result;
+	}
+}
+
+#endif //FUJINON_ZOOM_LENS_TRANSPORT_H
@@ -0,0 +1,139 @@
+//
+// Created by Masahiro Hirano <masahiro.dll@gmail.com>
+//
+// Compares InterThreadMessenger (triple buffer, one atomic word) with the previous mutex-based version.
+// One sender and one receiver thread pass DispMsg with a frame in its pool, as EngineVideo does.
+// Usage: fujinon-messenger-bench [seconds per run]
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "AppMsg.h"
+
+/*
+ * The mutex-based messenger InterThreadMessenger replaced, kept as the baseline.
+ * (seqno is tracked next to the buffers since MsgData::seqno is private to InterThreadMessenger.)
+ */
+template<class CustomMsgData>
+class LockedMessenger {
+public:
+    LockedMessenger() : msg_sender(new CustomMsgData()), msg_buffer(new CustomMsgData()), msg_receiver(new CustomMsgData()),
+                        seq_sender(0), seq_buffer(0), seq_receiver(0), master_seqno(0) {}
+    ~LockedMessenger() {
+        delete msg_sender;
+        delete msg_buffer;
+        delete msg_receiver;
+    }
+
+    CustomMsgData *prepareMsg() const { return msg_sender; }
+
+    void send() {
+        master_seqno++;
+        std::lock_guard<std::mutex> lock(mtx);
+        seq_sender = master_seqno;
+        std::swap(msg_sender, msg_buffer);
+        std::swap(seq_sender, seq_buffer);
+    }
+
+    bool isUpdated() { return seq_buffer > seq_receiver; } // unsynchronized read, as in the original
+
+    CustomMsgData *receive() {
+        if (!isUpdated()) return nullptr;
+        std::lock_guard<std::mutex> lock(mtx);
+        std::swap(msg_buffer, msg_receiver);
+        std::swap(seq_buffer, seq_receiver);
+        return msg_receiver;
+    }
+
+private:
+    CustomMsgData *msg_sender, *msg_buffer, *msg_receiver;
+    unsigned int seq_sender, seq_buffer, seq_receiver;
+    unsigned int master_seqno;
+    std::mutex mtx;
+};
+
+struct Result {
+    double sentPerSec = 0.0;
+    double receivedPerSec = 0.0;
+    double meanLatencyUs = 0.0;
+    double p99LatencyUs = 0.0;
+    double maxLatencyUs = 0.0;
+};
+
+static long long nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/*
+ * sendPeriodUs 0: the sender sends back to back (contention on every exchange);
+ * otherwise one message per period, which measures the handoff alone.
+ */
+template<class Messenger>
+static Result run(double seconds, int sendPeriodUs) {
+    Messenger messenger;
+    cv::Mat frame(512, 512, CV_8UC3, cv::Scalar(0, 0, 0));
+    std::atomic<bool> done(false);
+    size_t sent = 0, received = 0;
+    std::vector<long long> latencies;
+    latencies.reserve(1 << 22);
+
+    std::thread receiver([&] {
+        while (!done.load(std::memory_order_relaxed)) {
+            DispMsg *md = messenger.receive();
+            if (md == nullptr) continue;
+            const long long t = nowNs();
+            received++;
+            if (latencies.size() < latencies.capacity()) latencies.push_back(t - md->frameIndex);
+        }
+    });
+
+    const long long end = nowNs() + static_cast<long long>(seconds * 1e9);
+    long long next = nowNs();
+    while (nowNs() < end) {
+        if (sendPeriodUs > 0) {
+            while (nowNs() < next) {}
+            next += sendPeriodUs * 1000LL;
+        }
+        DispMsg *md = messenger.prepareMsg();
+        md->pool["video"] = frame;
+        md->frameIndex = nowNs(); // send time
+        messenger.send();
+        sent++;
+    }
+    done.store(true);
+    receiver.join();
+
+    Result r;
+    r.sentPerSec = sent / seconds;
+    r.receivedPerSec = received / seconds;
+    if (!latencies.empty()) {
+        std::sort(latencies.begin(), latencies.end());
+        double sum = 0.0;
+        for (long long l : latencies) sum += l;
+        r.meanLatencyUs = sum / latencies.size() / 1e3;
+        r.p99LatencyUs = latencies[latencies.size() * 99 / 100] / 1e3;
+        r.maxLatencyUs = latencies.back() / 1e3;
+    }
+    return r;
+}
+
+static void print(const char *name, const char *mode, const Result &r) {
+    printf("%-12s %-10s %14.0f %14.0f %12.2f %12.2f %12.1f\n", name, mode, r.sentPerSec, r.receivedPerSec,
+           r.meanLatencyUs, r.p99LatencyUs, r.maxLatencyUs);
+}
+
+int main(int argc, char **argv) {
+    double seconds = argc > 1 ? std::atof(argv[1]) : 2.0;
+
+    printf("%-12s %-10s %14s %14s %12s %12s %12s\n", "messenger", "sender", "sent/s", "received/s", "mean [us]", "p99 [us]", "max [us]");
+    print("mutex", "saturated", run<LockedMessenger<DispMsg>>(seconds, 0));
+    print("triple", "saturated", run<InterThreadMessenger<DispMsg>>(seconds, 0));
+    print("mutex", "1 kHz", run<LockedMessenger<DispMsg>>(seconds, 1000));
+    print("triple", "1 kHz", run<InterThreadMessenger<DispMsg>>(seconds, 1000));
+    return 0;
+}
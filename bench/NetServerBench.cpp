@@ -0,0 +1,128 @@
+//
+// Created by Masahiro Hirano <masahiro.dll@gmail.com>
+//
+// Measures the lens control server with a simulated lens behind it: request latency per client and throughput,
+// with clients sharing the lens evenly, then with one client flooding it next to interactive ones.
+// Usage: fujinon-netserver-bench [clients] [requests per client]
+//
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+#include "FujinonZoomLensNetServer.h"
+#include "FujinonZoomLensSimulator.h"
+
+using Clock = std::chrono::steady_clock;
+
+struct ClientResult {
+    size_t requests = 0;
+    size_t errors = 0;
+    double totalUs = 0.0;
+    double maxUs = 0.0;
+    double seconds = 0.0;
+};
+
+/* Serves requests through the simulator until stopped, as the engine's lens worker does */
+static void serve(FujinonZoomLensNetServer &server, std::atomic<bool> &running) {
+    FujinonZoomLensSimulator lens;
+    FujinonZoomLensControllerUtil::FujinonZoomLensFrameParser parser;
+    std::vector<uchar> replies;
+    FujinonZoomLensNetRequest request;
+    while (running) {
+        if (!server.next(0, request)) {
+            std::this_thread::yield();
+            continue;
+        }
+        const std::vector<uchar> frame = FujinonZoomLensControllerUtil::encodeCommand(request.cmd.code, request.cmd.data);
+        replies.clear();
+        lens.handle(frame.data(), frame.size(), replies);
+        parser.push(replies.data(), replies.size());
+        FujinonZoomLensControllerUtil::FujinonZoomLensResponse response;
+        const bool ok = parser.next(response) && response.code == request.cmd.code;
+        server.complete(request, ok, response);
+    }
+}
+
+/* Queries the zoom position as many times as requests, keeping up to window queries outstanding */
+static ClientResult run(const std::string &path, size_t requests, size_t window) {
+    using namespace FujinonZoomLensNetProtocol;
+    boost::asio::io_service io;
+    boost::asio::local::stream_protocol::socket socket(io);
+    socket.connect(boost::asio::local::stream_protocol::endpoint(path));
+    std::vector<Clock::time_point> sent(65536);
+    std::array<uchar, HEADER_SIZE> header;
+    std::vector<uchar> data;
+    ClientResult r;
+    size_t next = 0;
+    const auto begin = Clock::now();
+    while (r.requests + r.errors < requests) {
+        for (; next < requests && next - r.requests - r.errors < window; next++) {
+            const uint16_t id = static_cast<uint16_t>(next);
+            const std::vector<uchar> message = encode(static_cast<uchar>(TYPE::COMMAND), id, 0, 0x31, {});
+            sent[id] = Clock::now();
+            boost::asio::write(socket, boost::asio::buffer(message));
+        }
+        boost::asio::read(socket, boost::asio::buffer(header));
+        data.resize(header[6]);
+        boost::asio::read(socket, boost::asio::buffer(data));
+        const double us = std::chrono::duration<double, std::micro>(Clock::now() - sent[header[2] << 8 | header[3]]).count();
+        if (header[1] != static_cast<uchar>(STATUS::OK)) { r.errors++; continue; }
+        r.requests++;
+        r.totalUs += us;
+        r.maxUs = std::max(r.maxUs, us);
+    }
+    r.seconds = std::chrono::duration<double>(Clock::now() - begin).count();
+    return r;
+}
+
+/* Runs the clients at once, given their window, and prints one row per client */
+static void scenario(const char *name, const std::string &path, size_t requests, const std::vector<size_t> &windows) {
+    std::vector<ClientResult> results(windows.size());
+    std::vector<std::thread> clients;
+    const auto begin = Clock::now();
+    for (size_t c = 0; c < windows.size(); c++) {
+        clients.emplace_back([&, c] { results[c] = run(path, requests, windows[c]); });
+    }
+    for (auto &t : clients) t.join();
+    const double seconds = std::chrono::duration<double>(Clock::now() - begin).count();
+
+    size_t total = 0;
+    for (size_t c = 0; c < results.size(); c++) {
+        const ClientResult &r = results[c];
+        total += r.requests;
+        printf("%-12s %6zu %6zu %8zu %6zu %12.1f %12.1f %12.0f\n", name, c, windows[c], r.requests, r.errors,
+               r.requests > 0 ? r.totalUs / r.requests : 0.0, r.maxUs, r.seconds > 0.0 ? r.requests / r.seconds : 0.0);
+    }
+    printf("%-12s %6s %6s %8zu %6s %12s %12s %12.0f\n", name, "all", "", total, "", "", "", seconds > 0.0 ? total / seconds : 0.0);
+}
+
+int main(int argc, char **argv) {
+    const size_t clients = argc > 1 ? std::max<size_t>(std::strtoul(argv[1], nullptr, 10), 2) : 4;
+    const size_t requests = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 20000;
+
+    FujinonZoomLensNetServer::Options options;
+    options.tcpPort = 0;
+    options.unixSocketPath = (std::filesystem::temp_directory_path() / "fujinon-netserver-bench.sock").string();
+    options.rateLimit = 1e9; // measure the server, not the token bucket
+    options.burst = 1e9;
+    FujinonZoomLensNetServer server(options);
+    std::atomic<bool> running{ true };
+    std::thread lens([&] { serve(server, running); });
+
+    printf("%-12s %6s %6s %8s %6s %12s %12s %12s\n", "scenario", "client", "window", "requests", "errors", "mean [us]", "max [us]", "req/s");
+    scenario("even", options.unixSocketPath, requests, std::vector<size_t>(clients, 8));
+    std::vector<size_t> windows(clients, 1); // interactive clients, one request at a time
+    windows[0] = options.maxPending; // next to one that keeps its queue full
+    scenario("flood", options.unixSocketPath, requests, windows);
+
+    running = false;
+    lens.join();
+    return 0;
+}
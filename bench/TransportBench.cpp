@@ -0,0 +1,40 @@
+//
+// Created by Masahiro Hirano <masahiro.dll@gmail.com>
+//
+// Runs the same benchmark against every lens transport.
+// Usage: fujinon-transport-bench [iterations] [port ...]
+//   port: serial port name or tcp://host:port of a real lens (loopback and a local TCP bridge are always measured)
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include "FujinonZoomLensSimulator.h"
+#include "FujinonZoomLensTransport.h"
+
+static void print(const FujinonZoomLensTransportBench::Result &r) {
+    printf("%-24s %8zu %12.1f %12.1f %16.0f %14.0f\n", r.transport.c_str(), r.iterations,
+           r.meanRoundTripUs, r.maxRoundTripUs, r.pipelinedFramesPerSec, r.bytesPerSec);
+}
+
+int main(int argc, char **argv) {
+    size_t iterations = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 10000;
+
+    printf("%-24s %8s %12s %12s %16s %14s\n", "transport", "iter", "mean [us]", "max [us]", "pipelined [f/s]", "bytes/s");
+
+    FujinonZoomLensLoopbackTransport loopback;
+    print(FujinonZoomLensTransportBench::run(loopback, iterations));
+
+    FujinonZoomLensTcpBridgeSimulator bridge(std::make_shared<FujinonZoomLensSimulator>());
+    FujinonZoomLensTcpTransport tcp("127.0.0.1", std::to_string(bridge.port()));
+    print(FujinonZoomLensTransportBench::run(tcp, iterations));
+
+    for (int i = 2; i < argc; i++) {
+        try {
+            auto transport = openFujinonZoomLensTransport(argv[i]);
+            print(FujinonZoomLensTransportBench::run(*transport, iterations));
+        } catch (const std::exception &e) {
+            printf("%-24s failed: %s\n", argv[i], e.what());
+        }
+    }
+    return 0;
+}
@@ -6,35 +6,64 @@
 #define ISLAY_APPMSG_H
 
 #include <opencv2/opencv.hpp>
+#include <atomic>
 #include <map>
 #include <memory>
 #include "InterThreadMessenger.hpp"
+#include "ThreadSafeQueue.h"
+#include "FujinonZoomLensScheduler.h"
+#include "FujinonZoomLensHistory.h"
+#include "FujinonZoomLensMotion.h"
+#include "FujinonZoomLensTelemetry.h"
+#include "FujinonZoomLensPreset.h"
 
 struct DispMsg : public MsgData {
     std::map<std::string, cv::Mat> pool;
+    long frameIndex = -1; // frame number in the source, -1 if not a video frame
+    double timestampMs = 0.0; // position of the frame in the source
+    FujinonZoomLensFrameTag lens; // lens state when the frame was shown
 };
 
-// Zoom lens controller message
-struct ZLCMsg : public MsgData {
-	uchar code;
-	std::vector<uchar> data;
+// Zoom lens controller message: a transaction the lens confirmed, or notice that the lens was reopened
+struct ZLCMsg {
+	uchar code = 0;
+	FujinonZoomLensPayload data; // inline, so sending a message never allocates
+	bool reconnected = false; // the lens state may have changed meanwhile: forget what was confirmed
 };
 
 class AppMsg{
 public:
     AppMsg():
 			displayMessenger(new InterThreadMessenger<DispMsg>),
-			zlcRequestMessenger(new InterThreadMessenger<ZLCMsg>),
-			zlcResponseMessenger(new InterThreadMessenger<ZLCMsg>){};
+			zlcScheduler(new FujinonZoomLensScheduler),
+			zlcHistory(new FujinonZoomLensHistory),
+			zlcMotion(new FujinonZoomLensMotionModel),
+			zlcTelemetry(new FujinonZoomLensTelemetryStore),
+			zlcPresets(new FujinonZoomLensPresetStore),
+			zlcResponses(new ThreadSafeQueue<ZLCMsg>(ZLC_RESPONSE_CAPACITY)){};
+
+	static constexpr size_t ZLC_RESPONSE_CAPACITY = 1024; // far more than the lens confirms in one GUI frame
 
 	InterThreadMessenger<DispMsg>* displayMessenger;
-	InterThreadMessenger<ZLCMsg>* zlcRequestMessenger;
-	InterThreadMessenger<ZLCMsg>* zlcResponseMessenger;
+	FujinonZoomLensScheduler* zlcScheduler; // lens commands, in priority order
+	FujinonZoomLensHistory* zlcHistory; // timestamped lens positions
+	FujinonZoomLensMotionModel* zlcMotion; // motor model fitted from the same transactions as zlcHistory
+	FujinonZoomLensTelemetryStore* zlcTelemetry; // persisted lens positions (not recorded until opened)
+	FujinonZoomLensPresetStore* zlcPresets; // named framings recalled through zlcScheduler
+	// Every confirmation, in order, for the GUI's shadow state (a latest-wins messenger would lose some).
+	// If the GUI falls so far behind that the queue fills up, zlcResponsesLost tells it to forget what was confirmed.
+	ThreadSafeQueue<ZLCMsg>* zlcResponses;
+	std::atomic<bool> zlcResponsesLost{ false };
+
+	/* Lens worker: queue a message for the GUI without ever blocking */
+	void confirmToGui(ZLCMsg msg) {
+		if (!zlcResponses->tryPush(std::move(msg))) zlcResponsesLost.store(true);
+	}
 
     void close(){
         displayMessenger->close();
-		zlcRequestMessenger->close();
-		zlcResponseMessenger->close();
+		zlcScheduler->close();
+		zlcResponses->close();
     };
 };
 
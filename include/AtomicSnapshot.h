@@ -0,0 +1,96 @@
+//
+// Created by Hirano Masahiro <masahiro.dll@gmail.com>
+//
+
+#ifndef ISLAY_ATOMICSNAPSHOT_H
+#define ISLAY_ATOMICSNAPSHOT_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+/**
+ * Publishes immutable snapshots of T to readers that never wait.
+ *
+ * Readers call load() and share ownership of the latest snapshot: it stays valid for as long as they
+ * hold it, and is released when the last holder lets go, so memory does not grow with each publish.
+ * A load is a fixed sequence of atomic operations (no lock, no retry loop), so it completes in bounded
+ * steps whatever the writers do. std::atomic<std::shared_ptr> is not used because libstdc++ implements it
+ * with a spin lock.
+ *
+ * The current snapshot hangs off a node reached through a raw atomic pointer. A reader announces itself on
+ * one of two counters (chosen by the parity of the epoch), copies the shared pointer out of the node and
+ * leaves. A writer swaps in a new node, then flips the epoch twice, each time waiting for the readers
+ * still counted on the parity it left, before it frees the old node: any reader that could have reached
+ * it has copied it by then (a two-phase grace period, as in userspace RCU).
+ * Writers serialize on a mutex and wait only for readers already inside load().
+ * This is meant for rarely changing data (configuration, lens profiles), not for streams.
+ */
+template<class T>
+class AtomicSnapshot {
+public:
+    AtomicSnapshot() : current(nullptr), epoch(0), published(0) {};
+    explicit AtomicSnapshot(T initial) : AtomicSnapshot() { publish(std::move(initial)); };
+
+    ~AtomicSnapshot() { delete current.load(); }
+
+    AtomicSnapshot(const AtomicSnapshot &) = delete;
+    AtomicSnapshot &operator=(const AtomicSnapshot &) = delete;
+
+    /**
+     * Latest snapshot, or nullptr if nothing has been published yet
+     */
+    std::shared_ptr<const T> load() const {
+        std::atomic<size_t> &counter = readers[epoch.load() & 1];
+        counter.fetch_add(1);
+        const Node *node = current.load();
+        std::shared_ptr<const T> p = node != nullptr ? node->value : nullptr;
+        counter.fetch_sub(1, std::memory_order_release);
+        return p;
+    }
+
+    /**
+     * Make value the current snapshot and return it. The previous one is released once its readers are done.
+     */
+    std::shared_ptr<const T> publish(T value) {
+        Node *node = new Node{ std::make_shared<const T>(std::move(value)) };
+        std::shared_ptr<const T> p = node->value;
+        std::lock_guard<std::mutex> lock(mtx);
+        Node *previous = current.exchange(node);
+        published.fetch_add(1, std::memory_order_relaxed);
+        if (previous != nullptr) {
+            synchronize();
+            delete previous;
+        }
+        return p;
+    }
+
+    /**
+     * Number of snapshots published so far
+     */
+    size_t generation() const {
+        return published.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct Node {
+        std::shared_ptr<const T> value;
+    };
+
+    /* Wait until no reader can still be looking at a node replaced before this call (mtx held) */
+    void synchronize() {
+        for (int phase = 0; phase < 2; phase++) {
+            const size_t left = epoch.fetch_add(1);
+            while (readers[left & 1].load(std::memory_order_acquire) != 0) std::this_thread::yield();
+        }
+    }
+
+    std::atomic<Node *> current;
+    std::atomic<size_t> epoch;
+    mutable std::atomic<size_t> readers[2] = {};
+    std::atomic<size_t> published;
+    std::mutex mtx;
+};
+
+#endif //ISLAY_ATOMICSNAPSHOT_H
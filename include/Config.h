@@ -13,31 +13,195 @@
 
 #include <Eigen/Core>
 #include <string>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <iostream>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+#include "AtomicSnapshot.h"
+
+/**
+ * Typed view of the config, resolved once per load/edit.
+ * Snapshots are immutable; take a new one from Config::params() to see later edits.
+ */
+struct ConfigParams {
+    std::string resourceDirectory;
+    std::string resultParentDirectory;
+    std::string resultDirectory;
+    std::string imgName;
+    std::string imgPath;
+    std::string blurredImg;
+    int imageWidth = 0;
+    int imageHeight = 0;
+    int intVar = 0;
+    bool lensWarmStart = false;
+    std::string serialPort; // "auto": discover
+    int netServerPort = 0; // localhost control server, 0: disabled
+    std::string netServerSocket; // Unix domain socket of the control server, empty: disabled
+    std::string videoFile; // recorded footage to play next to the lens controls
+    int lensPollIntervalMs = 0; // zoom/focus position polling for the lens history, 0: disabled
+};
 
 class Config {
 private:
     Config() {
-        {
-            FILE *fp;
-            char buf[512];
-
-            // read
 #ifdef _MSC_VER
-			fp = fopen("../config/config_win_default.json", "rb");
+        configFilePath = "../config/config_win_default.json";
 #else
-			fp = fopen("config_default.json", "rb");
+        configFilePath = "config_default.json";
 #endif
-            rapidjson::FileReadStream rs(fp, buf, sizeof(buf));
+        parseFile(configFilePath, config);
+
+        createResultDirectory();
+        publish();
+        startWatching();
+    };
+
+    ~Config() {
+        stopWatching();
+    };
+
+    /*
+     * Parse a json file into doc. Returns false (and leaves doc untouched) on failure.
+     */
+    static bool parseFile(const std::string &fileName, rapidjson::Document &doc) {
+        FILE *fp;
+        char buf[512];
 
-            config.ParseStream<rapidjson::ParseFlag::kParseCommentsFlag>(rs);
+        fp = fopen(fileName.c_str(), "rb");
+        if (fp == NULL) {
+            std::cerr << "Failed to load " << fileName << std::endl;
+            return false;
+        }
+        rapidjson::FileReadStream rs(fp, buf, sizeof(buf));
+
+        rapidjson::Document parsed;
+        parsed.ParseStream<rapidjson::ParseFlag::kParseCommentsFlag>(rs);
 
-            fclose(fp);
+        fclose(fp);
+
+        if (parsed.HasParseError() || !parsed.IsObject()) {
+            std::cerr << "Failed to parse " << fileName << std::endl;
+            return false;
         }
+        doc.Swap(parsed);
+        return true;
+    }
 
-        createResultDirectory();
-    };
+    /*
+     * Resolve the document into a ConfigParams and make it the current snapshot (call with mtx held or before sharing).
+     */
+    void publish() {
+        auto str = [this](const char *name) -> std::string {
+            return config.HasMember(name) && config[name].IsString() ? std::string(config[name].GetString()) : std::string();
+        };
+        auto num = [this](const char *name) -> int {
+            return config.HasMember(name) && config[name].IsInt() ? config[name].GetInt() : 0;
+        };
 
-    ~Config() = default;
+        ConfigParams p;
+        p.resourceDirectory = str("RESOURCE_DIRECTORY");
+        p.resultParentDirectory = str("RESULT_PARENT_DIRECTORY");
+        p.resultDirectory = str("RESULT_DIRECTORY");
+        p.imgName = str("IMG_NAME");
+        p.imgPath = str("IMG_PATH");
+        p.blurredImg = str("BLURRED_IMG");
+        p.imageWidth = num("IMAGE_WIDTH");
+        p.imageHeight = num("IMAGE_HEIGHT");
+        p.intVar = num("INT_VAR");
+        p.serialPort = str("SERIAL_PORT");
+        if (p.serialPort.empty()) p.serialPort = "auto";
+        p.netServerPort = num("NET_SERVER_PORT");
+        p.netServerSocket = str("NET_SERVER_SOCKET");
+        p.videoFile = str("VIDEO_FILE");
+        p.lensPollIntervalMs = num("LENS_POLL_INTERVAL_MS");
+        p.lensWarmStart = config.HasMember("LENS_WARM_START") && config["LENS_WARM_START"].IsBool() && config["LENS_WARM_START"].GetBool();
+        snapshot.publish(std::move(p));
+    }
+
+    /*
+     * Re-read the config file after it was modified on disk.
+     * The result directory of this run is kept.
+     */
+    void reload() {
+        rapidjson::Document doc;
+        std::string fileName;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            fileName = configFilePath;
+        }
+        if (!parseFile(fileName, doc)) return;
+
+        std::lock_guard<std::mutex> lock(mtx);
+        std::string resultDirName = config["RESULT_DIRECTORY"].GetString();
+        doc.RemoveMember("RESULT_DIRECTORY");
+        doc.AddMember("RESULT_DIRECTORY", rapidjson::Value(resultDirName.c_str(), doc.GetAllocator()), doc.GetAllocator());
+        config.Swap(doc);
+        publish();
+        std::cout << "Config reloaded from " << fileName << std::endl;
+    }
+
+    /*
+     * Watch the config file and reload it when it is rewritten (inotify, Linux only).
+     */
+    void startWatching() {
+#ifdef __linux__
+        watching.store(true);
+        watcher = std::thread([this] {
+            int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            if (fd < 0) {
+                std::cerr << "inotify is not available, config hot reload disabled" << std::endl;
+                return;
+            }
+            int wd = -1;
+            std::string watchedDir, watchedName;
+            alignas(struct inotify_event) char events[4096];
+
+            while (watching.load()) {
+                std::string fileName;
+                {
+                    std::lock_guard<std::mutex> lock(mtx);
+                    fileName = configFilePath;
+                }
+                std::filesystem::path path(fileName);
+                std::string dir = path.has_parent_path() ? path.parent_path().string() : std::string(".");
+                if (dir != watchedDir) { // (re)attach when loadConfig switched to another directory
+                    if (wd >= 0) inotify_rm_watch(fd, wd);
+                    // watch the directory, editors usually replace the file instead of rewriting it in place
+                    wd = inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+                    watchedDir = dir;
+                }
+                watchedName = path.filename().string();
+
+                struct pollfd pfd = {fd, POLLIN, 0};
+                if (poll(&pfd, 1, 200) <= 0) continue; // wake up regularly to notice stopWatching()
+
+                bool modified = false;
+                ssize_t len;
+                while ((len = read(fd, events, sizeof(events))) > 0) {
+                    for (char *ptr = events; ptr < events + len;) {
+                        auto *event = reinterpret_cast<struct inotify_event *>(ptr);
+                        if (event->len > 0 && watchedName == event->name) modified = true;
+                        ptr += sizeof(struct inotify_event) + event->len;
+                    }
+                }
+                if (modified) reload();
+            }
+            close(fd);
+        });
+#endif
+    }
+
+    void stopWatching() {
+        watching.store(false);
+        if (watcher.joinable()) watcher.join();
+    }
 
     void createResultDirectory() {
         std::string currentDateAndTime;
@@ -66,7 +230,12 @@ private:
         config.AddMember("RESULT_DIRECTORY", rapidjson::Value(resultDirName.c_str(), config.GetAllocator()), config.GetAllocator());
     }
 
-    rapidjson::Document config;
+    rapidjson::Document config; // guarded by mtx once the watcher runs
+    std::string configFilePath;
+    AtomicSnapshot<ConfigParams> snapshot;
+    mutable std::mutex mtx;
+    std::thread watcher;
+    std::atomic<bool> watching{false};
 
 public:
     Config(const Config &) = delete;
@@ -79,9 +248,23 @@ public:
         return instance;
     }
 
+    /**
+     * Latest typed snapshot. Safe from any thread and never waits for an edit; the snapshot stays valid while it is held.
+     */
+    std::shared_ptr<const ConfigParams> params() const { return snapshot.load(); }
+
+    /**
+     * Number of snapshots published so far (1 + loads/edits/hot reloads)
+     */
+    size_t generation() const { return snapshot.generation(); }
+
+    /**
+     * Raw document. Only for the GUI thread; use params() elsewhere.
+     */
     const rapidjson::Document &getDocument() const { return config; }
 
     void saveConfig() {
+        std::lock_guard<std::mutex> lock(mtx);
         FILE *fp = fopen(( this->resultDirectory() + "/config.json").c_str(), "wb"); // non-Windows use "w"
 
         char writeBuffer[65536];
@@ -93,6 +276,7 @@ public:
     }
 
     void saveConfig(std::string name) {
+        std::lock_guard<std::mutex> lock(mtx);
         FILE *fp = fopen((this->resultDirectory() + "/" + name).c_str(), "wb"); // non-Windows use "w"
 
         char writeBuffer[65536];
@@ -105,24 +289,24 @@ public:
 
     void loadConfig(std::string configFileName) {
         {
-            FILE *fp;
-            char buf[512];
-
-            fp = fopen((configFileName).c_str(), "rb");
-            if (fp == NULL) {
-                std::cerr << "Failed to load " << configFileName << std::endl;
+            rapidjson::Document doc;
+            if (!parseFile(configFileName, doc)) return;
+
+            std::lock_guard<std::mutex> lock(mtx);
+            std::string resultDirName = config["RESULT_DIRECTORY"].GetString();
+            config.Swap(doc);
+            if (!config.HasMember("RESULT_DIRECTORY")) {
+                config.AddMember("RESULT_DIRECTORY", rapidjson::Value(resultDirName.c_str(), config.GetAllocator()), config.GetAllocator());
             }
-            rapidjson::FileReadStream rs(fp, buf, sizeof(buf));
-
-            config.ParseStream<rapidjson::ParseFlag::kParseCommentsFlag>(rs);
-
-            fclose(fp);
+            configFilePath = configFileName;
+            publish();
         };
 
         saveConfig();
     }
 
     std::string showConfig() {
+        std::lock_guard<std::mutex> lock(mtx);
         rapidjson::StringBuffer buffer;
         rapidjson::PrettyWriter<rapidjson::StringBuffer> writer(buffer);
         config.Accept(writer);
@@ -130,30 +314,50 @@ public:
     }
 
     std::string resultDirectory(){
-        return std::string(config["RESULT_DIRECTORY"].GetString());
+        return params()->resultDirectory;
     }
 
     std::string resourceDirectory(){
-        return std::string(config["RESOURCE_DIRECTORY"].GetString());
+        return params()->resourceDirectory;
+    }
+
+    /*
+     * name in the most recent result directory that has it (result directories are named by date and time), empty if none
+     */
+    std::string latestResultFile(const std::string &name) {
+        std::string latest;
+        std::error_code error;
+        for (auto &entry : std::filesystem::directory_iterator(params()->resultParentDirectory, error)) {
+            auto file = entry.path() / name;
+            if (entry.is_directory() && std::filesystem::exists(file) && file.string() > latest) {
+                latest = file.string();
+            }
+        }
+        return latest;
     }
 
     double readDoubleParam(std::string paramName) const {
+        std::lock_guard<std::mutex> lock(mtx);
         return config[paramName.c_str()].GetDouble();
     }
 
     int readIntParam(std::string paramName) const {
+        std::lock_guard<std::mutex> lock(mtx);
         return config[paramName.c_str()].GetInt();
     }
 
     std::string readStringParam(std::string paramName) const {
+        std::lock_guard<std::mutex> lock(mtx);
         return std::string(config[paramName.c_str()].GetString());
     }
 
     bool readBoolParam(std::string paramName) const {
+        std::lock_guard<std::mutex> lock(mtx);
         return config[paramName.c_str()].GetBool();
     }
 
     Eigen::VectorXd readVectorParam(std::string paramName) const {
+        std::lock_guard<std::mutex> lock(mtx);
         auto array = config[paramName.c_str()].GetArray();
         int num = array.Size();
 
@@ -165,6 +369,7 @@ public:
     }
 
     Eigen::MatrixXd readMatrixParam(std::string paramName) const {
+        std::lock_guard<std::mutex> lock(mtx);
         auto array = config[paramName.c_str()].GetArray();
 
         Eigen::MatrixXd matrix;
@@ -180,8 +385,10 @@ public:
     }
 
     bool setStringParam(std::string paramName, std::string paramToSet) {
+        std::lock_guard<std::mutex> lock(mtx);
         if (config[paramName.c_str()].IsString()) {
             config[paramName.c_str()].SetString(paramToSet.c_str(), paramToSet.length(), config.GetAllocator());
+            publish();
             return true;
         } else {
             std::cerr << "Invalid config parameter setting" << std::endl;
@@ -190,8 +397,10 @@ public:
     }
 
     bool setDoubleParam(std::string paramName, double paramToSet) {
+        std::lock_guard<std::mutex> lock(mtx);
         if (config[paramName.c_str()].IsDouble()) {
             config[paramName.c_str()].SetDouble(paramToSet);
+            publish();
             return true;
         } else {
             std::cerr << "Invalid config parameter setting" << std::endl;
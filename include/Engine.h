@@ -8,9 +8,20 @@
 #include <utility>
 #include <thread>
 #include <atomic>
+#include <memory>
+#include <mutex>
+#include <stop_token>
+#include <string>
+#include <vector>
 #include "AppMsg.h"
+#include "ThreadSafeQueue.h"
+#include "ZoomCalibration.h"
+#include "UndistortionCache.h"
 
-enum class WORKER_STATUS {IDLE = 0, RUNNING = 1};
+class FujinonZoomLensServer;
+class FujinonZoomLensNetServer;
+
+enum class WORKER_STATUS {IDLE = 0, RUNNING = 1, PAUSED = 2};
 
 class Engine {
 protected:
@@ -19,7 +30,10 @@ public:
     Engine (AppMsgPtr _appMsg): appMsg(std::move(_appMsg)){
         workerStatus.store(WORKER_STATUS::IDLE);
     };
-    virtual bool run() = 0;
+    virtual ~Engine() = default;
+    virtual bool run() = 0;   // start, or resume if paused
+    virtual bool pause() = 0; // keep the worker and its resources, stop processing
+    virtual bool stop() = 0;  // end the worker; resources persist for the next run()
     virtual bool reset() = 0;
 //    bool terminate(){
 //        if (worker.joinable()) {
@@ -33,17 +47,161 @@ public:
     AppMsgPtr appMsg;
 };
 
+/*
+ * Lens worker.
+ * The lens connection (and the control server) is opened on the first run() and kept until
+ * the engine is destroyed, so stop() followed by run() only restarts the worker thread.
+ */
 class EngineOffline: public Engine{
-    std::thread worker;
+    std::jthread worker;
+    std::atomic<bool> paused;
+    std::unique_ptr<FujinonZoomLensServer> server;
+    std::unique_ptr<FujinonZoomLensNetServer> netServer;
+    bool netInFlight; // a network command is in the scheduler (worker thread only)
+    bool pollInFlight; // position polls are in the scheduler (worker thread only)
+    std::atomic<const FujinonZoomLensProfile *> profile; // of the lens as last identified, nullptr until opened
+
+    static constexpr std::chrono::milliseconds RECONNECT_BACKOFF_MIN{ 5 };
+    static constexpr std::chrono::milliseconds RECONNECT_BACKOFF_MAX{ 50 }; // bounds the delay once the lens is back
+
+    bool openLens();
+    void identified();
+    void reconnectLens(std::stop_token stopToken);
+    void work(std::stop_token stopToken);
+public:
+    EngineOffline(AppMsgPtr _appMsg);
+    ~EngineOffline();
+    bool run() override;
+    bool pause() override;
+    bool stop() override;
+    bool reset() override;
+
+    /* Profile of the lens (kept alive by the profile store), nullptr until it was opened */
+    const FujinonZoomLensProfile *lensProfile() const { return profile.load(std::memory_order_acquire); }
+};
+
+/*
+ * Decode/presentation counters of EngineVideo
+ */
+struct VideoSourceStats {
+    size_t decoded = 0;
+    size_t presented = 0;
+    size_t dropped = 0; // decoded but skipped because presentation fell behind the file's frame rate
+    size_t queued = 0;
+    double decodeFps = 0.0; // frames per second of decoding time (decoder capacity)
+    size_t metadataWritten = 0; // rows in the lens metadata sidecar
+    size_t metadataDropped = 0; // rows lost because the writer fell behind
+    bool undistortionAvailable = false; // a lens distortion model was loaded
+    UndistortionCacheStats undistortion;
+};
+
+/*
+ * Frame source playing a video file into displayMessenger ("video" in the pool).
+ * A decoder thread prefetches frames into a bounded queue; the worker presents them at the
+ * file's frame rate (or as fast as possible in full-rate mode) with their index and timestamp.
+ */
+class EngineVideo: public Engine{
+    struct VideoFrame {
+        cv::Mat image;
+        long index = 0;
+        double timestampMs = 0.0; // position in the file
+        double presentationMs = 0.0; // keeps increasing across loops
+        unsigned generation = 0; // seek generation the frame was decoded in
+    };
+
+    cv::VideoCapture capture;
+    ThreadSafeQueue<VideoFrame> prefetch;
+    std::jthread decoder;
+    std::jthread worker;
+    std::atomic<bool> paused;
+    std::atomic<bool> loop;
+    std::atomic<bool> fullRate;
+    std::atomic<long> seekRequest;
+    std::atomic<unsigned> generation;
+    std::atomic<long> position;
+    long frameCountValue;
+    double fpsValue;
+
+    std::atomic<size_t> decoded;
+    std::atomic<size_t> presented;
+    std::atomic<size_t> dropped;
+    std::atomic<long long> decodeNs;
+    std::unique_ptr<FujinonZoomLensMetadataWriter> metadata; // <video>_lens.csv in the result directory
+    LensDistortionModel distortionModel; // lens_distortion.json in the resource directory
+    std::unique_ptr<UndistortionCache> undistortion; // created for the size of the first frame
+    std::mutex undistortionMtx; // replacing undistortion vs. reading its statistics
+    std::atomic<bool> undistortEnabled;
+
+    void decode(std::stop_token stopToken);
+    void present(std::stop_token stopToken);
+    bool seekCapture(long frame);
+public:
+    EngineVideo(AppMsgPtr _appMsg, size_t prefetchFrames = 16);
+    ~EngineVideo();
+    bool open(const std::string &fileName); // while stopped
+    bool run() override;
+    bool pause() override;
+    bool stop() override;
+    bool reset() override;
+
+    void seek(long frame);
+    void setLoop(bool enable) { loop.store(enable); }
+    void setFullRate(bool enable) { fullRate.store(enable); }
+    void setUndistort(bool enable) { undistortEnabled.store(enable); } // adds "undistorted" to the pool
+    bool isOpened() const { return capture.isOpened(); }
+    long frameCount() const { return frameCountValue; }
+    double fps() const { return fpsValue; }
+    long currentFrame() const { return position.load(); }
+    VideoSourceStats statistics();
+};
+
+/*
+ * Outcome of a zoom calibration run
+ */
+struct CalibrationResult {
+    std::vector<std::pair<float, float>> zoomLUT; // [ratio, position], ratio 1 at the wide end
+    size_t featurePairs = 0; // frame pairs measured by feature matching
+    size_t searchPairs = 0; // frame pairs measured by the scale search
+    double maxError = -1.0; // largest relative ratio error against the source's ground truth, -1 if unknown
+    double elapsedMs = 0.0;
+    std::string profileFile; // calibrated profile, empty if the run did not finish
+};
+
+/*
+ * Zoom LUT calibration.
+ * The worker sweeps raw zoom positions from the wide to the tele end and grabs a frame at each one;
+ * analysis threads estimate the magnification between neighbouring frames while the sweep goes on.
+ * Chaining the steps gives the magnification of every position against the wide-end frame, which is
+ * written as the ZOOM_LUT of a copy of the profile of the lens.
+ */
+class EngineCalibration: public Engine{
+    std::jthread worker;
+    std::atomic<bool> paused;
+    std::unique_ptr<CalibrationFrameSource> source;
+    FujinonZoomLensProfile profile; // of the lens behind source: the calibrated profile is a copy of it
+    const size_t steps;
+    const size_t analysisThreads;
+    const double maxStepScale; // largest magnification between neighbouring positions searched for
+
+    std::atomic<size_t> grabbed;
+    std::atomic<size_t> analyzed;
+    std::mutex resultMtx;
+    CalibrationResult result;
+
+    void work(std::stop_token stopToken);
 public:
-    EngineOffline(AppMsgPtr _appMsg): Engine(std::move(_appMsg)){};
-    ~EngineOffline(){
-        if(worker.joinable())
-            worker.join();
-    }
+    EngineCalibration(AppMsgPtr _appMsg, size_t _steps = 64, size_t _analysisThreads = 0 /* hardware concurrency */, double _maxStepScale = 1.5);
+    ~EngineCalibration();
+    bool setSource(std::unique_ptr<CalibrationFrameSource> _source, const FujinonZoomLensProfile &_profile); // while stopped
     bool run() override;
+    bool pause() override;
+    bool stop() override;
     bool reset() override;
 
+    size_t stepCount() const { return steps; }
+    size_t framesGrabbed() const { return grabbed.load(); }
+    size_t pairsAnalyzed() const { return analyzed.load(); }
+    CalibrationResult lastResult();
 };
 
 #endif //ISLAY_ENGINE_H
@@ -0,0 +1,252 @@
+//
+// Created by Hirano Masahiro <masahiro.dll@gmail.com>
+//
+
+#ifndef ISLAY_GAMEPADLENSCONTROL_H
+#define ISLAY_GAMEPADLENSCONTROL_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <SDL.h>
+
+#include "FujinonZoomLens.h"
+#include "FujinonZoomLensHistory.h"
+#include "FujinonZoomLensScheduler.h"
+#include "Logger.h"
+
+struct GamepadLensControlStats {
+    bool connected = false;
+    std::string name;
+    double sampleHz = 0.0; // achieved sampling rate
+    float zoomVelocity = 0.0f; // -1 .. 1 after the dead zone and response curve
+    float focusVelocity = 0.0f;
+    float zoomRatio = -1.0f; // last setpoints (-1: none yet)
+    float focusMeter = -1.0f;
+    size_t sent = 0; // setpoints handed to the lens worker
+    double lastLatencyUs = 0.0; // stick sample to serial write
+    double meanLatencyUs = 0.0;
+    double maxLatencyUs = 0.0;
+};
+
+/**
+ * Zoom and focus velocity control from a game controller.
+ *
+ * A thread samples the controller at a fixed rate, independently of the GUI frame rate:
+ *   zoom:  right trigger in, left trigger out, or the left stick (up: in)
+ *   focus: the right stick (up: far)
+ * Deflection sets a velocity in log ratio / log meter per second, so a move feels the same at both
+ * ends of the range. The integrated setpoint goes through the profile LUTs (FujinonZoomLensController)
+ * to a position command.
+ *
+ * Each axis has at most one command in the scheduler: the next setpoint is issued once the previous
+ * one has been acknowledged, so commands go out as fast as the serial line carries them and each
+ * carries the latest stick position. Latency is measured from the sample a command was computed
+ * from to the write that sent it.
+ *
+ * SDL locks its joystick state internally, so the controller can be updated from this thread while
+ * the GUI thread pumps events.
+ */
+class GamepadLensControl {
+public:
+    static constexpr float DEAD_ZONE = 0.12f;
+    static constexpr float ZOOM_RATE = 1.0f; // log ratio per second at full deflection
+    static constexpr float FOCUS_RATE = 1.5f; // log meter per second at full deflection
+
+    GamepadLensControl(FujinonZoomLensScheduler &scheduler, const FujinonZoomLensHistory &_history, int rateHz = 500)
+            : history(_history), period(std::chrono::microseconds(1000000 / std::max(rateHz, 1))),
+              state(std::make_shared<State>(scheduler)),
+              controller(std::make_shared<Client>(state)) {
+        worker = std::jthread([this](std::stop_token stopToken) { sample(stopToken); });
+    };
+
+    ~GamepadLensControl() {
+        worker.request_stop();
+        if (worker.joinable()) worker.join();
+    }
+
+    GamepadLensControl(const GamepadLensControl &) = delete;
+    GamepadLensControl &operator=(const GamepadLensControl &) = delete;
+
+    /* Profile of the lens the setpoints are converted with (nullptr: the built-in one); any thread */
+    void setProfile(const FujinonZoomLensProfile *profile) { controller.setProfile(profile); }
+
+    /* Commands are only sent while enabled; the controller is sampled either way */
+    void setEnabled(bool enable) { enabled.store(enable); }
+    bool isEnabled() const { return enabled.load(); }
+
+    GamepadLensControlStats statistics() const {
+        std::lock_guard<std::mutex> lock(state->mtx);
+        return state->stats;
+    }
+
+private:
+    /* Shared with the completions, which run on the lens worker and may outlive this object */
+    struct State {
+        explicit State(FujinonZoomLensScheduler &_scheduler) : scheduler(_scheduler) {
+            for (auto &axis : inFlight) axis.store(false);
+            for (auto &axis : ackedPosition) axis.store(-1);
+        };
+
+        FujinonZoomLensScheduler &scheduler;
+        std::array<std::atomic<bool>, 2> inFlight; // zoom, focus
+        std::array<std::atomic<int>, 2> ackedPosition; // last raw position of ours the lens acknowledged
+        std::chrono::steady_clock::time_point sampled; // sample behind the setpoint being issued (sampling thread)
+        GamepadLensControlStats stats;
+        double totalLatencyUs = 0.0;
+        mutable std::mutex mtx;
+    };
+
+    /* Sends the controller's commands through the scheduler, one in flight per axis */
+    class Client : public FujinonZoomLensClientTemplate {
+        std::shared_ptr<State> state;
+    public:
+        explicit Client(std::shared_ptr<State> _state) : state(std::move(_state)) {};
+
+        void send(FujinonZoomLensCommand cmd) override {
+            const size_t axis = cmd.code == 0x21 ? 0 : 1;
+            state->inFlight[axis].store(true);
+            const int position = static_cast<int>(cmd.data[0]) * 256 + cmd.data[1];
+            state->scheduler.push(std::move(cmd), FujinonZoomLensPriority::MOTION,
+                [state = state, axis, position, sampled = state->sampled](bool ok, const FujinonZoomLensControllerUtil::FujinonZoomLensResponse &) {
+                    const double us = std::chrono::duration<double, std::micro>(state->scheduler.lastWritten() - sampled).count();
+                    {
+                        std::lock_guard<std::mutex> lock(state->mtx);
+                        GamepadLensControlStats &s = state->stats;
+                        s.sent++;
+                        s.lastLatencyUs = us;
+                        state->totalLatencyUs += us;
+                        s.meanLatencyUs = state->totalLatencyUs / s.sent;
+                        s.maxLatencyUs = std::max(s.maxLatencyUs, us);
+                    }
+                    if (ok) state->ackedPosition[axis].store(position);
+                    state->inFlight[axis].store(false);
+                });
+        }
+    };
+
+    /* Stick or trigger value in -1 .. 1 (0 inside the dead zone, squared outside for fine control near the center) */
+    static float shape(Sint16 raw) {
+        const float v = std::clamp(raw / 32767.0f, -1.0f, 1.0f);
+        const float a = std::max(std::abs(v) - DEAD_ZONE, 0.0f) / (1.0f - DEAD_ZONE);
+        return std::copysign(a * a, v);
+    }
+
+    void open() {
+        for (int i = 0; i < SDL_NumJoysticks(); i++) {
+            if (!SDL_IsGameController(i)) continue;
+            pad = SDL_GameControllerOpen(i);
+            if (pad == nullptr) continue;
+            const char *name = SDL_GameControllerName(pad);
+            SPDLOG_INFO("Game controller connected: {}", name != nullptr ? name : "unknown");
+            std::lock_guard<std::mutex> lock(state->mtx);
+            state->stats.connected = true;
+            state->stats.name = name != nullptr ? name : "unknown";
+            return;
+        }
+    }
+
+    void close() {
+        SDL_GameControllerClose(pad);
+        pad = nullptr;
+        SPDLOG_INFO("Game controller disconnected");
+        std::lock_guard<std::mutex> lock(state->mtx);
+        state->stats.connected = false;
+    }
+
+    /*
+     * Integrate a velocity into an axis setpoint (log domain). The setpoint starts from the lens state
+     * in the history whenever the axis was last commanded by someone else.
+     */
+    bool integrate(size_t axis, float step, int commanded, float lensValue, float min, float max, float &setpoint) {
+        if (step == 0.0f) return false;
+        if (setpoint < 0.0f || (!state->inFlight[axis].load() && commanded >= 0 && commanded != state->ackedPosition[axis].load())) {
+            setpoint = lensValue > 0.0f ? lensValue : min;
+        }
+        setpoint = std::clamp(setpoint * std::exp(step), min, max);
+        return true;
+    }
+
+    void sample(std::stop_token stopToken) {
+        auto next = std::chrono::steady_clock::now();
+        auto last = next, rateBegin = next, nextScan = next;
+        size_t samples = 0;
+        float zoomSetpoint = -1.0f, focusSetpoint = -1.0f;
+        std::array<bool, 2> pending = { false, false }; // setpoint changed but not sent yet
+
+        while (!stopToken.stop_requested()) {
+            next += period;
+            std::this_thread::sleep_until(next);
+            const auto now = std::chrono::steady_clock::now();
+            if (now - next > period * 4) next = now; // do not try to catch up after a stall
+            const float dt = std::chrono::duration<float>(now - last).count();
+            last = now;
+
+            if (pad == nullptr) {
+                if (now >= nextScan) {
+                    open();
+                    nextScan = now + std::chrono::seconds(1);
+                }
+                if (pad == nullptr) continue;
+            }
+            SDL_GameControllerUpdate();
+            if (!SDL_GameControllerGetAttached(pad)) {
+                close();
+                continue;
+            }
+
+            const float triggers = shape(SDL_GameControllerGetAxis(pad, SDL_CONTROLLER_AXIS_TRIGGERRIGHT)) -
+                                   shape(SDL_GameControllerGetAxis(pad, SDL_CONTROLLER_AXIS_TRIGGERLEFT));
+            const float zoomVelocity = std::clamp(triggers - shape(SDL_GameControllerGetAxis(pad, SDL_CONTROLLER_AXIS_LEFTY)), -1.0f, 1.0f);
+            const float focusVelocity = -shape(SDL_GameControllerGetAxis(pad, SDL_CONTROLLER_AXIS_RIGHTY));
+
+            if (enabled.load()) {
+                const FujinonZoomLensProfile &profile = controller.profile();
+                FujinonZoomLensFrameTag lens;
+                if (zoomVelocity != 0.0f || focusVelocity != 0.0f) lens = history.tag(now);
+                pending[0] |= integrate(0, zoomVelocity * ZOOM_RATE * dt, lens.zoomCommanded, lens.zoomRatio, profile.zoomMin, profile.zoomMax, zoomSetpoint);
+                pending[1] |= integrate(1, focusVelocity * FOCUS_RATE * dt, lens.focusCommanded, lens.focusMeter, profile.focusMin, profile.focusMax, focusSetpoint);
+
+                state->sampled = now;
+                if (pending[0] && !state->inFlight[0].load()) {
+                    controller.setZoomRatio(zoomSetpoint);
+                    pending[0] = false;
+                }
+                if (pending[1] && !state->inFlight[1].load()) {
+                    controller.setFocus(focusSetpoint);
+                    pending[1] = false;
+                }
+            }
+
+            samples++;
+            std::lock_guard<std::mutex> lock(state->mtx);
+            GamepadLensControlStats &s = state->stats;
+            s.zoomVelocity = zoomVelocity;
+            s.focusVelocity = focusVelocity;
+            s.zoomRatio = zoomSetpoint;
+            s.focusMeter = focusSetpoint;
+            if (now - rateBegin >= std::chrono::seconds(1)) {
+                s.sampleHz = samples / std::chrono::duration<double>(now - rateBegin).count();
+                samples = 0;
+                rateBegin = now;
+            }
+        }
+        if (pad != nullptr) close();
+    }
+
+    const FujinonZoomLensHistory &history;
+    const std::chrono::steady_clock::duration period;
+    std::atomic<bool> enabled{ false };
+    std::shared_ptr<State> state;
+    FujinonZoomLensController controller; // sampling thread only, but for setProfile()
+    SDL_GameController *pad = nullptr; // sampling thread only
+    std::jthread worker;
+};
+
+#endif //ISLAY_GAMEPADLENSCONTROL_H
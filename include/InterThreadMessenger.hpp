@@ -7,7 +7,7 @@
 #ifndef ISLAY_INTERTHREADMESSENGER_H
 #define ISLAY_INTERTHREADMESSENGER_H
 
-#include <mutex>
+#include <atomic>
 
 /**
  * An interface class for the message data to be passed by InterThreadMessenger.
@@ -45,98 +45,96 @@ private:
 /**
  * Class template of the inter thread messenger
  *
+ * A triple buffer for one sender thread and one receiver thread. The sender
+ * writes into its own buffer, the receiver reads from its own buffer, and the
+ * third buffer holds the latest message sent. Both sides exchange their buffer
+ * with the third one through a single atomic word (index of the third buffer
+ * plus a flag telling whether it holds a message not yet received), so neither
+ * send() nor receive() ever blocks or waits for the other thread.
+ *
  * @tparam CustomMsgData A subclass of MsgData passed by the messenger.
  */
 template<class CustomMsgData>
 class InterThreadMessenger {
 public:
-    InterThreadMessenger() : master_seqno(0), closed(false) {
-        msg_sender = new CustomMsgData();
-        msg_buffer = new CustomMsgData();
-        msg_receiver = new CustomMsgData();
+    InterThreadMessenger() : sender(0), receiver(2), middle(1), master_seqno(0), closed(false) {
+        for (auto &msg : msgs) msg = new CustomMsgData();
     }
 
     ~InterThreadMessenger() {
-        delete msg_sender;
-        delete msg_buffer;
-        delete msg_receiver;
+        for (auto &msg : msgs) delete msg;
     }
 
+    InterThreadMessenger(const InterThreadMessenger &) = delete;
+    InterThreadMessenger &operator=(const InterThreadMessenger &) = delete;
+
     /**
      * Returns the pointer to the sender's CustomMsgData buffer so
      * that the message data to be sent can be put into it.
+     * (Sender thread only. The buffer holds an older message.)
      */
     CustomMsgData *prepareMsg() const {
-        return msg_sender;
+        return msgs[sender];
     }
 
     /**
-     * Send the message by exchanging the pointers to the sender's
-     * buffer and the intermediate buffer.
+     * Send the message by exchanging the sender's buffer and the
+     * intermediate buffer. A message not yet received is replaced.
      */
     void send() {
-        master_seqno++;
-        {
-            std::lock_guard<std::mutex> lock(mtx);
-            msg_sender->seqno = master_seqno;
-            swapPtr(&msg_sender, &msg_buffer);
-        }
+        msgs[sender]->seqno = ++master_seqno;
+        // release: the message written into the sender's buffer is visible to the receiver that takes it
+        sender = middle.exchange(sender | UPDATED, std::memory_order_acq_rel) & INDEX;
     }
 
     /**
-     * Returns true iff the message in the intermediate buffer is
-     * newer than the one in the receiver's buffer.
+     * Returns true iff the intermediate buffer holds a message newer
+     * than the one in the receiver's buffer.
      */
-    bool isUpdated() {
-        return msg_buffer->seqno > msg_receiver->seqno;
+    bool isUpdated() const {
+        return (middle.load(std::memory_order_acquire) & UPDATED) != 0;
     }
 
     /**
-     * Receive the message by exchanging the pointers to the
-     * intermediate buffer and the receiver's buffer.  If not
-     * isUpdated(), the pointers remain unchanged.
+     * Receive the message by exchanging the intermediate buffer and
+     * the receiver's buffer. If not isUpdated(), the buffers remain
+     * unchanged.
      * Returns the pointer to the receiver's buffer after exchange if
-     * isUpdated(); nullptr otherwise.
+     * isUpdated(); nullptr otherwise. (Receiver thread only.)
      */
     CustomMsgData *receive() {
         if (!isUpdated()) {
             return nullptr;
         }
-        {
-            std::lock_guard<std::mutex> lock(mtx);
-            swapPtr(&msg_buffer, &msg_receiver);
-        }
-        return msg_receiver;
+        // only send() can change the word in between, and it always sets UPDATED
+        receiver = middle.exchange(receiver, std::memory_order_acq_rel) & INDEX;
+        return msgs[receiver];
     }
 
     /**
      * Returns true iff the messenger has been closed.
      */
     bool isClosed() const {
-        return closed;
+        return closed.load(std::memory_order_acquire);
     }
 
     /**
      * Close the messenger.
      */
     void close() {
-        closed = true;
+        closed.store(true, std::memory_order_release);
     }
-    
+
 private:
-    void swapPtr(CustomMsgData **p1, CustomMsgData **p2) {
-        CustomMsgData *tmp;
-        tmp = *p1;
-        *p1 = *p2;
-        *p2 = tmp;
-    }
-    
-    CustomMsgData *msg_sender;
-    CustomMsgData *msg_buffer;
-    CustomMsgData *msg_receiver;
-    std::mutex mtx;
-    unsigned int master_seqno;
-    bool closed;
+    static constexpr unsigned char INDEX = 0x03;
+    static constexpr unsigned char UPDATED = 0x04;
+
+    CustomMsgData *msgs[3];
+    unsigned char sender; // index owned by the sender thread
+    unsigned char receiver; // index owned by the receiver thread
+    std::atomic<unsigned char> middle; // index of the intermediate buffer | UPDATED
+    unsigned int master_seqno; // sender thread only
+    std::atomic<bool> closed;
 };
 
 #endif //ISLAY_INTERTHREADMESSENGER_H
@@ -0,0 +1,106 @@
+//
+// Created by Hirano Masahiro <masahiro.dll@gmail.com>
+//
+
+#ifndef ISLAY_LOGRINGBUFFER_H
+#define ISLAY_LOGRINGBUFFER_H
+
+#include <algorithm>
+#include <atomic>
+#include <array>
+#include <cstring>
+
+#include "spdlog/sinks/base_sink.h"
+#include "spdlog/details/null_mutex.h"
+
+/**
+ * Fixed-capacity lock-free ring of formatted log lines.
+ *
+ * Single producer (the spdlog async worker) / single consumer (the GUI thread).
+ * When the ring is full the new line is dropped and counted instead of blocking the producer.
+ *
+ * @tparam Capacity Number of line slots (power of two)
+ * @tparam LineLength Maximum bytes per line, longer lines are truncated
+ */
+template<size_t Capacity = 1024, size_t LineLength = 256>
+class LogRingBuffer {
+    static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+public:
+    struct Line {
+        size_t length;
+        char text[LineLength];
+    };
+
+    LogRingBuffer() : head(0), tail(0), overflow(0) {};
+
+    /**
+     * Push a line (producer side). Returns false if the ring was full and the line was dropped.
+     */
+    bool push(const char *text, size_t length) {
+        const size_t h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) >= Capacity) {
+            overflow.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        Line &line = lines[h & (Capacity - 1)];
+        line.length = std::min(length, LineLength);
+        std::memcpy(line.text, text, line.length);
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Pop every available line (consumer side) and hand it to f(const char* begin, const char* end).
+     * Returns the number of lines consumed.
+     */
+    template<typename F>
+    size_t drain(F &&f) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        const size_t h = head.load(std::memory_order_acquire);
+        const size_t n = h - t;
+        for (; t != h; t++) {
+            const Line &line = lines[t & (Capacity - 1)];
+            f(line.text, line.text + line.length);
+        }
+        tail.store(h, std::memory_order_release);
+        return n;
+    }
+
+    /**
+     * Number of lines dropped because the ring was full.
+     */
+    size_t overflowCount() const { return overflow.load(std::memory_order_relaxed); }
+
+private:
+    std::array<Line, Capacity> lines;
+    alignas(64) std::atomic<size_t> head;
+    alignas(64) std::atomic<size_t> tail;
+    std::atomic<size_t> overflow;
+};
+
+using AppLogRingBuffer = LogRingBuffer<>;
+
+/**
+ * spdlog sink writing formatted messages into a LogRingBuffer.
+ *
+ * It is attached to the async logger only, so sink_it_ is always called from the single
+ * thread pool worker and no mutex is needed.
+ */
+class LogRingBufferSink : public spdlog::sinks::base_sink<spdlog::details::null_mutex> {
+public:
+    explicit LogRingBufferSink(std::shared_ptr<AppLogRingBuffer> _ring) : ring(std::move(_ring)) {};
+
+protected:
+    void sink_it_(const spdlog::details::log_msg &msg) override {
+        spdlog::memory_buf_t formatted;
+        formatter_->format(msg, formatted);
+        ring->push(formatted.data(), formatted.size());
+    }
+
+    void flush_() override {}
+
+private:
+    std::shared_ptr<AppLogRingBuffer> ring;
+};
+
+#endif //ISLAY_LOGRINGBUFFER_H
@@ -13,33 +13,52 @@
 #define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_INFO // All DEBUG/TRACE statements will be removed by the pre-processor
 #endif
 #include "spdlog/spdlog.h"
+#include "spdlog/async.h"
 #include "spdlog/sinks/basic_file_sink.h" // support for basic file logging
 #include "spdlog/sinks/stdout_color_sinks.h" // or "../stdout_sinks.h" if no colors needed
-#include "spdlog/sinks/ostream_sink.h"
+#include "LogRingBuffer.h"
 
+/*
+ * Logging is asynchronous: callers only enqueue into spdlog's bounded thread pool queue
+ * (overrun_oldest, so a full queue never blocks the serial path) and a single worker thread
+ * drives the sinks. The GUI log window drains a fixed-capacity ring instead of an ever-growing ostringstream.
+ */
 class Logger
 {
 private:
-    Logger(){
+    static constexpr size_t QUEUE_SIZE = 8192; // number of pending messages in the async queue
+    static constexpr std::chrono::seconds FLUSH_INTERVAL{1};
+
+    Logger() : ring(std::make_shared<AppLogRingBuffer>()) {
         try
         {   // Default logger
-            auto console_sink = std::make_shared<spdlog::sinks::stdout_color_sink_mt>();
-            auto file_sink = std::make_shared<spdlog::sinks::basic_file_sink_mt>("log.txt", true);
-            auto ostream_sink = std::make_shared<spdlog::sinks::ostream_sink_mt> (oss);
-            spdlog::sinks_init_list sink_list = { file_sink, console_sink, ostream_sink};
-            for (auto &sink:sink_list) {
-                sink->set_pattern("[%C-%m-%d %H:%M:%S.%f][%^%5l%$] %v");
-            }
-            logger.reset(new spdlog::logger("LOGGER", sink_list.begin(), sink_list.end()));
-            logger->set_level(spdlog::level::trace);
-            spdlog::set_default_logger(logger);
+            spdlog::init_thread_pool(QUEUE_SIZE, 1); // one worker thread, the ring sink relies on this
+            spdlog::flush_every(FLUSH_INTERVAL); // dedicated periodic flush thread
+            createLogger("log.txt");
         }
         catch (const spdlog::spdlog_ex& ex)
         {
             std::cout << "[Log initialization failed] " << ex.what() << std::endl;
         }
     };
-    ~Logger() = default;
+    ~Logger() {
+        spdlog::shutdown();
+    };
+
+    void createLogger(const std::string &logFileName) {
+        auto console_sink = std::make_shared<spdlog::sinks::stdout_color_sink_mt>();
+        auto file_sink = std::make_shared<spdlog::sinks::basic_file_sink_mt>(logFileName, true);
+        auto ring_sink = std::make_shared<LogRingBufferSink>(ring);
+        spdlog::sinks_init_list sink_list = { file_sink, console_sink, ring_sink };
+        for (auto &sink:sink_list) {
+            sink->set_pattern("[%C-%m-%d %H:%M:%S.%f][%^%5l%$] %v");
+        }
+        logger = std::make_shared<spdlog::async_logger>("LOGGER", sink_list.begin(), sink_list.end(),
+                                                         spdlog::thread_pool(), spdlog::async_overflow_policy::overrun_oldest);
+        logger->set_level(spdlog::level::trace);
+        logger->flush_on(spdlog::level::err);
+        spdlog::set_default_logger(logger);
+    }
 
 public:
     Logger(const Logger&) = delete;
@@ -54,20 +73,19 @@ public:
     }
 
     void setExportDirectory(std::string logExportDirectory){
-        auto console_sink = std::make_shared<spdlog::sinks::stdout_color_sink_mt>();
-        auto file_sink = std::make_shared<spdlog::sinks::basic_file_sink_mt>(logExportDirectory + "/log.txt", true);
-        auto ostream_sink = std::make_shared<spdlog::sinks::ostream_sink_mt> (oss);
-        spdlog::sinks_init_list sink_list = { file_sink, console_sink, ostream_sink};
-        for (auto &sink:sink_list) {
-            sink->set_pattern("[%C-%m-%d %H:%M:%S.%f][%^%5l%$] %v");
-        }
-        logger.reset(new spdlog::logger("LOGGER", sink_list.begin(), sink_list.end()));
-        logger->set_level(spdlog::level::trace);
-        spdlog::set_default_logger(logger);
+        createLogger(logExportDirectory + "/log.txt");
+    }
+
+    /**
+     * Messages discarded because the async queue was full
+     */
+    size_t queueOverrunCount() const {
+        auto pool = spdlog::thread_pool();
+        return pool ? pool->overrun_counter() : 0;
     }
 
     std::shared_ptr<spdlog::logger> logger;
-    std::ostringstream oss;
+    std::shared_ptr<AppLogRingBuffer> ring;
 };
 
 #endif //ISLAY_LOGGER_H
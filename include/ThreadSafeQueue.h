@@ -0,0 +1,116 @@
+//
+// Created by Hirano Masahiro <masahiro.dll@gmail.com>
+//
+
+#ifndef ISLAY_THREADSAFEQUEUE_H
+#define ISLAY_THREADSAFEQUEUE_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+/**
+ * Bounded FIFO shared by a producer and a consumer thread.
+ *
+ * push() blocks while the queue is full, pop() waits up to a timeout while it is empty.
+ * close() releases both sides; after that push() fails and pop() drains what is left.
+ */
+template<class T>
+class ThreadSafeQueue {
+public:
+    explicit ThreadSafeQueue(size_t _capacity) : capacity(_capacity), closed(false) {};
+
+    ThreadSafeQueue(const ThreadSafeQueue &) = delete;
+    ThreadSafeQueue &operator=(const ThreadSafeQueue &) = delete;
+
+    /**
+     * Append value, waiting for space. Returns false if the queue was closed.
+     */
+    bool push(T value) {
+        std::unique_lock<std::mutex> lock(mtx);
+        notFull.wait(lock, [this] { return items.size() < capacity || closed; });
+        if (closed) return false;
+        items.push_back(std::move(value));
+        lock.unlock();
+        notEmpty.notify_one();
+        return true;
+    }
+
+    /**
+     * Append value unless the queue is full or closed. Never blocks.
+     */
+    bool tryPush(T value) {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (closed || items.size() >= capacity) return false;
+            items.push_back(std::move(value));
+        }
+        notEmpty.notify_one();
+        return true;
+    }
+
+    /**
+     * Take the oldest value, waiting up to timeout. Returns false if nothing arrived.
+     */
+    template<class Rep, class Period>
+    bool pop(T &value, std::chrono::duration<Rep, Period> timeout) {
+        std::unique_lock<std::mutex> lock(mtx);
+        if (!notEmpty.wait_for(lock, timeout, [this] { return !items.empty() || closed; })) return false;
+        if (items.empty()) return false;
+        value = std::move(items.front());
+        items.pop_front();
+        lock.unlock();
+        notFull.notify_one();
+        return true;
+    }
+
+    /**
+     * Drop everything queued (e.g. after a seek)
+     */
+    void clear() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            items.clear();
+        }
+        notFull.notify_all();
+    }
+
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            closed = true;
+        }
+        notFull.notify_all();
+        notEmpty.notify_all();
+    }
+
+    /**
+     * Accept values again after close()
+     */
+    void reopen() {
+        std::lock_guard<std::mutex> lock(mtx);
+        items.clear();
+        closed = false;
+    }
+
+    bool isClosed() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return closed;
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return items.size();
+    }
+
+private:
+    const size_t capacity;
+    std::deque<T> items;
+    std::mutex mtx;
+    std::condition_variable notFull;
+    std::condition_variable notEmpty;
+    bool closed;
+};
+
+#endif //ISLAY_THREADSAFEQUEUE_H
@@ -0,0 +1,293 @@
+//
+// Created by Hirano Masahiro <masahiro.dll@gmail.com>
+//
+
+#ifndef ISLAY_UNDISTORTIONCACHE_H
+#define ISLAY_UNDISTORTIONCACHE_H
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <future>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+#include "rapidjson/document.h"
+#include "rapidjson/filereadstream.h"
+
+/**
+ * Camera intrinsics and distortion (k1, k2, p1, p2, k3) at one zoom position
+ */
+struct LensIntrinsics {
+    double fx = 0.0, fy = 0.0, cx = 0.0, cy = 0.0;
+    std::array<double, 5> distortion{};
+};
+
+/**
+ * Intrinsics calibrated at a few zoom positions, interpolated linearly in between.
+ *
+ * Read from json:
+ *   {
+ *     "IMAGE_SIZE": [1920, 1080],                 // size the nodes were calibrated at
+ *     "NODES": [
+ *       { "ZOOM": 0, "K": [fx, fy, cx, cy], "D": [k1, k2, p1, p2, k3] },
+ *       ...                                       // ascending raw zoom positions
+ *     ]
+ *   }
+ */
+class LensDistortionModel {
+    std::vector<std::pair<double, LensIntrinsics>> nodes;
+    cv::Size imageSize;
+public:
+    LensDistortionModel() = default;
+    LensDistortionModel(cv::Size _imageSize, std::vector<std::pair<double, LensIntrinsics>> _nodes)
+            : nodes(std::move(_nodes)), imageSize(_imageSize) {
+        std::sort(nodes.begin(), nodes.end(), [](const auto &a, const auto &b) { return a.first < b.first; });
+    };
+
+    bool load(const std::string &fileName) {
+        FILE *fp = fopen(fileName.c_str(), "rb");
+        if (fp == NULL) return false;
+        char buf[512];
+        rapidjson::FileReadStream rs(fp, buf, sizeof(buf));
+        rapidjson::Document doc;
+        doc.ParseStream<rapidjson::ParseFlag::kParseCommentsFlag>(rs);
+        fclose(fp);
+        if (doc.HasParseError() || !doc.IsObject() || !doc.HasMember("NODES") || !doc["NODES"].IsArray()) return false;
+        if (!doc.HasMember("IMAGE_SIZE") || !doc["IMAGE_SIZE"].IsArray() || doc["IMAGE_SIZE"].Size() != 2) return false;
+
+        std::vector<std::pair<double, LensIntrinsics>> loaded;
+        for (auto &node : doc["NODES"].GetArray()) {
+            if (!node.IsObject() || !node.HasMember("ZOOM") || !node.HasMember("K") || !node.HasMember("D")) return false;
+            if (!node["K"].IsArray() || node["K"].Size() != 4 || !node["D"].IsArray() || node["D"].Size() != 5) return false;
+            LensIntrinsics in;
+            in.fx = node["K"][0].GetDouble();
+            in.fy = node["K"][1].GetDouble();
+            in.cx = node["K"][2].GetDouble();
+            in.cy = node["K"][3].GetDouble();
+            for (rapidjson::SizeType i = 0; i < 5; i++) in.distortion[i] = node["D"][i].GetDouble();
+            loaded.emplace_back(node["ZOOM"].GetDouble(), in);
+        }
+        if (loaded.empty()) return false;
+        std::sort(loaded.begin(), loaded.end(), [](const auto &a, const auto &b) { return a.first < b.first; });
+
+        nodes = std::move(loaded);
+        imageSize = cv::Size(doc["IMAGE_SIZE"][0].GetInt(), doc["IMAGE_SIZE"][1].GetInt());
+        return true;
+    }
+
+    bool empty() const { return nodes.empty(); }
+
+    /**
+     * Intrinsics at a raw zoom position for frames of size (scaled from the calibration size)
+     */
+    LensIntrinsics at(double position, cv::Size size) const {
+        auto next = std::upper_bound(nodes.begin(), nodes.end(), position,
+                                     [](double p, const std::pair<double, LensIntrinsics> &n) { return p < n.first; });
+        LensIntrinsics in;
+        if (next == nodes.begin()) in = nodes.front().second;
+        else if (next == nodes.end()) in = nodes.back().second;
+        else {
+            const LensIntrinsics &a = std::prev(next)->second, &b = next->second;
+            double w = (position - std::prev(next)->first) / (next->first - std::prev(next)->first);
+            in.fx = a.fx + w * (b.fx - a.fx);
+            in.fy = a.fy + w * (b.fy - a.fy);
+            in.cx = a.cx + w * (b.cx - a.cx);
+            in.cy = a.cy + w * (b.cy - a.cy);
+            for (size_t i = 0; i < in.distortion.size(); i++) in.distortion[i] = a.distortion[i] + w * (b.distortion[i] - a.distortion[i]);
+        }
+        const double sx = static_cast<double>(size.width) / imageSize.width, sy = static_cast<double>(size.height) / imageSize.height;
+        in.fx *= sx; in.cx *= sx;
+        in.fy *= sy; in.cy *= sy;
+        return in;
+    }
+};
+
+/**
+ * Fixed-point remap table (CV_16SC2 + CV_16UC1) of one quantized zoom position
+ */
+struct RemapTable {
+    int key = 0;
+    cv::Mat map1, map2;
+
+    size_t bytes() const { return map1.total() * map1.elemSize() + map2.total() * map2.elemSize(); }
+};
+
+struct UndistortionCacheStats {
+    size_t hits = 0;
+    size_t misses = 0; // frame path waited for a table to be built
+    size_t prefetched = 0; // built in the background
+    size_t evicted = 0;
+    size_t entries = 0;
+    size_t bytes = 0;
+    double meanBuildMs = 0.0;
+};
+
+/**
+ * Undistortion remap tables keyed by quantized zoom position, in a memory-bounded LRU.
+ *
+ * get() returns the table of the nearest quantization step, building it on a miss; tables being
+ * built are shared, so a miss on a table the background thread is already building waits for it
+ * instead of building it twice. prefetch() queues the steps ahead of a zoom move for the background
+ * thread. Tables are handed out as shared_ptr, so an eviction never invalidates a remap in progress.
+ */
+class UndistortionCache {
+public:
+    UndistortionCache(LensDistortionModel _model, cv::Size _size, size_t _budgetBytes = size_t(256) << 20, int _quantum = 0x400)
+            : model(std::move(_model)), size(_size), budgetBytes(_budgetBytes), quantum(std::max(_quantum, 1)), bytes(0) {
+        builder = std::jthread([this](std::stop_token stopToken) { buildAhead(stopToken); });
+    };
+
+    ~UndistortionCache() {
+        builder.request_stop();
+        pendingCv.notify_all();
+    }
+
+    UndistortionCache(const UndistortionCache &) = delete;
+    UndistortionCache &operator=(const UndistortionCache &) = delete;
+
+    cv::Size frameSize() const { return size; }
+
+    std::shared_ptr<const RemapTable> get(double position) {
+        return obtain(keyOf(position), false);
+    }
+
+    /**
+     * Queue up to depth steps from position towards target for background building
+     */
+    void prefetch(double position, double target, int depth = 3) {
+        const int from = keyOf(position), to = keyOf(target);
+        if (from == to) return;
+        const int dir = to > from ? 1 : -1;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            pending.clear(); // a newer move supersedes the previous one
+            for (int key = from + dir, n = 0; n < depth && key != to + dir; key += dir, n++) {
+                if (index.count(key) == 0 && building.count(key) == 0) pending.push_back(key);
+            }
+        }
+        pendingCv.notify_one();
+    }
+
+    /**
+     * Undistort src as seen at a raw zoom position. cv::remap splits the rows over OpenCV's worker threads.
+     */
+    bool undistort(const cv::Mat &src, cv::Mat &dst, double position) {
+        if (src.size() != size) return false;
+        auto table = get(position);
+        cv::remap(src, dst, table->map1, table->map2, cv::INTER_LINEAR);
+        return true;
+    }
+
+    UndistortionCacheStats statistics() {
+        std::lock_guard<std::mutex> lock(mtx);
+        UndistortionCacheStats s = stats;
+        s.entries = lru.size();
+        s.bytes = bytes;
+        s.meanBuildMs = builds > 0 ? buildMs / builds : 0.0;
+        return s;
+    }
+
+private:
+    int keyOf(double position) const {
+        return static_cast<int>(std::lround(std::clamp(position, 0.0, 65535.0) / quantum));
+    }
+
+    std::shared_ptr<const RemapTable> obtain(int key, bool background) {
+        std::shared_future<std::shared_ptr<const RemapTable>> inFlight;
+        std::promise<std::shared_ptr<const RemapTable>> promise;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            auto found = index.find(key);
+            if (found != index.end()) {
+                lru.splice(lru.begin(), lru, found->second); // most recently used
+                if (!background) stats.hits++;
+                return *found->second;
+            }
+            auto itr = building.find(key);
+            if (!background) stats.misses++;
+            if (itr != building.end()) {
+                inFlight = itr->second;
+            } else {
+                building[key] = promise.get_future().share();
+                if (background) stats.prefetched++;
+            }
+        }
+        if (inFlight.valid()) return inFlight.get();
+
+        const auto begin = std::chrono::steady_clock::now();
+        auto table = build(key);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            lru.push_front(table);
+            index[key] = lru.begin();
+            bytes += table->bytes();
+            while (bytes > budgetBytes && lru.size() > 1) {
+                bytes -= lru.back()->bytes();
+                index.erase(lru.back()->key);
+                lru.pop_back();
+                stats.evicted++;
+            }
+            building.erase(key);
+            buildMs += ms;
+            builds++;
+        }
+        promise.set_value(table);
+        return table;
+    }
+
+    std::shared_ptr<const RemapTable> build(int key) const {
+        LensIntrinsics in = model.at(static_cast<double>(std::min(key * quantum, 65535)), size);
+        cv::Mat K = (cv::Mat_<double>(3, 3) << in.fx, 0.0, in.cx, 0.0, in.fy, in.cy, 0.0, 0.0, 1.0);
+        cv::Mat D = (cv::Mat_<double>(1, 5) << in.distortion[0], in.distortion[1], in.distortion[2], in.distortion[3], in.distortion[4]);
+        auto table = std::make_shared<RemapTable>();
+        table->key = key;
+        cv::initUndistortRectifyMap(K, D, cv::Mat(), K, size, CV_16SC2, table->map1, table->map2);
+        return table;
+    }
+
+    void buildAhead(std::stop_token stopToken) {
+        while (!stopToken.stop_requested()) {
+            int key;
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                pendingCv.wait_for(lock, std::chrono::milliseconds(100), [&] { return !pending.empty() || stopToken.stop_requested(); });
+                if (pending.empty()) continue;
+                key = pending.front();
+                pending.pop_front();
+            }
+            obtain(key, true);
+        }
+    }
+
+    const LensDistortionModel model;
+    const cv::Size size;
+    const size_t budgetBytes;
+    const int quantum;
+
+    std::list<std::shared_ptr<const RemapTable>> lru; // front: most recently used
+    std::unordered_map<int, std::list<std::shared_ptr<const RemapTable>>::iterator> index;
+    std::map<int, std::shared_future<std::shared_ptr<const RemapTable>>> building;
+    std::deque<int> pending;
+    size_t bytes;
+    UndistortionCacheStats stats;
+    double buildMs = 0.0;
+    size_t builds = 0;
+    std::mutex mtx;
+    std::condition_variable pendingCv;
+    std::jthread builder;
+};
+
+#endif //ISLAY_UNDISTORTIONCACHE_H
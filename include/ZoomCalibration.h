@@ -0,0 +1,234 @@
+//
+// Created by Hirano Masahiro <masahiro.dll@gmail.com>
+//
+
+#ifndef ISLAY_ZOOMCALIBRATION_H
+#define ISLAY_ZOOMCALIBRATION_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <future>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "FujinonZoomLensScheduler.h"
+
+namespace ZoomCalibrationUtil {
+
+    /**
+     * Relative magnification between two frames of the same scene
+     */
+    struct MagnificationEstimate {
+        double scale = 1.0; // narrower / wider
+        bool features = false; // true: from feature matches, false: from the scale search
+        int inliers = 0; // feature matches consistent with the scale (features only)
+        double score = 0.0; // normalized cross correlation at the scale (search only)
+    };
+
+    constexpr int MIN_INLIERS = 25;
+
+    /**
+     * Center of src magnified by scale, resampled to size.
+     * scale 1 fits the whole width of src into size.
+     */
+    inline cv::Mat magnify(const cv::Mat &src, double scale, cv::Size size) {
+        const double k = scale * size.width / src.cols;
+        cv::Mat M = (cv::Mat_<double>(2, 3) << k, 0.0, size.width / 2.0 - k * src.cols / 2.0,
+                                               0.0, k, size.height / 2.0 - k * src.rows / 2.0);
+        cv::Mat dst;
+        cv::warpAffine(src, dst, M, size, k > 1.0 ? cv::INTER_CUBIC : cv::INTER_LINEAR, cv::BORDER_REFLECT);
+        return dst;
+    }
+
+    /**
+     * Scale of the similarity transform between ORB matches (RANSAC).
+     * Fails on frames without enough texture, e.g. far into the tele end of a synthetic sequence.
+     */
+    inline bool scaleByFeatures(const cv::Mat &wider, const cv::Mat &narrower, MagnificationEstimate &estimate) {
+        cv::Ptr<cv::ORB> orb = cv::ORB::create(1500);
+        std::vector<cv::KeyPoint> wideKeys, narrowKeys;
+        cv::Mat wideDesc, narrowDesc;
+        orb->detectAndCompute(wider, cv::noArray(), wideKeys, wideDesc);
+        orb->detectAndCompute(narrower, cv::noArray(), narrowKeys, narrowDesc);
+        if (wideDesc.rows < MIN_INLIERS || narrowDesc.rows < MIN_INLIERS) return false;
+
+        cv::BFMatcher matcher(cv::NORM_HAMMING);
+        std::vector<std::vector<cv::DMatch>> knn;
+        matcher.knnMatch(narrowDesc, wideDesc, knn, 2);
+        std::vector<cv::Point2f> from, to;
+        for (auto &m : knn) {
+            if (m.size() == 2 && m[0].distance < 0.75f * m[1].distance) { // Lowe's ratio test
+                from.push_back(wideKeys[m[0].trainIdx].pt);
+                to.push_back(narrowKeys[m[0].queryIdx].pt);
+            }
+        }
+        if (from.size() < MIN_INLIERS) return false;
+
+        cv::Mat inlierMask;
+        cv::Mat A = cv::estimateAffinePartial2D(from, to, inlierMask, cv::RANSAC, 2.0);
+        if (A.empty()) return false;
+        estimate.inliers = cv::countNonZero(inlierMask);
+        if (estimate.inliers < MIN_INLIERS) return false;
+        estimate.scale = std::hypot(A.at<double>(0, 0), A.at<double>(1, 0)) * wider.cols / narrower.cols;
+        estimate.features = true;
+        return true;
+    }
+
+    /**
+     * Scale in [minScale, maxScale] at which the magnified center of wider correlates best with narrower.
+     * Assumes the optical axis is at the image center. Runs on ~160 px images: a log-spaced grid, then golden-section refinement.
+     */
+    inline MagnificationEstimate scaleBySearch(const cv::Mat &wider, const cv::Mat &narrower, double minScale, double maxScale) {
+        const double shrink = std::min(1.0, 160.0 / narrower.cols);
+        cv::Mat target, source;
+        cv::resize(narrower, target, cv::Size(), shrink, shrink, cv::INTER_AREA);
+        cv::resize(wider, source, target.size(), 0, 0, cv::INTER_AREA);
+        const cv::Rect roi(target.cols / 10, target.rows / 10, target.cols * 8 / 10, target.rows * 8 / 10); // keeps borders out
+
+        auto ncc = [&](double s) {
+            cv::Mat warped = magnify(source, s, target.size());
+            cv::Mat result;
+            cv::matchTemplate(warped(roi), target(roi), result, cv::TM_CCOEFF_NORMED);
+            return static_cast<double>(result.at<float>(0, 0));
+        };
+
+        const int GRID = 48;
+        const double logMin = std::log(minScale), logStep = (std::log(maxScale) - logMin) / (GRID - 1);
+        int best = 0;
+        double bestScore = -2.0;
+        for (int i = 0; i < GRID; i++) {
+            double score = ncc(std::exp(logMin + i * logStep));
+            if (score > bestScore) {
+                bestScore = score;
+                best = i;
+            }
+        }
+
+        double lo = logMin + std::max(best - 1, 0) * logStep, hi = logMin + std::min(best + 1, GRID - 1) * logStep;
+        const double phi = (std::sqrt(5.0) - 1.0) / 2.0;
+        double a = hi - phi * (hi - lo), b = lo + phi * (hi - lo);
+        double fa = ncc(std::exp(a)), fb = ncc(std::exp(b));
+        for (int i = 0; i < 24; i++) {
+            if (fa > fb) {
+                hi = b; b = a; fb = fa;
+                a = hi - phi * (hi - lo); fa = ncc(std::exp(a));
+            } else {
+                lo = a; a = b; fa = fb;
+                b = lo + phi * (hi - lo); fb = ncc(std::exp(b));
+            }
+        }
+
+        MagnificationEstimate estimate;
+        estimate.scale = std::exp((lo + hi) / 2.0);
+        estimate.score = std::max({ fa, fb, bestScore });
+        return estimate;
+    }
+
+    /**
+     * Magnification of narrower relative to wider (grayscale frames, same size).
+     * Feature matching first; the scale search when it does not find enough consistent matches.
+     */
+    inline MagnificationEstimate estimateMagnification(const cv::Mat &wider, const cv::Mat &narrower, double maxScale) {
+        MagnificationEstimate estimate;
+        if (scaleByFeatures(wider, narrower, estimate) && estimate.scale > 0.9 && estimate.scale < maxScale) return estimate;
+        return scaleBySearch(wider, narrower, 0.95, maxScale);
+    }
+}
+
+/**
+ * Frames for the zoom calibration: moves the zoom to a raw position and returns what is seen there.
+ */
+class CalibrationFrameSource {
+public:
+    virtual ~CalibrationFrameSource() = default;
+    virtual bool grab(uint16_t zoomPosition, cv::Mat &frame) = 0;
+
+    /**
+     * Ground truth zoom ratio of a position, -1 if unknown (real lenses)
+     */
+    virtual double trueRatio(uint16_t zoomPosition) const { return -1.0; }
+};
+
+/**
+ * Synthetic zoom sequence: the center of a still image magnified by the ratio a LUT gives for each position.
+ * Lets the calibration be run and checked without a lens or camera.
+ */
+class SyntheticZoomSource : public CalibrationFrameSource {
+    cv::Mat image;
+    std::vector<float> positions, ratios; // ascending positions
+    cv::Size frameSize;
+public:
+    SyntheticZoomSource(cv::Mat _image, std::vector<float> _positions, std::vector<float> _ratios, cv::Size _frameSize)
+            : image(std::move(_image)), positions(std::move(_positions)), ratios(std::move(_ratios)), frameSize(_frameSize) {};
+
+    bool grab(uint16_t zoomPosition, cv::Mat &frame) override {
+        if (image.empty()) return false;
+        frame = ZoomCalibrationUtil::magnify(image, trueRatio(zoomPosition), frameSize);
+        return true;
+    }
+
+    double trueRatio(uint16_t zoomPosition) const override {
+        auto next = std::upper_bound(positions.begin(), positions.end(), static_cast<float>(zoomPosition));
+        if (next == positions.begin()) return ratios.front();
+        if (next == positions.end()) return ratios.back();
+        size_t i = next - positions.begin();
+        double w = (zoomPosition - positions[i - 1]) / (positions[i] - positions[i - 1]);
+        return ratios[i - 1] + w * (ratios[i] - ratios[i - 1]);
+    }
+};
+
+/**
+ * Real lens (through the lens worker's scheduler) and a camera looking at a textured target.
+ * Waits until the reported zoom position stops moving before taking the frame.
+ */
+class LensCameraSource : public CalibrationFrameSource {
+    FujinonZoomLensScheduler &scheduler;
+    cv::VideoCapture camera;
+    static constexpr int POSITION_TOLERANCE = 0x40;
+    static constexpr int STALE_FRAMES = 3; // buffered frames exposed while the zoom was moving
+
+    bool command(FujinonZoomLensCommand cmd, FujinonZoomLensControllerUtil::FujinonZoomLensResponse *response = nullptr) {
+        using Reply = std::pair<bool, FujinonZoomLensControllerUtil::FujinonZoomLensResponse>;
+        auto reply = std::make_shared<std::promise<Reply>>(); // outlives a timed out wait
+        auto future = reply->get_future();
+        FujinonZoomLensPriority priority = FujinonZoomLensSchedulerUtil::classify(cmd.code);
+        scheduler.push(std::move(cmd), priority,
+                       [reply](bool ok, const FujinonZoomLensControllerUtil::FujinonZoomLensResponse &r) { reply->set_value({ ok, r }); });
+        if (future.wait_for(std::chrono::seconds(2)) != std::future_status::ready) return false;
+        Reply result = future.get();
+        if (response != nullptr) *response = result.second;
+        return result.first;
+    }
+
+public:
+    LensCameraSource(FujinonZoomLensScheduler &_scheduler, int cameraIndex) : scheduler(_scheduler) {
+        camera.open(cameraIndex);
+    };
+
+    bool isOpened() const { return camera.isOpened(); }
+
+    bool grab(uint16_t zoomPosition, cv::Mat &frame) override {
+        if (!camera.isOpened()) return false;
+        if (!command({ 0x21, { static_cast<uchar>(zoomPosition >> 8), static_cast<uchar>(zoomPosition & 0xFF) } })) return false;
+
+        int last = -1;
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while (std::chrono::steady_clock::now() < deadline) {
+            FujinonZoomLensControllerUtil::FujinonZoomLensResponse response;
+            if (!command({ 0x31, {} }, &response)) return false;
+            int reported = static_cast<int>(response.position());
+            if (std::abs(reported - zoomPosition) <= POSITION_TOLERANCE && reported == last) break;
+            last = reported;
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+
+        for (int i = 0; i < STALE_FRAMES; i++) camera.grab();
+        return camera.read(frame) && !frame.empty();
+    }
+};
+
+#endif //ISLAY_ZOOMCALIBRATION_H
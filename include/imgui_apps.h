@@ -11,21 +11,28 @@
 #include "rapidjson/filereadstream.h"
 #include "rapidjson/filewritestream.h"
 #include "rapidjson/prettywriter.h"
+#include "LogRingBuffer.h"
 
 // Usage:
 //  static ExampleAppLog my_log;
 //  my_log.AddLog("Hello %d world\n", 123);
 //  my_log.Draw("title");
+// or, to follow the application logger,
+//  ExampleAppLog my_log(Logger::get_instance().ring);
 struct ExampleAppLog
 {
     ImGuiTextBuffer     Buf;
     ImGuiTextFilter     Filter;
     ImVector<int>       LineOffsets;        // Index to lines offset. We maintain this with AddLog() calls, allowing us to have a random access on lines
     bool                AutoScroll;     // Keep scrolling if already at the bottom
+    int                 MaxLines;       // Older lines are discarded beyond this, so the buffer stays bounded
+    std::shared_ptr<AppLogRingBuffer> Source; // Ring drained at every Draw() (optional)
 
-    ExampleAppLog()
+    ExampleAppLog(std::shared_ptr<AppLogRingBuffer> source = nullptr, int maxLines = 4096)
     {
         AutoScroll = true;
+        MaxLines = maxLines;
+        Source = std::move(source);
         Clear();
     }
 
@@ -46,10 +53,49 @@ struct ExampleAppLog
         for (int new_size = Buf.size(); old_size < new_size; old_size++)
             if (Buf[old_size] == '\n')
                 LineOffsets.push_back(old_size + 1);
+        Trim();
+    }
+
+    void    AddLine(const char* line_begin, const char* line_end)
+    {
+        int old_size = Buf.size();
+        Buf.append(line_begin, line_end);
+        if (line_begin == line_end || line_end[-1] != '\n')
+            Buf.append("\n");
+        for (int new_size = Buf.size(); old_size < new_size; old_size++)
+            if (Buf[old_size] == '\n')
+                LineOffsets.push_back(old_size + 1);
+    }
+
+    // Move pending lines from the ring into the text buffer
+    void    Pull()
+    {
+        if (!Source)
+            return;
+        Source->drain([this](const char* line_begin, const char* line_end) { AddLine(line_begin, line_end); });
+        Trim();
+    }
+
+    // Keep the most recent MaxLines / 2 lines once MaxLines is exceeded (amortized O(1) per line)
+    void    Trim()
+    {
+        if (LineOffsets.Size <= MaxLines)
+            return;
+        const int first_kept = LineOffsets[LineOffsets.Size - MaxLines / 2];
+        ImGuiTextBuffer kept;
+        kept.append(Buf.begin() + first_kept, Buf.end());
+        Buf.Buf.swap(kept.Buf);
+        LineOffsets.clear();
+        LineOffsets.push_back(0);
+        for (int i = 0; i < Buf.size(); i++)
+            if (Buf[i] == '\n')
+                LineOffsets.push_back(i + 1);
     }
 
     void    Draw(const char* title, bool* p_open = NULL)
     {
+        Pull();
+
         if (!ImGui::Begin(title, p_open))
         {
             ImGui::End();
@@ -72,6 +118,8 @@ struct ExampleAppLog
         bool copy = ImGui::Button("Copy");
         ImGui::SameLine();
         Filter.Draw("Filter", -100.0f);
+        if (Source)
+            ImGui::Text("Dropped lines: %zu", Source->overflowCount());
 
         ImGui::Separator();
         ImGui::BeginChild("scrolling", ImVec2(0,0), false, ImGuiWindowFlags_HorizontalScrollbar);
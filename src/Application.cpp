@@ -15,6 +15,19 @@
 #include "Utility.h"
 
 #include "FujinonZoomLensCom.h"
+#include "FujinonZoomLensSequence.h"
+#include "GamepadLensControl.h"
+
+/*
+ * Example lens choreography: zoom to 10x, wait until settled, read focus, then pull focus to 20 m
+ */
+static FujinonZoomLensSequence zoomAndPullFocus(FujinonZoomLensSequenceExecutor &lens) {
+    co_await lens.zoomTo(10.0f);
+    bool settled = co_await lens.waitSettled(0x21);
+    uint focus = co_await lens.readFocus();
+    SPDLOG_INFO("Zoom {} at 10x, focus position {:04X}", settled ? "settled" : "did not settle", focus);
+    co_await lens.focusTo(20.0f);
+}
 
 Application::Application() {
 // Setup SDL
@@ -137,13 +150,45 @@ bool Application::run(){
     Config::get_instance();
 
 // Setup logger
-    ExampleAppLog my_log;
     Logger::get_instance().setExportDirectory(Config::get_instance().resultDirectory());
+    ExampleAppLog my_log(Logger::get_instance().ring);
+
+// Load lens profiles
+    FujinonZoomLensProfileStore::get_instance().loadDirectory(Config::get_instance().resourceDirectory() + "/lens_profiles");
+    FujinonZoomLensProfileStore::get_instance().setCacheFile(Config::get_instance().params()->resultParentDirectory + "/lens_profile_cache.json");
 
     AppMsgPtr appMsg = std::make_shared<AppMsg>();
+    if (!appMsg->zlcTelemetry->open(Config::get_instance().params()->resultParentDirectory + "/lens_telemetry.bin")) {
+        SPDLOG_ERROR("Lens telemetry is not recorded");
+    }
+    const std::string motionFile = Config::get_instance().latestResultFile("lens_motion.json");
+    if (!motionFile.empty() && appMsg->zlcMotion->load(motionFile)) {
+        SPDLOG_INFO("Lens motor model loaded from {}", motionFile);
+    }
+    const std::string presetFile = Config::get_instance().latestResultFile("lens_presets.json");
+    if (!presetFile.empty() && appMsg->zlcPresets->load(presetFile)) {
+        SPDLOG_INFO("{} lens presets loaded from {}", appMsg->zlcPresets->list().size(), presetFile);
+    }
     std::shared_ptr<EngineOffline> engine(new EngineOffline(appMsg));
+
+// Zoom lens controller (kept across frames for its shadow state)
+    auto client = std::make_shared<FujinonZoomLensClient>(appMsg);
+    FujinonZoomLensController zlc(std::static_pointer_cast<FujinonZoomLensClientTemplate>(client));
+// Lens sequences (coroutines sharing one executor thread)
+    FujinonZoomLensSequenceExecutor sequences(*appMsg->zlcScheduler, appMsg->zlcMotion);
+// Zoom / focus from a game controller (sampled on its own thread)
+    GamepadLensControl gamepad(*appMsg->zlcScheduler, *appMsg->zlcHistory);
     std::map<std::string, ImageTexture> texturePool;
 
+// Recorded footage shown next to the lens controls
+    std::shared_ptr<EngineVideo> video(new EngineVideo(appMsg));
+    long displayedFrameIndex = -1;
+    double displayedTimestampMs = 0.0;
+    FujinonZoomLensFrameTag displayedLens;
+
+// Zoom LUT calibration
+    std::shared_ptr<EngineCalibration> calibration(new EngineCalibration(appMsg));
+
     enum SHOW_IMAGE_MODE {IMGUI = 0, OPENCV = 1};
     static int selectedShowImageMode = SHOW_IMAGE_MODE::IMGUI;
 
@@ -190,26 +235,58 @@ bool Application::run(){
             observedWorkerStatus = engine->getWorkerStatus();
 
             if (ImGui::Button("Run fujinon setZoomRatio lens")) {
-                if(observedWorkerStatus == WORKER_STATUS::IDLE){
+                if(observedWorkerStatus != WORKER_STATUS::RUNNING){
                     engine->run();
                 } else {
                     ImGui::Text("Command ignored");
                 }
             }
             ImGui::SameLine();
+            if (ImGui::Button("Pause")) {
+                engine->pause();
+            }
+            ImGui::SameLine();
+            if (ImGui::Button("Stop")) {
+                engine->stop();
+            }
+            ImGui::SameLine();
             if (observedWorkerStatus == WORKER_STATUS::IDLE){
                 ImGui::Text("Worker: idle");
             } else if (observedWorkerStatus == WORKER_STATUS::RUNNING){
                 ImGui::Text("Worker: running");
+            } else if (observedWorkerStatus == WORKER_STATUS::PAUSED){
+                ImGui::Text("Worker: paused");
             } else {
                 ImGui::Text("Worker: unknown");
             }
 
 			{
 				ImGui::Text("Control");
-				
-				auto client = std::make_shared<FujinonZoomLensClient>(appMsg);
-				FujinonZoomLensController zlc(std::static_pointer_cast<FujinonZoomLensClientTemplate>(client));
+
+				// the profile of the lens the worker identified, for every controller that drives it
+				const FujinonZoomLensProfile *lensProfile = engine->lensProfile();
+				if (lensProfile != nullptr && lensProfile != &zlc.profile()) {
+					zlc.setProfile(lensProfile);
+					sequences.lens().setProfile(lensProfile);
+					gamepad.setProfile(lensProfile);
+				}
+
+				// confirmations from the lens, all of them before the controls below issue commands;
+				// the sequences get them too, as the lens is moved by more than their own commands
+				if (appMsg->zlcResponsesLost.exchange(false)) {
+					zlc.invalidateShadow();
+					sequences.invalidateShadow();
+				}
+				ZLCMsg responseMsg;
+				while (appMsg->zlcResponses->pop(responseMsg, std::chrono::milliseconds(0))) {
+					if (responseMsg.reconnected) {
+						zlc.invalidateShadow();
+						sequences.invalidateShadow();
+					} else {
+						zlc.onResponse(responseMsg.code, responseMsg.data);
+						sequences.onResponse(responseMsg.code, responseMsg.data);
+					}
+				}
 
 				// zoom
 				{
@@ -367,6 +444,119 @@ bool Application::run(){
 					}
 				}
 
+				// Stop: ahead of everything queued, which is dropped
+				{
+					if (ImGui::Button("Stop lens")) {
+						zlc.stop();
+					}
+				}
+
+				// Scene change: every axis in one batch, written to the lens in one write
+				{
+					if (ImGui::Button("Wide, focus 10 m, F8, filter clear")) {
+						zlc.beginBatch();
+						zlc.setZoomRatio(1.0f);
+						zlc.setFocus(10.0f);
+						zlc.setF(FujinonZoomLensControllerUtil::ZOOM_LENS_F::F8);
+						zlc.setFilter(FujinonZoomLensControllerUtil::ZOOM_LENS_FILTER::FILTER_CLEAR);
+						zlc.commitBatch();
+					}
+				}
+
+				// Sequence
+				{
+					if (ImGui::Button("Zoom 10x, then focus 20 m")) {
+						sequences.spawn(zoomAndPullFocus(sequences));
+					}
+					ImGui::SameLine();
+					ImGui::Text("Running sequences: %zu", sequences.running());
+				}
+
+				// Presets (saved to the result directory on every change)
+				{
+					static char presetName[64] = "";
+					ImGui::InputText("##preset", presetName, IM_ARRAYSIZE(presetName));
+					ImGui::SameLine();
+					if (ImGui::Button("Save preset") && presetName[0] != '\0') {
+						// what the lens confirmed, else what was last commanded (-1: not in the preset)
+						auto shadow = [&zlc](uchar code) {
+							const FujinonZoomLensShadowAxis *axis = zlc.shadowState(code);
+							if (!axis->confirmed && !axis->commanded) return -1;
+							const FujinonZoomLensPayload &data = axis->confirmed ? axis->confirmedData : axis->commandedData;
+							return data.size() == 2 ? data[0] * 256 + data[1] : data.size() == 1 ? static_cast<int>(data[0]) : -1;
+						};
+						appMsg->zlcPresets->set(presetName, shadow(0x21), shadow(0x22), shadow(0x20), shadow(0x40));
+						appMsg->zlcPresets->save(Config::get_instance().resultDirectory() + "/lens_presets.json");
+					}
+					for (auto &preset : appMsg->zlcPresets->list()) {
+						ImGui::PushID(preset->name.c_str());
+						if (ImGui::Button("Recall")) {
+							appMsg->zlcScheduler->recall(preset);
+						}
+						ImGui::SameLine();
+						if (ImGui::Button("Delete")) {
+							appMsg->zlcPresets->remove(preset->name);
+							appMsg->zlcPresets->save(Config::get_instance().resultDirectory() + "/lens_presets.json");
+						}
+						ImGui::SameLine();
+						ImGui::Text("%s: zoom %d, focus %d, iris %d, filter %d (%zu bytes)", preset->name.c_str(),
+							preset->zoom, preset->focus, preset->iris, preset->filter, preset->frames.size());
+						ImGui::PopID();
+					}
+					auto stats = appMsg->zlcPresets->statistics();
+					ImGui::Text("Recall to wire: last %.0f, mean %.0f, max %.0f [us] (%zu recalls)",
+						stats.lastUs, stats.meanUs(), stats.maxUs, stats.recalled);
+				}
+
+				// Motor model: position estimated between polls, and what waiting for a move costs
+				{
+					const auto now = std::chrono::steady_clock::now();
+					for (size_t axis : { 1, 2 }) {
+						const FujinonZoomLensMotionParams params = appMsg->zlcMotion->params(axis);
+						ImGui::Text("%-5s estimated %5.0f, polled %5.0f  (%.0f /s, %.0f /s^2, dead %.0f [ms], %zu moves)",
+							axis == 1 ? "Zoom" : "Focus", appMsg->zlcMotion->position(axis, now), appMsg->zlcHistory->position(axis, now),
+							params.velocity, params.acceleration, params.deadTime * 1000.0, params.moves);
+					}
+					auto stats = sequences.settleStatistics();
+					ImGui::Text("Settle waits: %zu, %.2f polls per wait", stats.waits, stats.pollsPerWait());
+				}
+
+				// Game controller
+				{
+					bool gamepadEnabled = gamepad.isEnabled();
+					if (ImGui::Checkbox("Gamepad zoom / focus", &gamepadEnabled)) {
+						gamepad.setEnabled(gamepadEnabled);
+					}
+					auto stats = gamepad.statistics();
+					ImGui::SameLine();
+					if (stats.connected) ImGui::Text("%s, %.0f [Hz]", stats.name.c_str(), stats.sampleHz);
+					else ImGui::Text("No controller");
+					ImGui::Text("Velocity: zoom %+.2f, focus %+.2f  Setpoint: x%.2f, %.1f [m]",
+						stats.zoomVelocity, stats.focusVelocity, stats.zoomRatio, stats.focusMeter);
+					ImGui::Text("Stick to wire: last %.0f, mean %.0f, max %.0f [us] (%zu commands)",
+						stats.lastLatencyUs, stats.meanLatencyUs, stats.maxLatencyUs, stats.sent);
+				}
+
+				// Redundant-command suppression
+				{
+					bool forceResend = zlc.isForceResend();
+					if (ImGui::Checkbox("Force resend", &forceResend)) {
+						zlc.setForceResend(forceResend);
+					}
+					const auto &stats = zlc.suppressionStats();
+					ImGui::Text("Sent: %zu, suppressed: %zu (%.1f %%)", stats.sent, stats.suppressed, 100.0 * stats.suppressionRatio());
+				}
+
+				// Queue time per priority class
+				{
+					for (auto priority : { FujinonZoomLensPriority::EMERGENCY, FujinonZoomLensPriority::MOTION,
+						FujinonZoomLensPriority::CONFIGURATION, FujinonZoomLensPriority::QUERY }) {
+						auto stats = appMsg->zlcScheduler->statistics(priority);
+						ImGui::Text("%-13s queued: %zu, mean: %.0f [us], max: %.0f [us], coalesced: %zu, cancelled: %zu", FujinonZoomLensSchedulerUtil::name(priority),
+							stats.queued, stats.meanQueueUs(), stats.maxQueueUs, stats.coalesced, stats.cancelled);
+					}
+				}
+
 			}
 
 
@@ -377,6 +567,150 @@ bool Application::run(){
             ImGui::End();
         }
 
+// Video
+        {
+            ImGui::Begin("Video");
+            static char videoPath[512] = "";
+            static bool videoPathInitialized = false;
+            if (!videoPathInitialized) {
+                snprintf(videoPath, sizeof(videoPath), "%s", Config::get_instance().params()->videoFile.c_str());
+                videoPathInitialized = true;
+            }
+            ImGui::InputText("File", videoPath, sizeof(videoPath));
+            if (ImGui::Button("Open")) {
+                video->stop();
+                video->open(videoPath);
+            }
+            ImGui::SameLine();
+            if (ImGui::Button("Play")) {
+                video->run();
+            }
+            ImGui::SameLine();
+            if (ImGui::Button("Pause##video")) {
+                video->pause();
+            }
+            ImGui::SameLine();
+            if (ImGui::Button("Stop##video")) {
+                video->stop();
+            }
+
+            if (video->isOpened()) {
+                static bool loop = true;
+                if (ImGui::Checkbox("Loop", &loop)) {
+                    video->setLoop(loop);
+                }
+                ImGui::SameLine();
+                static bool fullRate = false;
+                if (ImGui::Checkbox("Full rate", &fullRate)) {
+                    video->setFullRate(fullRate);
+                }
+                int frame = static_cast<int>(std::max(video->currentFrame(), 0L));
+                if (ImGui::SliderInt("Frame", &frame, 0, static_cast<int>(std::max(video->frameCount() - 1, 0L)))) {
+                    video->seek(frame);
+                }
+                ImGui::Text("Shown: frame %ld, %.1f [ms]", displayedFrameIndex, displayedTimestampMs);
+                auto stats = video->statistics();
+                ImGui::Text("Decoded: %zu (%.1f fps capacity, file %.2f fps), presented: %zu, dropped: %zu, prefetched: %zu",
+                            stats.decoded, stats.decodeFps, video->fps(), stats.presented, stats.dropped, stats.queued);
+                ImGui::Text("Lens: zoom %.0f (x%.2f), focus %.0f (%.2f [m]), iris %.0f",
+                            displayedLens.zoom, displayedLens.zoomRatio, displayedLens.focus, displayedLens.focusMeter, displayedLens.iris);
+                ImGui::Text("Metadata rows written: %zu, dropped: %zu", stats.metadataWritten, stats.metadataDropped);
+                if (stats.undistortionAvailable) {
+                    static bool undistort = false;
+                    if (ImGui::Checkbox("Undistort", &undistort)) {
+                        video->setUndistort(undistort);
+                    }
+                    const UndistortionCacheStats &u = stats.undistortion;
+                    ImGui::Text("Remap tables: %zu (%.1f MB), hits: %zu, misses: %zu, prefetched: %zu, evicted: %zu, build %.1f [ms]",
+                                u.entries, u.bytes / 1048576.0, u.hits, u.misses, u.prefetched, u.evicted, u.meanBuildMs);
+                }
+            }
+            ImGui::End();
+        }
+
+// Calibration
+        {
+            ImGui::Begin("Zoom calibration");
+            static int cameraIndex = 0;
+            ImGui::InputInt("Camera", &cameraIndex);
+            if (ImGui::Button("Calibrate lens")) {
+                auto camera = std::make_unique<LensCameraSource>(*appMsg->zlcScheduler, cameraIndex);
+                if (!camera->isOpened()) {
+                    SPDLOG_ERROR("Failed to open camera {}", cameraIndex);
+                } else if (calibration->setSource(std::move(camera), zlc.profile())) {
+                    calibration->run();
+                }
+            }
+            ImGui::SameLine();
+            static float drift = 3.0f;
+            if (ImGui::Button("Calibrate synthetic")) {
+                // default ZOOM_LUT with the magnification drifted by drift [%], zoomed into lena
+                const FujinonZoomLensProfile &profile = FujinonZoomLensControllerUtil::defaultProfile();
+                std::vector<float> ratios;
+                for (float r : profile.zoomRatio) ratios.push_back(1.0f + (r - 1.0f) * (1.0f + drift / 100.0f));
+                cv::Mat image = cv::imread(Config::get_instance().resourceDirectory() + "/lena.png");
+                if (image.empty()) {
+                    SPDLOG_ERROR("Failed to read lena.png");
+                } else if (calibration->setSource(std::make_unique<SyntheticZoomSource>(image, profile.zoomPosition, ratios, image.size()), profile)) {
+                    calibration->run();
+                }
+            }
+            ImGui::SliderFloat("Synthetic drift [%]", &drift, -10.0f, 10.0f);
+            if (ImGui::Button("Pause##calibration")) {
+                calibration->pause();
+            }
+            ImGui::SameLine();
+            if (ImGui::Button("Stop##calibration")) {
+                calibration->stop();
+            }
+            ImGui::Text("Frames: %zu / %zu, pairs analyzed: %zu", calibration->framesGrabbed(), calibration->stepCount(), calibration->pairsAnalyzed());
+            auto result = calibration->lastResult();
+            if (!result.profileFile.empty()) {
+                ImGui::Text("x%.2f at the tele end, %zu pairs by features / %zu by search, %.0f [ms]",
+                            result.zoomLUT.back().first, result.featurePairs, result.searchPairs, result.elapsedMs);
+                if (result.maxError >= 0.0) ImGui::Text("Max error against ground truth: %.2f [%%]", result.maxError * 100.0);
+                ImGui::Text("Profile: %s", result.profileFile.c_str());
+            }
+            ImGui::End();
+        }
+
+// Lens telemetry
+        {
+            ImGui::Begin("Lens telemetry");
+            static FujinonZoomLensTelemetryPyramid telemetryPyramid;
+            static FujinonZoomLensTelemetryPyramid::Series telemetrySeries;
+            static int telemetryAxis = 1;
+            const FujinonZoomLensTelemetryStore &telemetry = *appMsg->zlcTelemetry;
+            size_t pending = telemetryPyramid.update(telemetry); // a bounded number of new rows per frame
+            ImGui::Text("%zu rows in %s", telemetry.size(), telemetry.fileName().c_str());
+            if (pending > 0) ImGui::Text("Indexing: %zu rows left", pending);
+            ImGui::RadioButton("Iris", &telemetryAxis, 0); ImGui::SameLine();
+            ImGui::RadioButton("Zoom", &telemetryAxis, 1); ImGui::SameLine();
+            ImGui::RadioButton("Focus", &telemetryAxis, 2);
+
+            // x: seconds relative to the last row; only the visible span is read, decimated to about two points per pixel
+            const int64_t originNs = telemetry.timeRange().second;
+            ImPlot::SetNextPlotLimitsX(-60.0, 0.0, ImGuiCond_Once);
+            if (ImPlot::BeginPlot("##telemetry", "time [s]", "position")) {
+                ImPlotLimits limits = ImPlot::GetPlotLimits();
+                telemetryPyramid.query(telemetry, static_cast<size_t>(telemetryAxis), originNs + static_cast<int64_t>(limits.X.Min * 1e9),
+                                       originNs + static_cast<int64_t>(limits.X.Max * 1e9), originNs,
+                                       static_cast<size_t>(std::max(ImGui::GetWindowWidth(), 100.0f)) * 2, telemetrySeries);
+                const int n = static_cast<int>(telemetrySeries.time.size());
+                if (telemetrySeries.level > 0) { // min/max bands
+                    ImPlot::PlotShaded("commanded", telemetrySeries.time.data(), telemetrySeries.commandedMin.data(), telemetrySeries.commandedMax.data(), n);
+                    ImPlot::PlotShaded("actual", telemetrySeries.time.data(), telemetrySeries.actualMin.data(), telemetrySeries.actualMax.data(), n);
+                } else {
+                    ImPlot::PlotLine("commanded", telemetrySeries.time.data(), telemetrySeries.commandedMax.data(), n);
+                    ImPlot::PlotLine("actual", telemetrySeries.time.data(), telemetrySeries.actualMax.data(), n);
+                }
+                ImPlot::EndPlot();
+            }
+            ImGui::Text("%d points (%s)", static_cast<int>(telemetrySeries.time.size()),
+                        telemetrySeries.level > 0 ? "min/max per bucket" : "full resolution");
+            ImGui::End();
+        }
+
         /// Destroy OpenCV windows if exists
         if(selectedShowImageMode == SHOW_IMAGE_MODE::IMGUI) { /// Use ImGui
             cv::destroyAllWindows();
@@ -385,6 +719,9 @@ bool Application::run(){
         static float imguiImageScale = 1.0f; /// image scale for imgui rendering
         DispMsg *md = appMsg->displayMessenger->receive();
         if (md != nullptr) { // texture pool updated
+            displayedFrameIndex = md->frameIndex;
+            displayedTimestampMs = md->timestampMs;
+            displayedLens = md->lens;
             if(selectedShowImageMode == SHOW_IMAGE_MODE::IMGUI){
                 texturePool.clear();
                 for (auto img_in_pool:md->pool) {
@@ -450,13 +787,9 @@ bool Application::run(){
         //    DrawJsonConfig("config", Config::get_instance().getDocument());
         //}
 
-        //{
-        //    Logger::get_instance().logger->flush();
-        //    my_log.AddLog( "%s", Logger::get_instance().oss.str().c_str() );
-        //    Logger::get_instance().oss.str("");
-        //    Logger::get_instance().oss.clear();
-        //    my_log.Draw("Log");
-        //}
+        {
+            my_log.Draw("Log");
+        }
 
         {
             const float DISTANCE = 10.0f;
@@ -565,6 +898,7 @@ bool Application::run(){
     }
 
     appMsg->close();
+    appMsg->zlcMotion->save(Config::get_instance().resultDirectory() + "/lens_motion.json");
 
     return true;
 }
@@ -7,6 +7,8 @@
 #include "Config.h"
 #include "Logger.h"
 #include "FujinonZoomLensCom.h"
+#include "FujinonZoomLensDiscovery.h"
+#include "FujinonZoomLensNetServer.h"
 
 namespace Bench {
     template <typename TimeT = std::chrono::milliseconds, typename F>
@@ -35,35 +37,259 @@ namespace Bench {
 }
 
 
-bool EngineOffline::run() {
+/*
+ * Serial port of the lens: SERIAL_PORT in the config, or the first port answering a probe if it is "auto"
+ */
+static std::string lensPort() {
+    const std::string configured = Config::get_instance().params()->serialPort;
+    if (configured != "auto") return configured;
 
-    worker = std::thread([this] {
-        workerStatus.store(WORKER_STATUS::RUNNING);
+    const auto begin = std::chrono::steady_clock::now();
+    auto lenses = FujinonZoomLensDiscovery::discover();
+    const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - begin);
+    for (auto &lens : lenses) {
+        SPDLOG_INFO("Lens {} found on {}", lens.second, lens.first);
+    }
+    SPDLOG_INFO("Serial port discovery: {} lens(es) in {} [ms]", lenses.size(), elapsed.count());
+    return lenses.empty() ? std::string() : lenses.begin()->first;
+}
 
-		FujinonZoomLensServer server;
+EngineOffline::EngineOffline(AppMsgPtr _appMsg) : Engine(std::move(_appMsg)), paused(false), netInFlight(false), pollInFlight(false), profile(nullptr) {}
 
-		while (true) {
-			auto commandMsg = appMsg->zlcRequestMessenger->receive();
-			if (commandMsg != nullptr) {
-				FujinonZoomLensCommand cmd;
-				cmd.code = commandMsg->code;
-				cmd.data = commandMsg->data;
-				server.runCommand(cmd);
-			}
+EngineOffline::~EngineOffline() {
+    stop();
+}
 
-			if (appMsg->zlcRequestMessenger->isClosed()) {
-				printf("\n## termination requested ##\n");
-				break;
-			}
-		}
+/*
+ * Open the lens and the control server (first run only)
+ */
+bool EngineOffline::openLens() {
+    if (server) return true;
+
+    const std::shared_ptr<const ConfigParams> config = Config::get_instance().params();
+    FujinonZoomLensServerOptions options;
+    options.warmStart = config->lensWarmStart;
+    options.lastStateFile = Config::get_instance().latestResultFile("lens_state.json");
+    options.stateFile = config->resultDirectory + "/lens_state.json";
+    options.printPositions = config->lensPollIntervalMs <= 0; // polled positions go to the lens history
+
+    std::string port = lensPort();
+    if (port.empty()) {
+        SPDLOG_ERROR("No lens found");
+        return false;
+    }
+    port = FujinonZoomLensDiscovery::stablePath(port); // reconnects find the adapter again if it is renumbered
 
+    try {
+        server = std::make_unique<FujinonZoomLensServer>(port, options);
+    } catch (const boost::system::system_error &e) {
+        SPDLOG_ERROR("Failed to open {}: {}", port, e.what());
+        return false;
+    }
+    SPDLOG_INFO("Lens ready in {:.1f} [ms] ({} start)", server->timeToReady(), options.warmStart ? "warm" : "cold");
+    identified();
+
+    // local control server for other tools; its commands share the lens with the GUI
+    if (config->netServerPort > 0 || !config->netServerSocket.empty()) {
+        FujinonZoomLensNetServer::Options netOptions;
+        netOptions.tcpPort = static_cast<unsigned short>(std::max(config->netServerPort, 0));
+        netOptions.unixSocketPath = config->netServerSocket;
+        netOptions.lensCount = 1; // this engine drives one lens, lens 0 to clients; requests for others are INVALID
+        netOptions.onRequest = [this] { appMsg->zlcScheduler->wake(); };
+        try {
+            netServer = std::make_unique<FujinonZoomLensNetServer>(netOptions);
+            SPDLOG_INFO("Lens control server on localhost:{} {}", netServer->tcpPort(), netOptions.unixSocketPath);
+        } catch (const boost::system::system_error &e) {
+            SPDLOG_ERROR("Lens control server not started: {}", e.what());
+        }
+    }
+    return true;
+}
+
+/*
+ * The server (re)identified the lens: what is recorded from now on is converted with its profile,
+ * and the GUI picks it up for its controllers (lensProfile())
+ */
+void EngineOffline::identified() {
+    const FujinonZoomLensProfile *lens = &server->lensProfile();
+    appMsg->zlcHistory->recordProfile(lens, std::chrono::steady_clock::now());
+    appMsg->zlcMotion->recordProfile(*lens);
+    profile.store(lens, std::memory_order_release);
+}
+
+void EngineOffline::work(std::stop_token stopToken) {
+    FujinonZoomLensScheduler &scheduler = *appMsg->zlcScheduler;
+    std::stop_callback wakeOnStop(stopToken, [&scheduler] { scheduler.wake(); });
+
+    // record a completed transaction in the lens history, the motor model and the telemetry, and confirm it to the GUI
+    // (network commands too, which keeps the GUI's view of the lens current).
+    // Setters are confirmed with the acknowledged payload, queries with the reported data;
+    // the lens state is taken to apply halfway through the transaction.
+    auto track = [this](const FujinonZoomLensCommand &cmd, const FujinonZoomLensControllerUtil::FujinonZoomLensResponse &response,
+                        std::chrono::steady_clock::time_point time) {
+        const FujinonZoomLensPayload &data = response.data.empty() ? cmd.data : response.data;
+        appMsg->zlcHistory->record(cmd.code, data, time);
+        appMsg->zlcMotion->record(cmd.code, data, time);
+        appMsg->zlcTelemetry->record(cmd.code, data, time);
+        ZLCMsg confirmation;
+        confirmation.code = cmd.code;
+        confirmation.data = data;
+        appMsg->confirmToGui(confirmation);
+    };
+
+    const std::chrono::milliseconds pollInterval(Config::get_instance().params()->lensPollIntervalMs);
+    std::chrono::steady_clock::time_point lastPoll;
+
+    while (!stopToken.stop_requested()) {
+        if (paused.load()) {
+            workerStatus.store(WORKER_STATUS::PAUSED);
+            paused.wait(true); // commands keep queuing in the scheduler
+            workerStatus.store(WORKER_STATUS::RUNNING);
+            continue;
+        }
+
+        if (!server->isConnected()) {
+            reconnectLens(stopToken);
+            continue;
+        }
+
+        // stops overtake everything, the round robin included
+        FujinonZoomLensNetRequest netStop;
+        while (netServer && netServer->nextStop(0, netStop)) {
+            scheduler.halt([this, netStop](bool ok, const FujinonZoomLensControllerUtil::FujinonZoomLensResponse &response) {
+                netServer->complete(netStop, ok, response);
+            });
+        }
+
+        // network commands enter the scheduler one at a time so that the server's round robin across clients holds
+        FujinonZoomLensNetRequest netRequest;
+        if (netServer && !netInFlight && netServer->next(0, netRequest)) {
+            netInFlight = true;
+            FujinonZoomLensPriority priority = FujinonZoomLensSchedulerUtil::classify(netRequest.cmd.code);
+            FujinonZoomLensCommand cmd = netRequest.cmd;
+            scheduler.push(std::move(cmd), priority,
+                [this, netRequest](bool ok, const FujinonZoomLensControllerUtil::FujinonZoomLensResponse &response) {
+                    netServer->complete(netRequest, ok, response);
+                    netInFlight = false;
+                });
+        }
+
+        // periodic position polls feed the lens history between commands
+        const auto now = std::chrono::steady_clock::now();
+        if (pollInterval.count() > 0 && !pollInFlight && now - lastPoll >= pollInterval) {
+            pollInFlight = true;
+            lastPoll = now;
+            scheduler.push({ 0x31, {} }, FujinonZoomLensPriority::QUERY);
+            scheduler.push({ 0x32, {} }, FujinonZoomLensPriority::QUERY,
+                [this](bool, const FujinonZoomLensControllerUtil::FujinonZoomLensResponse &) { pollInFlight = false; });
+        }
+
+        FujinonZoomLensScheduledCommand next;
+        if (scheduler.pop(next, pollInterval.count() > 0 ? std::min(pollInterval, std::chrono::milliseconds(20)) : std::chrono::milliseconds(20))) {
+            const auto sent = std::chrono::steady_clock::now();
+            if (next.batch) {
+                // a batch or preset, encoded when it was made: all of its commands go out in one write
+                const FujinonZoomLensBatch &batch = *next.batch;
+                std::array<FujinonZoomLensControllerUtil::FujinonZoomLensResponse, FujinonZoomLensBatch::CAPACITY> responses;
+                size_t valid = server->runEncoded(batch.frames.data(), batch.frames.size(),
+                                                  batch.commands.data(), batch.commands.size(), responses.data());
+                if (!server->isConnected()) {
+                    scheduler.requeue(std::move(next)); // sent again once the lens is back
+                    continue;
+                }
+                scheduler.markWritten(server->lastWriteTime());
+                if (next.recall) appMsg->zlcPresets->recordRecall(server->lastWriteTime() - next.enqueued);
+                const auto midpoint = sent + (std::chrono::steady_clock::now() - sent) / 2;
+                for (size_t r = 0, c = 0; r < valid; r++, c++) {
+                    while (batch.commands[c].code != responses[r].code) c++; // commands without a valid reply
+                    track(batch.commands[c], responses[r], midpoint);
+                }
+                if (next.done) next.done(valid == batch.commands.size(),
+                                         valid > 0 ? responses[valid - 1] : FujinonZoomLensControllerUtil::FujinonZoomLensResponse());
+            } else {
+                FujinonZoomLensControllerUtil::FujinonZoomLensResponse response;
+                bool ok = server->runCommand(next.cmd, &response);
+                if (!server->isConnected()) {
+                    scheduler.requeue(std::move(next));
+                    continue;
+                }
+                scheduler.markWritten(server->lastWriteTime());
+                if (ok) track(next.cmd, response, sent + (std::chrono::steady_clock::now() - sent) / 2);
+                if (next.done) next.done(ok, response);
+            }
+        }
+
+        if (scheduler.isClosed()) {
+            printf("\n## termination requested ##\n");
+            break;
+        }
+    }
+}
+
+/*
+ * The lens went away (e.g. the USB-serial adapter was unplugged): retry with exponential backoff,
+ * capped low so the lens is back in control soon after it reappears. Commands keep queuing meanwhile.
+ */
+void EngineOffline::reconnectLens(std::stop_token stopToken) {
+    const auto lost = std::chrono::steady_clock::now();
+    SPDLOG_ERROR("Lens connection lost, reconnecting");
+    std::chrono::milliseconds backoff = RECONNECT_BACKOFF_MIN;
+    auto nextAttempt = lost;
+    while (!stopToken.stop_requested() && !paused.load()) {
+        std::this_thread::sleep_until(nextAttempt);
+        const auto attempt = std::chrono::steady_clock::now();
+        if (server->reconnect()) {
+            identified(); // may be another lens on the same port
+            ZLCMsg reconnected;
+            reconnected.reconnected = true;
+            appMsg->confirmToGui(reconnected);
+            const auto now = std::chrono::steady_clock::now();
+            SPDLOG_INFO("Lens reconnected after {:.0f} [ms] ({:.1f} [ms] to reopen and restore)",
+                        std::chrono::duration<double, std::milli>(now - lost).count(),
+                        std::chrono::duration<double, std::milli>(now - attempt).count());
+            return;
+        }
+        nextAttempt = attempt + backoff;
+        backoff = std::min(backoff * 2, RECONNECT_BACKOFF_MAX);
+    }
+}
+
+bool EngineOffline::run() {
+    if (worker.joinable() && workerStatus.load() != WORKER_STATUS::IDLE) {
+        // resume a paused worker
+        paused.store(false);
+        paused.notify_all();
+        return true;
+    }
+    if (worker.joinable()) worker.join(); // the last run ended by itself
+
+    workerStatus.store(WORKER_STATUS::RUNNING);
+    worker = std::jthread([this](std::stop_token stopToken) {
+        const auto begin = std::chrono::steady_clock::now();
+        if (openLens()) {
+            SPDLOG_INFO("Engine started in {:.1f} [ms]", std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count());
+            work(stopToken);
+        }
         workerStatus.store(WORKER_STATUS::IDLE);
     });
 
-    SPDLOG_DEBUG("Image processing for a single frame done ...");
+    return true;
+}
 
-//    reset();
+bool EngineOffline::pause() {
+    if (!worker.joinable()) return false;
+    paused.store(true);
+    appMsg->zlcScheduler->wake();
+    return true;
+}
 
+bool EngineOffline::stop() {
+    if (!worker.joinable()) return false;
+    worker.request_stop();
+    paused.store(false);
+    paused.notify_all();
+    worker.join();
+    workerStatus.store(WORKER_STATUS::IDLE);
     return true;
 }
 
@@ -72,4 +298,4 @@ bool EngineOffline::reset() {
         worker.join();
     }
     return true;
-}
\ No newline at end of file
+}
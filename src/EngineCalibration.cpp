@@ -0,0 +1,172 @@
+//
+// Created by Hirano Masahiro <masahiro.dll@gmail.com>
+//
+
+#include "Engine.h"
+#include "AppMsg.h"
+#include "Config.h"
+#include "Logger.h"
+#include "FujinonZoomLensProfile.h"
+
+EngineCalibration::EngineCalibration(AppMsgPtr _appMsg, size_t _steps, size_t _analysisThreads, double _maxStepScale)
+    : Engine(std::move(_appMsg)), paused(false), steps(std::max<size_t>(_steps, 2)),
+      analysisThreads(_analysisThreads > 0 ? _analysisThreads : std::max(std::thread::hardware_concurrency(), 1u)),
+      maxStepScale(_maxStepScale), grabbed(0), analyzed(0) {}
+
+EngineCalibration::~EngineCalibration() {
+    stop();
+}
+
+bool EngineCalibration::setSource(std::unique_ptr<CalibrationFrameSource> _source, const FujinonZoomLensProfile &_profile) {
+    if (workerStatus.load() != WORKER_STATUS::IDLE) {
+        SPDLOG_ERROR("Stop the calibration before changing its frame source");
+        return false;
+    }
+    if (worker.joinable()) worker.join();
+    source = std::move(_source);
+    profile = _profile;
+    return true;
+}
+
+void EngineCalibration::work(std::stop_token stopToken) {
+    const auto begin = std::chrono::steady_clock::now();
+
+    struct FramePair {
+        size_t index; // estimates[index]: position index - 1 -> index
+        cv::Mat wider, narrower;
+    };
+    ThreadSafeQueue<FramePair> pairs(analysisThreads * 2);
+    std::vector<ZoomCalibrationUtil::MagnificationEstimate> estimates(steps);
+
+    // analysis runs next to the sweep: the lens takes far longer to move than a pair takes to measure
+    std::vector<std::jthread> analysis;
+    for (size_t t = 0; t < analysisThreads; t++) {
+        analysis.emplace_back([this, &pairs, &estimates] {
+            FramePair pair;
+            while (true) {
+                if (!pairs.pop(pair, std::chrono::milliseconds(50))) {
+                    if (pairs.isClosed()) break;
+                    continue;
+                }
+                estimates[pair.index] = ZoomCalibrationUtil::estimateMagnification(pair.wider, pair.narrower, maxStepScale);
+                analyzed++;
+            }
+        });
+    }
+
+    std::vector<uint16_t> positions(steps);
+    for (size_t i = 0; i < steps; i++) positions[i] = static_cast<uint16_t>(i * 0xFFFF / (steps - 1));
+
+    bool complete = true;
+    cv::Mat previous;
+    for (size_t i = 0; i < steps; i++) {
+        if (paused.load()) {
+            workerStatus.store(WORKER_STATUS::PAUSED);
+            paused.wait(true);
+            workerStatus.store(WORKER_STATUS::RUNNING);
+        }
+        if (stopToken.stop_requested()) {
+            complete = false;
+            break;
+        }
+
+        cv::Mat frame, gray;
+        if (!source->grab(positions[i], frame)) {
+            SPDLOG_ERROR("Calibration: no frame at zoom position {:#06x}", positions[i]);
+            complete = false;
+            break;
+        }
+        if (frame.channels() == 3) cv::cvtColor(frame, gray, cv::COLOR_BGR2GRAY);
+        else gray = frame;
+        grabbed++;
+
+        if (i > 0) pairs.push({ i, previous, gray });
+        previous = gray;
+    }
+    pairs.close(); // analysis threads drain what is queued, then end
+    analysis.clear();
+
+    CalibrationResult r;
+    r.elapsedMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+    if (complete) {
+        double ratio = 1.0, maxError = -1.0;
+        const double wideTruth = source->trueRatio(positions[0]);
+        for (size_t i = 0; i < steps; i++) {
+            if (i > 0) {
+                ratio = std::max(ratio * estimates[i].scale, ratio * 1.0001); // interp() needs ascending ratios
+                if (estimates[i].features) r.featurePairs++;
+                else r.searchPairs++;
+            }
+            r.zoomLUT.emplace_back(static_cast<float>(ratio), static_cast<float>(positions[i]));
+            if (wideTruth > 0.0) {
+                double truth = source->trueRatio(positions[i]) / wideTruth;
+                maxError = std::max(maxError, std::abs(ratio - truth) / truth);
+            }
+        }
+        r.maxError = maxError;
+
+        FujinonZoomLensProfile calibrated = profile;
+        calibrated.setZoomLUT(r.zoomLUT);
+        std::string fileName = Config::get_instance().resultDirectory() + "/" + (calibrated.model.empty() ? std::string("default") : calibrated.model) + "_calibrated.json";
+        if (FujinonZoomLensProfileStore::save(calibrated, fileName)) r.profileFile = fileName;
+        else SPDLOG_ERROR("Failed to write {}", fileName);
+        SPDLOG_INFO("Zoom calibration: {} positions, x{:.2f} at the tele end, {} pairs by features / {} by search, {:.0f} [ms]",
+                    steps, ratio, r.featurePairs, r.searchPairs, r.elapsedMs);
+        if (maxError >= 0.0) SPDLOG_INFO("Zoom calibration: max ratio error {:.2f} [%] against ground truth", maxError * 100.0);
+    }
+
+    std::lock_guard<std::mutex> lock(resultMtx);
+    result = std::move(r);
+}
+
+bool EngineCalibration::run() {
+    if (worker.joinable()) {
+        if (paused.load()) {
+            paused.store(false);
+            paused.notify_all();
+            return true;
+        }
+        if (workerStatus.load() != WORKER_STATUS::IDLE) return false; // a sweep is running
+        worker.join();
+    }
+    if (!source) {
+        SPDLOG_ERROR("No calibration frame source");
+        return false;
+    }
+
+    grabbed = analyzed = 0;
+    workerStatus.store(WORKER_STATUS::RUNNING);
+    worker = std::jthread([this](std::stop_token stopToken) {
+        work(stopToken);
+        workerStatus.store(WORKER_STATUS::IDLE);
+    });
+    return true;
+}
+
+bool EngineCalibration::pause() {
+    if (!worker.joinable()) return false;
+    paused.store(true);
+    return true;
+}
+
+bool EngineCalibration::stop() {
+    if (!worker.joinable()) return false;
+    worker.request_stop();
+    paused.store(false);
+    paused.notify_all();
+    worker.join();
+    workerStatus.store(WORKER_STATUS::IDLE);
+    return true;
+}
+
+bool EngineCalibration::reset() {
+    if (worker.joinable()) {
+        worker.join();
+    }
+    return true;
+}
+
+CalibrationResult EngineCalibration::lastResult() {
+    std::lock_guard<std::mutex> lock(resultMtx);
+    return result;
+}
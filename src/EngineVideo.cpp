@@ -0,0 +1,234 @@
+//
+// Created by Hirano Masahiro <masahiro.dll@gmail.com>
+//
+
+#include <filesystem>
+#include "Engine.h"
+#include "AppMsg.h"
+#include "Config.h"
+#include "Logger.h"
+
+EngineVideo::EngineVideo(AppMsgPtr _appMsg, size_t prefetchFrames)
+    : Engine(std::move(_appMsg)), prefetch(prefetchFrames),
+      paused(false), loop(true), fullRate(false), seekRequest(-1), generation(0), position(-1),
+      frameCountValue(0), fpsValue(0.0), decoded(0), presented(0), dropped(0), decodeNs(0), undistortEnabled(false) {
+    std::string modelFile = Config::get_instance().resourceDirectory() + "/lens_distortion.json";
+    if (distortionModel.load(modelFile)) SPDLOG_INFO("Lens distortion model: {}", modelFile);
+}
+
+EngineVideo::~EngineVideo() {
+    stop();
+}
+
+bool EngineVideo::open(const std::string &fileName) {
+    if (worker.joinable()) {
+        SPDLOG_ERROR("Stop the video before opening {}", fileName);
+        return false;
+    }
+    if (!capture.open(fileName)) {
+        SPDLOG_ERROR("Failed to open {}", fileName);
+        return false;
+    }
+    frameCountValue = static_cast<long>(capture.get(cv::CAP_PROP_FRAME_COUNT));
+    fpsValue = capture.get(cv::CAP_PROP_FPS);
+    if (fpsValue <= 0.0) fpsValue = 30.0; // some containers do not report it
+    position.store(-1);
+    decoded = presented = dropped = 0;
+    decodeNs = 0;
+    SPDLOG_INFO("Video {}: {} frames, {:.2f} fps", fileName, frameCountValue, fpsValue);
+
+    std::string metadataFile = Config::get_instance().resultDirectory() + "/" + std::filesystem::path(fileName).stem().string() + "_lens.csv";
+    metadata = std::make_unique<FujinonZoomLensMetadataWriter>(metadataFile);
+    SPDLOG_INFO("Lens metadata: {}", metadataFile);
+    return true;
+}
+
+/*
+ * Position the capture so that the next read() returns frame.
+ * Backends may land on a keyframe instead, so the position is checked and corrected by decoding forward.
+ */
+bool EngineVideo::seekCapture(long frame) {
+    capture.set(cv::CAP_PROP_POS_FRAMES, static_cast<double>(frame));
+    long landed = static_cast<long>(capture.get(cv::CAP_PROP_POS_FRAMES));
+    if (landed > frame || landed < 0) {
+        capture.set(cv::CAP_PROP_POS_FRAMES, 0.0);
+        landed = 0;
+    }
+    for (; landed < frame; landed++) {
+        if (!capture.grab()) return false;
+    }
+    return true;
+}
+
+void EngineVideo::decode(std::stop_token stopToken) {
+    const double periodMs = 1000.0 / fpsValue;
+    long next = static_cast<long>(capture.get(cv::CAP_PROP_POS_FRAMES));
+    double loopOffsetMs = 0.0;
+    unsigned currentGeneration = generation.load();
+
+    while (!stopToken.stop_requested()) {
+        long target = seekRequest.exchange(-1);
+        if (target >= 0) {
+            currentGeneration = generation.load();
+            if (seekCapture(target)) next = target;
+            loopOffsetMs = -target * periodMs; // presentation restarts at 0
+        }
+
+        VideoFrame frame;
+        const auto begin = std::chrono::steady_clock::now();
+        bool ok = capture.read(frame.image);
+        decodeNs += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count();
+        if (!ok || frame.image.empty()) {
+            if (loop.load() && next > 0) {
+                // continue from the first frame without starting a new presentation clock
+                loopOffsetMs += next * periodMs;
+                seekCapture(0);
+                next = 0;
+            } else {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10)); // end of file; wait for a seek or stop
+            }
+            continue;
+        }
+
+        frame.index = next++;
+        frame.timestampMs = frame.index * periodMs;
+        frame.presentationMs = loopOffsetMs + frame.timestampMs;
+        frame.generation = currentGeneration;
+        decoded++;
+        if (!prefetch.push(std::move(frame))) break; // closed
+    }
+}
+
+void EngineVideo::present(std::stop_token stopToken) {
+    const auto period = std::chrono::duration<double, std::milli>(1000.0 / fpsValue);
+    bool clockValid = false;
+    unsigned clockGeneration = 0;
+    std::chrono::steady_clock::time_point start; // wall time of presentation 0
+
+    while (!stopToken.stop_requested()) {
+        if (paused.load()) {
+            workerStatus.store(WORKER_STATUS::PAUSED);
+            paused.wait(true);
+            workerStatus.store(WORKER_STATUS::RUNNING);
+            clockValid = false;
+            continue;
+        }
+
+        VideoFrame frame;
+        if (!prefetch.pop(frame, std::chrono::milliseconds(20))) continue;
+        if (frame.generation != generation.load()) continue; // decoded before a seek
+
+        const auto now = std::chrono::steady_clock::now();
+        if (!clockValid || frame.generation != clockGeneration) {
+            start = now - std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double, std::milli>(frame.presentationMs));
+            clockGeneration = frame.generation;
+            clockValid = true;
+        }
+        auto shown = now;
+        if (!fullRate.load()) {
+            shown = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double, std::milli>(frame.presentationMs));
+            if (now > shown + period) {
+                dropped++;
+                continue;
+            }
+        }
+
+        // tagged for the time it is due, so the undistortion runs in the wait before it
+        FujinonZoomLensFrameTag lens = appMsg->zlcHistory->tag(shown);
+        cv::Mat undistorted;
+        if (undistortEnabled.load() && !distortionModel.empty() && lens.zoom >= 0.0) {
+            if (!undistortion || undistortion->frameSize() != frame.image.size()) {
+                std::lock_guard<std::mutex> lock(undistortionMtx);
+                undistortion = std::make_unique<UndistortionCache>(distortionModel, frame.image.size());
+            }
+            if (lens.zoomCommanded >= 0) undistortion->prefetch(lens.zoom, lens.zoomCommanded); // zoom moving: tables ahead of it
+            undistortion->undistort(frame.image, undistorted, lens.zoom);
+        }
+        if (!fullRate.load()) std::this_thread::sleep_until(shown);
+
+        auto md = appMsg->displayMessenger->prepareMsg();
+        md->pool["video"] = frame.image;
+        if (!undistorted.empty()) md->pool["undistorted"] = undistorted;
+        else md->pool.erase("undistorted"); // the message is recycled from an earlier send
+        md->frameIndex = frame.index;
+        md->timestampMs = frame.timestampMs;
+        md->lens = lens;
+        if (metadata) metadata->add(frame.index, frame.timestampMs, shown, md->lens);
+        appMsg->displayMessenger->send();
+        position.store(frame.index);
+        presented++;
+    }
+}
+
+bool EngineVideo::run() {
+    if (worker.joinable()) {
+        paused.store(false);
+        paused.notify_all();
+        return true;
+    }
+    if (!capture.isOpened()) {
+        SPDLOG_ERROR("No video opened");
+        return false;
+    }
+
+    prefetch.reopen();
+    if (position.load() >= 0) seek(position.load() + 1); // frames prefetched by the last run were discarded
+    workerStatus.store(WORKER_STATUS::RUNNING);
+    decoder = std::jthread([this](std::stop_token stopToken) { decode(stopToken); });
+    worker = std::jthread([this](std::stop_token stopToken) {
+        present(stopToken);
+        workerStatus.store(WORKER_STATUS::IDLE);
+    });
+    return true;
+}
+
+bool EngineVideo::pause() {
+    if (!worker.joinable()) return false;
+    paused.store(true);
+    return true;
+}
+
+bool EngineVideo::stop() {
+    if (!worker.joinable()) return false;
+    worker.request_stop();
+    decoder.request_stop();
+    paused.store(false);
+    paused.notify_all();
+    prefetch.close(); // releases a decoder blocked on a full queue
+    worker.join();
+    decoder.join();
+    workerStatus.store(WORKER_STATUS::IDLE);
+    return true;
+}
+
+bool EngineVideo::reset() {
+    if (worker.joinable()) {
+        worker.join();
+    }
+    return true;
+}
+
+void EngineVideo::seek(long frame) {
+    if (frameCountValue > 0) frame = std::min(frame, frameCountValue - 1);
+    generation++;
+    seekRequest.store(std::max(frame, 0L));
+    prefetch.clear(); // frames decoded before the seek; also unblocks the decoder
+}
+
+VideoSourceStats EngineVideo::statistics() {
+    VideoSourceStats stats;
+    stats.decoded = decoded.load();
+    stats.presented = presented.load();
+    stats.dropped = dropped.load();
+    stats.queued = prefetch.size();
+    long long ns = decodeNs.load();
+    stats.decodeFps = ns > 0 ? stats.decoded * 1e9 / ns : 0.0;
+    if (metadata) {
+        stats.metadataWritten = metadata->written();
+        stats.metadataDropped = metadata->dropped();
+    }
+    stats.undistortionAvailable = !distortionModel.empty();
+    std::lock_guard<std::mutex> lock(undistortionMtx);
+    if (undistortion) stats.undistortion = undistortion->statistics();
+    return stats;
+}
@@ -0,0 +1,148 @@
+//
+// Created by Hirano Masahiro <masahiro.dll@gmail.com>
+//
+// Probes pseudo terminals with FujinonZoomLensDiscovery: one served by FujinonZoomLensSimulator on the master side,
+// one that never answers. POSIX only.
+// Registered with CTest; exits non-zero if any check fails.
+//
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "FujinonZoomLensDiscovery.h"
+#include "FujinonZoomLensSimulator.h"
+
+namespace {
+
+    int failures = 0;
+    int checks = 0;
+
+#define CHECK(cond) do { checks++; if (!(cond)) { failures++; std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond ") failed" << std::endl; } } while (0)
+
+    /*
+     * Pseudo terminal pair: discovery opens the slave path like a serial port, the test holds the master.
+     * With serve(), a simulated lens answers on the master side until the pair is destroyed.
+     */
+    class Pty {
+    public:
+        Pty() {
+            master = posix_openpt(O_RDWR | O_NOCTTY);
+            if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) return;
+            const char *name = ptsname(master);
+            if (name != nullptr) slave = name;
+        }
+
+        ~Pty() {
+            running = false;
+            if (server.joinable()) server.join();
+            if (master >= 0) close(master);
+        }
+
+        bool ok() const { return master >= 0 && !slave.empty(); }
+
+        void serve(FujinonZoomLensSimulator &lens) {
+            running = true;
+            server = std::thread([this, &lens] {
+                std::vector<uchar> rx(64), tx;
+                while (running) {
+                    pollfd fd{ master, POLLIN, 0 };
+                    if (poll(&fd, 1, 10) <= 0 || !(fd.revents & POLLIN)) continue;
+                    const ssize_t n = read(master, rx.data(), rx.size());
+                    if (n <= 0) continue;
+                    tx.clear();
+                    lens.handle(rx.data(), static_cast<size_t>(n), tx);
+                    if (!tx.empty() && write(master, tx.data(), tx.size()) != static_cast<ssize_t>(tx.size())) return;
+                }
+            });
+        }
+
+        std::string slave;
+
+    private:
+        int master = -1;
+        std::thread server;
+        std::atomic<bool> running{ false };
+    };
+
+    using Clock = std::chrono::steady_clock;
+
+    double elapsedMs(Clock::time_point begin) {
+        return std::chrono::duration<double, std::milli>(Clock::now() - begin).count();
+    }
+
+    void testAnswering() {
+        FujinonZoomLensSimulator lens("HA23x7.6", "12345678");
+        Pty pty;
+        CHECK(pty.ok());
+        if (!pty.ok()) return;
+        pty.serve(lens);
+
+        const auto deadline = std::chrono::milliseconds(1000);
+        const auto begin = Clock::now();
+        auto found = FujinonZoomLensDiscovery::probe({ pty.slave }, deadline);
+        const double ms = elapsedMs(begin);
+        CHECK(found.size() == 1);
+        CHECK(found.count(pty.slave) == 1 && found[pty.slave] == "HA23x7.6");
+        CHECK(ms < deadline.count() / 2.0); // every port answered: no waiting for the deadline
+    }
+
+    void testSilent() {
+        Pty pty; // nobody reads the master
+        CHECK(pty.ok());
+        if (!pty.ok()) return;
+
+        const auto deadline = std::chrono::milliseconds(100);
+        const auto begin = Clock::now();
+        auto found = FujinonZoomLensDiscovery::probe({ pty.slave }, deadline);
+        const double ms = elapsedMs(begin);
+        CHECK(found.empty());
+        CHECK(ms >= deadline.count() * 0.9);
+        CHECK(ms < deadline.count() * 5.0);
+    }
+
+    void testMixed() {
+        FujinonZoomLensSimulator first("XA20sx8.5", "00000001"), second("ZA17x7.6", "00000002");
+        Pty a, silent, b;
+        CHECK(a.ok() && silent.ok() && b.ok());
+        if (!a.ok() || !silent.ok() || !b.ok()) return;
+        a.serve(first);
+        b.serve(second);
+
+        // all probed in one round: the answering ports are found, the silent one and a missing path are dropped
+        const auto deadline = std::chrono::milliseconds(200);
+        const auto begin = Clock::now();
+        auto found = FujinonZoomLensDiscovery::probe({ a.slave, silent.slave, "/dev/nonexistent-lens-port", b.slave }, deadline);
+        const double ms = elapsedMs(begin);
+        CHECK(found.size() == 2);
+        CHECK(found[a.slave] == "XA20sx8.5");
+        CHECK(found[b.slave] == "ZA17x7.6");
+        CHECK(found.count(silent.slave) == 0);
+        CHECK(ms < deadline.count() * 5.0);
+    }
+
+    void testNothing() {
+        CHECK(FujinonZoomLensDiscovery::probe({}).empty());
+        CHECK(FujinonZoomLensDiscovery::probe({ "/dev/nonexistent-lens-port" }).empty());
+    }
+}
+
+int main() {
+    const auto begin = std::chrono::steady_clock::now();
+
+    testAnswering();
+    testSilent();
+    testMixed();
+    testNothing();
+
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+    std::cout << checks - failures << "/" << checks << " checks passed in " << ms << " [ms]" << std::endl;
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,218 @@
+//
+// Created by Hirano Masahiro <masahiro.dll@gmail.com>
+//
+// Fits FujinonZoomLensMotionModel to synthetic trapezoidal moves and checks the recovered velocity, acceleration
+// and dead time, and the arrival it predicts.
+// Registered with CTest; exits non-zero if any check fails.
+//
+
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <utility>
+#include <vector>
+
+#include "FujinonZoomLensMotion.h"
+
+namespace {
+
+    int failures = 0;
+    int checks = 0;
+
+#define CHECK(cond) do { checks++; if (!(cond)) { failures++; std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond ") failed" << std::endl; } } while (0)
+
+    using Clock = std::chrono::steady_clock;
+
+    bool near(double actual, double expected, double relative) {
+        return std::abs(actual - expected) <= relative * std::abs(expected);
+    }
+
+    /* A lens that is not the defaults: slower, gentler, with a longer dead time */
+    FujinonZoomLensMotionParams truth() {
+        FujinonZoomLensMotionParams p;
+        p.velocity = 20000.0;
+        p.acceleration = 80000.0;
+        p.deadTime = 0.05;
+        return p;
+    }
+
+    /* Polls every interval from the command until a few after the arrival, as (s since the command, distance covered) */
+    std::vector<std::pair<double, double>> polls(const FujinonZoomLensMotionParams &p, double distance, double interval) {
+        std::vector<std::pair<double, double>> samples;
+        const double end = p.duration(distance) + 3 * interval;
+        for (double t = interval; t < end; t += interval) samples.emplace_back(t, std::round(p.travel(t, distance)));
+        return samples;
+    }
+
+    Clock::time_point at(Clock::time_point origin, double seconds) {
+        return origin + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+    }
+
+    FujinonZoomLensPayload position(int v) {
+        return { static_cast<uchar>(v / 256), static_cast<uchar>(v % 256) };
+    }
+
+    void testProfile() {
+        const FujinonZoomLensMotionParams p = truth();
+        // cruising: v^2 / a = 5000 positions to reach the top velocity and stop
+        CHECK(p.travel(0.0, 40000.0) == 0.0);
+        CHECK(p.travel(p.deadTime, 40000.0) == 0.0);
+        CHECK(near(p.travel(p.deadTime + 0.25, 40000.0), 2500.0, 1e-9)); // end of the acceleration
+        CHECK(near(p.travel(p.deadTime + 1.0, 40000.0), 2500.0 + 0.75 * 20000.0, 1e-9));
+        CHECK(near(p.duration(40000.0), 0.05 + 2.0 + 0.25, 1e-9));
+        CHECK(p.travel(p.duration(40000.0), 40000.0) == 40000.0);
+        // too short to reach the top velocity: a triangle
+        CHECK(near(p.duration(2000.0), 0.05 + 2.0 * std::sqrt(2000.0 / 80000.0), 1e-9));
+        CHECK(near(p.travel(p.deadTime + std::sqrt(2000.0 / 80000.0), 2000.0), 1000.0, 1e-9));
+    }
+
+    void testFit() {
+        const FujinonZoomLensMotionParams p = truth();
+        const FujinonZoomLensMotionParams defaults;
+        { // a long move tells all three
+            const double distance = 40000.0;
+            const FujinonZoomLensMotionParams f = FujinonZoomLensMotionModel::fit(defaults, polls(p, distance, 0.02), distance);
+            CHECK(near(f.velocity, p.velocity, 0.02));
+            CHECK(near(f.acceleration, p.acceleration, 0.05));
+            CHECK(std::abs(f.deadTime - p.deadTime) < 0.005);
+            CHECK(std::abs(f.duration(distance) - p.duration(distance)) < 0.01);
+        }
+        { // polled as slowly as the lens worker does when busy
+            const double distance = 60000.0;
+            const FujinonZoomLensMotionParams f = FujinonZoomLensMotionModel::fit(defaults, polls(p, distance, 0.1), distance);
+            CHECK(near(f.velocity, p.velocity, 0.05));
+            CHECK(std::abs(f.duration(distance) - p.duration(distance)) < 0.05);
+        }
+        { // a short move never cruises: acceleration and dead time, the velocity is left alone
+            const double distance = 3000.0;
+            const FujinonZoomLensMotionParams f = FujinonZoomLensMotionModel::fit(defaults, polls(p, distance, 0.01), distance);
+            CHECK(f.velocity * f.velocity / f.acceleration >= distance); // not taken for a cruise (observe() keeps the velocity)
+            CHECK(near(f.acceleration, p.acceleration, 0.05));
+            CHECK(std::abs(f.deadTime - p.deadTime) < 0.005);
+        }
+        { // a fit keeps the counters of the parameters it starts from
+            FujinonZoomLensMotionParams initial;
+            initial.moves = 7;
+            initial.cruises = 3;
+            const FujinonZoomLensMotionParams f = FujinonZoomLensMotionModel::fit(initial, polls(p, 40000.0, 0.02), 40000.0);
+            CHECK(f.moves == 7 && f.cruises == 3);
+        }
+    }
+
+    void testSingular() {
+        const double distance = 40000.0;
+        const FujinonZoomLensMotionParams defaults;
+        const FujinonZoomLensMotionParams p = truth();
+        auto unchanged = [&defaults](const FujinonZoomLensMotionParams &f) {
+            return f.velocity == defaults.velocity && f.acceleration == defaults.acceleration && f.deadTime == defaults.deadTime;
+        };
+        { // every poll on the cruise, by both the lens and the parameters: acceleration and dead time only shift the line
+            FujinonZoomLensMotionParams initial = p;
+            initial.acceleration = 100000.0;
+            initial.deadTime = 0.04;
+            std::vector<std::pair<double, double>> samples;
+            for (double t = 0.5; t < 1.5; t += 0.02) samples.emplace_back(t, std::round(p.travel(t, distance)));
+            const FujinonZoomLensMotionParams f = FujinonZoomLensMotionModel::fit(initial, samples, distance);
+            CHECK(f.velocity == initial.velocity && f.acceleration == initial.acceleration && f.deadTime == initial.deadTime);
+        }
+        { // polls before the modelled start of the motion: the travel depends on none of the parameters
+            const std::vector<std::pair<double, double>> samples = { { 0.01, 500.0 }, { 0.02, 900.0 } };
+            CHECK(unchanged(FujinonZoomLensMotionModel::fit(defaults, samples, distance)));
+        }
+        { // no polls at all
+            CHECK(unchanged(FujinonZoomLensMotionModel::fit(defaults, {}, distance)));
+        }
+        { // a single poll, at the target: only time is rescaled, to arrive by then
+            const double t = p.duration(distance);
+            const FujinonZoomLensMotionParams f = FujinonZoomLensMotionModel::fit(defaults, { { t, distance } }, distance);
+            CHECK(std::isfinite(f.velocity) && std::isfinite(f.acceleration) && std::isfinite(f.deadTime));
+            CHECK(f.duration(distance) <= t + 1e-9);
+            CHECK(f.deadTime == defaults.deadTime);
+        }
+        { // two polls cannot pin three parameters, but what comes out stays in range
+            const std::vector<std::pair<double, double>> samples = { { 1.0, p.travel(1.0, distance) }, { 3.0, distance } };
+            const FujinonZoomLensMotionParams f = FujinonZoomLensMotionModel::fit(defaults, samples, distance);
+            CHECK(std::isfinite(f.velocity) && std::isfinite(f.acceleration) && std::isfinite(f.deadTime));
+            CHECK(f.velocity >= 100.0 && f.velocity <= 1e6);
+            CHECK(f.deadTime >= 0.0 && f.deadTime <= FujinonZoomLensMotionModel::MAX_DEAD_TIME);
+        }
+    }
+
+    void testModel() {
+        // zoom moves back and forth, commanded from rest and polled every 20 ms, as the lens worker records them
+        const FujinonZoomLensMotionParams p = truth();
+        const size_t zoom = 1;
+        const double interval = 0.02;
+        FujinonZoomLensMotionModel model;
+        const Clock::time_point origin = Clock::now();
+        double now = 0.0;
+        int at0 = 0x0800;
+        model.record(0x31, position(at0), at(origin, now));
+
+        const int targets[] = { 0xF000, 0x1000, 0xC000, 0x2000, 0xE800, 0x0800, 0x9000, 0x1800 };
+        for (int to : targets) {
+            now += 0.5;
+            const Clock::time_point start = at(origin, now);
+            model.record(0x21, position(to), start);
+            const double distance = std::abs(to - at0);
+            for (double t = interval; t < p.duration(distance) + 2 * interval; t += interval) {
+                const double covered = std::round(p.travel(t, distance));
+                model.record(0x31, position(static_cast<int>(to > at0 ? at0 + covered : at0 - covered)), at(origin, now + t));
+            }
+            now += p.duration(distance) + 2 * interval;
+            at0 = to;
+        }
+
+        const FujinonZoomLensMotionParams fitted = model.params(zoom);
+        CHECK(fitted.moves == std::size(targets));
+        CHECK(fitted.cruises == std::size(targets));
+        CHECK(near(fitted.velocity, p.velocity, 0.05));
+        CHECK(near(fitted.acceleration, p.acceleration, 0.1));
+        CHECK(std::abs(fitted.deadTime - p.deadTime) < 0.01);
+        CHECK(model.params(0).moves == 0); // other axes untouched
+
+        // the next move: arrival as the lens will do it, and positions in between
+        now += 0.5;
+        const int to = 0xD000;
+        const double distance = std::abs(to - at0);
+        const Clock::time_point start = at(origin, now);
+        model.record(0x21, position(to), start);
+        const double predicted = std::chrono::duration<double>(model.arrival(zoom) - start).count();
+        CHECK(std::abs(predicted - p.duration(distance)) < 0.02);
+        const double midway = p.deadTime + p.duration(distance) / 2.0;
+        CHECK(std::abs(model.position(zoom, at(origin, now + midway)) - (at0 + p.travel(midway, distance))) < 0.02 * distance);
+        CHECK(model.position(zoom, at(origin, now + p.duration(distance) + 1.0)) == to);
+    }
+
+    void testUnfitted() {
+        // short moves and moves commanded on the way are not fitted
+        FujinonZoomLensMotionModel model;
+        const Clock::time_point origin = Clock::now();
+        model.record(0x32, position(0x4000), origin);
+        model.record(0x22, position(0x4100), at(origin, 0.1)); // shorter than MIN_FIT_DISTANCE
+        model.record(0x32, position(0x4100), at(origin, 0.3));
+        CHECK(model.params(2).moves == 0);
+
+        model.record(0x22, position(0xF000), at(origin, 1.0));
+        model.record(0x32, position(0x4200), at(origin, 1.1));
+        model.record(0x22, position(0x1000), at(origin, 1.2)); // still moving
+        for (double t = 0.02; t < 4.0; t += 0.02) {
+            model.record(0x32, position(0x1000), at(origin, 1.2 + t));
+        }
+        CHECK(model.params(2).moves == 0);
+    }
+}
+
+int main() {
+    const auto begin = std::chrono::steady_clock::now();
+
+    testProfile();
+    testFit();
+    testSingular();
+    testModel();
+    testUnfitted();
+
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+    std::cout << checks - failures << "/" << checks << " checks passed in " << ms << " [ms]" << std::endl;
+    return failures == 0 ? 0 : 1;
+}
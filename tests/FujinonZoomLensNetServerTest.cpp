@@ -0,0 +1,302 @@
+//
+// Created by Hirano Masahiro <masahiro.dll@gmail.com>
+//
+// Connects two clients to FujinonZoomLensNetServer over a Unix domain socket, with a simulated lens behind the server,
+// and checks the round robin across clients, axis leases, the per-client token bucket and stop requests. POSIX only.
+// Registered with CTest; exits non-zero if any check fails.
+//
+
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "FujinonZoomLensNetServer.h"
+#include "FujinonZoomLensSimulator.h"
+
+namespace {
+
+    int failures = 0;
+    int checks = 0;
+
+#define CHECK(cond) do { checks++; if (!(cond)) { failures++; std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond ") failed" << std::endl; } } while (0)
+
+    using TYPE = FujinonZoomLensNetProtocol::TYPE;
+    using STATUS = FujinonZoomLensNetProtocol::STATUS;
+
+    /*
+     * Lens worker of the tests: takes requests from the server (stops first), runs them through the simulator
+     * and completes them with its reply, as the engine does. Serves only while serving is set.
+     */
+    class Lens {
+    public:
+        explicit Lens(FujinonZoomLensNetServer &_server) : server(_server) {
+            worker = std::thread([this] { loop(); });
+        }
+
+        ~Lens() {
+            running = false;
+            worker.join();
+        }
+
+        /* Ids of the requests served, in order */
+        std::vector<uint16_t> served() {
+            std::lock_guard<std::mutex> lock(mtx);
+            return log;
+        }
+
+        std::atomic<bool> serving{ false };
+
+    private:
+        void loop() {
+            FujinonZoomLensControllerUtil::FujinonZoomLensFrameParser parser;
+            std::vector<uchar> replies;
+            while (running) {
+                FujinonZoomLensNetRequest request;
+                FujinonZoomLensControllerUtil::FujinonZoomLensResponse response;
+                if (serving && server.nextStop(0, request)) { // nothing queued in this worker to overtake
+                    served(request);
+                    server.complete(request, true, response);
+                    continue;
+                }
+                if (!serving || !server.next(0, request)) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                    continue;
+                }
+                served(request);
+                const std::vector<uchar> frame = FujinonZoomLensControllerUtil::encodeCommand(request.cmd.code, request.cmd.data);
+                replies.clear();
+                lens.handle(frame.data(), frame.size(), replies);
+                parser.push(replies.data(), replies.size());
+                const bool ok = parser.next(response) && response.code == request.cmd.code;
+                server.complete(request, ok, response);
+            }
+        }
+
+        void served(const FujinonZoomLensNetRequest &request) {
+            std::lock_guard<std::mutex> lock(mtx);
+            log.push_back(request.id);
+        }
+
+        FujinonZoomLensNetServer &server;
+        FujinonZoomLensSimulator lens;
+        std::vector<uint16_t> log;
+        std::mutex mtx;
+        std::atomic<bool> running{ true };
+        std::thread worker;
+    };
+
+    struct Reply {
+        STATUS status;
+        uint16_t id;
+        uchar code;
+        FujinonZoomLensPayload data;
+    };
+
+    /* Blocking client of the server protocol */
+    class Client {
+    public:
+        explicit Client(const std::string &path) : socket(io) {
+            socket.connect(boost::asio::local::stream_protocol::endpoint(path));
+        }
+
+        void send(TYPE type, uint16_t id, uchar code, const FujinonZoomLensPayload &data = {}, uchar lens = 0) {
+            const std::vector<uchar> message = FujinonZoomLensNetProtocol::encode(static_cast<uchar>(type), id, lens, code, data);
+            boost::asio::write(socket, boost::asio::buffer(message));
+        }
+
+        Reply receive() {
+            std::array<uchar, FujinonZoomLensNetProtocol::HEADER_SIZE> header;
+            boost::asio::read(socket, boost::asio::buffer(header));
+            Reply reply{ static_cast<STATUS>(header[1]), static_cast<uint16_t>(header[2] << 8 | header[3]), header[5], {} };
+            std::vector<uchar> data(header[6]);
+            boost::asio::read(socket, boost::asio::buffer(data));
+            for (uchar b : data) reply.data.push_back(b);
+            return reply;
+        }
+
+        /* Send one request and wait for its reply */
+        Reply request(TYPE type, uint16_t id, uchar code, const FujinonZoomLensPayload &data = {}) {
+            send(type, id, code, data);
+            return receive();
+        }
+
+    private:
+        boost::asio::io_service io;
+        boost::asio::local::stream_protocol::socket socket;
+    };
+
+    std::string socketPath() {
+        const std::string path = (std::filesystem::temp_directory_path() / "fujinon-zoom-lens-test-net.sock").string();
+        std::filesystem::remove(path);
+        return path;
+    }
+
+    FujinonZoomLensNetServer::Options options(const std::string &path) {
+        FujinonZoomLensNetServer::Options o;
+        o.tcpPort = 0;
+        o.unixSocketPath = path;
+        o.rateLimit = 10000.0;
+        o.burst = 1000.0;
+        return o;
+    }
+
+    bool waitFor(const std::function<bool()> &done, std::chrono::seconds timeout) {
+        const auto deadline = std::chrono::steady_clock::now() + timeout;
+        while (!done()) {
+            if (std::chrono::steady_clock::now() > deadline) return false;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return true;
+    }
+
+    void testRoundRobin() {
+        const std::string path = socketPath();
+        FujinonZoomLensNetServer server(options(path));
+        Lens lens(server);
+        Client chatty(path), quiet(path);
+
+        // both queue while the lens is busy elsewhere: 20 and 5 queries
+        for (uint16_t i = 0; i < 20; i++) chatty.send(TYPE::COMMAND, 100 + i, 0x31);
+        for (uint16_t i = 0; i < 5; i++) quiet.send(TYPE::COMMAND, 200 + i, 0x32);
+        CHECK(waitFor([&server] { return server.statistics().accepted == 25; }, std::chrono::seconds(10)));
+        lens.serving = true;
+
+        size_t ok = 0;
+        for (uint16_t i = 0; i < 5; i++) {
+            Reply reply = quiet.receive();
+            if (reply.status == STATUS::OK && reply.id == 200 + i && reply.code == 0x32 && reply.data.size() == 2) ok++;
+        }
+        for (uint16_t i = 0; i < 20; i++) {
+            Reply reply = chatty.receive();
+            if (reply.status == STATUS::OK && reply.id == 100 + i && reply.code == 0x31 && reply.data.size() == 2) ok++;
+        }
+        CHECK(ok == 25); // every reply, in the order of each client
+
+        // the quiet client waited for one command of the chatty one at a time, not for all of them
+        const std::vector<uint16_t> served = lens.served();
+        CHECK(served.size() == 25);
+        if (served.size() == 25) {
+            size_t quietServed = 0;
+            for (size_t i = 0; i < 10; i++) {
+                if (served[i] >= 200) quietServed++;
+                if (i > 0) CHECK((served[i] >= 200) != (served[i - 1] >= 200));
+            }
+            CHECK(quietServed == 5);
+        }
+        CHECK(server.statistics().completed == 25);
+    }
+
+    void testLeases() {
+        const std::string path = socketPath();
+        FujinonZoomLensNetServer server(options(path));
+        Lens lens(server);
+        lens.serving = true;
+        Client owner(path), other(path);
+
+        CHECK(owner.request(TYPE::ACQUIRE_LEASE, 1, 0x21, { 0x27, 0x10 }).status == STATUS::OK); // 10 s
+        CHECK(other.request(TYPE::COMMAND, 2, 0x21, { 0x40, 0x00 }).status == STATUS::AXIS_LEASED);
+        CHECK(other.request(TYPE::ACQUIRE_LEASE, 3, 0x21, { 0x27, 0x10 }).status == STATUS::AXIS_LEASED);
+        CHECK(other.request(TYPE::COMMAND, 4, 0x22, { 0x40, 0x00 }).status == STATUS::OK); // another axis
+        CHECK(other.request(TYPE::COMMAND, 5, 0x31).status == STATUS::OK); // queries are not leased
+        CHECK(owner.request(TYPE::COMMAND, 6, 0x21, { 0x40, 0x00 }).status == STATUS::OK);
+        CHECK(other.request(TYPE::RELEASE_LEASE, 7, 0x21).status == STATUS::OK); // not the owner: no effect
+        CHECK(other.request(TYPE::COMMAND, 8, 0x21, { 0x40, 0x00 }).status == STATUS::AXIS_LEASED);
+        CHECK(owner.request(TYPE::RELEASE_LEASE, 9, 0x21).status == STATUS::OK);
+        CHECK(other.request(TYPE::COMMAND, 10, 0x21, { 0x50, 0x00 }).status == STATUS::OK);
+
+        // a lease expires
+        CHECK(owner.request(TYPE::ACQUIRE_LEASE, 11, 0x20, { 0x00, 0x05 }).status == STATUS::OK); // 5 ms
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        CHECK(other.request(TYPE::COMMAND, 12, 0x20, { 0x10, 0x00 }).status == STATUS::OK);
+
+        CHECK(other.request(TYPE::ACQUIRE_LEASE, 13, 0x31, { 0x27, 0x10 }).status == STATUS::INVALID); // not an axis
+        CHECK(other.request(TYPE::COMMAND, 14, 0x21, { 0x40 }).status == STATUS::INVALID); // short position
+        other.send(TYPE::COMMAND, 15, 0x31, {}, 1); // no such lens
+        const Reply wrongLens = other.receive();
+        CHECK(wrongLens.status == STATUS::INVALID && wrongLens.id == 15);
+        CHECK(server.statistics().leaseRejected == 3);
+
+        // and goes with its owner
+        {
+            Client gone(path);
+            CHECK(gone.request(TYPE::ACQUIRE_LEASE, 16, 0x22, { 0x27, 0x10 }).status == STATUS::OK);
+        }
+        CHECK(waitFor([&other] { return other.request(TYPE::COMMAND, 17, 0x22, { 0x20, 0x00 }).status == STATUS::OK; }, std::chrono::seconds(10)));
+    }
+
+    void testRateLimit() {
+        const std::string path = socketPath();
+        FujinonZoomLensNetServer::Options o = options(path);
+        o.rateLimit = 1.0;
+        o.burst = 5.0;
+        FujinonZoomLensNetServer server(o);
+        Lens lens(server);
+        lens.serving = true;
+        Client flooding(path), polite(path);
+
+        for (uint16_t i = 0; i < 12; i++) flooding.send(TYPE::COMMAND, i, 0x31);
+        size_t ok = 0, limited = 0;
+        for (int i = 0; i < 12; i++) {
+            const Reply reply = flooding.receive();
+            if (reply.status == STATUS::OK) ok++;
+            if (reply.status == STATUS::RATE_LIMITED) limited++;
+        }
+        CHECK(ok == 5 && limited == 7); // the burst, then rejected until tokens come back
+
+        // the other client has a bucket of its own
+        for (uint16_t i = 0; i < 5; i++) CHECK(polite.request(TYPE::COMMAND, 100 + i, 0x32).status == STATUS::OK);
+        CHECK(polite.request(TYPE::COMMAND, 105, 0x32).status == STATUS::RATE_LIMITED);
+        CHECK(server.statistics().rateLimited == 8);
+    }
+
+    void testStop() {
+        const std::string path = socketPath();
+        FujinonZoomLensNetServer server(options(path));
+        Lens lens(server);
+        Client mover(path), stopper(path);
+
+        CHECK(mover.request(TYPE::ACQUIRE_LEASE, 1, 0x21, { 0x27, 0x10 }).status == STATUS::OK);
+        for (uint16_t i = 0; i < 3; i++) mover.send(TYPE::COMMAND, 10 + i, 0x21, { static_cast<uchar>(0x10 * i), 0x00 });
+        mover.send(TYPE::COMMAND, 13, 0x31);
+        mover.send(TYPE::COMMAND, 14, 0x40, { 0xF0 });
+        CHECK(waitFor([&server] { return server.statistics().accepted == 5; }, std::chrono::seconds(10)));
+
+        // a stop from a client without the lease, while the lens is busy elsewhere
+        stopper.send(TYPE::STOP, 50, 0);
+        size_t cancelled = 0;
+        for (int i = 0; i < 3; i++) {
+            const Reply reply = mover.receive();
+            if (reply.status == STATUS::CANCELLED && reply.id == 10 + i && reply.code == 0x21) cancelled++;
+        }
+        CHECK(cancelled == 3);
+
+        lens.serving = true;
+        const Reply stopped = stopper.receive();
+        CHECK(stopped.status == STATUS::OK && stopped.id == 50);
+        CHECK(mover.receive().id == 13);
+        CHECK(mover.receive().id == 14);
+        const std::vector<uint16_t> served = lens.served();
+        CHECK(served == std::vector<uint16_t>({ 50, 13, 14 })); // ahead of what was queued before it
+        const FujinonZoomLensNetServer::Stats stats = server.statistics();
+        CHECK(stats.stops == 1 && stats.cancelled == 3);
+    }
+}
+
+int main() {
+    const auto begin = std::chrono::steady_clock::now();
+
+    testRoundRobin();
+    testLeases();
+    testRateLimit();
+    testStop();
+
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+    std::cout << checks - failures << "/" << checks << " checks passed in " << ms << " [ms]" << std::endl;
+    return failures == 0 ? 0 : 1;
+}
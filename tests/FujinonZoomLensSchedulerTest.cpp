@@ -0,0 +1,435 @@
+//
+// Created by Hirano Masahiro <masahiro.dll@gmail.com>
+//
+// Checks the order in which FujinonZoomLensScheduler hands commands to the lens worker: priority classes,
+// aging, coalescing, batches, recalls and requeues, that a halt overtakes the queued motion, and that the slab is
+// reused once the queue drains.
+// Registered with CTest; exits non-zero if any check fails.
+//
+
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "FujinonZoomLensScheduler.h"
+
+namespace {
+
+    int failures = 0;
+    int checks = 0;
+
+#define CHECK(cond) do { checks++; if (!(cond)) { failures++; std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond ") failed" << std::endl; } } while (0)
+
+    using Done = std::function<void(bool, const FujinonZoomLensControllerUtil::FujinonZoomLensResponse &)>;
+
+    const Done ignore = [](bool, const FujinonZoomLensControllerUtil::FujinonZoomLensResponse &) {};
+
+    /* Code of the next command, 0 if none is waiting */
+    uchar next(FujinonZoomLensScheduler &scheduler) {
+        FujinonZoomLensScheduledCommand entry;
+        return scheduler.pop(entry, std::chrono::milliseconds(0)) ? entry.cmd.code : 0;
+    }
+
+    std::shared_ptr<const FujinonZoomLensBatch> batch(std::initializer_list<FujinonZoomLensCommand> commands) {
+        auto b = std::make_shared<FujinonZoomLensBatch>();
+        for (const FujinonZoomLensCommand &cmd : commands) b->add(cmd.code, cmd.data);
+        return b;
+    }
+
+    void testClassify() {
+        using FujinonZoomLensSchedulerUtil::classify;
+        CHECK(classify(0x20) == FujinonZoomLensPriority::MOTION);
+        CHECK(classify(0x21) == FujinonZoomLensPriority::MOTION);
+        CHECK(classify(0x22) == FujinonZoomLensPriority::MOTION);
+        CHECK(classify(0x40) == FujinonZoomLensPriority::CONFIGURATION);
+        CHECK(classify(0x42) == FujinonZoomLensPriority::CONFIGURATION);
+        CHECK(classify(0x31) == FujinonZoomLensPriority::QUERY);
+        CHECK(classify(0x11) == FujinonZoomLensPriority::QUERY);
+    }
+
+    void testOrder() {
+        { // FIFO within a class
+            FujinonZoomLensScheduler scheduler;
+            for (uchar code : { 0x30, 0x31, 0x32, 0x17 }) scheduler.push({ code, {} });
+            CHECK(next(scheduler) == 0x30);
+            CHECK(next(scheduler) == 0x31);
+            CHECK(next(scheduler) == 0x32);
+            CHECK(next(scheduler) == 0x17);
+            CHECK(next(scheduler) == 0);
+        }
+        { // queued together, the more urgent class goes first whatever the arrival order
+            FujinonZoomLensScheduler scheduler;
+            scheduler.push({ 0x31, {} });
+            scheduler.push({ 0x40, { 0x01 } });
+            scheduler.push({ 0x21, { 0x10, 0x00 } });
+            scheduler.push({ 0x22, { 0x20, 0x00 } }, FujinonZoomLensPriority::EMERGENCY);
+            CHECK(next(scheduler) == 0x22);
+            CHECK(next(scheduler) == 0x21);
+            CHECK(next(scheduler) == 0x40);
+            CHECK(next(scheduler) == 0x31);
+        }
+        { // statistics per class
+            FujinonZoomLensScheduler scheduler;
+            scheduler.push({ 0x31, {} });
+            scheduler.push({ 0x32, {} });
+            CHECK(scheduler.statistics(FujinonZoomLensPriority::QUERY).queued == 2);
+            next(scheduler);
+            FujinonZoomLensSchedulerStats stats = scheduler.statistics(FujinonZoomLensPriority::QUERY);
+            CHECK(stats.queued == 1 && stats.scheduled == 1);
+            CHECK(scheduler.statistics(FujinonZoomLensPriority::MOTION).scheduled == 0);
+            scheduler.resetStatistics();
+            stats = scheduler.statistics(FujinonZoomLensPriority::QUERY);
+            CHECK(stats.queued == 1 && stats.scheduled == 0);
+        }
+        { // closed: nothing more is handed out
+            FujinonZoomLensScheduler scheduler;
+            scheduler.push({ 0x31, {} });
+            scheduler.close();
+            CHECK(scheduler.isClosed());
+            CHECK(next(scheduler) == 0);
+        }
+    }
+
+    void testAging() {
+        const auto step = std::chrono::milliseconds(10);
+        { // a query older than 2 * agingStep goes before a fresh motion command
+            FujinonZoomLensScheduler scheduler(step);
+            scheduler.push({ 0x31, {} });
+            std::this_thread::sleep_for(3 * step);
+            scheduler.push({ 0x21, { 0x10, 0x00 } });
+            CHECK(next(scheduler) == 0x31);
+            CHECK(next(scheduler) == 0x21);
+        }
+        { // ...but an emergency command never waits for aged ones
+            FujinonZoomLensScheduler scheduler(step);
+            scheduler.push({ 0x31, {} });
+            scheduler.push({ 0x40, { 0x01 } });
+            std::this_thread::sleep_for(5 * step);
+            scheduler.push({ 0x21, { 0x10, 0x00 } }, FujinonZoomLensPriority::EMERGENCY);
+            CHECK(next(scheduler) == 0x21);
+        }
+        { // line saturated with motion commands: the queue never empties, yet a query gets through
+            // once the motion commands queued before it + 2 * agingStep are sent
+            constexpr int DEPTH = 20;
+            const auto line = std::chrono::milliseconds(1); // one transaction
+            FujinonZoomLensScheduler scheduler(step);
+            for (int i = 0; i < DEPTH; i++) scheduler.push({ 0x21, { 0x10, 0x00 } }, FujinonZoomLensPriority::MOTION, ignore);
+
+            bool served = false;
+            int emergencyWait = -1;
+            for (int i = 0; i < 500 && !served; i++) {
+                if (i == 5) scheduler.push({ 0x31, {} });
+                if (i == 10) scheduler.push({ 0x20, { 0x00, 0x00 } }, FujinonZoomLensPriority::EMERGENCY);
+                FujinonZoomLensScheduledCommand entry;
+                if (!scheduler.pop(entry, std::chrono::milliseconds(0))) break;
+                if (entry.cmd.code == 0x31) served = true;
+                if (entry.cmd.code == 0x20) emergencyWait = i - 10;
+                std::this_thread::sleep_for(line);
+                scheduler.push({ 0x21, { 0x10, 0x00 } }, FujinonZoomLensPriority::MOTION, ignore);
+            }
+            CHECK(served);
+            CHECK(emergencyWait == 0);
+            FujinonZoomLensSchedulerStats query = scheduler.statistics(FujinonZoomLensPriority::QUERY);
+            CHECK(query.scheduled == 1);
+            // 2 * agingStep + DEPTH transactions, with room for a loaded machine
+            CHECK(query.maxQueueUs < 1000.0 * (2 * step.count() + DEPTH * line.count()) * 4);
+            CHECK(scheduler.statistics(FujinonZoomLensPriority::EMERGENCY).maxQueueUs < 1000.0 * 2 * line.count() * 4);
+        }
+    }
+
+    void testCoalescing() {
+        { // setters without a completion: the latest payload, in the place of the first
+            FujinonZoomLensScheduler scheduler;
+            scheduler.push({ 0x21, { 0x10, 0x00 } });
+            scheduler.push({ 0x22, { 0x20, 0x00 } });
+            scheduler.push({ 0x21, { 0x30, 0x00 } });
+            scheduler.push({ 0x21, { 0x40, 0x00 } });
+            CHECK(scheduler.statistics(FujinonZoomLensPriority::MOTION).coalesced == 2);
+            CHECK(scheduler.statistics(FujinonZoomLensPriority::MOTION).queued == 2);
+            FujinonZoomLensScheduledCommand entry;
+            CHECK(scheduler.pop(entry, std::chrono::milliseconds(0)));
+            CHECK(entry.cmd.code == 0x21 && entry.cmd.data == FujinonZoomLensPayload({ 0x40, 0x00 }));
+            CHECK(next(scheduler) == 0x22);
+            CHECK(next(scheduler) == 0);
+        }
+        { // a command someone waits for is never replaced, nor does it replace
+            FujinonZoomLensScheduler scheduler;
+            scheduler.push({ 0x21, { 0x10, 0x00 } }, FujinonZoomLensPriority::MOTION, ignore);
+            scheduler.push({ 0x21, { 0x20, 0x00 } });
+            scheduler.push({ 0x21, { 0x30, 0x00 } }, FujinonZoomLensPriority::MOTION, ignore);
+            CHECK(scheduler.statistics(FujinonZoomLensPriority::MOTION).coalesced == 0);
+            CHECK(scheduler.statistics(FujinonZoomLensPriority::MOTION).queued == 3);
+        }
+        { // queries all go out: each one reads the lens at a different time
+            FujinonZoomLensScheduler scheduler;
+            scheduler.push({ 0x31, {} });
+            scheduler.push({ 0x31, {} });
+            CHECK(scheduler.statistics(FujinonZoomLensPriority::QUERY).queued == 2);
+        }
+        { // only within a class: an emergency stop does not absorb the queued motion
+            FujinonZoomLensScheduler scheduler;
+            scheduler.push({ 0x21, { 0x10, 0x00 } });
+            scheduler.push({ 0x21, { 0x20, 0x00 } }, FujinonZoomLensPriority::EMERGENCY);
+            CHECK(next(scheduler) == 0x21);
+            CHECK(next(scheduler) == 0x21);
+            CHECK(next(scheduler) == 0);
+        }
+    }
+
+    void testSlab() {
+        FujinonZoomLensScheduler scheduler;
+        const size_t initial = scheduler.capacity();
+        CHECK(initial > 0);
+
+        auto captured = std::make_shared<int>(0);
+        const size_t deep = initial * 2 + 1;
+        for (size_t i = 0; i < deep; i++) {
+            scheduler.push({ 0x31, {} }, FujinonZoomLensPriority::QUERY,
+                [captured](bool, const FujinonZoomLensControllerUtil::FujinonZoomLensResponse &) {});
+        }
+        const size_t grown = scheduler.capacity();
+        CHECK(grown >= deep);
+        CHECK(captured.use_count() == static_cast<long>(deep) + 1);
+        while (next(scheduler) != 0) {}
+        CHECK(captured.use_count() == 1); // completions released with their nodes
+
+        // the drained queue is refilled from the free list, in every class, without growing
+        for (int round = 0; round < 10; round++) {
+            for (size_t i = 0; i < deep; i++) {
+                static const uchar codes[] = { 0x20, 0x40, 0x31 };
+                scheduler.push({ codes[i % 3], {} }, FujinonZoomLensSchedulerUtil::classify(codes[i % 3]), ignore);
+            }
+            size_t popped = 0;
+            while (next(scheduler) != 0) popped++;
+            CHECK(popped == deep);
+        }
+        CHECK(scheduler.capacity() == grown);
+    }
+
+    void testBatch() {
+        { // a batch goes in the class of its most urgent command, and is never coalesced
+            FujinonZoomLensScheduler scheduler;
+            scheduler.push({ 0x31, {} });
+            scheduler.pushBatch(batch({ { 0x40, { 0x01 } }, { 0x42, { 0x00 } } }));
+            scheduler.pushBatch(batch({ { 0x40, { 0x02 } }, { 0x21, { 0x10, 0x00 } } }));
+            scheduler.pushBatch(batch({ { 0x40, { 0x03 } }, { 0x21, { 0x20, 0x00 } } }));
+            scheduler.pushBatch(std::make_shared<FujinonZoomLensBatch>()); // empty: ignored
+            CHECK(scheduler.statistics(FujinonZoomLensPriority::MOTION).queued == 2);
+            CHECK(scheduler.statistics(FujinonZoomLensPriority::CONFIGURATION).queued == 1);
+            CHECK(scheduler.statistics(FujinonZoomLensPriority::MOTION).coalesced == 0);
+
+            FujinonZoomLensScheduledCommand entry;
+            CHECK(scheduler.pop(entry, std::chrono::milliseconds(0)));
+            CHECK(entry.batch && !entry.recall && entry.batch->size() == 2);
+            CHECK(entry.batch->commands.front().data == FujinonZoomLensPayload({ 0x02 }));
+            CHECK(scheduler.pop(entry, std::chrono::milliseconds(0)));
+            CHECK(entry.batch && entry.batch->commands.front().data == FujinonZoomLensPayload({ 0x03 }));
+            CHECK(scheduler.pop(entry, std::chrono::milliseconds(0)));
+            CHECK(entry.batch && entry.priority == FujinonZoomLensPriority::CONFIGURATION);
+            CHECK(scheduler.pop(entry, std::chrono::milliseconds(0)));
+            CHECK(!entry.batch && entry.cmd.code == 0x31);
+        }
+        { // a setter does not absorb a queued batch setting the same control
+            FujinonZoomLensScheduler scheduler;
+            scheduler.pushBatch(batch({ { 0x21, { 0x10, 0x00 } } }));
+            scheduler.push({ 0x21, { 0x20, 0x00 } });
+            CHECK(scheduler.statistics(FujinonZoomLensPriority::MOTION).queued == 2);
+        }
+    }
+
+    void testRecall() {
+        FujinonZoomLensScheduler scheduler;
+        auto wide = batch({ { 0x21, { 0x00, 0x00 } }, { 0x40, { 0x00 } } });
+        auto tele = batch({ { 0x21, { 0xFF, 0xFF } }, { 0x40, { 0x00 } } });
+        auto macro = batch({ { 0x22, { 0x00, 0x00 } } });
+
+        scheduler.recall(wide);
+        scheduler.push({ 0x22, { 0x10, 0x00 } });
+        scheduler.recall(tele); // replaces wide, in its place
+        CHECK(scheduler.statistics(FujinonZoomLensPriority::MOTION).coalesced == 1);
+        scheduler.recall(macro, ignore); // someone waits for it: kept
+        CHECK(scheduler.statistics(FujinonZoomLensPriority::MOTION).queued == 3);
+
+        FujinonZoomLensScheduledCommand entry;
+        CHECK(scheduler.pop(entry, std::chrono::milliseconds(0)));
+        CHECK(entry.recall && entry.batch == tele);
+        CHECK(scheduler.pop(entry, std::chrono::milliseconds(0)));
+        CHECK(!entry.batch && entry.cmd.code == 0x22);
+        CHECK(scheduler.pop(entry, std::chrono::milliseconds(0)));
+        CHECK(entry.recall && entry.batch == macro && entry.done);
+        CHECK(next(scheduler) == 0);
+    }
+
+    void testRequeue() {
+        { // back at the head of its class, keeping its turn
+            FujinonZoomLensScheduler scheduler;
+            scheduler.push({ 0x30, {} });
+            scheduler.push({ 0x31, {} });
+            FujinonZoomLensScheduledCommand entry;
+            CHECK(scheduler.pop(entry, std::chrono::milliseconds(0)) && entry.cmd.code == 0x30);
+            scheduler.requeue(entry);
+            CHECK(scheduler.statistics(FujinonZoomLensPriority::QUERY).queued == 2);
+            CHECK(next(scheduler) == 0x30);
+            CHECK(next(scheduler) == 0x31);
+        }
+        { // a setter superseded while the lens was away is dropped
+            FujinonZoomLensScheduler scheduler;
+            scheduler.push({ 0x21, { 0x10, 0x00 } });
+            FujinonZoomLensScheduledCommand entry;
+            CHECK(scheduler.pop(entry, std::chrono::milliseconds(0)));
+            scheduler.push({ 0x21, { 0x20, 0x00 } });
+            scheduler.requeue(entry);
+            CHECK(scheduler.statistics(FujinonZoomLensPriority::MOTION).coalesced == 1);
+            CHECK(scheduler.pop(entry, std::chrono::milliseconds(0)));
+            CHECK(entry.cmd.data == FujinonZoomLensPayload({ 0x20, 0x00 }));
+            CHECK(next(scheduler) == 0);
+        }
+        { // ...but not one with a completion, nor a batch
+            FujinonZoomLensScheduler scheduler;
+            scheduler.push({ 0x21, { 0x10, 0x00 } }, FujinonZoomLensPriority::MOTION, ignore);
+            scheduler.pushBatch(batch({ { 0x21, { 0x30, 0x00 } } }));
+            FujinonZoomLensScheduledCommand first, second;
+            CHECK(scheduler.pop(first, std::chrono::milliseconds(0)));
+            CHECK(scheduler.pop(second, std::chrono::milliseconds(0)));
+            scheduler.push({ 0x21, { 0x20, 0x00 } });
+            scheduler.requeue(second);
+            scheduler.requeue(first);
+            CHECK(scheduler.statistics(FujinonZoomLensPriority::MOTION).queued == 3);
+            FujinonZoomLensScheduledCommand entry;
+            CHECK(scheduler.pop(entry, std::chrono::milliseconds(0)) && entry.done);
+            CHECK(scheduler.pop(entry, std::chrono::milliseconds(0)) && entry.batch);
+            CHECK(scheduler.pop(entry, std::chrono::milliseconds(0)) && entry.cmd.data == FujinonZoomLensPayload({ 0x20, 0x00 }));
+        }
+        { // a superseded recall is dropped as well
+            FujinonZoomLensScheduler scheduler;
+            auto wide = batch({ { 0x21, { 0x00, 0x00 } } });
+            auto tele = batch({ { 0x21, { 0xFF, 0xFF } } });
+            scheduler.recall(wide);
+            FujinonZoomLensScheduledCommand entry;
+            CHECK(scheduler.pop(entry, std::chrono::milliseconds(0)));
+            scheduler.recall(tele);
+            scheduler.requeue(entry);
+            CHECK(scheduler.pop(entry, std::chrono::milliseconds(0)) && entry.batch == tele);
+            CHECK(next(scheduler) == 0);
+        }
+    }
+
+    void testWake() {
+        FujinonZoomLensScheduler scheduler;
+        std::thread waker([&scheduler] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            scheduler.wake();
+        });
+        const auto begin = std::chrono::steady_clock::now();
+        FujinonZoomLensScheduledCommand entry;
+        CHECK(!scheduler.pop(entry, std::chrono::seconds(10)));
+        CHECK(std::chrono::steady_clock::now() - begin < std::chrono::seconds(5));
+        waker.join();
+
+        std::thread pusher([&scheduler] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            scheduler.push({ 0x31, {} });
+        });
+        CHECK(scheduler.pop(entry, std::chrono::seconds(10)) && entry.cmd.code == 0x31);
+        pusher.join();
+    }
+
+    /* Sends the controller's commands through a scheduler, as the GUI client does */
+    class SchedulerClient : public FujinonZoomLensClientTemplate {
+    public:
+        explicit SchedulerClient(FujinonZoomLensScheduler &_scheduler) : scheduler(_scheduler) {};
+        void send(FujinonZoomLensCommand cmd) override { scheduler.push(std::move(cmd)); }
+        void sendBatch(std::shared_ptr<const FujinonZoomLensBatch> b) override { scheduler.pushBatch(std::move(b)); }
+        void halt() override { scheduler.halt(); }
+    private:
+        FujinonZoomLensScheduler &scheduler;
+    };
+
+    void testHalt() {
+        FujinonZoomLensScheduler scheduler;
+        // a backlog of motion (completions, a batch, a recall) behind one query, and a configuration command
+        size_t dropped = 0;
+        const Done count = [&dropped](bool ok, const FujinonZoomLensControllerUtil::FujinonZoomLensResponse &) { if (!ok) dropped++; };
+        for (int i = 0; i < 100; i++) scheduler.push({ 0x21, { static_cast<uchar>(i), 0x00 } }, FujinonZoomLensPriority::MOTION, count);
+        scheduler.push({ 0x22, { 0x80, 0x00 } });
+        scheduler.pushBatch(batch({ { 0x20, { 0x10, 0x00 } }, { 0x21, { 0x20, 0x00 } } }), count);
+        scheduler.recall(batch({ { 0x21, { 0x30, 0x00 } } }));
+        scheduler.push({ 0x40, { 0xF0 } });
+        scheduler.push({ 0x17, {} });
+
+        bool halted = false, haltedOk = false;
+        scheduler.halt([&](bool ok, const FujinonZoomLensControllerUtil::FujinonZoomLensResponse &) { halted = true; haltedOk = ok; });
+        CHECK(dropped == 101);
+        CHECK(scheduler.statistics(FujinonZoomLensPriority::MOTION).queued == 0);
+        CHECK(scheduler.statistics(FujinonZoomLensPriority::MOTION).cancelled == 103);
+
+        // the positions first, then each axis is commanded where it is; the rest is left as it was
+        const uchar reported[] = { 0x12, 0x34, 0x56 };
+        FujinonZoomLensScheduledCommand entry;
+        for (uchar code : { 0x30, 0x31, 0x32 }) {
+            CHECK(scheduler.pop(entry, std::chrono::milliseconds(0)) && entry.cmd.code == code && entry.priority == FujinonZoomLensPriority::EMERGENCY);
+            FujinonZoomLensControllerUtil::FujinonZoomLensResponse response;
+            response.code = code;
+            response.data = { reported[code - 0x30], 0x00 };
+            entry.done(true, response);
+        }
+        for (uchar code : { 0x20, 0x21, 0x22 }) {
+            CHECK(scheduler.pop(entry, std::chrono::milliseconds(0)) && entry.cmd.code == code && entry.priority == FujinonZoomLensPriority::EMERGENCY);
+            CHECK(entry.cmd.data == FujinonZoomLensPayload({ reported[code - 0x20], 0x00 }));
+            CHECK(!halted);
+            entry.done(true, { code, {} });
+        }
+        CHECK(halted && haltedOk);
+        CHECK(next(scheduler) == 0x40);
+        CHECK(next(scheduler) == 0x17);
+        CHECK(next(scheduler) == 0);
+
+        { // a position the lens does not report fails the halt, once the other axes are done
+            halted = false;
+            scheduler.halt([&](bool ok, const FujinonZoomLensControllerUtil::FujinonZoomLensResponse &) { halted = true; haltedOk = ok; });
+            while (scheduler.pop(entry, std::chrono::milliseconds(0))) {
+                FujinonZoomLensControllerUtil::FujinonZoomLensResponse response;
+                response.code = entry.cmd.code;
+                if (entry.cmd.code != 0x31) response.data = { 0x00, 0x00 };
+                entry.done(entry.cmd.code != 0x31, response);
+            }
+            CHECK(halted && !haltedOk);
+        }
+
+        { // through the controller: the batch being collected is dropped and the next setter is not suppressed
+            auto client = std::make_shared<SchedulerClient>(scheduler);
+            FujinonZoomLensController controller(client);
+            controller.command(0x21, { 0x10, 0x00 });
+            controller.onResponse(0x21, { 0x10, 0x00 });
+            CHECK(next(scheduler) == 0x21);
+            controller.beginBatch();
+            controller.command(0x22, { 0x20, 0x00 });
+            controller.stop();
+            CHECK(!controller.isBatching());
+            CHECK(next(scheduler) == 0x30);
+            controller.command(0x21, { 0x10, 0x00 });
+            CHECK(controller.suppressionStats().suppressed == 0);
+        }
+    }
+}
+
+int main() {
+    const auto begin = std::chrono::steady_clock::now();
+
+    testClassify();
+    testOrder();
+    testAging();
+    testCoalescing();
+    testSlab();
+    testBatch();
+    testRecall();
+    testRequeue();
+    testWake();
+    testHalt();
+
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+    std::cout << checks - failures << "/" << checks << " checks passed in " << ms << " [ms]" << std::endl;
+    return failures == 0 ? 0 : 1;
+}
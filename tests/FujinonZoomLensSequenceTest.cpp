@@ -0,0 +1,246 @@
+//
+// Created by Hirano Masahiro <masahiro.dll@gmail.com>
+//
+// Runs thousands of FujinonZoomLensSequence coroutines against a simulated lens behind the scheduler, and checks that
+// they all complete, that the frames of sequences still suspended are freed with the executor, and that the executor
+// follows moves made by other clients.
+// Registered with CTest; exits non-zero if any check fails.
+//
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "FujinonZoomLensSequence.h"
+#include "FujinonZoomLensSimulator.h"
+
+namespace {
+
+    int failures = 0;
+    int checks = 0;
+
+#define CHECK(cond) do { checks++; if (!(cond)) { failures++; std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond ") failed" << std::endl; } } while (0)
+
+    /*
+     * Lens worker of the tests: takes commands from the scheduler, runs them through the simulator
+     * and completes them with its reply, as FujinonZoomLensServer does with a real lens.
+     * Every transaction the lens confirmed is passed to confirmed first, as the engine does for the GUI.
+     */
+    class Loopback {
+    public:
+        using Confirmed = std::function<void(uchar, const FujinonZoomLensPayload &)>;
+
+        explicit Loopback(FujinonZoomLensScheduler &_scheduler, bool _answering = true, Confirmed _confirmed = nullptr)
+            : scheduler(_scheduler), answering(_answering), confirmed(std::move(_confirmed)) {
+            worker = std::thread([this] { loop(); });
+        }
+
+        ~Loopback() {
+            scheduler.close();
+            worker.join();
+        }
+
+        std::atomic<size_t> served{ 0 };
+
+    private:
+        void loop() {
+            FujinonZoomLensControllerUtil::FujinonZoomLensFrameParser parser;
+            FujinonZoomLensScheduledCommand entry;
+            std::vector<uchar> replies;
+            while (!scheduler.isClosed()) {
+                if (!scheduler.pop(entry, std::chrono::milliseconds(10))) continue;
+                if (!answering) continue; // the lens is gone: completions are never called
+                const std::vector<uchar> frame = FujinonZoomLensControllerUtil::encodeCommand(entry.cmd.code, entry.cmd.data);
+                replies.clear();
+                lens.handle(frame.data(), frame.size(), replies);
+                parser.push(replies.data(), replies.size());
+                FujinonZoomLensControllerUtil::FujinonZoomLensResponse response;
+                const bool ok = parser.next(response) && response.code == entry.cmd.code;
+                served++;
+                if (ok && confirmed) confirmed(entry.cmd.code, response.data.empty() ? entry.cmd.data : response.data);
+                if (entry.done) entry.done(ok, response);
+            }
+        }
+
+        FujinonZoomLensScheduler &scheduler;
+        FujinonZoomLensSimulator lens;
+        bool answering;
+        Confirmed confirmed;
+        std::thread worker;
+    };
+
+    /* Counts the frames destroyed, finished or not */
+    struct FrameGuard {
+        std::atomic<size_t> &destroyed;
+        ~FrameGuard() { destroyed++; }
+    };
+
+    FujinonZoomLensSequence move(FujinonZoomLensSequenceExecutor &lens, int i, std::atomic<size_t> &completed, std::atomic<size_t> &destroyed) {
+        FrameGuard guard{ destroyed };
+        const FujinonZoomLensPayload target = { static_cast<uchar>(i % 256), static_cast<uchar>(i / 256) };
+        co_await lens.command(0x21, target);
+        const uint zoom = co_await lens.readZoom();
+        if (i % 7 == 0) co_await lens.sleepFor(std::chrono::milliseconds(1));
+        if (i % 5 == 0) co_await lens.waitSettled(0x21, 0xFFFF);
+        const FujinonZoomLensPayload focus = { static_cast<uchar>(zoom / 256), static_cast<uchar>(zoom % 256) };
+        co_await lens.command(0x22, focus);
+        completed++;
+    }
+
+    /* The token is copied into the frame when the sequence is created, so it counts frames that never ran as well */
+    FujinonZoomLensSequence forever(FujinonZoomLensSequenceExecutor &lens, std::shared_ptr<int> /* token */, std::atomic<size_t> &started, std::atomic<size_t> &destroyed) {
+        FrameGuard guard{ destroyed };
+        started++;
+        co_await lens.sleepFor(std::chrono::hours(1));
+    }
+
+    FujinonZoomLensSequence unanswered(FujinonZoomLensSequenceExecutor &lens, int i, std::atomic<size_t> &started, std::atomic<size_t> &destroyed) {
+        FrameGuard guard{ destroyed };
+        started++;
+        const FujinonZoomLensPayload iris = { static_cast<uchar>(i % 256), 0x00 };
+        co_await lens.command(0x20, iris);
+    }
+
+    FujinonZoomLensSequence zoomAndSettle(FujinonZoomLensSequenceExecutor &lens, float ratio, uint &position, bool &settled) {
+        co_await lens.zoomTo(ratio);
+        position = co_await lens.readZoom();
+        settled = co_await lens.waitSettled(0x21, 0x40, std::chrono::milliseconds(5), std::chrono::milliseconds(500));
+    }
+
+    bool waitFor(const std::function<bool()> &done, std::chrono::seconds timeout) {
+        const auto deadline = std::chrono::steady_clock::now() + timeout;
+        while (!done()) {
+            if (std::chrono::steady_clock::now() > deadline) return false;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return true;
+    }
+
+    void testThousands() {
+        constexpr size_t N = 5000;
+        std::atomic<size_t> completed{ 0 }, destroyed{ 0 };
+        FujinonZoomLensScheduler scheduler;
+        Loopback loopback(scheduler);
+        {
+            FujinonZoomLensSequenceExecutor executor(scheduler);
+            // spawned from two threads at once
+            std::thread other([&] { for (size_t i = 1; i < N; i += 2) executor.spawn(move(executor, static_cast<int>(i), completed, destroyed)); });
+            for (size_t i = 0; i < N; i += 2) executor.spawn(move(executor, static_cast<int>(i), completed, destroyed));
+            other.join();
+
+            CHECK(waitFor([&] { return executor.running() == 0; }, std::chrono::seconds(60)));
+            CHECK(completed == N);
+            CHECK(destroyed == N);
+            CHECK(executor.settleStatistics().waits == N / 5);
+        }
+        CHECK(destroyed == N);
+        CHECK(loopback.served >= N);
+    }
+
+    void testSuspendedAtShutdown() {
+        constexpr size_t N = 2000;
+        { // sleeping and never-started sequences
+            std::atomic<size_t> started{ 0 }, destroyed{ 0 };
+            auto token = std::make_shared<int>(0);
+            FujinonZoomLensScheduler scheduler;
+            Loopback loopback(scheduler);
+            {
+                FujinonZoomLensSequenceExecutor executor(scheduler);
+                for (size_t i = 0; i < N; i++) executor.spawn(forever(executor, token, started, destroyed));
+                CHECK(waitFor([&] { return started == N; }, std::chrono::seconds(30)));
+                for (size_t i = 0; i < N; i++) executor.spawn(forever(executor, token, started, destroyed)); // may not get to run
+                CHECK(executor.running() == 2 * N);
+                CHECK(token.use_count() == static_cast<long>(2 * N) + 1);
+                CHECK(destroyed == 0);
+            }
+            CHECK(token.use_count() == 1);
+            CHECK(destroyed >= N); // those that ran
+        }
+        { // waiting on commands the lens never answers
+            std::atomic<size_t> started{ 0 }, destroyed{ 0 };
+            FujinonZoomLensScheduler scheduler;
+            Loopback loopback(scheduler, false);
+            {
+                FujinonZoomLensSequenceExecutor executor(scheduler);
+                for (size_t i = 0; i < N; i++) executor.spawn(unanswered(executor, static_cast<int>(i), started, destroyed));
+                CHECK(waitFor([&] { return started == N; }, std::chrono::seconds(30)));
+            }
+            CHECK(destroyed == N);
+        }
+        { // completions of a destroyed executor are dropped, not resumed
+            std::atomic<size_t> started{ 0 }, destroyed{ 0 };
+            FujinonZoomLensScheduler scheduler;
+            {
+                FujinonZoomLensSequenceExecutor executor(scheduler);
+                for (size_t i = 0; i < N; i++) executor.spawn(unanswered(executor, static_cast<int>(i), started, destroyed));
+                CHECK(waitFor([&] { return started == N; }, std::chrono::seconds(30)));
+            }
+            CHECK(destroyed == N);
+            Loopback loopback(scheduler); // serves what the sequences queued
+            CHECK(waitFor([&] { return loopback.served > 0 && scheduler.statistics(FujinonZoomLensPriority::MOTION).queued == 0; },
+                std::chrono::seconds(30)));
+            CHECK(destroyed == N);
+        }
+    }
+
+    void testOtherClient() {
+        // the executor zooms to 2.0, another client moves the lens away, and the executor zooms to 2.0 again
+        FujinonZoomLensScheduler scheduler;
+        std::unique_ptr<FujinonZoomLensSequenceExecutor> executor;
+        Loopback loopback(scheduler, true, [&executor](uchar code, const FujinonZoomLensPayload &data) { executor->onResponse(code, data); });
+        executor = std::make_unique<FujinonZoomLensSequenceExecutor>(scheduler);
+        uint position = 0;
+        bool settled = false;
+
+        executor->spawn(zoomAndSettle(*executor, 2.0f, position, settled));
+        CHECK(waitFor([&] { return executor->running() == 0; }, std::chrono::seconds(10)));
+        CHECK(position == 0x5400 && settled);
+
+        std::atomic<bool> moved{ false };
+        scheduler.push({ 0x21, { 0xC0, 0x00 } }, FujinonZoomLensPriority::MOTION,
+            [&moved](bool, const FujinonZoomLensControllerUtil::FujinonZoomLensResponse &) { moved = true; });
+        CHECK(waitFor([&] { return moved.load(); }, std::chrono::seconds(10)));
+
+        // the confirmation reached the executor before this spawn: the command goes out and the settle target is right
+        position = 0;
+        settled = false;
+        executor->spawn(zoomAndSettle(*executor, 2.0f, position, settled));
+        CHECK(waitFor([&] { return executor->running() == 0; }, std::chrono::seconds(10)));
+        CHECK(executor->lens().suppressionStats().suppressed == 0);
+        CHECK(position == 0x5400 && settled);
+
+        // nobody moved it since: suppressed, and still settled at once
+        executor->spawn(zoomAndSettle(*executor, 2.0f, position, settled));
+        CHECK(waitFor([&] { return executor->running() == 0; }, std::chrono::seconds(10)));
+        CHECK(executor->lens().suppressionStats().suppressed == 1);
+        CHECK(position == 0x5400 && settled);
+
+        // the other client moves it again, but this time the confirmation is lost: the shadow is forgotten instead
+        moved = false;
+        scheduler.push({ 0x21, { 0x10, 0x00 } }, FujinonZoomLensPriority::MOTION,
+            [&moved](bool, const FujinonZoomLensControllerUtil::FujinonZoomLensResponse &) { moved = true; });
+        CHECK(waitFor([&] { return moved.load(); }, std::chrono::seconds(10)));
+        executor->invalidateShadow();
+        executor->spawn(zoomAndSettle(*executor, 2.0f, position, settled));
+        CHECK(waitFor([&] { return executor->running() == 0; }, std::chrono::seconds(10)));
+        CHECK(executor->lens().suppressionStats().suppressed == 1);
+        CHECK(position == 0x5400 && settled);
+
+        executor.reset(); // before the loopback stops, which could otherwise still confirm to it
+    }
+}
+
+int main() {
+    const auto begin = std::chrono::steady_clock::now();
+
+    testThousands();
+    testSuspendedAtShutdown();
+    testOtherClient();
+
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+    std::cout << checks - failures << "/" << checks << " checks passed in " << ms << " [ms]" << std::endl;
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,272 @@
+//
+// Created by Hirano Masahiro <masahiro.dll@gmail.com>
+//
+// Appends telemetry across a block boundary, reopens the file, and checks FujinonZoomLensTelemetryStore::lowerBound
+// against a linear scan and the points FujinonZoomLensTelemetryPyramid::query returns against brute-force min/max.
+// Registered with CTest; exits non-zero if any check fails.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "FujinonZoomLensTelemetry.h"
+
+namespace {
+
+    int failures = 0;
+    int checks = 0;
+
+#define CHECK(cond) do { checks++; if (!(cond)) { failures++; std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond ") failed" << std::endl; } } while (0)
+
+    using Store = FujinonZoomLensTelemetryStore;
+    using Pyramid = FujinonZoomLensTelemetryPyramid;
+
+    constexpr size_t ROWS = Store::BLOCK_SAMPLES + 1000; // one block and a bit of the next
+    constexpr int64_t ORIGIN_NS = 1000000;
+
+    /* Row r as appended: two rows per time stamp, axes in turn, every 7th reported position unknown */
+    FujinonZoomLensTelemetrySample row(size_t r) {
+        FujinonZoomLensTelemetrySample s;
+        s.timeNs = ORIGIN_NS + static_cast<int64_t>(r / 2) * 1000;
+        s.axis = static_cast<uint8_t>(r % 3);
+        s.commanded = static_cast<int32_t>((r * 2654435761u) % 65536);
+        s.actual = r % 7 == 0 ? -1 : static_cast<int32_t>((r * 40503u + 12345u) % 65536);
+        return s;
+    }
+
+    bool same(const FujinonZoomLensTelemetrySample &a, const FujinonZoomLensTelemetrySample &b) {
+        return a.timeNs == b.timeNs && a.axis == b.axis && a.commanded == b.commanded && a.actual == b.actual;
+    }
+
+    /* Every row of the store equals the one appended */
+    bool intact(const Store &store, size_t rows) {
+        size_t r = 0;
+        bool ok = store.size() == rows;
+        store.visit(0, rows, [&](const FujinonZoomLensTelemetrySample &s) { ok = ok && same(s, row(r++)); });
+        return ok && r == rows;
+    }
+
+    std::string temporary(const char *name) {
+        const std::filesystem::path file = std::filesystem::temp_directory_path() / name;
+        std::filesystem::remove(file);
+        return file.string();
+    }
+
+    void testAppend(const std::string &file) {
+        Store store;
+        CHECK(!store.append(row(0))); // not open
+        CHECK(store.open(file));
+        CHECK(std::filesystem::file_size(file) == Store::HEADER_BYTES + Store::BLOCK_BYTES);
+        for (size_t r = 0; r < ROWS; r++) store.append(row(r));
+        CHECK(std::filesystem::file_size(file) == Store::HEADER_BYTES + 2 * Store::BLOCK_BYTES); // grown once
+        CHECK(intact(store, ROWS));
+        CHECK(store.timeRange() == std::make_pair(row(0).timeNs, row(ROWS - 1).timeNs));
+    }
+
+    void testReopen(const std::string &file) {
+        {
+            Store store;
+            CHECK(store.open(file));
+            CHECK(store.fileName() == file);
+            CHECK(intact(store, ROWS)); // rows of the other store kept, on both sides of the block boundary
+
+            // appending goes on after them, and never back in time
+            FujinonZoomLensTelemetrySample early = row(ROWS);
+            early.timeNs = ORIGIN_NS;
+            CHECK(store.append(early));
+            CHECK(store.size() == ROWS + 1);
+            int64_t last = 0;
+            store.visit(ROWS, ROWS + 1, [&last](const FujinonZoomLensTelemetrySample &s) { last = s.timeNs; });
+            CHECK(last == row(ROWS - 1).timeNs);
+        }
+        { // a file that is not telemetry
+            const std::string other = temporary("fujinon-zoom-lens-test-telemetry-other.bin");
+            std::ofstream(other, std::ios::binary) << std::string(Store::HEADER_BYTES + 16, 'x');
+            Store store;
+            CHECK(!store.open(other));
+            CHECK(!store.isOpen());
+            std::filesystem::remove(other);
+        }
+        { // more rows counted than there are blocks
+            std::filesystem::resize_file(file, Store::HEADER_BYTES + Store::BLOCK_BYTES);
+            Store store;
+            CHECK(!store.open(file));
+            CHECK(store.size() == 0);
+        }
+    }
+
+    void testLowerBound(const std::string &file) {
+        Store store;
+        CHECK(store.open(file));
+        for (size_t r = 0; r < ROWS; r++) store.append(row(r));
+        std::vector<int64_t> times;
+        store.visit(0, store.size(), [&times](const FujinonZoomLensTelemetrySample &s) { times.push_back(s.timeNs); });
+        auto linear = [&times](int64_t t) {
+            size_t r = 0;
+            while (r < times.size() && times[r] < t) r++;
+            return r;
+        };
+        const int64_t last = times.back();
+        std::vector<int64_t> probes = { INT64_MIN, 0, ORIGIN_NS - 1, ORIGIN_NS, ORIGIN_NS + 1, last - 1, last, last + 1, INT64_MAX };
+        for (size_t r = Store::BLOCK_SAMPLES - 4; r < Store::BLOCK_SAMPLES + 4; r++) probes.push_back(times[r]); // at the boundary
+        for (int64_t t = ORIGIN_NS; t < last; t += 77777) probes.push_back(t); // between and on time stamps
+        size_t mismatches = 0;
+        for (int64_t t : probes) {
+            if (store.lowerBound(t) != linear(t)) mismatches++;
+        }
+        CHECK(mismatches == 0);
+        CHECK(store.lowerBound(row(1).timeNs) == 0); // the first of equal times
+    }
+
+    /* Rows of an axis between two times, and their min/max, brute force */
+    struct Envelope {
+        size_t rows = 0;
+        int32_t commandedMin = INT32_MAX, commandedMax = -1;
+        int32_t actualMin = INT32_MAX, actualMax = -1;
+    };
+
+    Envelope envelope(size_t axis, int64_t fromNs, int64_t toNs) {
+        Envelope e;
+        for (size_t r = 0; r < ROWS; r++) {
+            const FujinonZoomLensTelemetrySample s = row(r);
+            if (s.axis != axis || s.timeNs < fromNs || s.timeNs > toNs) continue;
+            e.rows++;
+            e.commandedMin = std::min(e.commandedMin, s.commanded);
+            e.commandedMax = std::max(e.commandedMax, s.commanded);
+            if (s.actual >= 0) {
+                e.actualMin = std::min(e.actualMin, s.actual);
+                e.actualMax = std::max(e.actualMax, s.actual);
+            }
+        }
+        return e;
+    }
+
+    /* Min of the minima and max of the maxima of the points, NaN (unknown) left out */
+    Envelope reduce(const Pyramid::Series &series) {
+        Envelope e;
+        for (size_t i = 0; i < series.time.size(); i++) {
+            e.rows++;
+            e.commandedMin = std::min(e.commandedMin, static_cast<int32_t>(series.commandedMin[i]));
+            e.commandedMax = std::max(e.commandedMax, static_cast<int32_t>(series.commandedMax[i]));
+            if (!std::isnan(series.actualMin[i])) {
+                e.actualMin = std::min(e.actualMin, static_cast<int32_t>(series.actualMin[i]));
+                e.actualMax = std::max(e.actualMax, static_cast<int32_t>(series.actualMax[i]));
+            }
+        }
+        return e;
+    }
+
+    void testPyramid(const std::string &file) {
+        Store store;
+        CHECK(store.open(file));
+        for (size_t r = 0; r < ROWS; r++) store.append(row(r));
+
+        Pyramid pyramid;
+        size_t updates = 0;
+        while (pyramid.update(store, 10000) > 0) updates++;
+        CHECK(updates == ROWS / 10000);
+        CHECK(pyramid.indexedRows() == ROWS);
+
+        const size_t axis = 1;
+        const int64_t first = row(0).timeNs, last = row(ROWS - 1).timeNs;
+        const Envelope all = envelope(axis, first, last);
+        Pyramid::Series series;
+
+        // the whole file: the finest level that fits, whose points hold the exact min/max
+        size_t leaves = (all.rows + Pyramid::LEAF_SAMPLES - 1) / Pyramid::LEAF_SAMPLES;
+        for (size_t maxPoints : { size_t(1) << 20, size_t(5000), size_t(1000), size_t(300), size_t(80), size_t(20) }) {
+            pyramid.query(store, axis, first, last, first, maxPoints, series);
+            size_t level = 0, buckets = leaves;
+            if (leaves * Pyramid::LEAF_SAMPLES > maxPoints) {
+                level = 1;
+                while (buckets > maxPoints) {
+                    buckets = (buckets + Pyramid::FANOUT - 1) / Pyramid::FANOUT;
+                    level++;
+                }
+            }
+            CHECK(series.level == level);
+            CHECK(series.time.size() == (level == 0 ? all.rows : buckets));
+            CHECK(series.time.size() <= maxPoints);
+            const Envelope points = reduce(series);
+            CHECK(points.commandedMin == all.commandedMin && points.commandedMax == all.commandedMax);
+            CHECK(points.actualMin == all.actualMin && points.actualMax == all.actualMax);
+            CHECK(std::is_sorted(series.time.begin(), series.time.end()));
+        }
+
+        // a span inside: the points cover it (buckets overlapping its ends reach beyond)
+        const int64_t from = first + (last - first) / 3, to = first + (last - first) / 2;
+        const Envelope inside = envelope(axis, from, to);
+        pyramid.query(store, axis, from, to, from, 200, series);
+        CHECK(series.level > 1 && series.time.size() <= 200);
+        const Envelope points = reduce(series);
+        CHECK(points.commandedMin <= inside.commandedMin && points.commandedMax >= inside.commandedMax);
+        CHECK(points.actualMin <= inside.actualMin && points.actualMax >= inside.actualMax);
+        CHECK(std::is_sorted(series.time.begin(), series.time.end()));
+
+        // a span short enough for full resolution: the rows of the axis, and one on either side
+        const int64_t shortTo = from + 20000;
+        pyramid.query(store, axis, from, shortTo, from, 1000, series);
+        CHECK(series.level == 0);
+        const Envelope rows = envelope(axis, from, shortTo);
+        CHECK(series.time.size() >= rows.rows && series.time.size() <= rows.rows + 2);
+        for (size_t i = 0; i < series.time.size(); i++) {
+            CHECK(series.commandedMin[i] == series.commandedMax[i]);
+        }
+
+        // another (shorter) file starts over
+        const std::string other = temporary("fujinon-zoom-lens-test-telemetry-short.bin");
+        Store small;
+        CHECK(small.open(other));
+        for (size_t r = 0; r < 100; r++) small.append(row(r));
+        CHECK(pyramid.update(small) == 0);
+        CHECK(pyramid.indexedRows() == 100);
+        pyramid.query(small, axis, first, last, first, 1 << 20, series);
+        CHECK(series.time.size() == envelope(axis, first, row(99).timeNs).rows);
+        std::filesystem::remove(other);
+    }
+
+    void testRecord(const std::string &file) {
+        Store store;
+        CHECK(store.open(file));
+        const auto now = std::chrono::steady_clock::now();
+        store.record(0x21, { 0x12, 0x34 }, now); // zoom commanded
+        store.record(0x31, { 0x10, 0x00 }, now); // zoom reported
+        store.record(0x32, { 0x20, 0x00 }, now); // focus reported, never commanded
+        store.record(0x40, { 0xE0 }, now); // not a position
+        std::vector<FujinonZoomLensTelemetrySample> rows;
+        store.visit(0, store.size(), [&rows](const FujinonZoomLensTelemetrySample &s) { rows.push_back(s); });
+        CHECK(rows.size() == 3);
+        if (rows.size() == 3) {
+            CHECK(rows[0].axis == 1 && rows[0].commanded == 0x1234 && rows[0].actual == -1);
+            CHECK(rows[1].axis == 1 && rows[1].commanded == 0x1234 && rows[1].actual == 0x1000);
+            CHECK(rows[2].axis == 2 && rows[2].commanded == -1 && rows[2].actual == 0x2000);
+        }
+    }
+}
+
+int main() {
+    const auto begin = std::chrono::steady_clock::now();
+
+    const std::string file = temporary("fujinon-zoom-lens-test-telemetry.bin");
+    testAppend(file);
+    testReopen(file);
+    const std::string scratch = temporary("fujinon-zoom-lens-test-telemetry-scratch.bin");
+    testLowerBound(scratch);
+    std::filesystem::remove(scratch);
+    testPyramid(scratch);
+    std::filesystem::remove(scratch);
+    testRecord(scratch);
+    std::filesystem::remove(scratch);
+    std::filesystem::remove(file);
+
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+    std::cout << checks - failures << "/" << checks << " checks passed in " << ms << " [ms]" << std::endl;
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,560 @@
+//
+// Created by Hirano Masahiro <masahiro.dll@gmail.com>
+//
+// Checks the frames FujinonZoomLensController emits, byte for byte, the C10 frame codec, the lens profile files
+// the lens history and the preset store.
+// Registered with CTest; exits non-zero if any check fails.
+//
+
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "FujinonZoomLens.h"
+#include "FujinonZoomLensHistory.h"
+#include "FujinonZoomLensPreset.h"
+#include "FujinonZoomLensProfile.h"
+
+namespace {
+
+    int failures = 0;
+    int checks = 0;
+
+    std::string hex(const std::vector<uchar> &bytes) {
+        std::string s;
+        char buf[4];
+        for (size_t i = 0; i < bytes.size(); i++) {
+            snprintf(buf, sizeof(buf), i == 0 ? "%02X" : " %02X", bytes[i]);
+            s += buf;
+        }
+        return s;
+    }
+
+#define CHECK(cond) do { checks++; if (!(cond)) { failures++; std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond ") failed" << std::endl; } } while (0)
+#define CHECK_BYTES(actual, ...) do { checks++; std::vector<uchar> expected_{ __VA_ARGS__ }; if ((actual) != expected_) { failures++; \
+    std::cerr << __FILE__ << ":" << __LINE__ << ": " << hex(actual) << " != " << hex(expected_) << std::endl; } } while (0)
+
+    /*
+     * Client that keeps every frame the controller sends, encoded as it would go on the wire
+     */
+    class RecordingClient : public FujinonZoomLensClientTemplate {
+    public:
+        std::vector<std::vector<uchar>> frames;
+        std::vector<std::shared_ptr<const FujinonZoomLensBatch>> batches;
+
+        void send(FujinonZoomLensCommand cmd) override {
+            frames.push_back(FujinonZoomLensControllerUtil::encodeCommand(cmd.code, cmd.data));
+        }
+
+        void sendBatch(std::shared_ptr<const FujinonZoomLensBatch> batch) override {
+            batches.push_back(std::move(batch));
+        }
+
+        /* The only frame sent since the last call (empty if none or more than one) */
+        std::vector<uchar> take() {
+            std::vector<uchar> frame = frames.size() == 1 ? frames.front() : std::vector<uchar>();
+            frames.clear();
+            return frame;
+        }
+    };
+
+    struct Fixture {
+        std::shared_ptr<RecordingClient> client = std::make_shared<RecordingClient>();
+        FujinonZoomLensController zlc{ std::static_pointer_cast<FujinonZoomLensClientTemplate>(client) };
+    };
+
+    /* Position the controller sends for a setter, -1 if it did not send exactly one 2-byte frame */
+    long sentPosition(RecordingClient &client) {
+        std::vector<uchar> frame = client.take();
+        if (frame.size() != 5) return -1;
+        return frame[2] * 256L + frame[3];
+    }
+
+    void testChecksum() {
+        CHECK(FujinonZoomLensControllerUtil::checksum({}) == 0x00);
+        CHECK(FujinonZoomLensControllerUtil::checksum({ 0x00, 0x11 }) == 0xEF);
+        CHECK(FujinonZoomLensControllerUtil::checksum({ 0x02, 0x21, 0xFF, 0xFF }) == 0xDF);
+        CHECK(FujinonZoomLensControllerUtil::checksum({ 0x80, 0x80 }) == 0x00); // wraps
+
+        // every encoded frame sums to zero
+        for (uint code : { 0x11u, 0x20u, 0x21u, 0x22u, 0x40u, 0x42u }) {
+            for (uint d = 0; d < 0x100; d += 0x33) {
+                auto frame = FujinonZoomLensControllerUtil::encodeCommand(static_cast<uchar>(code), { static_cast<uchar>(d), static_cast<uchar>(0xFF - d) });
+                uchar sum = 0;
+                for (uchar b : frame) sum += b;
+                CHECK(sum == 0x00);
+            }
+        }
+    }
+
+    void testGetters() {
+        Fixture f;
+        f.zlc.getNameFirst();      CHECK_BYTES(f.client->take(), 0x00, 0x11, 0xEF);
+        f.zlc.getNameSecond();     CHECK_BYTES(f.client->take(), 0x00, 0x12, 0xEE);
+        f.zlc.getSerialNumber();   CHECK_BYTES(f.client->take(), 0x00, 0x17, 0xE9);
+        f.zlc.getIrisPosition();   CHECK_BYTES(f.client->take(), 0x00, 0x30, 0xD0);
+        f.zlc.getZoomPosition();   CHECK_BYTES(f.client->take(), 0x00, 0x31, 0xCF);
+        f.zlc.getFocusPosition();  CHECK_BYTES(f.client->take(), 0x00, 0x32, 0xCE);
+    }
+
+    void testIris() {
+        using F = FujinonZoomLensControllerUtil::ZOOM_LENS_F;
+        Fixture f;
+        f.zlc.setF(F::CLOSE); CHECK_BYTES(f.client->take(), 0x02, 0x20, 0x00, 0x00, 0xDE);
+        f.zlc.setF(F::F16);   CHECK_BYTES(f.client->take(), 0x02, 0x20, 0x34, 0x00, 0xAA);
+        f.zlc.setF(F::F11);   CHECK_BYTES(f.client->take(), 0x02, 0x20, 0x46, 0x00, 0x98);
+        f.zlc.setF(F::F8);    CHECK_BYTES(f.client->take(), 0x02, 0x20, 0x5E, 0x00, 0x80);
+        f.zlc.setF(F::F5_6);  CHECK_BYTES(f.client->take(), 0x02, 0x20, 0x8E, 0x00, 0x50);
+        f.zlc.setF(F::F4);    CHECK_BYTES(f.client->take(), 0x02, 0x20, 0xEE, 0x00, 0xF0);
+        f.zlc.setF(F::OPEN);  CHECK_BYTES(f.client->take(), 0x02, 0x20, 0xFF, 0xFF, 0xE0);
+        f.zlc.setF(static_cast<F>(42)); CHECK_BYTES(f.client->take(), 0x02, 0x20, 0xFF, 0xFF, 0xE0); // out of range: open
+    }
+
+    void testFilterAndIrisMode() {
+        using FILTER = FujinonZoomLensControllerUtil::ZOOM_LENS_FILTER;
+        using IRIS = FujinonZoomLensControllerUtil::ZOOM_LENS_IRIS;
+        Fixture f;
+        f.zlc.setFilter(FILTER::VISIBLE_LIGHT_CUT_FILTER); CHECK_BYTES(f.client->take(), 0x01, 0x40, 0xF0, 0xCF);
+        f.zlc.setFilter(FILTER::FILTER_CLEAR);             CHECK_BYTES(f.client->take(), 0x01, 0x40, 0xE0, 0xDF);
+        f.zlc.setIrisMode(IRIS::AUTO);                     CHECK_BYTES(f.client->take(), 0x01, 0x42, 0xCC, 0xF1);
+        f.zlc.setIrisMode(IRIS::REMOTE);                   CHECK_BYTES(f.client->take(), 0x01, 0x42, 0xDC, 0xE1);
+    }
+
+    void testZoom() {
+        Fixture f;
+        f.zlc.command(0x21, { 0x00, 0x00 }); CHECK_BYTES(f.client->take(), 0x02, 0x21, 0x00, 0x00, 0xDD);
+        f.zlc.command(0x21, { 0xFF, 0xFF }); CHECK_BYTES(f.client->take(), 0x02, 0x21, 0xFF, 0xFF, 0xDF);
+        f.zlc.setZoomRatio(1.0f);  CHECK_BYTES(f.client->take(), 0x02, 0x21, 0x00, 0x00, 0xDD);
+        f.zlc.setZoomRatio(2.0f);  CHECK_BYTES(f.client->take(), 0x02, 0x21, 0x54, 0x00, 0x89);
+        f.zlc.setZoomRatio(3.0f);  CHECK_BYTES(f.client->take(), 0x02, 0x21, 0x78, 0x00, 0x65);
+        f.zlc.setZoomRatio(10.0f); CHECK_BYTES(f.client->take(), 0x02, 0x21, 0xC2, 0x00, 0x1B);
+        f.zlc.setZoomRatio(32.0f); CHECK_BYTES(f.client->take(), 0x02, 0x21, 0xFF, 0xFF, 0xDF);
+
+        // out of range: clamped to the ends
+        f.zlc.setZoomRatio(0.5f);  CHECK(sentPosition(*f.client) == 0x0000);
+        f.zlc.setZoomRatio(99.0f); CHECK(sentPosition(*f.client) == 0xFFFF);
+    }
+
+    void testFocus() {
+        Fixture f;
+        f.zlc.setFocus(3.0f);   CHECK_BYTES(f.client->take(), 0x02, 0x22, 0x0C, 0x00, 0xD0);
+        f.zlc.setFocus(5.0f);   CHECK_BYTES(f.client->take(), 0x02, 0x22, 0x6E, 0x00, 0x6E);
+        f.zlc.setFocus(100.0f); CHECK_BYTES(f.client->take(), 0x02, 0x22, 0xF7, 0x63, 0x82);
+        f.zlc.setFocus(500.0f); CHECK_BYTES(f.client->take(), 0x02, 0x22, 0xFF, 0xFF, 0xDE);
+
+        f.zlc.setFocus(1.0f);    CHECK(sentPosition(*f.client) == 0x0C00);
+        f.zlc.setFocus(1000.0f); CHECK(sentPosition(*f.client) == 0xFFFF);
+    }
+
+    /* Every LUT node maps to its own position; values in between land between the neighbouring positions */
+    void testLUT(const std::vector<std::pair<float, float>> &lut, const std::function<void(FujinonZoomLensController &, float)> &set) {
+        Fixture f;
+        long previous = -1;
+        for (size_t i = 0; i < lut.size(); i++) {
+            set(f.zlc, lut[i].first);
+            long position = sentPosition(*f.client);
+            CHECK(position == static_cast<long>(lut[i].second));
+            CHECK(position > previous);
+            previous = position;
+
+            if (i + 1 < lut.size()) {
+                set(f.zlc, (lut[i].first + lut[i + 1].first) / 2.0f);
+                long mid = sentPosition(*f.client);
+                CHECK(std::abs(mid - static_cast<long>((lut[i].second + lut[i + 1].second) / 2.0f)) <= 1);
+            }
+        }
+    }
+
+    void testLUTs() {
+        testLUT(FujinonZoomLensControllerUtil::ZOOM_LUT, [](FujinonZoomLensController &zlc, float v) { zlc.setZoomRatio(v); });
+        testLUT(FujinonZoomLensControllerUtil::FOCUS_LUT, [](FujinonZoomLensController &zlc, float v) { zlc.setFocus(v); });
+    }
+
+    /* Interpolation on a profile pinned to the controller */
+    void testProfile() {
+        FujinonZoomLensProfile profile = FujinonZoomLensControllerUtil::defaultProfile();
+        profile.setZoomLUT({ { 1.0f, 2000.0f }, { 3.0f, 4000.0f }, { 6.0f, 9000.0f }, { 10.0f, 15000.0f } });
+        Fixture f;
+        f.zlc.setProfile(&profile);
+        const std::vector<std::pair<float, long>> cases = {
+            { 0.0f, 2000 }, { 1.0f, 2000 }, { 2.0f, 3000 }, { 3.0f, 4000 }, { 4.0f, 5667 }, { 6.0f, 9000 }, { 9.0f, 13500 }, { 11.0f, 15000 } };
+        for (auto &c : cases) {
+            f.zlc.setZoomRatio(c.first);
+            CHECK(sentPosition(*f.client) == c.second);
+        }
+        f.zlc.setProfile(nullptr);
+        f.zlc.setZoomRatio(2.0f);
+        CHECK(sentPosition(*f.client) == 0x5400);
+    }
+
+    /* Profile files: a valid one loads, and every malformed one is rejected rather than read */
+    void testProfileFiles() {
+        const std::filesystem::path directory = std::filesystem::temp_directory_path() / "fujinon-zoom-lens-test-profiles";
+        std::filesystem::remove_all(directory);
+        std::filesystem::create_directories(directory);
+        auto write = [&directory](const std::string &model, const std::string &body) {
+            std::ofstream((directory / (model + ".json")).string()) << "{ \"MODEL\": \"" << model << "\", " << body << " }";
+        };
+        const std::string focus = "\"FOCUS_LUT\": [[3.0, 3072], [500, 65535]]";
+        write("TEST-VALID", "\"ZOOM_LUT\": [[1.0, 0], [2.0, 20000], [32.0, 65535]], " + focus
+            + ", \"ZOOM_RANGE\": [1.5, 20.0], \"F_TABLE\": [[0, 0], [52, 0], [70, 0], [94, 0], [128, 0], [160, 0], [255, 255]]");
+        write("TEST-DESCENDING", "\"ZOOM_LUT\": [[1.0, 0], [32.0, 65535], [2.0, 20000]], " + focus);
+        write("TEST-REPEATED", "\"ZOOM_LUT\": [[1.0, 0], [1.0, 20000], [32.0, 65535]], " + focus);
+        write("TEST-POSITIONS", "\"ZOOM_LUT\": [[1.0, 20000], [2.0, 10000], [32.0, 65535]], " + focus);
+        write("TEST-OUT-OF-RANGE", "\"ZOOM_LUT\": [[1.0, 0], [32.0, 70000]], " + focus);
+        write("TEST-SHORT", "\"ZOOM_LUT\": [[1.0, 0]], " + focus);
+        write("TEST-STRING", "\"ZOOM_LUT\": [[1.0, 0], [\"32\", 65535]], " + focus);
+        write("TEST-PAIR", "\"ZOOM_LUT\": [[1.0, 0], [32.0]], " + focus);
+        write("TEST-RANGE", "\"ZOOM_LUT\": [[1.0, 0], [32.0, 65535]], " + focus + ", \"ZOOM_RANGE\": [1.0, \"max\"]");
+        write("TEST-F-TABLE", "\"ZOOM_LUT\": [[1.0, 0], [32.0, 65535]], " + focus
+            + ", \"F_TABLE\": [[0, 0], [52, 0], [70, 0], [94, 0], [128, 0], [160, 0], [256, 0]]");
+        write("TEST-F-ENTRY", "\"ZOOM_LUT\": [[1.0, 0], [32.0, 65535]], " + focus
+            + ", \"F_TABLE\": [[0, 0], [52, 0], [70, 0], [94, 0], [128, 0], [160, 0], 255]");
+
+        FujinonZoomLensProfileStore &store = FujinonZoomLensProfileStore::get_instance();
+        CHECK(store.loadDirectory(directory.string()) == 1);
+        const FujinonZoomLensProfile *valid = store.findByModel("TEST-VALID");
+        CHECK(valid != nullptr);
+        if (valid != nullptr) {
+            CHECK(valid->zoomMin == 1.5f && valid->zoomMax == 20.0f);
+            CHECK(valid->fTable[6][0] == 0xFF && valid->fTable[6][1] == 0xFF);
+        }
+        for (const char *model : { "TEST-DESCENDING", "TEST-REPEATED", "TEST-POSITIONS", "TEST-OUT-OF-RANGE", "TEST-SHORT",
+            "TEST-STRING", "TEST-PAIR", "TEST-RANGE", "TEST-F-TABLE", "TEST-F-ENTRY" }) {
+            CHECK(store.findByModel(model) == nullptr);
+        }
+
+        // what save() writes, loadDirectory() reads back
+        std::filesystem::remove_all(directory);
+        std::filesystem::create_directories(directory);
+        if (valid != nullptr) {
+            FujinonZoomLensProfile saved = *valid;
+            saved.model = "TEST-SAVED";
+            CHECK(FujinonZoomLensProfileStore::save(saved, (directory / "saved.json").string()));
+            CHECK(store.loadDirectory(directory.string()) == 1);
+            const FujinonZoomLensProfile *loaded = store.findByModel("TEST-SAVED");
+            CHECK(loaded != nullptr && loaded->zoomRatio == saved.zoomRatio && loaded->zoomPosition == saved.zoomPosition
+                && loaded->fTable == saved.fTable && loaded->zoomMin == saved.zoomMin && loaded->zoomMax == saved.zoomMax);
+        }
+        std::filesystem::remove_all(directory);
+    }
+
+    /* Polls interpolated, commands as steps, and positions converted with the profile of their time */
+    void testHistory() {
+        using ms = std::chrono::milliseconds;
+        const auto t0 = std::chrono::steady_clock::now();
+        FujinonZoomLensHistory history;
+        history.record(0x31, { 0x10, 0x00 }, t0);
+        history.record(0x31, { 0x50, 0x00 }, t0 + ms(200));
+        history.record(0x31, { 0x30, 0x00 }, t0 + ms(100)); // late arrival
+        history.record(0x21, { 0x54, 0x00 }, t0 + ms(10));
+        history.record(0x21, { 0x20, 0x00 }, t0 + ms(150));
+        history.record(0x21, { 0x20 }, t0 + ms(160)); // not a position
+        history.record(0x11, { 0x00, 0x00 }, t0 + ms(170)); // not an axis
+        CHECK(history.size() == 5);
+
+        CHECK(history.position(1, t0 - ms(1)) == -1.0);
+        CHECK(history.position(1, t0) == 0x1000);
+        CHECK(std::abs(history.position(1, t0 + ms(50)) - 0x2000) < 1.0);
+        CHECK(history.position(1, t0 + ms(100)) == 0x3000);
+        CHECK(std::abs(history.position(1, t0 + ms(175)) - 0x4800) < 1.0);
+        CHECK(history.position(1, t0 + ms(1000)) == 0x5000); // held after the last poll
+        CHECK(history.position(2, t0 + ms(50)) == -1.0);
+
+        CHECK(history.commandedPosition(1, t0 + ms(5)) == -1);
+        CHECK(history.commandedPosition(1, t0 + ms(10)) == 0x5400);
+        CHECK(history.commandedPosition(1, t0 + ms(149)) == 0x5400);
+        CHECK(history.commandedPosition(1, t0 + ms(150)) == 0x2000);
+        CHECK(history.commandedPosition(1, t0 + ms(1000)) == 0x2000);
+
+        // converted with the built-in profile until the lens is identified, then with the profile of the time
+        FujinonZoomLensProfile first = FujinonZoomLensControllerUtil::defaultProfile();
+        first.setZoomLUT({ { 1.0f, 0.0f }, { 9.0f, 0x8000 } });
+        FujinonZoomLensProfile second = FujinonZoomLensControllerUtil::defaultProfile();
+        second.setZoomLUT({ { 1.0f, 0.0f }, { 2.0f, 0x2000 }, { 4.0f, 0x4000 } });
+        const FujinonZoomLensFrameTag before = history.tag(t0 + ms(50));
+        history.recordProfile(&second, t0 + ms(100));
+        history.recordProfile(&first, t0 + ms(20)); // late arrival
+        CHECK(&history.profile(t0) == &FujinonZoomLensControllerUtil::defaultProfile());
+        CHECK(&history.profile(t0 + ms(20)) == &first);
+        CHECK(&history.profile(t0 + ms(1000)) == &second);
+
+        FujinonZoomLensFrameTag t = history.tag(t0 + ms(50));
+        CHECK(std::abs(t.zoom - 0x2000) < 1.0 && t.zoomCommanded == 0x5400);
+        CHECK(std::abs(t.zoomRatio - 3.0f) < 0.01f); // 0x2000 on the first profile
+        CHECK(std::abs(before.zoomRatio - 3.0f) > 0.1f); // the same instant before the profile was known: the built-in one
+        t = history.tag(t0 + ms(175));
+        CHECK(std::abs(t.zoomRatio - 4.0f) < 0.01f); // 0x4800 on the second profile, beyond its last node
+        t = history.tag(t0 + ms(5));
+        CHECK(t.zoomRatio > 1.1f && t.zoomRatio < 1.2f); // 0x119A on the built-in profile
+        CHECK(t.focusMeter == -1.0f && t.focusCommanded == -1 && t.iris == -1.0);
+    }
+
+    void testShadow() {
+        Fixture f;
+        f.zlc.setZoomRatio(2.0f);
+        CHECK(f.client->frames.size() == 1);
+        f.zlc.onResponse(0x21, { 0x54, 0x00 });
+        f.zlc.setZoomRatio(2.0f); // lens already there
+        CHECK(f.client->frames.size() == 1);
+        CHECK(f.zlc.suppressionStats().suppressed == 1);
+
+        f.zlc.command(0x21, { 0x54, 0x00 }, true); // forced
+        CHECK(f.client->frames.size() == 2);
+
+        f.zlc.onResponse(0x31, { 0x10, 0x00 }); // reported position confirms the zoom axis
+        f.zlc.command(0x21, { 0x10, 0x00 });
+        CHECK(f.client->frames.size() == 3); // commanded 0x5400 last, so not suppressed
+        f.zlc.command(0x21, { 0x10, 0x00 });
+        CHECK(f.client->frames.size() == 3);
+
+        f.zlc.invalidateShadow();
+        f.zlc.command(0x21, { 0x10, 0x00 });
+        CHECK(f.client->frames.size() == 4);
+
+        f.zlc.getZoomPosition(); // queries are never suppressed
+        f.zlc.getZoomPosition();
+        CHECK(f.client->frames.size() == 6);
+    }
+
+    void testForeignConfirmation() {
+        // the GUI sets zoom A, then another client (preset, network, sequence) moves it to C:
+        // once that confirmation is seen, setting A again must go out
+        Fixture f;
+        f.zlc.command(0x21, { 0x40, 0x00 });
+        f.zlc.onResponse(0x21, { 0x40, 0x00 });
+        f.zlc.command(0x21, { 0x40, 0x00 });
+        CHECK(f.client->frames.size() == 1); // lens at A: suppressed
+
+        f.zlc.onResponse(0x21, { 0xC0, 0x00 }); // someone else's command, confirmed
+        f.zlc.onResponse(0x22, { 0x12, 0x34 }); // interleaved with other axes
+        f.zlc.command(0x21, { 0x40, 0x00 });
+        CHECK(f.client->frames.size() == 2);
+
+        f.zlc.onResponse(0x21, { 0x40, 0x00 });
+        f.zlc.onResponse(0x31, { 0xC0, 0x00 }); // a poll reports the lens at C too
+        f.zlc.command(0x21, { 0x40, 0x00 });
+        CHECK(f.client->frames.size() == 3);
+
+        f.zlc.onResponse(0x21, { 0x40, 0x00 });
+        f.zlc.invalidateShadow(); // reconnected: the lens may have been moved by hand
+        f.zlc.command(0x21, { 0x40, 0x00 });
+        CHECK(f.client->frames.size() == 4);
+    }
+
+    void testBatch() {
+        using F = FujinonZoomLensControllerUtil::ZOOM_LENS_F;
+        using FILTER = FujinonZoomLensControllerUtil::ZOOM_LENS_FILTER;
+        Fixture f;
+        f.zlc.onResponse(0x40, { 0xE0 }); // filter already clear
+
+        f.zlc.beginBatch();
+        CHECK(f.zlc.isBatching());
+        f.zlc.command(0x21, { 0x54, 0x00 });
+        f.zlc.command(0x22, { 0x12, 0x34 });
+        f.zlc.setF(F::F8);
+        f.zlc.setFilter(FILTER::FILTER_CLEAR); // suppressed as usual
+        CHECK(f.client->frames.empty() && f.client->batches.empty()); // nothing sent before the commit
+        f.zlc.commitBatch();
+        CHECK(!f.zlc.isBatching());
+        CHECK(f.client->frames.empty());
+        CHECK(f.client->batches.size() == 1);
+        if (f.client->batches.size() == 1) {
+            const FujinonZoomLensBatch &batch = *f.client->batches.front();
+            CHECK(batch.size() == 3);
+            CHECK(batch.commands[0].code == 0x21 && batch.commands[1].code == 0x22 && batch.commands[2].code == 0x20);
+            CHECK_BYTES(batch.frames,
+                0x02, 0x21, 0x54, 0x00, 0x89,
+                0x02, 0x22, 0x12, 0x34, 0x96,
+                0x02, 0x20, 0x5E, 0x00, 0x80);
+        }
+
+        f.client->batches.clear();
+        f.zlc.beginBatch();
+        f.zlc.commitBatch(); // empty: nothing sent
+        CHECK(f.client->batches.empty());
+
+        f.zlc.beginBatch(); // a full batch is handed over and a new one started
+        for (size_t i = 0; i < FujinonZoomLensBatch::CAPACITY + 2; i++) f.zlc.getZoomPosition();
+        CHECK(f.client->batches.size() == 1);
+        f.zlc.commitBatch();
+        CHECK(f.client->batches.size() == 2);
+        if (f.client->batches.size() == 2) {
+            CHECK(f.client->batches[0]->size() == FujinonZoomLensBatch::CAPACITY);
+            CHECK(f.client->batches[1]->size() == 2);
+        }
+
+        f.zlc.getZoomPosition(); // back to one by one
+        CHECK(f.client->frames.size() == 1);
+    }
+
+    /* A preset writes the frames the controller would send for the same positions, and survives save / load */
+    void testPresets() {
+        FujinonZoomLensPresetStore store;
+        auto wide = store.set("wide", 0x0000, 0xFFFF, 0x5E00, 0xE0);
+        auto tele = store.set("tele", 0xFFFF, 0x1234, -1, -1);
+        CHECK(store.find("wide") == wide && store.list().size() == 2);
+
+        // one batch of filter, zoom, focus and iris through the controller, and frame by frame
+        Fixture f;
+        f.zlc.beginBatch();
+        f.zlc.command(0x40, { 0xE0 });
+        f.zlc.command(0x21, { 0x00, 0x00 });
+        f.zlc.command(0x22, { 0xFF, 0xFF });
+        f.zlc.command(0x20, { 0x5E, 0x00 });
+        f.zlc.commitBatch();
+        CHECK(f.client->batches.size() == 1);
+        if (f.client->batches.size() == 1) CHECK(wide->frames == f.client->batches.front()->frames);
+        std::vector<uchar> frames;
+        for (const FujinonZoomLensCommand &cmd : wide->commands) {
+            const std::vector<uchar> frame = FujinonZoomLensControllerUtil::encodeCommand(cmd.code, cmd.data);
+            frames.insert(frames.end(), frame.begin(), frame.end());
+        }
+        CHECK(wide->frames == frames);
+        CHECK(tele->size() == 2); // only what is part of the preset
+        CHECK_BYTES(tele->frames,
+            0x02, 0x21, 0xFF, 0xFF, 0xDF,
+            0x02, 0x22, 0x12, 0x34, 0x96);
+
+        const std::filesystem::path file = std::filesystem::temp_directory_path() / "fujinon-zoom-lens-test-presets.json";
+        CHECK(store.save(file.string()));
+        FujinonZoomLensPresetStore loaded;
+        loaded.set("stale", 1, 2, 3, 4); // replaced by the file
+        CHECK(loaded.load(file.string()));
+        CHECK(loaded.list().size() == 2 && loaded.find("stale") == nullptr);
+        for (const char *name : { "wide", "tele" }) {
+            auto a = store.find(name), b = loaded.find(name);
+            CHECK(b != nullptr);
+            if (b == nullptr) continue;
+            CHECK(a->zoom == b->zoom && a->focus == b->focus && a->iris == b->iris && a->filter == b->filter);
+            CHECK(a->frames == b->frames);
+        }
+
+        // values out of range are left out, a malformed file keeps the presets
+        std::ofstream(file.string()) << "{ \"PRESETS\": [ { \"NAME\": \"odd\", \"ZOOM\": 70000, \"FOCUS\": 16, \"FILTER\": 256 }, { \"ZOOM\": 0 } ] }";
+        CHECK(loaded.load(file.string()));
+        auto odd = loaded.find("odd");
+        CHECK(loaded.list().size() == 1 && odd != nullptr);
+        if (odd != nullptr) CHECK(odd->zoom == -1 && odd->focus == 16 && odd->iris == -1 && odd->filter == -1 && odd->size() == 1);
+        std::ofstream(file.string()) << "{ \"PRESETS\": ";
+        CHECK(!loaded.load(file.string()));
+        CHECK(loaded.find("odd") != nullptr);
+        std::filesystem::remove(file);
+        CHECK(!loaded.load(file.string()));
+    }
+
+    void testParseResponse() {
+        using FujinonZoomLensControllerUtil::FujinonZoomLensResponse;
+        std::array<uchar, 32> frame{};
+        FujinonZoomLensResponse response;
+
+        frame[0] = 0x02; frame[1] = 0x31; frame[2] = 0x12; frame[3] = 0x34;
+        frame[4] = FujinonZoomLensControllerUtil::checksum({ 0x02, 0x31, 0x12, 0x34 });
+        CHECK(FujinonZoomLensControllerUtil::parseResponse(frame.data(), 5, response));
+        CHECK(response.code == 0x31 && response.position() == 0x1234);
+        CHECK(!FujinonZoomLensControllerUtil::parseResponse(frame.data(), 4, response)); // truncated
+        CHECK(!FujinonZoomLensControllerUtil::parseResponse(frame.data(), 2, response));
+        frame[4] ^= 0x01;
+        CHECK(!FujinonZoomLensControllerUtil::parseResponse(frame.data(), 5, response)); // checksum
+
+        frame[0] = 30; // longer than what was received
+        CHECK(!FujinonZoomLensControllerUtil::parseResponse(frame.data(), frame.size(), response));
+    }
+
+    void testResponseDecoding() {
+        FujinonZoomLensControllerUtil::FujinonZoomLensResponse response;
+        response.data = { 'H', 'A', '2', '2', ' ', ' ', '\0', 'x' };
+        CHECK(response.text() == "HA22");
+        response.data = { 0xAB };
+        CHECK(response.position() == 0); // not a position
+        response.data = { 0xAB, 0xCD };
+        CHECK(response.position() == 0xABCD);
+    }
+
+    void testFrameParser() {
+        using FujinonZoomLensControllerUtil::FujinonZoomLensFrameParser;
+        using FujinonZoomLensControllerUtil::FujinonZoomLensResponse;
+        auto zoom = FujinonZoomLensControllerUtil::encodeCommand(0x31, { 0x54, 0x00 });
+        auto name = FujinonZoomLensControllerUtil::encodeCommand(0x11, { 'H', 'A', '2', '2', 'x', '1', '3', '.', '5', 'B', 'E', 'R', 'D', ' ', ' ' });
+        FujinonZoomLensResponse response;
+
+        { // byte by byte
+            FujinonZoomLensFrameParser parser;
+            for (size_t i = 0; i + 1 < zoom.size(); i++) {
+                parser.push(&zoom[i], 1);
+                CHECK(!parser.next(response));
+            }
+            parser.push(&zoom.back(), 1);
+            CHECK(parser.next(response));
+            CHECK(response.code == 0x31 && response.position() == 0x5400);
+            CHECK(parser.pending() == 0);
+        }
+        { // several frames in one read, maximum data length
+            FujinonZoomLensFrameParser parser;
+            std::vector<uchar> stream = zoom;
+            stream.insert(stream.end(), name.begin(), name.end());
+            stream.insert(stream.end(), zoom.begin(), zoom.end());
+            parser.push(stream.data(), stream.size());
+            CHECK(parser.next(response) && response.code == 0x31);
+            CHECK(parser.next(response) && response.code == 0x11 && response.data.size() == FujinonZoomLensFrameParser::MAX_DATA_LENGTH);
+            CHECK(parser.next(response) && response.code == 0x31);
+            CHECK(!parser.next(response));
+            CHECK(parser.droppedBytes() == 0);
+        }
+        { // line noise and a corrupted frame before a good one
+            FujinonZoomLensFrameParser parser;
+            std::vector<uchar> stream = { 0xFF, 0x20, 0x00 };
+            std::vector<uchar> bad = zoom;
+            bad[3] ^= 0x10;
+            stream.insert(stream.end(), bad.begin(), bad.end());
+            stream.insert(stream.end(), zoom.begin(), zoom.end());
+            parser.push(stream.data(), stream.size());
+            CHECK(parser.next(response));
+            CHECK(response.code == 0x31 && response.position() == 0x5400);
+            CHECK(parser.droppedBytes() == 3 + bad.size());
+            CHECK(!parser.next(response));
+        }
+        { // a long run of noise does not grow the buffer without bound
+            FujinonZoomLensFrameParser parser;
+            std::vector<uchar> noise(1000, 0xF0);
+            parser.push(noise.data(), noise.size());
+            CHECK(!parser.next(response));
+            CHECK(parser.pending() < 3);
+            parser.push(zoom.data(), zoom.size());
+            CHECK(parser.next(response) && response.position() == 0x5400);
+        }
+    }
+}
+
+int main() {
+    const auto begin = std::chrono::steady_clock::now();
+
+    testChecksum();
+    testGetters();
+    testIris();
+    testFilterAndIrisMode();
+    testZoom();
+    testFocus();
+    testLUTs();
+    testProfile();
+    testProfileFiles();
+    testHistory();
+    testShadow();
+    testForeignConfirmation();
+    testBatch();
+    testPresets();
+    testParseResponse();
+    testResponseDecoding();
+    testFrameParser();
+
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+    std::cout << checks - failures << "/" << checks << " checks passed in " << ms << " [ms]" << std::endl;
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,133 @@
+//
+// Created by Hirano Masahiro <masahiro.dll@gmail.com>
+//
+// Runs EngineCalibration on a SyntheticZoomSource that zooms into res/lena.png by the default ZOOM_LUT with a known
+// drift, and checks that the LUT it recovers follows the drifted ratios, not the hand-typed ones, and that the profile
+// it writes loads back. Needs the configured config_default.json, so CTest runs it in the build directory.
+// Registered with CTest; exits non-zero if any check fails.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "Engine.h"
+#include "Config.h"
+#include "FujinonZoomLensProfile.h"
+
+namespace {
+
+    int failures = 0;
+    int checks = 0;
+
+#define CHECK(cond) do { checks++; if (!(cond)) { failures++; std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond ") failed" << std::endl; } } while (0)
+
+    constexpr float DRIFT = 0.05f; // the lens magnifies 5 % more than the hand-typed LUT says
+    constexpr double TOLERANCE = 0.025; // half the drift, so the recovered LUT cannot pass for the hand-typed one
+    constexpr double CHECKED_RATIO = 8.0; // beyond, the center of a 512 px image is too blurred to measure reliably
+
+    /* Ratio of a LUT at a raw position (positions ascending) */
+    double ratioAt(const std::vector<std::pair<float, float>> &lut, float position) {
+        auto next = std::find_if(lut.begin(), lut.end(), [position](const std::pair<float, float> &p) { return position <= p.second; });
+        if (next == lut.begin()) return lut.front().first;
+        if (next == lut.end()) return lut.back().first;
+        auto prev = std::prev(next);
+        double w = (position - prev->second) / (next->second - prev->second);
+        return prev->first + w * (next->first - prev->first);
+    }
+
+    void testSynthetic() {
+        const FujinonZoomLensProfile &defaults = FujinonZoomLensControllerUtil::defaultProfile();
+        std::vector<float> drifted;
+        for (float r : defaults.zoomRatio) drifted.push_back(1.0f + (r - 1.0f) * (1.0f + DRIFT));
+        cv::Mat image = cv::imread(Config::get_instance().resourceDirectory() + "/lena.png");
+        CHECK(!image.empty());
+        if (image.empty()) return;
+        auto source = std::make_unique<SyntheticZoomSource>(image, defaults.zoomPosition, drifted, image.size());
+        const SyntheticZoomSource &truth = *source;
+
+        FujinonZoomLensProfile profile = defaults;
+        profile.model = "TEST-CALIBRATION";
+        auto appMsg = std::make_shared<AppMsg>();
+        EngineCalibration calibration(appMsg);
+        CHECK(calibration.setSource(std::move(source), profile));
+        CHECK(calibration.run());
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::minutes(5);
+        while (calibration.getWorkerStatus() != WORKER_STATUS::IDLE && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        CHECK(calibration.getWorkerStatus() == WORKER_STATUS::IDLE);
+        calibration.reset();
+
+        const CalibrationResult result = calibration.lastResult();
+        CHECK(calibration.framesGrabbed() == calibration.stepCount());
+        CHECK(calibration.pairsAnalyzed() == calibration.stepCount() - 1);
+        CHECK(result.zoomLUT.size() == calibration.stepCount());
+        CHECK(result.featurePairs + result.searchPairs == calibration.stepCount() - 1);
+        CHECK(result.maxError >= 0.0); // the source knows the truth
+        if (result.zoomLUT.size() != calibration.stepCount()) return;
+
+        CHECK(result.zoomLUT.front().first == 1.0f && result.zoomLUT.front().second == 0.0f);
+        CHECK(result.zoomLUT.back().second == 0xFFFF);
+        bool ascending = true;
+        for (size_t i = 1; i < result.zoomLUT.size(); i++) {
+            ascending = ascending && result.zoomLUT[i].first > result.zoomLUT[i - 1].first && result.zoomLUT[i].second > result.zoomLUT[i - 1].second;
+        }
+        CHECK(ascending);
+
+        // against the drifted truth, as far as the image allows
+        const double wide = truth.trueRatio(0);
+        double worst = 0.0;
+        size_t checked = 0;
+        for (const auto &[ratio, position] : result.zoomLUT) {
+            const double expected = truth.trueRatio(static_cast<uint16_t>(position)) / wide;
+            if (expected > CHECKED_RATIO) break;
+            worst = std::max(worst, std::abs(ratio - expected) / expected);
+            checked++;
+        }
+        CHECK(checked > calibration.stepCount() / 2);
+        CHECK(worst < TOLERANCE);
+        const std::vector<std::pair<float, float>> handTyped = FujinonZoomLensControllerUtil::ZOOM_LUT;
+        for (const auto &[ratio, position] : result.zoomLUT) {
+            const double expected = truth.trueRatio(static_cast<uint16_t>(position)) / wide;
+            if (expected < 4.0) continue;
+            CHECK(std::abs(ratio - expected) < std::abs(ratio - ratioAt(handTyped, position))); // the drift was found
+            break;
+        }
+
+        // the calibrated profile is a copy of the one given, with the new ZOOM_LUT
+        CHECK(!result.profileFile.empty());
+        if (result.profileFile.empty()) return;
+        const std::filesystem::path directory = std::filesystem::temp_directory_path() / "zoom-calibration-test-profiles";
+        std::filesystem::remove_all(directory);
+        std::filesystem::create_directories(directory);
+        std::filesystem::copy_file(result.profileFile, directory / "calibrated.json");
+        std::filesystem::remove(result.profileFile);
+        FujinonZoomLensProfileStore &store = FujinonZoomLensProfileStore::get_instance();
+        CHECK(store.loadDirectory(directory.string()) == 1);
+        const FujinonZoomLensProfile *loaded = store.findByModel("TEST-CALIBRATION");
+        CHECK(loaded != nullptr);
+        if (loaded != nullptr) {
+            CHECK(loaded->zoomRatio.size() == result.zoomLUT.size());
+            CHECK(loaded->focusMeter == profile.focusMeter && loaded->focusPosition == profile.focusPosition);
+            CHECK(loaded->fTable == profile.fTable);
+        }
+        std::filesystem::remove_all(directory);
+    }
+}
+
+int main() {
+    const auto begin = std::chrono::steady_clock::now();
+
+    testSynthetic();
+
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+    std::cout << checks - failures << "/" << checks << " checks passed in " << ms << " [ms]" << std::endl;
+    return failures == 0 ? 0 : 1;
+}